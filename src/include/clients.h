@@ -41,6 +41,7 @@ typedef struct radclient {
 	char const		*shortname;		//!< Client nickname.
 
 	char const		*secret;		//!< Secret PSK.
+	fr_radius_secret_t	*prepared;		//!< Hashed state for secret.
 
 	bool			message_authenticator;	//!< Require RADIUS message authenticator in requests.
 
@@ -28,7 +28,7 @@ RCSIDH(event_h, "$Id$")
 
 #include <freeradius-devel/missing.h>
 #include <stdbool.h>
-#include <sys/event.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,6 +46,14 @@ typedef struct fr_event_list_t fr_event_list_t;
  */
 typedef struct fr_event_timer_t fr_event_timer_t;
 
+/** How timer events are stored
+ */
+typedef enum fr_event_timer_backend_t {
+	FR_EVENT_TIMER_HEAP = 0,				//!< Binary heap, ordered by time.
+	FR_EVENT_TIMER_WHEEL					//!< Hierarchical timing wheel, with O(1)
+								//!< insert and delete.
+} fr_event_timer_backend_t;
+
 /** Called when a timer event fires
  *
  * @param[in] now	The current time.
@@ -70,18 +78,22 @@ typedef	int (*fr_event_status_t)(void *ctx, struct timeval *now);
  */
 typedef void (*fr_event_fd_handler_t)(fr_event_list_t *el, int sock, void *ctx);
 
-/** Called when a user kevent occurs
+/** Called when a user event occurs
  *
- * @param[in] kq	that received the user kevent.
- * @param[in] kev	The kevent.
+ * User events are EVFILT_USER filters with kqueue, and eventfd
+ * descriptors with epoll.
+ *
+ * @param[in] kq	that received the user event.
+ * @param[in] ident	of the user event, as passed to #fr_event_user_register.
  * @param[in] ctx	User ctx passed to #fr_event_user_insert.
  */
-typedef void (*fr_event_user_handler_t)(int kq, struct kevent const *kev, void *ctx);
+typedef void (*fr_event_user_handler_t)(int kq, uintptr_t ident, void *ctx);
 
 int		fr_event_list_num_fds(fr_event_list_t *el);
 int		fr_event_list_num_elements(fr_event_list_t *el);
 int		fr_event_list_kq(fr_event_list_t *el);
 int		fr_event_list_time(struct timeval *when, fr_event_list_t *el);
+int		fr_event_list_timer_backend(fr_event_list_t *el, fr_event_timer_backend_t backend);
 
 int		fr_event_fd_delete(fr_event_list_t *el, int fd);
 int		fr_event_fd_insert(fr_event_list_t *el, int fd,
@@ -89,6 +101,7 @@ int		fr_event_fd_insert(fr_event_list_t *el, int fd,
 				   fr_event_fd_handler_t write_fn,
 				   fr_event_fd_handler_t error,
 				   void *ctx);
+int		fr_event_fd_edge_triggered(fr_event_list_t *el, int fd, bool edge);
 
 int		fr_event_timer_delete(fr_event_list_t *el, fr_event_timer_t **parent);
 int		fr_event_timer_insert(fr_event_list_t *el,
@@ -99,6 +112,10 @@ int		fr_event_timer_run(fr_event_list_t *el, struct timeval *when);
 int		fr_event_user_insert(fr_event_list_t *el, fr_event_user_handler_t user, void *ctx) CC_HINT(nonnull(1,2));
 int		fr_event_user_delete(fr_event_list_t *el, fr_event_user_handler_t user, void *ctx) CC_HINT(nonnull(1,2));
 
+int		fr_event_user_register(int kq, uintptr_t ident);
+int		fr_event_user_trigger(int fd, uintptr_t ident);
+void		fr_event_user_deregister(int kq, int fd, uintptr_t ident);
+
 int		fr_event_corral(fr_event_list_t *el, bool wait);
 void		fr_event_service(fr_event_list_t *el);
 
@@ -133,6 +133,7 @@ typedef struct {
 	fr_cond_t		*cond;		//!< #UNLANG_TYPE_IF, #UNLANG_TYPE_ELSIF.
 
 	map_proc_inst_t		*proc_inst;	//!< Instantiation data for #UNLANG_TYPE_MAP.
+	bool			first;		//!< #UNLANG_TYPE_PARALLEL, finish when the first child does.
 	bool			done_pass2;
 } unlang_group_t;
 
@@ -207,6 +208,15 @@ typedef struct {
 	unlang_t		*found;
 } unlang_stack_entry_redundant_t;
 
+typedef struct unlang_parallel_t unlang_parallel_t;
+
+/** State of a parallel section
+ *
+ */
+typedef struct {
+	unlang_parallel_t	*state;		//!< The children, their stacks, and the results so far.
+} unlang_stack_entry_parallel_t;
+
 /** Our interpreter stack, as distinct from the C stack
  *
  * We don't call the modules recursively.  Instead we iterate over a list of unlang_t and
@@ -234,14 +244,20 @@ typedef struct {
 		unlang_stack_entry_modcall_t	modcall;
 		unlang_stack_entry_foreach_t	foreach;
 		unlang_stack_entry_redundant_t	redundant;
+		unlang_stack_entry_parallel_t	parallel;
 	};
 } unlang_stack_frame_t;
 
 /** An unlang stack associated with a request
  *
  */
-typedef struct {
+typedef struct unlang_stack_t {
 	int			depth;		//!< Current depth we're executing at.
+	struct unlang_stack_t	*parent;	//!< Stack which started us, if we're a child of a parallel section.
+	bool			resumable;	//!< Set by unlang_resumable(), cleared when we're resumed.
+	TALLOC_CTX		*ctx;		//!< Events and resumptions of a parallel child are allocated here,
+						//!< so that they're freed if the child is cancelled.  NULL for
+						//!< the request's own stack.
 	unlang_stack_frame_t	frame[UNLANG_STACK_MAX];	//!< The stack...
 } unlang_stack_t;
 
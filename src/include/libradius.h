@@ -90,6 +90,7 @@ RCSIDH(libradius_h, "$Id$")
  */
 #include <freeradius-devel/sha1.h>
 #include <freeradius-devel/md4.h>
+#include <freeradius-devel/md5.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -124,6 +125,8 @@ typedef void (*sig_t)(int);
  *
  *	data,data_len:	Used between fr_radius_recv and fr_radius_decode.
  */
+typedef struct fr_radius_index fr_radius_index_t;
+
 typedef struct radius_packet {
 	int			sockfd;			//!< Socket this packet was read from.
 	int			if_index;		//!< Index of receiving interface.
@@ -142,6 +145,7 @@ typedef struct radius_packet {
 	uint8_t			*data;			//!< Packet data (body).
 	size_t			data_len;		//!< Length of packet data.
 	VALUE_PAIR		*vps;			//!< Result of decoding the packet into VALUE_PAIRs.
+	fr_radius_index_t	*index;			//!< Attributes not decoded yet, see fr_radius_decode_lazy().
 	ssize_t			offset;
 
 	uint32_t       		rounds;			//!< for State[0]
@@ -210,6 +214,25 @@ do { \
 #define	FR_TUNNEL_PW_ENC_LENGTH(_x) (2 + 1 + _x + PAD(_x + 1, 16))
 extern FR_NAME_NUMBER const fr_request_types[];
 
+/** A shared secret, and the MD5 state derived from it
+ *
+ * Allocated by fr_radius_secret_alloc(), and passed to the *_prepared()
+ * functions instead of the secret string.
+ */
+typedef struct fr_radius_secret {
+	char const		*secret;	//!< The secret.
+	FR_MD5_CTX		md5;		//!< MD5 state after hashing the secret.
+	fr_hmac_md5_ctx_t	hmac;		//!< HMAC-MD5 state, keyed with the secret.
+} fr_radius_secret_t;
+
+fr_radius_secret_t *fr_radius_secret_alloc(TALLOC_CTX *ctx, char const *secret);
+
+void		fr_radius_md5_secret_init(FR_MD5_CTX *context, char const *secret,
+					  fr_radius_secret_t const *prepared);
+
+void		fr_radius_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *data, size_t data_len,
+				   char const *secret, fr_radius_secret_t const *prepared);
+
 void		fr_radius_make_secret(uint8_t *digest, uint8_t const *vector, char const *secret, uint8_t const *value);
 
 void		fr_radius_print_hex(RADIUS_PACKET const *packet);
@@ -226,12 +249,44 @@ ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *sr
 
 int		fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
 
+int		fr_radius_verify_prepared(RADIUS_PACKET *packet, RADIUS_PACKET *original,
+					  fr_radius_secret_t const *secret);
+
+int		fr_radius_verify_batch(RADIUS_PACKET *packets[], RADIUS_PACKET *originals[], char const *secrets[],
+				       fr_radius_secret_t const *prepared[], int rcodes[], size_t num);
+
+/** Find the shared secret for a client
+ *
+ * @return the prepared secret, or NULL if the client isn't known.
+ */
+typedef fr_radius_secret_t const *(*fr_radius_secret_find_t)(void *uctx, fr_ipaddr_t const *src_ipaddr,
+							      uint16_t src_port);
+
+int		fr_radius_recv_batch(int sockfd, uint8_t *buffer, size_t slot_size, int num,
+				     size_t *data_size, struct sockaddr_storage *src, socklen_t *sizeof_src,
+				     fr_radius_secret_find_t secret_find, void *uctx);
+
 int		fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
 
+int		fr_radius_decode_prepared(RADIUS_PACKET *packet, RADIUS_PACKET *original,
+					  fr_radius_secret_t const *secret);
+
+int		fr_radius_decode_lazy(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
+
+int		fr_radius_decode_da(RADIUS_PACKET *packet, fr_dict_attr_t const *da);
+
+int		fr_radius_decode_remaining(RADIUS_PACKET *packet);
+
 int		fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
 
+int		fr_radius_encode_prepared(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+					  fr_radius_secret_t const *secret);
+
 int		fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
 
+int		fr_radius_sign_prepared(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+					fr_radius_secret_t const *secret);
+
 int		fr_radius_digest_cmp(uint8_t const *a, uint8_t const *b, size_t length);
 
 RADIUS_PACKET	*fr_radius_alloc(TALLOC_CTX *ctx, bool new_vector);
@@ -243,6 +298,7 @@ typedef struct fr_radius_ctx {
 	RADIUS_PACKET const	*packet;
 	RADIUS_PACKET const	*original;
 	char const		*secret;
+	fr_radius_secret_t const *prepared;	//!< State for secret, or NULL to hash it.
 } fr_radius_ctx_t;
 
 /*
@@ -305,6 +361,7 @@ VALUE_PAIR	*fr_pair_cursor_next_by_ancestor(vp_cursor_t *cursor, fr_dict_attr_t
 VALUE_PAIR	*fr_pair_cursor_next(vp_cursor_t *cursor);
 VALUE_PAIR	*fr_pair_cursor_next_peek(vp_cursor_t *cursor);
 VALUE_PAIR	*fr_pair_cursor_current(vp_cursor_t *cursor);
+bool		fr_pair_cursor_failed(vp_cursor_t const *cursor);
 void		fr_pair_cursor_prepend(vp_cursor_t *cursor, VALUE_PAIR *vp);
 void		fr_pair_cursor_append(vp_cursor_t *cursor, VALUE_PAIR *vp);
 void		fr_pair_cursor_merge(vp_cursor_t *cursor, VALUE_PAIR *vp);
@@ -533,6 +590,7 @@ int		fr_socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_
 				     uint16_t dst_port, bool async);
 int		fr_socket_wait_for_connect(int sockfd, struct timeval const *timeout);
 int		fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const *port_name, bool async);
+int		fr_socket_server_reuseport(int sockfd);
 int		fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const *interface);
 
 #ifdef __cplusplus
@@ -76,16 +76,61 @@ USES_APPLE_DEPRECATED_API
 #  define fr_md5_final			MD5_Final
 #  define fr_md5_transform		MD5_Transform
 #  define fr_md5_copy(_out, _in)	memcpy(_out, _in, sizeof(*_out))
+#  define MD5_BLOCK_LENGTH		MD5_CBLOCK
 #endif
 
 /* hmac.c */
+/** HMAC-MD5 state for a key
+ *
+ * Both pads are a full MD5 block, so hashing them once per key saves
+ * two block transforms for each message.
+ */
+typedef struct fr_hmac_md5_ctx {
+	FR_MD5_CTX	inner;		//!< MD5 state after hashing the key XOR ipad.
+	FR_MD5_CTX	outer;		//!< MD5 state after hashing the key XOR opad.
+} fr_hmac_md5_ctx_t;
+
 void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
 		    uint8_t const *key, size_t key_len)
 	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
 
+void	fr_hmac_md5_init(fr_hmac_md5_ctx_t *ctx, uint8_t const *key, size_t key_len);
+
+void	fr_hmac_md5_digest(uint8_t digest[MD5_DIGEST_LENGTH], fr_hmac_md5_ctx_t const *ctx,
+			   uint8_t const *text, size_t text_len)
+	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
+
 /* md5.c */
 void	fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen);
 
+/* md5_mb.c */
+/** Engines for hashing many messages at once
+ *
+ */
+typedef enum fr_md5_mb_engine {
+	FR_MD5_MB_AUTO = 0,			//!< Widest engine the CPU supports.
+	FR_MD5_MB_SCALAR,			//!< One message at a time.
+	FR_MD5_MB_VEC4,				//!< Four messages at a time (SSE2 on x86_64).
+	FR_MD5_MB_AVX2				//!< Eight messages at a time.
+} fr_md5_mb_engine_t;
+
+/** A message to hash with fr_md5_mb_calc()
+ *
+ */
+typedef struct fr_md5_mb_msg {
+	FR_MD5_CTX const	*ctx;		//!< State to continue from, e.g. an HMAC pad.
+						///< NULL to start a new digest.
+	uint8_t const		*in;		//!< Data to hash.
+	size_t			inlen;		//!< Length of the data.
+	uint8_t			*out;		//!< Where to write the digest.
+} fr_md5_mb_msg_t;
+
+void	fr_md5_mb_calc(fr_md5_mb_msg_t const *msgs, size_t num);
+
+int	fr_md5_mb_engine_set(fr_md5_mb_engine_t type);
+
+char const *fr_md5_mb_engine_name(void);
+
 #ifdef __cplusplus
 }
 #endif
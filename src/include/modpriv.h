@@ -42,6 +42,10 @@ extern "C" {
 typedef struct {
 	char const			*name;		//!< Instance name e.g. user_database.
 
+	uint32_t			number;		//!< Unique, dense, number of the instance, assigned
+							//!< when the module is bootstrapped.  Used to find
+							//!< thread specific instance data.
+
 	rad_module_t const		*module;	//!< Module this is an instance of.
 	dl_module_t const		*handle;	//!< dlhandle of module.
 
@@ -216,6 +216,8 @@ rlm_rcode_t	unlang_interpret_continue(REQUEST *request);
 
 rlm_rcode_t	unlang_interpret(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t default_action);
 
+rlm_rcode_t	unlang_interpret_synchronous(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t default_action);
+
 int		unlang_compile(CONF_SECTION *cs, rlm_components_t component);
 
 /** A callback when the the timeout occurs
@@ -254,6 +256,8 @@ typedef void (*fr_unlang_fd_callback_t)(REQUEST *request, void *instance, void *
  *
  * The resumed request cannot call the normal "authorize", etc. method.  It needs a separate callback.
  *
+ * The callback may add new events, and return unlang_yield() again.
+ *
  * @param[in] request		the current request.
  * @param[in] instance		The module instance.
  * @param[in] thread		data specific to this module instance.
@@ -114,10 +114,35 @@ typedef enum value_type {
 	VT_SET,							//!< VALUE_PAIR has children.
 	VT_LIST,						//!< VALUE_PAIR has multiple values.
 	VT_DATA,						//!< VALUE_PAIR has a single value.
-	VT_XLAT							//!< valuepair value must be xlat expanded when it's
+	VT_XLAT,						//!< valuepair value must be xlat expanded when it's
 								//!< added to VALUE_PAIR tree.
+	VT_LAZY							//!< VALUE_PAIR stands for attributes which haven't
+								//!< been decoded yet.  See fr_pair_lazy_alloc().
 } value_type_t;
 
+struct value_pair;
+
+/** Decode the attributes a #VT_LAZY VALUE_PAIR stands for
+ *
+ * @param[out] out	Where to write the decoded VALUE_PAIRs.
+ * @param[in] uctx	passed to fr_pair_lazy_alloc().
+ * @param[in] da	to decode.  NULL to decode everything.
+ * @return
+ *	- 1 if there are attributes which still haven't been decoded.
+ *	- 0 if everything has been decoded.
+ *	- -1 on error.
+ */
+typedef int (*fr_pair_lazy_decode_t)(struct value_pair **out, void *uctx, fr_dict_attr_t const *da);
+
+/** Attributes which haven't been decoded yet
+ *
+ */
+typedef struct fr_pair_lazy {
+	fr_pair_lazy_decode_t	decode;				//!< Decodes attributes when they're needed.
+	void			*uctx;				//!< Decoder state, freed with the VALUE_PAIR.
+	bool			failed;				//!< Decoding failed, and won't be tried again.
+} fr_pair_lazy_t;
+
 /** Stores an attribute, a value and various bits of other data
  *
  * VALUE_PAIRs are the main data structure used in the server
@@ -142,6 +167,7 @@ typedef struct value_pair {
 	//	value_box_t	*data;				//!< Value data for this attribute.
 
 		char const 	*xlat;				//!< Source string for xlat expansion.
+		fr_pair_lazy_t	*lazy;				//!< Decoder for a #VT_LAZY VALUE_PAIR.
 	};
 
 	value_type_t		type;				//!< Type of pointer in value union.
@@ -162,6 +188,7 @@ typedef struct vp_cursor {
 	VALUE_PAIR	*last;					//!< Temporary only used for fr_pair_cursor_append
 	VALUE_PAIR	*current;				//!< The current attribute.
 	VALUE_PAIR	*next;					//!< Next attribute to process.
+	bool		failed;					//!< A #VT_LAZY VALUE_PAIR failed to decode.
 } vp_cursor_t;
 
 /** A VALUE_PAIR in string format.
@@ -233,6 +260,9 @@ VALUE_PAIR	*fr_pair_make(TALLOC_CTX *ctx, VALUE_PAIR **vps, char const *attribut
 void		fr_pair_list_free(VALUE_PAIR **);
 int		fr_pair_to_unknown(VALUE_PAIR *vp);
 int 		fr_pair_mark_xlat(VALUE_PAIR *vp, char const *value);
+VALUE_PAIR	*fr_pair_lazy_alloc(TALLOC_CTX *ctx, fr_pair_lazy_decode_t decode, void *uctx);
+int		fr_pair_lazy_decode(VALUE_PAIR *vp, fr_dict_attr_t const *da);
+int		fr_pair_list_lazy_decode(VALUE_PAIR *head);
 
 /* Searching and list modification */
 VALUE_PAIR	*fr_pair_find_by_da(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_t tag);
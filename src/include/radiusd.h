@@ -482,8 +482,22 @@ void		rad_suid_down_permanent(void);
  */
 #  define REQUEST_MAX_REGEX 32
 
-void	regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value,
-			     size_t len, regmatch_t rxmatch[], size_t nmatch);
+typedef struct regex_cache_stats {
+	uint64_t	hits;		//!< Expressions found in the cache.
+	uint64_t	misses;		//!< Expressions which had to be compiled.
+	uint64_t	evictions;	//!< Entries removed to make room for new ones.
+	uint64_t	studied;	//!< Expressions studied because they were used often.
+} regex_cache_stats_t;
+
+typedef struct regex_cache_entry regex_cache_entry_t;
+
+ssize_t	regex_cache_compile(REQUEST *request, regex_t **out, regex_cache_entry_t **entry,
+			    char const *pattern, size_t len, bool ignore_case, bool multiline, bool subcaptures);
+
+void	regex_cache_stats(regex_cache_stats_t *stats);
+
+void	regex_sub_to_request(REQUEST *request, regex_t **preg, regex_cache_entry_t *cached,
+			     char const *value, size_t len, regmatch_t rxmatch[], size_t nmatch);
 
 int	regex_request_to_sub(TALLOC_CTX *ctx, char **out, REQUEST *request, uint32_t num);
 
@@ -25,6 +25,12 @@
  */
 RCSIDH(realms_h, "$Id$")
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -96,6 +102,7 @@ typedef struct home_server {
 	fr_socket_limit_t 	limit;
 
 	char const		*secret;
+	fr_radius_secret_t	*prepared;		//!< Hashed state for secret.
 
 	fr_event_timer_t		*ev;
 	struct timeval		when;
@@ -104,7 +111,7 @@ typedef struct home_server {
 	uint32_t		response_timeouts;
 	uint32_t		max_response_timeouts;
 	uint32_t		max_outstanding;	//!< Maximum outstanding requests.
-	uint32_t		currently_outstanding;
+	atomic_uint_fast32_t	currently_outstanding;	//!< Requests in the proxy hash.
 
 	time_t			last_packet_sent;
 	time_t			last_packet_recv;
@@ -39,6 +39,24 @@ extern "C" {
 #define UDP_FLAGS_CONNECTED	(1 << 0)
 #define UDP_FLAGS_PEEK		(1 << 1)
 
+#define UDP_MAX_BATCH		(64)
+
+/** One packet in a batch to be sent
+ *
+ */
+typedef struct udp_batch_entry_t {
+	uint8_t			*data;			//!< packet to send
+	size_t			data_len;		//!< length of the packet
+
+	struct sockaddr_storage	src;			//!< source address of the reply
+	socklen_t		sizeof_src;		//!< 0 to let the kernel choose the source address
+
+	struct sockaddr_storage	dst;			//!< where the packet is sent
+	socklen_t		sizeof_dst;		//!< length of the destination address
+
+	int			if_index;		//!< outbound interface, or 0
+} udp_batch_entry_t;
+
 ssize_t udp_send(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *src_ipaddr, uint16_t src_port, int if_index,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t dst_port);
@@ -52,6 +70,11 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 struct timeval *when);
 
+int udp_recv_batch(int sockfd, uint8_t *buffer, size_t slot_size, int num,
+		   size_t *data_size, struct sockaddr_storage *src, socklen_t *sizeof_src);
+
+int udp_send_batch(int sockfd, udp_batch_entry_t *entries, int num);
+
 #ifdef __cplusplus
 }
 #endif
@@ -41,6 +41,8 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t fromlen,
 	       struct sockaddr *to, socklen_t tolen,
 	       int if_index);
+int udpfromto_msghdr(int s, struct msghdr *msgh, char *cbuf, size_t cbuf_len,
+		     struct sockaddr *from, socklen_t fromlen, int if_index);
 #endif
 
 #ifdef __cplusplus
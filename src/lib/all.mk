@@ -20,6 +20,7 @@ SOURCES		:= cbuff.c \
 		   missing.c \
 		   md4.c \
 		   md5.c \
+		   md5_mb.c \
 		   net.c \
 		   pair.c \
 		   pair_cursor.c \
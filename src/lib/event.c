@@ -31,8 +31,38 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/event.h>
 
+#ifdef WITH_EPOLL
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#else
+#  include <sys/event.h>
+#endif
+
 #define FR_EV_BATCH_FDS (256)
 
+#ifdef WITH_EPOLL
+/*
+ *	epoll only gives us 64 bits of data for each descriptor.  For
+ *	file descriptor events, it's a pointer to the fr_event_fd_t.
+ *	For user events, it's the eventfd and the ident, with the low
+ *	bit set so that it can't be mistaken for a pointer.
+ */
+#define FR_EV_USER_DATA(_fd, _ident)	((((uint64_t) (_fd)) << 32) | ((((uint64_t) (_ident)) & 0x7fffffff) << 1) | 1)
+#define FR_EV_USER_IS_DATA(_data)	(((_data) & 0x01) != 0)
+#define FR_EV_USER_IDENT(_data)		((uintptr_t) (((_data) >> 1) & 0x7fffffff))
+#endif
+
+/*
+ *	The timing wheel has FR_EV_WHEEL_LEVELS levels, each of
+ *	FR_EV_WHEEL_SLOTS slots.  A tick is one millisecond, so the
+ *	levels cover 256ms, 65s, 4.6h, and 49 days.
+ */
+#define FR_EV_WHEEL_BITS	(8)
+#define FR_EV_WHEEL_SLOTS	(1 << FR_EV_WHEEL_BITS)
+#define FR_EV_WHEEL_MASK	(FR_EV_WHEEL_SLOTS - 1)
+#define FR_EV_WHEEL_LEVELS	(4)
+#define FR_EV_WHEEL_WORDS	(FR_EV_WHEEL_SLOTS / 64)
+
 #undef USEC
 #define USEC (1000000)
 
@@ -46,6 +76,11 @@ struct fr_event_timer_t {
 
 	fr_event_timer_t	**parent;		//!< Previous timer.
 	int			heap;			//!< Where to store opaque heap data.
+
+	fr_event_timer_t	*next;			//!< Next timer in the same wheel slot.
+	fr_event_timer_t	**prev;			//!< Pointer to us, in the previous timer or the slot.
+	int			level;			//!< Wheel level we're in, or -1 for the expired list.
+	unsigned int		slot;			//!< Wheel slot we're in.
 };
 
 /** A file descriptor event
@@ -61,6 +96,9 @@ typedef struct fr_event_fd_t {
 	bool			is_registered;		//!< Whether this fr_event_fd_t's FD has been registered with
 							//!< kevent.  Mostly for debugging.
 
+	bool			edge_triggered;		//!< Only report the FD when it becomes readable / writable,
+							//!< not for as long as it is.
+
 	bool			in_handler;		//!< Event is currently being serviced.  Deletes should be
 							//!< deferred until after the handlers complete.
 
@@ -75,6 +113,15 @@ typedef struct fr_event_fd_t {
  */
 struct fr_event_list_t {
 	fr_heap_t		*times;			//!< of timer events to be executed.
+
+	fr_event_timer_backend_t timer_backend;		//!< Whether timers are in the heap or the wheel.
+	int			num_timers;		//!< Number of timers in the wheel.
+	int			wheel_count[FR_EV_WHEEL_LEVELS];	//!< Number of timers in each level.
+	uint64_t		wheel_tick;		//!< The current tick.  All slots before it are empty.
+	fr_event_timer_t	*wheel[FR_EV_WHEEL_LEVELS][FR_EV_WHEEL_SLOTS];	//!< Timers, by when they fire.
+	uint64_t		wheel_used[FR_EV_WHEEL_LEVELS][FR_EV_WHEEL_WORDS];	//!< Bitmap of non-empty slots.
+	fr_event_timer_t	*expired;		//!< Timers which are due to fire.
+	fr_event_timer_t	**expired_tail;		//!< End of the expired list.
 	rbtree_t		*fds;			//!< Tree used to track FDs with filters in kqueue.
 
 	int			exit;
@@ -90,11 +137,16 @@ struct fr_event_list_t {
 	int			num_fd_events;		//!< Number of events in this event list.
 
 	int			kq;			//!< instance associated with this event list.
+	int			wakeup_fd;		//!< user event used to wake the loop when it exits.
 
-	fr_event_user_handler_t user;			//!< callback for EVFILT_USER events
+	fr_event_user_handler_t user;			//!< callback for user events
 	void			*user_ctx;		//!< Context pointer to pass to the user callback.
 
+#ifdef WITH_EPOLL
+	struct epoll_event	events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
+#else
 	struct kevent		events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
+#endif
 };
 
 /** Compare two timer events to see which one should occur first
@@ -139,6 +191,288 @@ static int fr_event_fd_cmp(void const *a, void const *b)
 	return 0;
 }
 
+/** Convert a time to a timing wheel tick
+ *
+ * @param[in] when	to convert.
+ * @return the number of milliseconds since the epoch.
+ */
+static inline uint64_t fr_event_wheel_tick(struct timeval const *when)
+{
+	return (((uint64_t) when->tv_sec) * 1000) + (when->tv_usec / 1000);
+}
+
+/** Remove a timer from the timing wheel, or from the expired list
+ *
+ * @param[in] el	containing the timer.
+ * @param[in] ev	to remove.
+ */
+static void fr_event_wheel_unlink(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (el->expired_tail == &ev->next) el->expired_tail = ev->prev;
+
+	*ev->prev = ev->next;
+	if (ev->next) ev->next->prev = ev->prev;
+
+	if (ev->level >= 0) {
+		el->wheel_count[ev->level]--;
+
+		if (!el->wheel[ev->level][ev->slot]) {
+			el->wheel_used[ev->level][ev->slot / 64] &= ~((uint64_t) 1 << (ev->slot % 64));
+		}
+	}
+
+	ev->next = NULL;
+	ev->prev = NULL;
+}
+
+/** Add a timer to the end of the expired list
+ *
+ * @param[in] el	to add the timer to.
+ * @param[in] ev	which is due to fire.
+ */
+static void fr_event_wheel_expire(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	ev->level = -1;
+	ev->next = NULL;
+	ev->prev = el->expired_tail;
+
+	*el->expired_tail = ev;
+	el->expired_tail = &ev->next;
+}
+
+/** Put a timer into the right slot of the timing wheel
+ *
+ * Timers which fire within 256 ticks go into level 0.  Timers which
+ * fire later go into a higher level, and are moved down a level each
+ * time the level below wraps around.  Timers which fire further in
+ * the future than the wheel covers go into the last slot, and are
+ * placed again when that slot is reached.
+ *
+ * @param[in] el	to add the timer to.
+ * @param[in] ev	to add.
+ */
+static void fr_event_wheel_place(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	int			level = 0;
+	unsigned int		slot;
+	uint64_t		tick, delta;
+	fr_event_timer_t	**head;
+
+	tick = fr_event_wheel_tick(&ev->when);
+
+	/*
+	 *	Timers which should have already fired go into the
+	 *	current slot.
+	 */
+	if (tick <= el->wheel_tick) {
+		tick = el->wheel_tick;
+
+	} else {
+		delta = tick - el->wheel_tick;
+
+		while ((level < (FR_EV_WHEEL_LEVELS - 1)) &&
+		       (delta >= ((uint64_t) 1 << (FR_EV_WHEEL_BITS * (level + 1))))) {
+			level++;
+		}
+
+		if (delta >= ((uint64_t) 1 << (FR_EV_WHEEL_BITS * FR_EV_WHEEL_LEVELS))) {
+			tick = el->wheel_tick + ((uint64_t) 1 << (FR_EV_WHEEL_BITS * FR_EV_WHEEL_LEVELS)) - 1;
+		}
+	}
+
+	slot = (tick >> (FR_EV_WHEEL_BITS * level)) & FR_EV_WHEEL_MASK;
+	head = &el->wheel[level][slot];
+
+	ev->next = *head;
+	if (ev->next) ev->next->prev = &ev->next;
+	*head = ev;
+	ev->prev = head;
+
+	ev->level = level;
+	ev->slot = slot;
+	el->wheel_count[level]++;
+	el->wheel_used[level][slot / 64] |= ((uint64_t) 1 << (slot % 64));
+}
+
+/** Find the first non-empty slot in a level, starting from a given slot
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[in] level	to search.
+ * @param[in] start	slot to start searching from.  The search wraps around.
+ * @return
+ *	- the slot number.
+ *	- -1 if the level is empty.
+ */
+static int fr_event_wheel_find(fr_event_list_t *el, int level, unsigned int start)
+{
+	unsigned int	i, word;
+	uint64_t	bits;
+
+	word = start / 64;
+	bits = el->wheel_used[level][word] & (~(uint64_t) 0 << (start % 64));
+
+	for (i = 0; i <= FR_EV_WHEEL_WORDS; i++) {
+		if (bits) return ((word * 64) + __builtin_ctzll(bits)) & FR_EV_WHEEL_MASK;
+
+		word = (word + 1) % FR_EV_WHEEL_WORDS;
+		bits = el->wheel_used[level][word];
+	}
+
+	return -1;
+}
+
+/** Move timers down a level, when the level below wraps around
+ *
+ * @param[in] el	containing the timing wheel.
+ */
+static void fr_event_wheel_cascade(fr_event_list_t *el)
+{
+	int level;
+
+	for (level = FR_EV_WHEEL_LEVELS - 1; level > 0; level--) {
+		unsigned int		slot;
+		fr_event_timer_t	*ev;
+		int			shift = FR_EV_WHEEL_BITS * level;
+
+		if ((el->wheel_tick & (((uint64_t) 1 << shift) - 1)) != 0) continue;
+
+		slot = (el->wheel_tick >> shift) & FR_EV_WHEEL_MASK;
+
+		while ((ev = el->wheel[level][slot]) != NULL) {
+			fr_event_wheel_unlink(el, ev);
+			fr_event_wheel_place(el, ev);
+		}
+	}
+}
+
+/** Advance the timing wheel, moving all timers which are due to the expired list
+ *
+ * Empty parts of the wheel are skipped, so catching up after a long
+ * sleep is cheap.
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[in] now	the current tick.
+ */
+static void fr_event_wheel_advance(fr_event_list_t *el, uint64_t now)
+{
+	while (el->wheel_tick < now) {
+		int			level, shift;
+		uint64_t		next;
+		fr_event_timer_t	*ev;
+
+		/*
+		 *	Everything in the current slot is due.
+		 */
+		while ((ev = el->wheel[0][el->wheel_tick & FR_EV_WHEEL_MASK]) != NULL) {
+			fr_event_wheel_unlink(el, ev);
+			fr_event_wheel_expire(el, ev);
+		}
+
+		/*
+		 *	Skip ahead to the next point where a level
+		 *	with timers in it cascades.
+		 */
+		for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+			if (el->wheel_count[level] > 0) break;
+		}
+
+		if (level == FR_EV_WHEEL_LEVELS) {
+			el->wheel_tick = now;
+			break;
+		}
+
+		shift = FR_EV_WHEEL_BITS * level;
+		next = ((el->wheel_tick >> shift) + 1) << shift;
+		if (next > now) {
+			el->wheel_tick = now;
+			break;
+		}
+
+		el->wheel_tick = next;
+		fr_event_wheel_cascade(el);
+	}
+}
+
+/** Find when the next timer in the timing wheel fires
+ *
+ * The first non-empty slot in each level holds the earliest timers
+ * for that level.  The answer is the earliest of those.
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[out] when	the time the next timer fires.
+ * @return
+ *	- true if there is a timer.
+ *	- false if the wheel is empty.
+ */
+static bool fr_event_wheel_next(fr_event_list_t *el, struct timeval *when)
+{
+	int		level;
+	bool		found = false;
+
+	if (el->expired) {
+		*when = el->expired->when;
+		return true;
+	}
+
+	for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+		int			slot, shift = FR_EV_WHEEL_BITS * level;
+		unsigned int		current, offset;
+		fr_event_timer_t	*ev;
+
+		if (!el->wheel_count[level]) continue;
+
+		/*
+		 *	Higher levels have already cascaded the
+		 *	current slot.  Anything still in it is for
+		 *	the next time around the wheel.
+		 */
+		current = (el->wheel_tick >> shift) & FR_EV_WHEEL_MASK;
+		slot = fr_event_wheel_find(el, level, (current + (level > 0)) & FR_EV_WHEEL_MASK);
+		if (slot < 0) continue;
+
+		/*
+		 *	Every timer in the slot fires at or after the
+		 *	start of the slot.  If that's later than what
+		 *	we already have, there's no need to look.
+		 */
+		offset = (slot - current) & FR_EV_WHEEL_MASK;
+		if ((level > 0) && (offset == 0)) offset = FR_EV_WHEEL_SLOTS;
+
+		if (found &&
+		    ((((el->wheel_tick >> shift) + offset) << shift) > fr_event_wheel_tick(when))) continue;
+
+		for (ev = el->wheel[level][slot]; ev != NULL; ev = ev->next) {
+			if (!found || (fr_timeval_cmp(&ev->when, when) < 0)) {
+				*when = ev->when;
+				found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+/** Find when the next timer event fires
+ *
+ * @param[in] el	containing the timer events.
+ * @param[out] when	the time the next timer fires.
+ * @return
+ *	- true if there is a timer.
+ *	- false if there are no timers.
+ */
+static bool fr_event_timer_next(fr_event_list_t *el, struct timeval *when)
+{
+	fr_event_timer_t *ev;
+
+	if (el->timer_backend == FR_EVENT_TIMER_WHEEL) return fr_event_wheel_next(el, when);
+
+	ev = fr_heap_peek(el->times);
+	if (!ev) return false;
+
+	*when = ev->when;
+	return true;
+}
+
 /** Return the number of file descriptors is_registered with this event loop
  *
  */
@@ -158,6 +492,8 @@ int fr_event_list_num_elements(fr_event_list_t *el)
 {
 	if (!el) return -1;
 
+	if (el->timer_backend == FR_EVENT_TIMER_WHEEL) return el->num_timers;
+
 	return fr_heap_num_elements(el->times);
 }
 
@@ -200,6 +536,41 @@ int fr_event_list_time(struct timeval *when, fr_event_list_t *el)
 	return 1;
 }
 
+/** Choose how timer events are stored
+ *
+ * The heap is O(log n) for inserts and deletes.  The timing wheel is
+ * O(1), which is better when there are many timers, most of which are
+ * deleted before they fire.  The wheel has a resolution of one
+ * millisecond, but timers never fire early.
+ *
+ * @param[in] el	to change.  Must not have any timer events.
+ * @param[in] backend	to use for timer events.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_event_list_timer_backend(fr_event_list_t *el, fr_event_timer_backend_t backend)
+{
+	struct timeval now;
+
+	if (!el) {
+		fr_strerror_printf("Invalid argument: NULL event list");
+		return -1;
+	}
+
+	if (fr_event_list_num_elements(el) > 0) {
+		fr_strerror_printf("Cannot change timer backend when there are timer events");
+		return -1;
+	}
+
+	gettimeofday(&now, NULL);
+
+	el->timer_backend = backend;
+	el->wheel_tick = fr_event_wheel_tick(&now);
+
+	return 0;
+}
+
 /** Remove a file descriptor from the event loop
  *
  * @param[in] el	to remove file descriptor from.
@@ -248,11 +619,22 @@ int fr_event_fd_delete(fr_event_list_t *el, int fd)
  */
 static int _fr_event_fd_free(fr_event_fd_t *ef)
 {
+	fr_event_list_t	*el = talloc_parent(ef);
+
+#ifdef WITH_EPOLL
+	if (ef->is_registered) {
+		struct epoll_event evset;
+
+		memset(&evset, 0, sizeof(evset));
+		if (epoll_ctl(el->kq, EPOLL_CTL_DEL, ef->fd, &evset) < 0) {
+			fr_strerror_printf("Failed removing FD %i: %s", ef->fd, fr_syserror(errno));
+			return -1;
+		}
+	}
+#else
 	int		filter = 0;
 	struct kevent	evset;
 
-	fr_event_list_t	*el = talloc_parent(ef);
-
 	if (ef->read) filter |= EVFILT_READ;
 	if (ef->write) filter |= EVFILT_WRITE;
 
@@ -263,6 +645,7 @@ static int _fr_event_fd_free(fr_event_fd_t *ef)
 			return -1;
 		}
 	}
+#endif
 	rbtree_deletebydata(el->fds, ef);
 	ef->is_registered = false;
 
@@ -289,8 +672,12 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 		       fr_event_fd_handler_t error,
 		       void *ctx)
 {
+#ifdef WITH_EPOLL
+	struct epoll_event evset;
+#else
 	int	      	filter = 0;
 	struct kevent	evset;
+#endif
 	fr_event_fd_t	*ef, find;
 	bool		pre_existing;
 
@@ -346,6 +733,7 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 	} else {
 		pre_existing = true;
 
+#ifndef WITH_EPOLL
 		if (ef->read && !read_fn) filter |= EVFILT_READ;
 		if (ef->write && !write_fn) filter |= EVFILT_WRITE;
 
@@ -364,6 +752,7 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 			}
 			filter = 0;
 		}
+#endif
 
 		/*
 		 *	I/O handler may delete an event, then
@@ -375,6 +764,27 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 
 	ef->ctx = ctx;
 
+#ifdef WITH_EPOLL
+	/*
+	 *	epoll has one registration per FD, so we just
+	 *	replace the existing one.
+	 */
+	ef->read = read_fn;
+	ef->write = write_fn;
+	ef->error = error;
+
+	memset(&evset, 0, sizeof(evset));
+	if (read_fn) evset.events |= EPOLLIN;
+	if (write_fn) evset.events |= EPOLLOUT;
+	if (ef->edge_triggered) evset.events |= EPOLLET;
+	evset.data.u64 = (uintptr_t) ef;
+
+	if (epoll_ctl(el->kq, ef->is_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &evset) < 0) {
+		fr_strerror_printf("Failed adding FD %i: %s", fd, fr_syserror(errno));
+		if (!pre_existing) talloc_free(ef);
+		return -1;
+	}
+#else
 	if (read_fn) {
 		ef->read = read_fn;
 		filter |= EVFILT_READ;
@@ -386,17 +796,69 @@ int fr_event_fd_insert(fr_event_list_t *el, int fd,
 	}
 	ef->error = error;
 
-	EV_SET(&evset, fd, filter, EV_ADD | EV_ENABLE, 0, 0, ef);
+	EV_SET(&evset, fd, filter, EV_ADD | EV_ENABLE | (ef->edge_triggered ? EV_CLEAR : 0), 0, 0, ef);
 	if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
 		fr_strerror_printf("Failed adding filter for FD %i: %s", fd, fr_syserror(errno));
 		if (!pre_existing) talloc_free(ef);
 		return -1;
 	}
+#endif
 	ef->is_registered = true;
 
 	return 0;
 }
 
+/** Change whether a file descriptor is edge triggered
+ *
+ * By default, a file descriptor is reported for as long as it is
+ * readable (or writable).  When it is edge triggered, it is only
+ * reported when it becomes readable.  The read callback then has to
+ * read until there is no more data, or it won't be called again.
+ *
+ * This saves the event loop from reporting a busy socket on every
+ * iteration, when the callback already reads batches of packets.
+ *
+ * @param[in] el	the file descriptor was inserted into.
+ * @param[in] fd	to change.
+ * @param[in] edge	true for edge triggered, false for level triggered.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_fd_edge_triggered(fr_event_list_t *el, int fd, bool edge)
+{
+	fr_event_fd_t	*ef, find;
+
+	if (!el) {
+		fr_strerror_printf("Invalid argument: NULL event list");
+		return -1;
+	}
+
+	memset(&find, 0, sizeof(find));
+	find.fd = fd;
+
+	ef = rbtree_finddata(el->fds, &find);
+	if (!ef) {
+		fr_strerror_printf("No events is_registered for fd %i", fd);
+		return -1;
+	}
+
+	if (ef->edge_triggered == edge) return 0;
+
+	ef->edge_triggered = edge;
+
+	/*
+	 *	Re-register the FD with the same callbacks, which
+	 *	picks up the new flag.
+	 */
+	if (fr_event_fd_insert(el, fd, ef->read, ef->write, ef->error, ef->ctx) < 0) {
+		ef->edge_triggered = !edge;
+		return -1;
+	}
+
+	return 0;
+}
+
 
 /** Delete a timer event from the event list
  *
@@ -440,6 +902,13 @@ int fr_event_timer_delete(fr_event_list_t *el, fr_event_timer_t **parent)
 	}
 	*parent = NULL;
 
+	if (el->timer_backend == FR_EVENT_TIMER_WHEEL) {
+		fr_event_wheel_unlink(el, ev);
+		el->num_timers--;
+		talloc_free(ev);
+		return 1;
+	}
+
 	ret = fr_heap_extract(el->times, ev);
 
 	/*
@@ -510,8 +979,13 @@ int fr_event_timer_insert(fr_event_list_t *el, fr_event_callback_t callback, voi
 		ev = *parent;
 #endif
 
-		ret = fr_heap_extract(el->times, ev);
-		if (!fr_cond_assert(ret == 1)) return -1;	/* events MUST be in the heap */
+		if (el->timer_backend == FR_EVENT_TIMER_WHEEL) {
+			fr_event_wheel_unlink(el, ev);
+			el->num_timers--;
+		} else {
+			ret = fr_heap_extract(el->times, ev);
+			if (!fr_cond_assert(ret == 1)) return -1;	/* events MUST be in the heap */
+		}
 
 		memset(ev, 0, sizeof(*ev));
 	} else {
@@ -524,7 +998,11 @@ int fr_event_timer_insert(fr_event_list_t *el, fr_event_callback_t callback, voi
 	ev->when = *when;
 	ev->parent = parent;
 
-	if (!fr_heap_insert(el->times, ev)) {
+	if (el->timer_backend == FR_EVENT_TIMER_WHEEL) {
+		fr_event_wheel_place(el, ev);
+		el->num_timers++;
+
+	} else if (!fr_heap_insert(el->times, ev)) {
 		fr_strerror_printf("Failed inserting event into heap");
 		talloc_free(ev);
 		return -1;
@@ -574,6 +1052,161 @@ int fr_event_user_delete(fr_event_list_t *el, fr_event_user_handler_t user, void
 }
 
 
+/** Register a user event
+ *
+ * User events let another thread wake up an event loop.  With kqueue,
+ * they're EVFILT_USER filters on the kqueue.  With epoll, each one is
+ * an eventfd which is added to the epoll set.  Either way, waking up
+ * the event loop costs one system call.
+ *
+ * @param[in] kq	to register the event with.  See #fr_event_list_kq.
+ * @param[in] ident	for the event.  Passed to the #fr_event_user_handler_t.
+ * @return
+ *	- the descriptor to pass to #fr_event_user_trigger.
+ *	- -1 on error.
+ */
+int fr_event_user_register(int kq, uintptr_t ident)
+{
+#ifdef WITH_EPOLL
+	int			fd;
+	struct epoll_event	evset;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating eventfd: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Edge triggered, so that we're woken up once for
+	 *	each trigger, without having to read the counter.
+	 */
+	memset(&evset, 0, sizeof(evset));
+	evset.events = EPOLLIN | EPOLLET;
+	evset.data.u64 = FR_EV_USER_DATA(fd, ident);
+
+	if (epoll_ctl(kq, EPOLL_CTL_ADD, fd, &evset) < 0) {
+		fr_strerror_printf("Failed adding user event: %s", fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, ident, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed adding user event: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return kq;
+#endif
+}
+
+/** Trigger a user event
+ *
+ * This function may be called from any thread.
+ *
+ * @param[in] fd	returned by #fr_event_user_register.
+ * @param[in] ident	the event was registered with.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_event_user_trigger(int fd, uintptr_t ident)
+{
+#ifdef WITH_EPOLL
+	uint64_t value = 1;
+
+	(void) ident;
+
+	if (write(fd, &value, sizeof(value)) == sizeof(value)) return 0;
+
+	/*
+	 *	The counter is full.  Nothing reads it, so reset it
+	 *	and try again.
+	 */
+	if (errno == EAGAIN) {
+		if (read(fd, &value, sizeof(value)) < 0) return -1;
+
+		value = 1;
+		if (write(fd, &value, sizeof(value)) == sizeof(value)) return 0;
+	}
+
+	return -1;
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, ident, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
+	return kevent(fd, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/** Deregister a user event
+ *
+ * @param[in] kq	the event was registered with.
+ * @param[in] fd	returned by #fr_event_user_register.
+ * @param[in] ident	the event was registered with.
+ */
+void fr_event_user_deregister(int kq, int fd, uintptr_t ident)
+{
+#ifdef WITH_EPOLL
+	struct epoll_event evset;
+
+	(void) ident;
+
+	memset(&evset, 0, sizeof(evset));
+	(void) epoll_ctl(kq, EPOLL_CTL_DEL, fd, &evset);
+	close(fd);
+#else
+	/*
+	 *	Other users may have registered the same ident on
+	 *	the same kqueue, so we leave the filter in place.
+	 *	It goes away when the kqueue is closed.
+	 */
+	(void) kq;
+	(void) fd;
+	(void) ident;
+#endif
+}
+
+/** Find a timer in the timing wheel which is due to fire
+ *
+ * The wheel is first advanced to the current time, which moves all
+ * of the timers in the slots which have passed to the expired list.
+ *
+ * @param[in] el	containing the timer events.
+ * @param[in,out] when	the current time.  Updated to the time of the next event
+ *			if no event is due.
+ * @return
+ *	- the timer to run.
+ *	- NULL if no timer is due.
+ */
+static fr_event_timer_t *fr_event_wheel_due(fr_event_list_t *el, struct timeval *when)
+{
+	fr_event_timer_t *ev;
+
+	fr_event_wheel_advance(el, fr_event_wheel_tick(when));
+
+	if (el->expired) return el->expired;
+
+	/*
+	 *	Timers in the current slot may, or may not, be due.
+	 */
+	for (ev = el->wheel[0][el->wheel_tick & FR_EV_WHEEL_MASK]; ev != NULL; ev = ev->next) {
+		if (fr_timeval_cmp(&ev->when, when) <= 0) return ev;
+	}
+
+	if (!fr_event_wheel_next(el, when)) {
+		when->tv_sec = 0;
+		when->tv_usec = 0;
+	}
+
+	return NULL;
+}
+
 /** Run a single scheduled timer event
  *
  * @param[in] el	containing the timer events.
@@ -590,6 +1223,19 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 
 	if (!el) return 0;
 
+	if (el->timer_backend == FR_EVENT_TIMER_WHEEL) {
+		if (el->num_timers == 0) {
+			when->tv_sec = 0;
+			when->tv_usec = 0;
+			return 0;
+		}
+
+		ev = fr_event_wheel_due(el, when);
+		if (!ev) return 0;
+
+		goto run;
+	}
+
 	if (fr_heap_num_elements(el->times) == 0) {
 		when->tv_sec = 0;
 		when->tv_usec = 0;
@@ -613,6 +1259,7 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 		return 0;
 	}
 
+run:
 	callback = ev->callback;
 	memcpy(&ctx, &ev->ctx, sizeof(ctx));
 
@@ -637,7 +1284,11 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 int fr_event_corral(fr_event_list_t *el, bool wait)
 {
 	struct timeval when, *wake;
+#ifdef WITH_EPOLL
+	int timeout;
+#else
 	struct timespec ts_when, *ts_wake;
+#endif
 
 	if (el->exit) {
 		fr_strerror_printf("Event loop exiting");
@@ -653,19 +1304,16 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	wake = &when;
 
 	if (wait) {
-		if (fr_heap_num_elements(el->times) > 0) {
-			fr_event_timer_t *ev;
-
-			ev = fr_heap_peek(el->times);
-			if (!fr_cond_assert(ev)) return -1;
+		struct timeval next;
 
+		if (fr_event_timer_next(el, &next)) {
 			gettimeofday(&el->now, NULL);
 
 			/*
 			 *	Next event is in the future, get the time
 			 *	between now and that event.
 			 */
-			if (fr_timeval_cmp(&ev->when, &el->now) > 0) fr_timeval_subtract(&when, &ev->when, &el->now);
+			if (fr_timeval_cmp(&next, &el->now) > 0) fr_timeval_subtract(&when, &next, &el->now);
 		} else {
 			wake = NULL;
 		}
@@ -684,6 +1332,28 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 		}
 	}
 
+#ifdef WITH_EPOLL
+	/*
+	 *	epoll_wait() takes milliseconds.  Round up, so
+	 *	that we don't wake up before the timer is due.
+	 */
+	if (wake) {
+		if (when.tv_sec >= (INT_MAX / 1000)) {
+			timeout = INT_MAX;
+		} else {
+			timeout = (when.tv_sec * 1000) + ((when.tv_usec + 999) / 1000);
+		}
+	} else {
+		timeout = -1;
+	}
+
+	/*
+	 *	Populate el->events with the list of I/O events
+	 *	that occurred since this function was last called
+	 *	or wait for the next timer event.
+	 */
+	el->num_fd_events = epoll_wait(el->kq, el->events, FR_EV_BATCH_FDS, timeout);
+#else
 	if (wake) {
 		ts_wake = &ts_when;
 		ts_when.tv_sec = when.tv_sec;
@@ -698,6 +1368,7 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	 *	or wait for the next timer event.
 	 */
 	el->num_fd_events = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, ts_wake);
+#endif
 
 	/*
 	 *	Interrupt is different from timeout / FD events.
@@ -723,6 +1394,47 @@ void fr_event_service(fr_event_list_t *el)
 	for (i = 0; i < el->num_fd_events; i++) {
 		fr_event_fd_t *ev;
 
+#ifdef WITH_EPOLL
+		uint64_t data = el->events[i].data.u64;
+		uint32_t flags = el->events[i].events;
+
+		/*
+		 *	Process any user events.  We don't read the
+		 *	eventfd, as it's edge triggered.
+		 */
+		if (FR_EV_USER_IS_DATA(data)) {
+			/*
+			 *	This is just a "wakeup" event, which
+			 *	is always ignored.
+			 */
+			if (!el->user || (FR_EV_USER_IDENT(data) == 0)) continue;
+
+			el->user(el->kq, FR_EV_USER_IDENT(data), el->user_ctx);
+			continue;
+		}
+
+#ifndef NDEBUG
+		ev = talloc_get_type_abort((void *) (uintptr_t) data, fr_event_fd_t);
+#else
+		ev = (fr_event_fd_t *) (uintptr_t) data;
+#endif
+
+		if (!fr_cond_assert(ev->is_registered)) continue;
+
+		/*
+		 *	Errors are only fatal if there's no data left
+		 *	to read.
+		 */
+		if ((flags & EPOLLERR) || ((flags & EPOLLHUP) && !(flags & EPOLLIN))) {
+			if (ev->error) ev->error(el, ev->fd, ev->ctx);
+			continue;
+		}
+
+		ev->in_handler = true;
+		if (ev->read && (flags & (EPOLLIN | EPOLLHUP))) ev->read(el, ev->fd, ev->ctx);
+		if (ev->write && (flags & EPOLLOUT) && !ev->do_delete) ev->write(el, ev->fd, ev->ctx);
+		ev->in_handler = false;
+#else
 		/*
 		 *	Process any user events
 		 */
@@ -733,7 +1445,7 @@ void fr_event_service(fr_event_list_t *el)
 			 */
 			if (el->events[i].ident == 0) continue;
 
-			el->user(el->kq, &el->events[i], el->user_ctx);
+			el->user(el->kq, el->events[i].ident, el->user_ctx);
 			continue;
 		}
 
@@ -763,6 +1475,7 @@ void fr_event_service(fr_event_list_t *el)
 		if (ev->read && (el->events[i].filter == EVFILT_READ)) ev->read(el, ev->fd, ev->ctx);
 		if (ev->write && (el->events[i].filter == EVFILT_WRITE) && !ev->do_delete) ev->write(el, ev->fd, ev->ctx);
 		ev->in_handler = false;
+#endif
 
 		/*
 		 *	Process any deferred deletes performed
@@ -771,7 +1484,7 @@ void fr_event_service(fr_event_list_t *el)
 		if (ev->do_delete) fr_event_fd_delete(el, ev->fd);
 	}
 
-	if (fr_heap_num_elements(el->times) > 0) {
+	if (fr_event_list_num_elements(el) > 0) {
 		struct timeval when;
 
 		do {
@@ -790,8 +1503,6 @@ void fr_event_service(fr_event_list_t *el)
  */
 void fr_event_loop_exit(fr_event_list_t *el, int code)
 {
-	struct kevent kev;
-
 	if (!el) return;
 
 	el->exit = code;
@@ -799,8 +1510,7 @@ void fr_event_loop_exit(fr_event_list_t *el, int code)
 	/*
 	 *	Signal the control plane to exit.
 	 */
-	EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	(void) kevent(el->kq, &kev, 1, NULL, 0, NULL);
+	(void) fr_event_user_trigger(el->wakeup_fd, 0);
 }
 
 /** Check to see whether the event loop is in the process of exiting
@@ -841,14 +1551,29 @@ int fr_event_loop(fr_event_list_t *el)
  */
 static int _event_list_free(fr_event_list_t *el)
 {
+	int level, slot;
 	fr_event_timer_t *ev;
 
 	while ((ev = fr_heap_peek(el->times)) != NULL) {
 		fr_event_timer_delete(el, &ev);
 	}
 
+	while ((ev = el->expired) != NULL) {
+		fr_event_timer_delete(el, &ev);
+	}
+
+	for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FR_EV_WHEEL_SLOTS; slot++) {
+			while ((ev = el->wheel[level][slot]) != NULL) {
+				fr_event_timer_delete(el, &ev);
+			}
+		}
+	}
+
 	fr_heap_delete(el->times);
 
+	if (el->wakeup_fd >= 0) fr_event_user_deregister(el->kq, el->wakeup_fd, 0);
+
 	close(el->kq);
 
 	return 0;
@@ -866,7 +1591,6 @@ static int _event_list_free(fr_event_list_t *el)
 fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status, void *status_ctx)
 {
 	fr_event_list_t *el;
-	struct kevent kev;
 
 	el = talloc_zero(ctx, fr_event_list_t);
 	if (!fr_cond_assert(el)) {
@@ -880,8 +1604,14 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status,
 		return NULL;
 	}
 	el->fds = rbtree_create(el, fr_event_fd_cmp, NULL, 0);
+	el->expired_tail = &el->expired;
+	el->wakeup_fd = -1;
 
+#ifdef WITH_EPOLL
+	el->kq = epoll_create1(EPOLL_CLOEXEC);
+#else
 	el->kq = kqueue();
+#endif
 	if (el->kq < 0) {
 		talloc_free(el);
 		return NULL;
@@ -893,8 +1623,8 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status,
 	/*
 	 *	Set our "exit" callback as ident 0.
 	 */
-	EV_SET(&kev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
-	if (kevent(el->kq, &kev, 1, NULL, 0, NULL) < 0) {
+	el->wakeup_fd = fr_event_user_register(el->kq, 0);
+	if (el->wakeup_fd < 0) {
 		talloc_free(el);
 		return NULL;
 	}
@@ -914,16 +1644,24 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status,
  *  but when you hit CTRL-S/CTRL-Q, you should see a number
  *  of events run right after each other.
  *
+ *  ./event -w
+ *
+ *  Does the same thing, using the timing wheel.
+ *
+ *  ./event -b [num]
+ *
+ *  Benchmarks the heap against the timing wheel, with num timers.
+ *
  *  OR
  *
  *   valgrind --tool=memcheck --leak-check=full --show-reachable=yes ./event
  */
 
-static void print_time(void *ctx)
+static void print_time(UNUSED struct timeval *now, void *ctx)
 {
 	struct timeval *when = ctx;
 
-	printf("%d.%06d\n", when->tv_sec, when->tv_usec);
+	printf("%d.%06d\n", (int) when->tv_sec, (int) when->tv_usec);
 	fflush(stdout);
 }
 
@@ -942,17 +1680,115 @@ static uint32_t event_rand(void)
 	return num;
 }
 
+static uint64_t num_fired;
+
+static void count_fired(UNUSED struct timeval *now, UNUSED void *ctx)
+{
+	num_fired++;
+}
+
+static uint64_t bench_usec(struct timeval const *start, struct timeval const *end)
+{
+	return ((end->tv_sec - start->tv_sec) * (uint64_t) USEC) + end->tv_usec - start->tv_usec;
+}
+
+/*
+ *	Model what the server does with request timers.  Every timer
+ *	is inserted, most are re-armed once, and most are deleted
+ *	before they fire.  The rest fire as time advances.
+ */
+static void benchmark(fr_event_timer_backend_t backend, int num)
+{
+	int			i;
+	fr_event_list_t		*el;
+	fr_event_timer_t	**ev;
+	struct timeval		*when, base, now, start, end;
+	uint64_t		insert, rearm, delete, run;
+
+	el = fr_event_list_create(NULL, NULL, NULL);
+	if (!el) exit(1);
+
+	if (fr_event_list_timer_backend(el, backend) < 0) exit(1);
+
+	ev = talloc_zero_array(el, fr_event_timer_t *, num);
+	when = talloc_array(el, struct timeval, num);
+
+	/*
+	 *	Timers spread over the next 30 seconds.
+	 */
+	gettimeofday(&base, NULL);
+	for (i = 0; i < num; i++) {
+		uint32_t delay = event_rand() % (30 * USEC);
+
+		when[i].tv_sec = base.tv_sec + (delay / USEC);
+		when[i].tv_usec = base.tv_usec + (delay % USEC);
+		if (when[i].tv_usec >= USEC) {
+			when[i].tv_usec -= USEC;
+			when[i].tv_sec++;
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num; i++) {
+		fr_event_timer_insert(el, count_fired, NULL, &when[i], &ev[i]);
+	}
+	gettimeofday(&end, NULL);
+	insert = bench_usec(&start, &end);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num; i += 2) {
+		when[i].tv_sec++;
+		fr_event_timer_insert(el, count_fired, NULL, &when[i], &ev[i]);
+	}
+	gettimeofday(&end, NULL);
+	rearm = bench_usec(&start, &end);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num; i++) {
+		if ((i % 10) == 0) continue;
+		fr_event_timer_delete(el, &ev[i]);
+	}
+	gettimeofday(&end, NULL);
+	delete = bench_usec(&start, &end);
+
+	/*
+	 *	Run the rest, in 1ms steps.
+	 */
+	num_fired = 0;
+	now = base;
+	gettimeofday(&start, NULL);
+	while (fr_event_list_num_elements(el) > 0) {
+		struct timeval tv = now;
+
+		while (fr_event_timer_run(el, &tv) == 1) tv = now;
+
+		now.tv_usec += 1000;
+		if (now.tv_usec >= USEC) {
+			now.tv_usec -= USEC;
+			now.tv_sec++;
+		}
+	}
+	gettimeofday(&end, NULL);
+	run = bench_usec(&start, &end);
+
+	printf("%s: %d timers\n", (backend == FR_EVENT_TIMER_WHEEL) ? "wheel" : "heap", num);
+	printf("\tinsert %.1f ns/op\n", (insert * 1000.0) / num);
+	printf("\tre-arm %.1f ns/op\n", (rearm * 1000.0) / ((num + 1) / 2));
+	printf("\tdelete %.1f ns/op\n", (delete * 1000.0) / (num - ((num + 9) / 10)));
+	printf("\trun    %" PRIu64 " fired in %.3f ms\n", num_fired, run / 1000.0);
+
+	talloc_free(el);
+}
 
 #define MAX 100
 int main(int argc, char **argv)
 {
-	int i, rcode;
+	int i;
 	struct timeval array[MAX];
+	fr_event_timer_t *ev[MAX];
 	struct timeval now, when;
 	fr_event_list_t *el;
-
-	el = fr_event_list_create(NULL, NULL);
-	if (!el) exit(1);
+	fr_event_timer_backend_t backend = FR_EVENT_TIMER_HEAP;
 
 	memset(&rand_pool, 0, sizeof(rand_pool));
 	rand_pool.randrsl[1] = time(NULL);
@@ -960,16 +1796,36 @@ int main(int argc, char **argv)
 	fr_randinit(&rand_pool, 1);
 	rand_pool.randcnt = 0;
 
+	if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+		int num = 1000000;
+
+		if (argc > 2) num = atoi(argv[2]);
+		if (num <= 0) exit(1);
+
+		benchmark(FR_EVENT_TIMER_HEAP, num);
+		benchmark(FR_EVENT_TIMER_WHEEL, num);
+		return 0;
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "-w") == 0)) backend = FR_EVENT_TIMER_WHEEL;
+
+	el = fr_event_list_create(NULL, NULL, NULL);
+	if (!el) exit(1);
+
+	if (fr_event_list_timer_backend(el, backend) < 0) exit(1);
+
+	memset(ev, 0, sizeof(ev));
+
 	gettimeofday(&array[0], NULL);
 	for (i = 1; i < MAX; i++) {
 		array[i] = array[i - 1];
 
 		array[i].tv_usec += event_rand() & 0xffff;
-		if (array[i].tv_usec > 1000000) {
+		if (array[i].tv_usec >= 1000000) {
 			array[i].tv_usec -= 1000000;
 			array[i].tv_sec++;
 		}
-		fr_event_timer_insert(el, print_time, &array[i], &array[i]);
+		fr_event_timer_insert(el, print_time, &array[i], &array[i], &ev[i]);
 	}
 
 	while (fr_event_list_num_elements(el)) {
@@ -982,7 +1838,7 @@ int main(int argc, char **argv)
 
 			printf("\tsleep %d\n", delay);
 			fflush(stdout);
-			usleep(delay);
+			if (delay > 0) usleep(delay);
 		}
 	}
 
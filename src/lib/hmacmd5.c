@@ -33,19 +33,14 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/md5.h>
 
-/** Calculate HMAC using MD5
+/** Hash the padded key, so that it can be used for many messages
  *
- * @param digest Caller digest to be filled in.
- * @param text Pointer to data stream.
- * @param text_len length of data stream.
+ * @param ctx Where to write the HMAC-MD5 state.
  * @param key Pointer to authentication key.
  * @param key_len Length of authentication key.
- *
  */
-void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
-		 uint8_t const *key, size_t key_len)
+void fr_hmac_md5_init(fr_hmac_md5_ctx_t *ctx, uint8_t const *key, size_t key_len)
 {
-	FR_MD5_CTX context;
 	uint8_t k_ipad[65];    /* inner padding - key XORd with ipad */
 	uint8_t k_opad[65];    /* outer padding - key XORd with opad */
 	uint8_t tk[16];
@@ -86,25 +81,59 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t
 		k_ipad[i] ^= 0x36;
 		k_opad[i] ^= 0x5c;
 	}
+
+	fr_md5_init(&ctx->inner);
+	fr_md5_update(&ctx->inner, k_ipad, 64);	/* start with inner pad */
+
+	fr_md5_init(&ctx->outer);
+	fr_md5_update(&ctx->outer, k_opad, 64);	/* start with outer pad */
+}
+
+/** Calculate HMAC using MD5, with a key set up by fr_hmac_md5_init()
+ *
+ * @param digest Caller digest to be filled in.
+ * @param ctx HMAC-MD5 state for the key.
+ * @param text Pointer to data stream.
+ * @param text_len length of data stream.
+ */
+void fr_hmac_md5_digest(uint8_t digest[MD5_DIGEST_LENGTH], fr_hmac_md5_ctx_t const *ctx,
+			uint8_t const *text, size_t text_len)
+{
+	FR_MD5_CTX context;
+
 	/*
 	 * perform inner MD5
 	 */
-	fr_md5_init(&context);		   /* init context for 1st
-					      * pass */
-	fr_md5_update(&context, k_ipad, 64);      /* start with inner pad */
+	fr_md5_copy(&context, &ctx->inner);
 	fr_md5_update(&context, text, text_len); /* then text of datagram */
 	fr_md5_final(digest, &context);	  /* finish up 1st pass */
 	/*
 	 * perform outer MD5
 	 */
-	fr_md5_init(&context);		   /* init context for 2nd
-					      * pass */
-	fr_md5_update(&context, k_opad, 64);     /* start with outer pad */
+	fr_md5_copy(&context, &ctx->outer);
 	fr_md5_update(&context, digest, 16);     /* then results of 1st
 					      * hash */
 	fr_md5_final(digest, &context);	  /* finish up 2nd pass */
 }
 
+/** Calculate HMAC using MD5
+ *
+ * @param digest Caller digest to be filled in.
+ * @param text Pointer to data stream.
+ * @param text_len length of data stream.
+ * @param key Pointer to authentication key.
+ * @param key_len Length of authentication key.
+ *
+ */
+void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+		 uint8_t const *key, size_t key_len)
+{
+	fr_hmac_md5_ctx_t ctx;
+
+	fr_hmac_md5_init(&ctx, key, key_len);
+	fr_hmac_md5_digest(digest, &ctx, text, text_len);
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -0,0 +1,467 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file md5_mb.c
+ * @brief Multi-buffer MD5, hashing several independent messages at once.
+ *
+ * MD5 is a serial chain of 64 steps per block, so one message can't be
+ * made faster with SIMD.  Many messages can, by putting one message in
+ * each lane of a vector register, and doing the same step for all of
+ * them at the same time.
+ *
+ * The kernels use GCC vector extensions, so the same code is used for
+ * every vector width.  The widest kernel the CPU supports is selected at
+ * runtime.  Compilers without vector extensions get the scalar engine,
+ * which hashes each message with fr_md5_update() and fr_md5_final().
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+
+#if defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 7)) || defined(__clang__))
+#  define HAVE_MD5_MB_VECTOR 1
+#  if defined(__x86_64__) || defined(__i386__)
+#    define HAVE_MD5_MB_AVX2 1
+#  endif
+#endif
+
+/*
+ *	Lanes in the widest kernel.
+ */
+#define MD5_MB_MAX_LANES	(8)
+
+typedef void (*md5_mb_kernel_t)(uint32_t *state, uint8_t const * const *block);
+
+typedef struct md5_mb_engine {
+	fr_md5_mb_engine_t	type;		//!< Which engine this is.
+	char const		*name;		//!< For debug and benchmark output.
+	int			lanes;		//!< Number of messages hashed at once, 0 for the scalar engine.
+	md5_mb_kernel_t		kernel;		//!< Transforms one block in each lane.
+} md5_mb_engine_t;
+
+static const uint8_t md5_mb_zero_block[MD5_BLOCK_LENGTH];
+
+#define GET_32BIT_LE(_p) ((uint32_t)(_p)[0] | ((uint32_t)(_p)[1] << 8) | \
+			  ((uint32_t)(_p)[2] << 16) | ((uint32_t)(_p)[3] << 24))
+
+#define PUT_32BIT_LE(_p, _v) do {\
+	(_p)[0] = (_v);\
+	(_p)[1] = (_v) >> 8;\
+	(_p)[2] = (_v) >> 16;\
+	(_p)[3] = (_v) >> 24;\
+} while (0)
+
+#ifdef HAVE_MD5_MB_VECTOR
+/*
+ *	The same step functions as md5.c, applied to every lane.
+ */
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = (w << s) | (w >> (32 - s)), w += x)
+
+/*
+ *	State is stored as a[lanes], b[lanes], c[lanes], d[lanes].
+ */
+#define MD5_MB_KERNEL(_name, _vec, _lanes, _attr) \
+static _attr void _name(uint32_t *state, uint8_t const * const *block) \
+{ \
+	_vec a, b, c, d, aa, bb, cc, dd; \
+	_vec in[16]; \
+	int i, j; \
+\
+	memcpy(&a, state, sizeof(a)); \
+	memcpy(&b, state + _lanes, sizeof(b)); \
+	memcpy(&c, state + (2 * _lanes), sizeof(c)); \
+	memcpy(&d, state + (3 * _lanes), sizeof(d)); \
+\
+	for (i = 0; i < 16; i++) { \
+		for (j = 0; j < _lanes; j++) in[i][j] = GET_32BIT_LE(block[j] + (i * 4)); \
+	} \
+\
+	aa = a; \
+	bb = b; \
+	cc = c; \
+	dd = d; \
+\
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22); \
+\
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20); \
+\
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 2] + 0xc4ac5665, 23); \
+\
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c, in[ 7] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, in[ 5] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c, in[ 3] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, in[ 1] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, in[ 8] + 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, in[ 6] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, in[ 4] + 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, in[ 2] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, in[ 9] + 0xeb86d391, 21); \
+\
+	a += aa; \
+	b += bb; \
+	c += cc; \
+	d += dd; \
+\
+	memcpy(state, &a, sizeof(a)); \
+	memcpy(state + _lanes, &b, sizeof(b)); \
+	memcpy(state + (2 * _lanes), &c, sizeof(c)); \
+	memcpy(state + (3 * _lanes), &d, sizeof(d)); \
+}
+
+/*
+ *	Four lanes is SSE2 on x86_64, NEON on ARM, and whatever the
+ *	compiler can manage elsewhere.
+ */
+typedef uint32_t md5_mb_vec4_t __attribute__((vector_size(16)));
+
+MD5_MB_KERNEL(md5_mb_kernel_vec4, md5_mb_vec4_t, 4, )
+
+#  ifdef HAVE_MD5_MB_AVX2
+typedef uint32_t md5_mb_vec8_t __attribute__((vector_size(32)));
+
+MD5_MB_KERNEL(md5_mb_kernel_avx2, md5_mb_vec8_t, 8, __attribute__((target("avx2"))))
+#  endif
+#endif	/* HAVE_MD5_MB_VECTOR */
+
+static md5_mb_engine_t const md5_mb_engines[] = {
+	{ FR_MD5_MB_SCALAR,	"scalar",	0,	NULL },
+#ifdef HAVE_MD5_MB_VECTOR
+	{ FR_MD5_MB_VEC4,	"vec4",		4,	md5_mb_kernel_vec4 },
+#  ifdef HAVE_MD5_MB_AVX2
+	{ FR_MD5_MB_AVX2,	"avx2",		8,	md5_mb_kernel_avx2 },
+#  endif
+#endif
+};
+
+static md5_mb_engine_t const *md5_mb_engine = NULL;
+
+/** Whether the CPU can run an engine
+ *
+ */
+static bool md5_mb_engine_supported(fr_md5_mb_engine_t type)
+{
+	switch (type) {
+	case FR_MD5_MB_SCALAR:
+		return true;
+
+#ifdef HAVE_MD5_MB_VECTOR
+	case FR_MD5_MB_VEC4:
+		return true;
+
+#  ifdef HAVE_MD5_MB_AVX2
+	case FR_MD5_MB_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#  endif
+#endif
+
+	default:
+		return false;
+	}
+}
+
+/** Pick the widest engine the CPU supports
+ *
+ * Called on first use.  Every thread picks the same engine, so the race
+ * is harmless.
+ */
+static md5_mb_engine_t const *md5_mb_engine_select(void)
+{
+	int i;
+
+	if (md5_mb_engine) return md5_mb_engine;
+
+	for (i = (sizeof(md5_mb_engines) / sizeof(*md5_mb_engines)) - 1; i > 0; i--) {
+		if (md5_mb_engine_supported(md5_mb_engines[i].type)) break;
+	}
+	md5_mb_engine = &md5_mb_engines[i];
+
+	return md5_mb_engine;
+}
+
+/** Choose the engine used by fr_md5_mb_calc()
+ *
+ * Mainly for benchmarks and tests.  The engine is picked automatically if
+ * this function isn't called.
+ *
+ * @param[in] type	of engine, or FR_MD5_MB_AUTO for the widest one the
+ *			CPU supports.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the engine isn't available.
+ */
+int fr_md5_mb_engine_set(fr_md5_mb_engine_t type)
+{
+	size_t i;
+
+	if (type == FR_MD5_MB_AUTO) {
+		md5_mb_engine = NULL;
+		(void) md5_mb_engine_select();
+		return 0;
+	}
+
+	for (i = 0; i < (sizeof(md5_mb_engines) / sizeof(*md5_mb_engines)); i++) {
+		if (md5_mb_engines[i].type != type) continue;
+
+		if (!md5_mb_engine_supported(type)) break;
+
+		md5_mb_engine = &md5_mb_engines[i];
+		return 0;
+	}
+
+	fr_strerror_printf("MD5 engine not supported by this CPU or compiler");
+	return -1;
+}
+
+/** Return the name of the engine used by fr_md5_mb_calc()
+ *
+ */
+char const *fr_md5_mb_engine_name(void)
+{
+	return md5_mb_engine_select()->name;
+}
+
+/** Get the chaining state and length from a context with no buffered data
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the context has a partial block buffered.
+ */
+static int md5_mb_ctx_state(uint32_t state[4], uint64_t *len, FR_MD5_CTX const *ctx)
+{
+#ifdef HAVE_OPENSSL_EVP_H
+	if (ctx->num != 0) return -1;
+
+	state[0] = ctx->A;
+	state[1] = ctx->B;
+	state[2] = ctx->C;
+	state[3] = ctx->D;
+	*len = ((((uint64_t) ctx->Nh) << 32) | ctx->Nl) >> 3;
+#else
+	*len = ((((uint64_t) ctx->count[1]) << 32) | ctx->count[0]) >> 3;
+	if ((*len & (MD5_BLOCK_LENGTH - 1)) != 0) return -1;
+
+	memcpy(state, ctx->state, sizeof(ctx->state));
+#endif
+
+	return 0;
+}
+
+/** Hash one message the normal way
+ *
+ */
+static void md5_mb_scalar(fr_md5_mb_msg_t const *msg)
+{
+	FR_MD5_CTX context;
+
+	if (msg->ctx) {
+		fr_md5_copy(&context, msg->ctx);
+	} else {
+		fr_md5_init(&context);
+	}
+	fr_md5_update(&context, msg->in, msg->inlen);
+	fr_md5_final(msg->out, &context);
+}
+
+typedef struct md5_mb_lane {
+	fr_md5_mb_msg_t const	*msg;		//!< Being hashed in this lane, or NULL if the lane is idle.
+	size_t			block;		//!< Next block to hash.
+	size_t			full;		//!< Number of complete blocks in msg->in.
+	size_t			blocks;		//!< Total blocks, including padding.
+	uint8_t			tail[MD5_BLOCK_LENGTH * 2];	//!< Last partial block of msg->in, and padding.
+} md5_mb_lane_t;
+
+/** Start hashing a message in a lane
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the message can't be hashed by the vector engines.
+ */
+static int md5_mb_lane_load(md5_mb_lane_t *lane, uint32_t *state, int lanes, int i, fr_md5_mb_msg_t const *msg)
+{
+	uint32_t	init[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint64_t	bits, len = 0;
+	size_t		rem;
+	int		j;
+
+	if (msg->ctx && (md5_mb_ctx_state(init, &len, msg->ctx) < 0)) return -1;
+
+	for (j = 0; j < 4; j++) state[(j * lanes) + i] = init[j];
+
+	lane->msg = msg;
+	lane->block = 0;
+	lane->full = msg->inlen / MD5_BLOCK_LENGTH;
+
+	/*
+	 *	Copy the partial block, and add the padding and
+	 *	length in bits.
+	 */
+	rem = msg->inlen - (lane->full * MD5_BLOCK_LENGTH);
+	memset(lane->tail, 0, sizeof(lane->tail));
+	if (rem) memcpy(lane->tail, msg->in + (lane->full * MD5_BLOCK_LENGTH), rem);
+	lane->tail[rem] = 0x80;
+
+	lane->blocks = lane->full + ((rem < (MD5_BLOCK_LENGTH - 8)) ? 1 : 2);
+
+	bits = (len + msg->inlen) << 3;
+	PUT_32BIT_LE(lane->tail + ((lane->blocks - lane->full) * MD5_BLOCK_LENGTH) - 8, (uint32_t) bits);
+	PUT_32BIT_LE(lane->tail + ((lane->blocks - lane->full) * MD5_BLOCK_LENGTH) - 4, (uint32_t) (bits >> 32));
+
+	return 0;
+}
+
+/** Calculate the MD5 digests of many independent messages
+ *
+ * Messages are hashed in parallel, in as many lanes as the selected engine
+ * has.  When a message is finished, the next one is started in its lane,
+ * so messages of different lengths keep all of the lanes busy.
+ *
+ * @param[in] msgs	to hash.
+ * @param[in] num	Number of messages.
+ */
+void fr_md5_mb_calc(fr_md5_mb_msg_t const *msgs, size_t num)
+{
+	md5_mb_engine_t const	*engine;
+	md5_mb_lane_t		lane[MD5_MB_MAX_LANES];
+	uint32_t		state[4 * MD5_MB_MAX_LANES];
+	uint8_t const		*block[MD5_MB_MAX_LANES];
+	size_t			next = 0;
+	int			i, j, lanes, active = 0;
+
+	engine = md5_mb_engine_select();
+	lanes = engine->lanes;
+
+	if (!lanes || (num == 1)) {
+		for (next = 0; next < num; next++) md5_mb_scalar(&msgs[next]);
+		return;
+	}
+
+	memset(state, 0, sizeof(state));
+	for (i = 0; i < lanes; i++) lane[i].msg = NULL;
+
+	for (;;) {
+		/*
+		 *	Fill idle lanes.
+		 */
+		for (i = 0; (i < lanes) && (next < num); i++) {
+			if (lane[i].msg) continue;
+
+			while (next < num) {
+				if (md5_mb_lane_load(&lane[i], state, lanes, i, &msgs[next]) == 0) {
+					next++;
+					active++;
+					break;
+				}
+
+				md5_mb_scalar(&msgs[next++]);
+			}
+		}
+
+		if (!active) break;
+
+		for (i = 0; i < lanes; i++) {
+			md5_mb_lane_t *l = &lane[i];
+
+			if (!l->msg) {
+				block[i] = md5_mb_zero_block;
+			} else if (l->block < l->full) {
+				block[i] = l->msg->in + (l->block * MD5_BLOCK_LENGTH);
+			} else {
+				block[i] = l->tail + ((l->block - l->full) * MD5_BLOCK_LENGTH);
+			}
+		}
+
+		engine->kernel(state, block);
+
+		/*
+		 *	Write out the digests of finished messages.
+		 */
+		for (i = 0; i < lanes; i++) {
+			md5_mb_lane_t *l = &lane[i];
+
+			if (!l->msg) continue;
+
+			if (++l->block < l->blocks) continue;
+
+			for (j = 0; j < 4; j++) PUT_32BIT_LE(l->msg->out + (j * 4), state[(j * lanes) + i]);
+			l->msg = NULL;
+			active--;
+		}
+	}
+}
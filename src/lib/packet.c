@@ -26,6 +26,7 @@ RCSID("$Id$")
 #include	<freeradius-devel/udp.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 
 /*
  *	See if two packets are identical.
@@ -234,12 +235,19 @@ int fr_socket(fr_ipaddr_t const *ipaddr, uint16_t port)
 
 /*
  *	We need to keep track of the socket & it's IP/port.
+ *
+ *	Each socket is a shard of the outgoing packets.  Its IDs and
+ *	packets are protected by its own mutex, so that threads using
+ *	different sockets don't contend with each other.
  */
 typedef struct fr_packet_socket_t {
 	int		sockfd;
 	void		*ctx;
 
-	uint32_t	num_outgoing;
+	pthread_mutex_t	mutex;
+
+	uint32_t	num_outgoing;		//!< number of IDs allocated
+	uint32_t	num_packets;		//!< number of packets in the ID table
 
 	int		src_any;
 	fr_ipaddr_t	src_ipaddr;
@@ -256,6 +264,7 @@ typedef struct fr_packet_socket_t {
 #endif
 
 	uint8_t		id[32];
+	RADIUS_PACKET	***packets;		//!< outgoing packets, indexed by ID
 } fr_packet_socket_t;
 
 
@@ -267,18 +276,29 @@ typedef struct fr_packet_socket_t {
 /*
  *	Structure defining a list of packets (incoming or outgoing)
  *	that should be managed.
+ *
+ *	Incoming packets are kept in the tree.  Outgoing packets are
+ *	kept in the ID table of the socket they were sent on.
  */
 struct fr_packet_list_t {
 	rbtree_t	*tree;
 
 	int		alloc_id;
-	uint32_t	num_outgoing;
 	int		last_recv;
 	int		num_sockets;
 
+	pthread_mutex_t	mutex;			//!< serializes adding sockets
+
 	fr_packet_socket_t sockets[MAX_SOCKETS];
 };
 
+/*
+ *	The socket this thread last allocated an ID from.  We start
+ *	looking there, so that each thread tends to stick to its own
+ *	sockets.
+ */
+static _Thread_local int fr_packet_socket_last = -1;
+
 
 /*
  *	Ugh.  Doing this on every sent/received packet is not nice.
@@ -314,7 +334,10 @@ bool fr_packet_list_socket_freeze(fr_packet_list_t *pl, int sockfd)
 		return false;
 	}
 
+	pthread_mutex_lock(&ps->mutex);
 	ps->dont_use = true;
+	pthread_mutex_unlock(&ps->mutex);
+
 	return true;
 }
 
@@ -327,7 +350,10 @@ bool fr_packet_list_socket_thaw(fr_packet_list_t *pl, int sockfd)
 	ps = fr_socket_find(pl, sockfd);
 	if (!ps) return false;
 
+	pthread_mutex_lock(&ps->mutex);
 	ps->dont_use = false;
+	pthread_mutex_unlock(&ps->mutex);
+
 	return true;
 }
 
@@ -341,10 +367,19 @@ bool fr_packet_list_socket_del(fr_packet_list_t *pl, int sockfd)
 	ps = fr_socket_find(pl, sockfd);
 	if (!ps) return false;
 
-	if (ps->num_outgoing != 0) return false;
+	pthread_mutex_lock(&ps->mutex);
+	if (ps->num_outgoing != 0) {
+		pthread_mutex_unlock(&ps->mutex);
+		return false;
+	}
 
 	ps->sockfd = -1;
+	TALLOC_FREE(ps->packets);
+	pthread_mutex_unlock(&ps->mutex);
+
+	pthread_mutex_lock(&pl->mutex);
 	pl->num_sockets--;
+	pthread_mutex_unlock(&pl->mutex);
 
 	return true;
 }
@@ -358,17 +393,16 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	struct sockaddr_storage	src;
 	socklen_t		sizeof_src;
 	fr_packet_socket_t	*ps;
+	fr_ipaddr_t		src_ipaddr;
+	uint16_t		src_port;
+	int			src_any, dst_any;
+	RADIUS_PACKET		***packets;
 
 	if (!pl || !dst_ipaddr || (dst_ipaddr->af == AF_UNSPEC)) {
 		fr_strerror_printf("Invalid argument");
 		return false;
 	}
 
-	if (pl->num_sockets >= MAX_SOCKETS) {
-		fr_strerror_printf("Too many open sockets");
-		return false;
-	}
-
 #ifndef WITH_TCP
 	if (proto != IPPROTO_UDP) {
 		fr_strerror_printf("only UDP is supported");
@@ -376,6 +410,48 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	}
 #endif
 
+	/*
+	 *	Get address family, etc. first, so we know if we
+	 *	need to do udpfromto.
+	 *
+	 *	FIXME: udpfromto also does this, but it's not
+	 *	a critical problem.
+	 */
+	sizeof_src = sizeof(src);
+	memset(&src, 0, sizeof_src);
+	if (getsockname(sockfd, (struct sockaddr *) &src,
+			&sizeof_src) < 0) {
+		fr_strerror_printf("%s", fr_syserror(errno));
+		return false;
+	}
+
+	if (!fr_ipaddr_from_sockaddr(&src, sizeof_src, &src_ipaddr,
+				&src_port)) {
+		fr_strerror_printf("Failed to get IP");
+		return false;
+	}
+
+	src_any = fr_is_inaddr_any(&src_ipaddr);
+	if (src_any < 0) return false;
+
+	dst_any = fr_is_inaddr_any(dst_ipaddr);
+	if (dst_any < 0) return false;
+
+	packets = talloc_zero_array(pl, RADIUS_PACKET **, 256);
+	if (!packets) {
+		fr_strerror_printf("Out of memory");
+		return false;
+	}
+
+	pthread_mutex_lock(&pl->mutex);
+
+	if (pl->num_sockets >= MAX_SOCKETS) {
+		pthread_mutex_unlock(&pl->mutex);
+		talloc_free(packets);
+		fr_strerror_printf("Too many open sockets");
+		return false;
+	}
+
 	ps = NULL;
 	i = start = SOCK2OFFSET(sockfd);
 
@@ -389,51 +465,45 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	} while (i != start);
 
 	if (!ps) {
+		pthread_mutex_unlock(&pl->mutex);
+		talloc_free(packets);
 		fr_strerror_printf("All socket entries are full");
 		return false;
 	}
 
-	memset(ps, 0, sizeof(*ps));
+	pthread_mutex_lock(&ps->mutex);
+
 	ps->ctx = ctx;
+	ps->num_outgoing = 0;
+	ps->num_packets = 0;
+	ps->dont_use = false;
 #ifdef WITH_TCP
 	ps->proto = proto;
 #endif
-
-	/*
-	 *	Get address family, etc. first, so we know if we
-	 *	need to do udpfromto.
-	 *
-	 *	FIXME: udpfromto also does this, but it's not
-	 *	a critical problem.
-	 */
-	sizeof_src = sizeof(src);
-	memset(&src, 0, sizeof_src);
-	if (getsockname(sockfd, (struct sockaddr *) &src,
-			&sizeof_src) < 0) {
-		fr_strerror_printf("%s", fr_syserror(errno));
-		return false;
-	}
-
-	if (!fr_ipaddr_from_sockaddr(&src, sizeof_src, &ps->src_ipaddr,
-				&ps->src_port)) {
-		fr_strerror_printf("Failed to get IP");
-		return false;
-	}
+	ps->src_ipaddr = src_ipaddr;
+	ps->src_port = src_port;
+	ps->src_any = src_any;
 
 	ps->dst_ipaddr = *dst_ipaddr;
 	ps->dst_port = dst_port;
+	ps->dst_any = dst_any;
 
-	ps->src_any = fr_is_inaddr_any(&ps->src_ipaddr);
-	if (ps->src_any < 0) return false;
-
-	ps->dst_any = fr_is_inaddr_any(&ps->dst_ipaddr);
-	if (ps->dst_any < 0) return false;
+	memset(ps->id, 0, sizeof(ps->id));
+	ps->packets = packets;
 
 	/*
 	 *	As the last step before returning.
 	 */
 	ps->sockfd = sockfd;
+	pthread_mutex_unlock(&ps->mutex);
+
 	pl->num_sockets++;
+	pthread_mutex_unlock(&pl->mutex);
+
+	/*
+	 *	The thread which opened the socket should use it.
+	 */
+	fr_packet_socket_last = i;
 
 	return true;
 }
@@ -448,8 +518,15 @@ static int packet_entry_cmp(void const *one, void const *two)
 
 void fr_packet_list_free(fr_packet_list_t *pl)
 {
+	int i;
+
 	if (!pl) return;
 
+	for (i = 0; i < MAX_SOCKETS; i++) {
+		pthread_mutex_destroy(&pl->sockets[i].mutex);
+	}
+	pthread_mutex_destroy(&pl->mutex);
+
 	rbtree_free(pl->tree);
 	talloc_free(pl);
 }
@@ -465,16 +542,19 @@ fr_packet_list_t *fr_packet_list_create(int alloc_id)
 
 	pl = talloc_zero(NULL, fr_packet_list_t);
 	if (!pl) return NULL;
+
+	for (i = 0; i < MAX_SOCKETS; i++) {
+		pl->sockets[i].sockfd = -1;
+		pthread_mutex_init(&pl->sockets[i].mutex, NULL);
+	}
+	pthread_mutex_init(&pl->mutex, NULL);
+
 	pl->tree = rbtree_create(pl, packet_entry_cmp, NULL, 0);
 	if (!pl->tree) {
 		fr_packet_list_free(pl);
 		return NULL;
 	}
 
-	for (i = 0; i < MAX_SOCKETS; i++) {
-		pl->sockets[i].sockfd = -1;
-	}
-
 	pl->alloc_id = alloc_id;
 
 	return pl;
@@ -508,7 +588,7 @@ RADIUS_PACKET **fr_packet_list_find(fr_packet_list_t *pl,
  */
 RADIUS_PACKET **fr_packet_list_find_byreply(fr_packet_list_t *pl, RADIUS_PACKET *reply)
 {
-	RADIUS_PACKET my_request, *request;
+	RADIUS_PACKET my_request, *request, **request_p;
 	fr_packet_socket_t *ps;
 
 	if (!pl || !reply) return NULL;
@@ -559,16 +639,59 @@ RADIUS_PACKET **fr_packet_list_find_byreply(fr_packet_list_t *pl, RADIUS_PACKET
 #endif
 	request = &my_request;
 
-	return rbtree_finddata(pl->tree, &request);
+	if (!pl->alloc_id) return rbtree_finddata(pl->tree, &request);
+
+	if ((reply->id < 0) || (reply->id > 255)) return NULL;
+
+	pthread_mutex_lock(&ps->mutex);
+	request_p = NULL;
+	if ((ps->sockfd == reply->sockfd) && ps->packets) {
+		request_p = ps->packets[reply->id];
+		if (request_p && (fr_packet_cmp(*request_p, request) != 0)) request_p = NULL;
+	}
+	pthread_mutex_unlock(&ps->mutex);
+
+	return request_p;
 }
 
+/*
+ *	Remove a packet from the ID table of its socket.  Called with
+ *	the socket mutex held.
+ */
+static bool fr_packet_socket_yank(fr_packet_socket_t *ps, RADIUS_PACKET const *request)
+{
+	RADIUS_PACKET **request_p;
+
+	if (!ps->packets || (request->id < 0) || (request->id > 255)) return false;
+
+	request_p = ps->packets[request->id];
+	if (!request_p || (fr_packet_cmp(*request_p, request) != 0)) return false;
+
+	ps->packets[request->id] = NULL;
+	ps->num_packets--;
+
+	return true;
+}
 
 bool fr_packet_list_yank(fr_packet_list_t *pl, RADIUS_PACKET *request)
 {
 	rbnode_t *node;
+	fr_packet_socket_t *ps;
+	bool rcode;
 
 	if (!pl || !request) return false;
 
+	if (pl->alloc_id) {
+		ps = fr_socket_find(pl, request->sockfd);
+		if (!ps) return false;
+
+		pthread_mutex_lock(&ps->mutex);
+		rcode = fr_packet_socket_yank(ps, request);
+		pthread_mutex_unlock(&ps->mutex);
+
+		return rcode;
+	}
+
 	node = rbtree_find(pl->tree, &request);
 	if (!node) return false;
 
@@ -578,11 +701,114 @@ bool fr_packet_list_yank(fr_packet_list_t *pl, RADIUS_PACKET *request)
 
 uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 {
+	int i;
+	uint32_t num_elements;
+
 	if (!pl) return 0;
 
-	return rbtree_num_elements(pl->tree);
+	num_elements = rbtree_num_elements(pl->tree);
+
+	/*
+	 *	This isn't locked, so it's only a hint if other
+	 *	threads are allocating IDs.
+	 */
+	for (i = 0; i < MAX_SOCKETS; i++) {
+		if (pl->sockets[i].sockfd == -1) continue;
+
+		num_elements += pl->sockets[i].num_packets;
+	}
+
+	return num_elements;
 }
 
+/*
+ *	Check if we can allocate an ID for the request from this
+ *	socket.  Called with the socket mutex held.
+ */
+static bool fr_packet_socket_usable(fr_packet_socket_t *ps, RADIUS_PACKET const *request,
+				    UNUSED int proto, int src_any)
+{
+	/*
+	 *	The socket was deleted after we looked at it.
+	 */
+	if (ps->sockfd == -1) return false;
+
+	/*
+	 *	This socket is marked as "don't use for new
+	 *	packets".  But we can still receive packets
+	 *	that are outstanding.
+	 */
+	if (ps->dont_use) return false;
+
+	/*
+	 *	All IDs are allocated: ignore it.
+	 */
+	if (ps->num_outgoing == 256) return false;
+
+#ifdef WITH_TCP
+	if (ps->proto != proto) return false;
+#endif
+
+	/*
+	 *	Address families don't match, skip it.
+	 */
+	if (ps->src_ipaddr.af != request->dst_ipaddr.af) return false;
+
+	/*
+	 *	MUST match dst port, if we have one.
+	 */
+	if ((ps->dst_port != 0) &&
+	    (ps->dst_port != request->dst_port)) return false;
+
+	/*
+	 *	MUST match requested src port, if one has been given.
+	 */
+	if ((request->src_port != 0) &&
+	    (ps->src_port != request->src_port)) return false;
+
+	/*
+	 *	We don't care about the source IP, but this
+	 *	socket is link local, and the requested
+	 *	destination is not link local.  Ignore it.
+	 */
+	if (src_any && (ps->src_ipaddr.af == AF_INET) &&
+	    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
+	    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) return false;
+
+	/*
+	 *	We're sourcing from *, and they asked for a
+	 *	specific source address: ignore it.
+	 */
+	if (ps->src_any && !src_any) return false;
+
+	/*
+	 *	We're sourcing from a specific IP, and they
+	 *	asked for a source IP that isn't us: ignore
+	 *	it.
+	 */
+	if (!ps->src_any && !src_any &&
+	    (fr_ipaddr_cmp(&request->src_ipaddr,
+			   &ps->src_ipaddr) != 0)) return false;
+
+	/*
+	 *	UDP sockets are allowed to match
+	 *	destination IPs exactly, OR a socket
+	 *	with destination * is allowed to match
+	 *	any requested destination.
+	 *
+	 *	TCP sockets must match the destination
+	 *	exactly.  They *always* have dst_any=0,
+	 *	so the first check always matches.
+	 */
+	if (!ps->dst_any &&
+	    (fr_ipaddr_cmp(&request->dst_ipaddr,
+			   &ps->dst_ipaddr) != 0)) return false;
+
+	/*
+	 *	Otherwise, this socket is OK to use.
+	 */
+	return true;
+}
 
 /*
  *	1 == ID was allocated & assigned
@@ -591,10 +817,10 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
  *	Note that this ALSO assigns a socket to use, and updates
  *	packet->request->src_ipaddr && packet->request->src_port
  *
- *	In multi-threaded systems, the calls to id_alloc && id_free
- *	should be protected by a mutex.  This does NOT have to be
- *	the same mutex as the one protecting the insert/find/yank
- *	calls!
+ *	This function is thread-safe.  Each socket has its own
+ *	mutex, and threads start looking for an ID at the socket
+ *	they last used.  Sockets which are busy in another thread are
+ *	skipped, unless there are no others.
  *
  *	We assume that the packet has dst_ipaddr && dst_port
  *	already initialized.  We will use those to find an
@@ -606,7 +832,7 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, j, k, id, pass, start_i, start_j, start_k;
 	int src_any = 0;
 	fr_packet_socket_t *ps= NULL;
 	RADIUS_PACKET *request = *request_p;
@@ -665,125 +891,68 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	 *	on free.  The new method has brute-force on allocation,
 	 *	and near-zero cost on free.
 	 */
-
-	id = fd = -1;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
+	id = -1;
+	start_i = fr_packet_socket_last;
+	if ((start_i < 0) || (start_i >= MAX_SOCKETS)) start_i = fr_rand() & SOCKOFFSET_MASK;
 
 #define ID_i ((i + start_i) & SOCKOFFSET_MASK)
-	for (i = 0; i < MAX_SOCKETS; i++) {
-		if (pl->sockets[ID_i].sockfd == -1) continue; /* paranoia */
-
-		ps = &(pl->sockets[ID_i]);
-
-		/*
-		 *	This socket is marked as "don't use for new
-		 *	packets".  But we can still receive packets
-		 *	that are outstanding.
-		 */
-		if (ps->dont_use) continue;
-
-		/*
-		 *	All IDs are allocated: ignore it.
-		 */
-		if (ps->num_outgoing == 256) continue;
-
-#ifdef WITH_TCP
-		if (ps->proto != proto) continue;
-#endif
-
-		/*
-		 *	Address families don't match, skip it.
-		 */
-		if (ps->src_ipaddr.af != request->dst_ipaddr.af) continue;
-
-		/*
-		 *	MUST match dst port, if we have one.
-		 */
-		if ((ps->dst_port != 0) &&
-		    (ps->dst_port != request->dst_port)) continue;
-
-		/*
-		 *	MUST match requested src port, if one has been given.
-		 */
-		if ((request->src_port != 0) &&
-		    (ps->src_port != request->src_port)) continue;
-
-		/*
-		 *	We don't care about the source IP, but this
-		 *	socket is link local, and the requested
-		 *	destination is not link local.  Ignore it.
-		 */
-		if (src_any && (ps->src_ipaddr.af == AF_INET) &&
-		    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
-		    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) continue;
-
-		/*
-		 *	We're sourcing from *, and they asked for a
-		 *	specific source address: ignore it.
-		 */
-		if (ps->src_any && !src_any) continue;
-
-		/*
-		 *	We're sourcing from a specific IP, and they
-		 *	asked for a source IP that isn't us: ignore
-		 *	it.
-		 */
-		if (!ps->src_any && !src_any &&
-		    (fr_ipaddr_cmp(&request->src_ipaddr,
-				   &ps->src_ipaddr) != 0)) continue;
-
-		/*
-		 *	UDP sockets are allowed to match
-		 *	destination IPs exactly, OR a socket
-		 *	with destination * is allowed to match
-		 *	any requested destination.
-		 *
-		 *	TCP sockets must match the destination
-		 *	exactly.  They *always* have dst_any=0,
-		 *	so the first check always matches.
-		 */
-		if (!ps->dst_any &&
-		    (fr_ipaddr_cmp(&request->dst_ipaddr,
-				   &ps->dst_ipaddr) != 0)) continue;
-
-		/*
-		 *	Otherwise, this socket is OK to use.
-		 */
-
-		/*
-		 *	Look for a free Id, starting from a random number.
-		 */
-		start_j = fr_rand() & 0x1f;
 #define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
-
-
-			start_k = fr_rand() & 0x07;
 #define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < MAX_SOCKETS; i++) {
+			ps = &(pl->sockets[ID_i]);
+
+			if (ps->sockfd == -1) continue;
+
+			/*
+			 *	On the first pass, skip sockets which
+			 *	another thread is using.
+			 */
+			if (pass == 0) {
+				if (pthread_mutex_trylock(&ps->mutex) != 0) continue;
+			} else {
+				pthread_mutex_lock(&ps->mutex);
+			}
+
+			if (!fr_packet_socket_usable(ps, request, proto, src_any)) {
+				pthread_mutex_unlock(&ps->mutex);
+				continue;
+			}
 
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
+			/*
+			 *	Look for a free Id, starting from a random number.
+			 *	An Id which has been freed, but not yet
+			 *	removed from the table, isn't free.
+			 */
+			start_j = fr_rand() & 0x1f;
+			for (j = 0; j < 32; j++) {
+				if (ps->id[ID_j] == 0xff) continue;
+
+				start_k = fr_rand() & 0x07;
+				for (k = 0; k < 8; k++) {
+					if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
+					if (ps->packets[(ID_j * 8) + ID_k] != NULL) continue;
+
+					id = (ID_j * 8) + ID_k;
+					goto found;
+				}
 			}
-			if (fd >= 0) break;
+
+			pthread_mutex_unlock(&ps->mutex);
 		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
-		break;
 	}
 
 	/*
 	 *	Ask the caller to allocate a new ID.
 	 */
-	if (fd < 0) {
-		fr_strerror_printf("Failed finding socket, caller must allocate a new one");
-		return false;
-	}
+	fr_strerror_printf("Failed finding socket, caller must allocate a new one");
+	return false;
+
+found:
+	fr_packet_socket_last = ID_i;
+#undef ID_i
+#undef ID_j
+#undef ID_k
 
 	/*
 	 *	Set the ID, source IP, and source port.
@@ -794,28 +963,16 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	request->src_ipaddr = ps->src_ipaddr;
 	request->src_port = ps->src_port;
 
-	/*
-	 *	If we managed to insert it, we're done.
-	 */
-	if (fr_packet_list_insert(pl, request_p)) {
-		if (pctx) *pctx = ps->ctx;
-		ps->num_outgoing++;
-		pl->num_outgoing++;
-		return true;
-	}
+	ps->id[(id >> 3) & 0x1f] |= (1 << (id & 0x07));
+	ps->packets[id] = request_p;
+	ps->num_outgoing++;
+	ps->num_packets++;
 
-	/*
-	 *	Mark the ID as free.  This is the one line from
-	 *	id_free() that we care about here.
-	 */
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	if (pctx) *pctx = ps->ctx;
 
-	request->id = -1;
-	request->sockfd = -1;
-	request->src_ipaddr.af = AF_UNSPEC;
-	request->src_port = 0;
+	pthread_mutex_unlock(&ps->mutex);
 
-	return false;
+	return true;
 }
 
 /*
@@ -829,11 +986,16 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 
 	if (!pl || !request) return false;
 
-	if (yank && !fr_packet_list_yank(pl, request)) return false;
-
 	ps = fr_socket_find(pl, request->sockfd);
 	if (!ps) return false;
 
+	pthread_mutex_lock(&ps->mutex);
+
+	if (yank && !fr_packet_socket_yank(ps, request)) {
+		pthread_mutex_unlock(&ps->mutex);
+		return false;
+	}
+
 #if 0
 	if (!ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) {
 		fr_exit(1);
@@ -843,7 +1005,8 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
 
 	ps->num_outgoing--;
-	pl->num_outgoing--;
+
+	pthread_mutex_unlock(&ps->mutex);
 
 	request->id = -1;
 	request->src_ipaddr.af = AF_UNSPEC; /* id_alloc checks this */
@@ -852,6 +1015,52 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 	return true;
 }
 
+/*
+ *	Walk over the outgoing packets of one socket.
+ *
+ *	The callback is called without the socket mutex held, so that
+ *	it can free IDs.  If it asks for the packet to be deleted, we
+ *	only remove it if it's still in the table.
+ */
+static int fr_packet_socket_walk(fr_packet_socket_t *ps, void *ctx, rb_walker_t callback)
+{
+	int i, num, rcode;
+	uint8_t ids[256];
+	RADIUS_PACKET **packets[256];
+
+	pthread_mutex_lock(&ps->mutex);
+	if ((ps->sockfd == -1) || !ps->packets) {
+		pthread_mutex_unlock(&ps->mutex);
+		return 0;
+	}
+
+	for (i = 0, num = 0; i < 256; i++) {
+		if (!ps->packets[i]) continue;
+
+		ids[num] = i;
+		packets[num++] = ps->packets[i];
+	}
+	pthread_mutex_unlock(&ps->mutex);
+
+	rcode = 0;
+	for (i = 0; i < num; i++) {
+		rcode = callback(ctx, packets[i]);
+		if (rcode < 0) return rcode;
+		if (rcode == 0) continue;
+
+		pthread_mutex_lock(&ps->mutex);
+		if (ps->packets && (ps->packets[ids[i]] == packets[i])) {
+			ps->packets[ids[i]] = NULL;
+			ps->num_packets--;
+		}
+		pthread_mutex_unlock(&ps->mutex);
+
+		if (rcode != 2) return rcode;
+	}
+
+	return rcode;
+}
+
 /*
  *	We always walk RBTREE_DELETE_ORDER, which is like RBTREE_IN_ORDER, except that
  *	<0 means error, stop
@@ -861,9 +1070,36 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
  */
 int fr_packet_list_walk(fr_packet_list_t *pl, void *ctx, rb_walker_t callback)
 {
+	int i, rcode;
+
+	if (!pl || !callback) return 0;
+
+	rcode = rbtree_walk(pl->tree, RBTREE_DELETE_ORDER, callback, ctx);
+	if ((rcode < 0) || (rcode == 1)) return rcode;
+
+	for (i = 0; i < MAX_SOCKETS; i++) {
+		if (pl->sockets[i].sockfd == -1) continue;
+
+		rcode = fr_packet_socket_walk(&pl->sockets[i], ctx, callback);
+		if ((rcode < 0) || (rcode == 1)) return rcode;
+	}
+
+	return rcode;
+}
+
+/*
+ *	As above, but only for the packets sent on one socket.
+ */
+int fr_packet_list_socket_walk(fr_packet_list_t *pl, int sockfd, void *ctx, rb_walker_t callback)
+{
+	fr_packet_socket_t *ps;
+
 	if (!pl || !callback) return 0;
 
-	return rbtree_walk(pl->tree, RBTREE_DELETE_ORDER, callback, ctx);
+	ps = fr_socket_find(pl, sockfd);
+	if (!ps) return 0;
+
+	return fr_packet_socket_walk(ps, ctx, callback);
 }
 
 int fr_packet_list_fd_set(fr_packet_list_t *pl, fd_set *set)
@@ -934,21 +1170,26 @@ RADIUS_PACKET *fr_packet_list_recv(fr_packet_list_t *pl, fd_set *set)
 
 uint32_t fr_packet_list_num_incoming(fr_packet_list_t *pl)
 {
-	uint32_t num_elements;
-
 	if (!pl) return 0;
 
-	num_elements = rbtree_num_elements(pl->tree);
-	if (num_elements < pl->num_outgoing) return 0; /* panic! */
-
-	return num_elements - pl->num_outgoing;
+	return rbtree_num_elements(pl->tree);
 }
 
 uint32_t fr_packet_list_num_outgoing(fr_packet_list_t *pl)
 {
+	int i;
+	uint32_t num_outgoing;
+
 	if (!pl) return 0;
 
-	return pl->num_outgoing;
+	num_outgoing = 0;
+	for (i = 0; i < MAX_SOCKETS; i++) {
+		if (pl->sockets[i].sockfd == -1) continue;
+
+		num_outgoing += pl->sockets[i].num_outgoing;
+	}
+
+	return num_outgoing;
 }
 
 /*
@@ -619,17 +619,19 @@ do_add:
  */
 void fr_pair_list_free(VALUE_PAIR **vps)
 {
-	VALUE_PAIR	*vp;
-	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp, *next;
 
 	if (!vps || !*vps) {
 		return;
 	}
 
-	for (vp = fr_pair_cursor_init(&cursor, vps);
-	     vp;
-	     vp = fr_pair_cursor_next(&cursor)) {
+	/*
+	 *	Not a cursor, which would decode any #VT_LAZY
+	 *	VALUE_PAIRs just to free them.
+	 */
+	for (vp = *vps; vp; vp = next) {
 		VERIFY_VP(vp);
+		next = vp->next;
 		talloc_free(vp);
 	}
 
@@ -697,6 +699,136 @@ int fr_pair_mark_xlat(VALUE_PAIR *vp, char const *value)
 	return 0;
 }
 
+/** Allocate a VALUE_PAIR which stands for attributes which haven't been decoded yet
+ *
+ * Protocol libraries add one of these to a list instead of decoding every
+ * attribute up front.  The cursor and search functions call decode when they
+ * reach it, so attributes are decoded the first time they're looked for.
+ *
+ * The VALUE_PAIR is a Raw-Attribute, which is internal, so it's never encoded.
+ *
+ * @param[in] ctx	to allocate the VALUE_PAIR in.  Should be the ctx the decoded
+ *			VALUE_PAIRs are allocated in.
+ * @param[in] decode	function which decodes the attributes.
+ * @param[in] uctx	passed to decode.  It's stolen, and freed once everything has
+ *			been decoded, or when the VALUE_PAIR is freed.
+ * @return
+ *	- A new #VT_LAZY VALUE_PAIR.
+ *	- NULL on error.
+ */
+VALUE_PAIR *fr_pair_lazy_alloc(TALLOC_CTX *ctx, fr_pair_lazy_decode_t decode, void *uctx)
+{
+	VALUE_PAIR	*vp;
+
+	vp = fr_pair_afrom_num(ctx, 0, PW_RAW_ATTRIBUTE);
+	if (!vp) return NULL;
+
+	vp->lazy = talloc(vp, fr_pair_lazy_t);
+	if (!vp->lazy) {
+		fr_strerror_printf("Out of memory");
+		talloc_free(vp);
+		return NULL;
+	}
+	vp->lazy->decode = decode;
+	vp->lazy->uctx = talloc_steal(vp->lazy, uctx);
+	vp->lazy->failed = false;
+	vp->type = VT_LAZY;
+
+	return vp;
+}
+
+/** Decode attributes which a #VT_LAZY VALUE_PAIR stands for
+ *
+ * The decoded VALUE_PAIRs are inserted after vp.  Once there's nothing left to
+ * decode, vp is turned into the first of them, so that it doesn't have to be
+ * unlinked from a list we may not have the head of.  If there were none, vp
+ * stays where it is with no decoder, and the cursor functions skip it.
+ *
+ * If decoding fails, every later call fails too, as the VALUE_PAIRs decoded
+ * with the failed one are gone.
+ *
+ * @param[in] vp	to decode attributes for.
+ * @param[in] da	to decode.  NULL to decode everything.
+ * @return
+ *	- 0 on success, or if vp has nothing left to decode.
+ *	- -1 on error.
+ */
+int fr_pair_lazy_decode(VALUE_PAIR *vp, fr_dict_attr_t const *da)
+{
+	VALUE_PAIR	*head = NULL, *tail;
+	int		rcode;
+
+	if ((vp->type != VT_LAZY) || !vp->lazy) return 0;
+
+	/*
+	 *	Some of the attributes may have been lost, so
+	 *	don't let anything see the list as complete.
+	 */
+	if (vp->lazy->failed) {
+		fr_strerror_printf("Attributes failed to decode");
+		return -1;
+	}
+
+	rcode = vp->lazy->decode(&head, vp->lazy->uctx, da);
+	if (rcode < 0) {
+		fr_pair_list_free(&head);
+		vp->lazy->failed = true;
+		return -1;
+	}
+
+	if (head) {
+		for (tail = head; tail->next; tail = tail->next);
+		tail->next = vp->next;
+		vp->next = head;
+	}
+
+	if (rcode > 0) return 0;
+
+	TALLOC_FREE(vp->lazy);
+	if (!head) return 0;
+
+	/*
+	 *	Become the first decoded VALUE_PAIR, taking its
+	 *	buffers and its unknown da (if any) with it.
+	 */
+	memcpy(vp, head, sizeof(*vp));
+	if (vp->da->flags.is_unknown) (void) talloc_steal(vp, vp->da);
+	switch (vp->vp_type) {
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_STRING:
+		if (vp->vp_ptr) (void) talloc_steal(vp, vp->vp_ptr);
+		break;
+
+	default:
+		break;
+	}
+
+	head->next = NULL;
+	talloc_free(head);
+
+	return 0;
+}
+
+/** Decode every #VT_LAZY VALUE_PAIR in a list
+ *
+ * For functions which walk lists directly, and need every attribute.
+ *
+ * @param[in] head	of the list.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_pair_list_lazy_decode(VALUE_PAIR *head)
+{
+	VALUE_PAIR *vp;
+
+	for (vp = head; vp; vp = vp->next) {
+		if ((vp->type == VT_LAZY) && (fr_pair_lazy_decode(vp, NULL) < 0)) return -1;
+	}
+
+	return 0;
+}
+
 /** Find the pair with the matching DAs
  *
  */
@@ -801,6 +933,8 @@ void fr_pair_replace(VALUE_PAIR **head, VALUE_PAIR *replace)
 		return;
 	}
 
+	(void) fr_pair_list_lazy_decode(*head);
+
 	/*
 	 *	Not an empty list, so find item if it is there, and
 	 *	replace it. Note, we always replace the head one, and
@@ -894,6 +1028,8 @@ void fr_pair_delete_by_num(VALUE_PAIR **head, unsigned int vendor, unsigned int
 	VALUE_PAIR *i, *next;
 	VALUE_PAIR **last = head;
 
+	(void) fr_pair_list_lazy_decode(*head);
+
 	if (!vendor) {
 		for(i = *head; i; i = next) {
 			VERIFY_VP(i);
@@ -1242,6 +1378,8 @@ void fr_pair_list_sort(VALUE_PAIR **vps, fr_cmp_t cmp)
 	 */
 	if (!head || !head->next) return;
 
+	(void) fr_pair_list_lazy_decode(head);
+
 	_pair_list_sort_split(head, &a, &b);	/* Split into sublists */
 	fr_pair_list_sort(&a, cmp);		/* Traverse left */
 	fr_pair_list_sort(&b, cmp);		/* Traverse right */
@@ -1717,6 +1855,9 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 
 	if (!to || !from || !*from) return;
 
+	(void) fr_pair_list_lazy_decode(*to);
+	(void) fr_pair_list_lazy_decode(*from);
+
 	/*
 	 *	We're editing the "to" list while we're adding new
 	 *	attributes to it.  We don't want the new attributes to
@@ -1870,6 +2011,9 @@ static void fr_pair_list_move_by_num_internal(TALLOC_CTX *ctx, VALUE_PAIR **to,
 	VALUE_PAIR *to_tail, *i, *next, *this;
 	VALUE_PAIR *iprev = NULL;
 
+	(void) fr_pair_list_lazy_decode(*to);
+	(void) fr_pair_list_lazy_decode(*from);
+
 	/*
 	 *	Find the last pair in the "to" list and put it in "to_tail".
 	 *
@@ -2911,29 +3055,19 @@ inline void fr_pair_verify(char const *file, int line, VALUE_PAIR const *vp)
  */
 void fr_pair_list_verify(char const *file, int line, TALLOC_CTX *expected, VALUE_PAIR *vps)
 {
-	vp_cursor_t		slow_cursor, fast_cursor;
 	VALUE_PAIR		*slow, *fast;
 	TALLOC_CTX		*parent;
 
 	if (!vps) return;	/* Fast path */
 
-	fr_pair_cursor_init(&fast_cursor, &vps);
-
-	for (slow = fr_pair_cursor_init(&slow_cursor, &vps), fast = fr_pair_cursor_init(&fast_cursor, &vps);
-	     slow && fast;
-	     slow = fr_pair_cursor_next(&fast_cursor), fast = fr_pair_cursor_next(&fast_cursor)) {
+	/*
+	 *	Not cursors, which would decode any #VT_LAZY
+	 *	VALUE_PAIRs.
+	 */
+	slow = fast = vps;
+	while (slow) {
 		VERIFY_VP(slow);
 
-		/*
-		 *	Advances twice as fast as slow...
-		 */
-		fast = fr_pair_cursor_next(&fast_cursor);
-		if (fast == slow) {
-			FR_FAULT_LOG("CONSISTENCY CHECK FAILED %s[%u]: Looping list found.  Fast pointer hit "
-				     "slow pointer at \"%s\"", file, line, slow->da->name);
-			if (!fr_cond_assert(0)) fr_exit_now(1);
-		}
-
 		parent = talloc_parent(slow);
 		if (expected && (parent != expected)) {
 			FR_FAULT_LOG("CONSISTENCY CHECK FAILED %s[%u]: Expected VALUE_PAIR \"%s\" to be parented "
@@ -2946,6 +3080,18 @@ void fr_pair_list_verify(char const *file, int line, TALLOC_CTX *expected, VALUE
 			if (parent) fr_log_talloc_report(parent);
 			if (!fr_cond_assert(0)) fr_exit_now(1);
 		}
+
+		/*
+		 *	Advances twice as fast as slow...
+		 */
+		slow = slow->next;
+		if (fast) fast = fast->next;
+		if (fast) fast = fast->next;
+		if (fast && (fast == slow)) {
+			FR_FAULT_LOG("CONSISTENCY CHECK FAILED %s[%u]: Looping list found.  Fast pointer hit "
+				     "slow pointer at \"%s\"", file, line, slow->da->name);
+			if (!fr_cond_assert(0)) fr_exit_now(1);
+		}
 	}
 }
 #endif
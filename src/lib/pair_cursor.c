@@ -28,6 +28,33 @@
  */
 #include <freeradius-devel/libradius.h>
 
+/** Decode the attributes a #VT_LAZY VALUE_PAIR stands for, and skip it if it's still there
+ *
+ * If decoding fails, the list ends at the #VT_LAZY VALUE_PAIR, and the cursor
+ * is marked as failed.  See fr_pair_cursor_failed().
+ *
+ * @param cursor the list is being walked with.
+ * @param vp to start at.
+ * @param da to decode, or NULL to decode everything.
+ * @return
+ *	- The first VALUE_PAIR at or after vp which isn't #VT_LAZY.
+ *	- NULL if there are none, or decoding failed.
+ */
+inline static VALUE_PAIR *fr_pair_cursor_lazy_skip(vp_cursor_t *cursor, VALUE_PAIR *vp, fr_dict_attr_t const *da)
+{
+	while (vp && (vp->type == VT_LAZY)) {
+		if (fr_pair_lazy_decode(vp, da) < 0) {
+			cursor->failed = true;
+			return NULL;
+		}
+		if (vp->type != VT_LAZY) break;
+
+		vp = vp->next;
+	}
+
+	return vp;
+}
+
 /** Internal function to update cursor state
  *
  * @param cursor to operate on.
@@ -76,7 +103,7 @@ VALUE_PAIR *fr_pair_cursor_init(vp_cursor_t *cursor, VALUE_PAIR * const *const_v
 	if (*vp) VERIFY_VP(*vp);
 #endif
 	memcpy(&cursor->first, &vp, sizeof(cursor->first));
-	cursor->current = *cursor->first;
+	cursor->current = fr_pair_cursor_lazy_skip(cursor, *cursor->first, NULL);
 
 	if (cursor->current) {
 		VERIFY_VP(cursor->current);
@@ -105,7 +132,7 @@ VALUE_PAIR *fr_pair_cursor_first(vp_cursor_t *cursor)
 {
 	if (!cursor->first) return NULL;
 
-	cursor->current = *cursor->first;
+	cursor->current = fr_pair_cursor_lazy_skip(cursor, *cursor->first, NULL);
 
 	if (cursor->current) {
 		VERIFY_VP(cursor->current);
@@ -209,6 +236,8 @@ VALUE_PAIR *fr_pair_cursor_next_by_num(vp_cursor_t *cursor, unsigned int vendor,
 		for (i = cursor->found ? cursor->found->next : cursor->current;
 		     i != NULL;
 		     i = i->next) {
+			if ((i->type == VT_LAZY) &&
+			    !(i = fr_pair_cursor_lazy_skip(cursor, i, fr_dict_attr_by_num(NULL, 0, attr)))) break;
 			VERIFY_VP(i);
 			if (i->da->parent->flags.is_root &&
 			    (i->da->attr == attr) && (i->da->vendor == 0) &&
@@ -220,6 +249,8 @@ VALUE_PAIR *fr_pair_cursor_next_by_num(vp_cursor_t *cursor, unsigned int vendor,
 		for (i = cursor->found ? cursor->found->next : cursor->current;
 		     i != NULL;
 		     i = i->next) {
+			if ((i->type == VT_LAZY) &&
+			    !(i = fr_pair_cursor_lazy_skip(cursor, i, fr_dict_attr_by_num(NULL, vendor, attr)))) break;
 			VERIFY_VP(i);
 			if ((i->da->parent->type == PW_TYPE_VENDOR) &&
 			    (i->da->attr == attr) && (i->da->vendor == vendor) &&
@@ -265,6 +296,7 @@ VALUE_PAIR *fr_pair_cursor_next_by_child_num(vp_cursor_t *cursor,
 	for (i = cursor->found ? cursor->found->next : cursor->current;
 	     i != NULL;
 	     i = i->next) {
+		if ((i->type == VT_LAZY) && !(i = fr_pair_cursor_lazy_skip(cursor, i, da))) break;
 		VERIFY_VP(i);
 		if ((i->da == da) &&
 		    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
@@ -302,6 +334,7 @@ VALUE_PAIR *fr_pair_cursor_next_by_da(vp_cursor_t *cursor, fr_dict_attr_t const
 	for (i = cursor->found ? cursor->found->next : cursor->current;
 	     i != NULL;
 	     i = i->next) {
+		if ((i->type == VT_LAZY) && !(i = fr_pair_cursor_lazy_skip(cursor, i, da))) break;
 		VERIFY_VP(i);
 		if ((i->da == da) &&
 		    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
@@ -337,6 +370,7 @@ VALUE_PAIR *fr_pair_cursor_next_by_ancestor(vp_cursor_t *cursor, fr_dict_attr_t
 	for (i = cursor->found ? cursor->found->next : cursor->current;
 	     i != NULL;
 	     i = i->next) {
+		if ((i->type == VT_LAZY) && !(i = fr_pair_cursor_lazy_skip(cursor, i, ancestor))) break;
 		VERIFY_VP(i);
 		if (fr_dict_parent_common(ancestor, i->da, true) &&
 		    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) break;
@@ -356,7 +390,7 @@ VALUE_PAIR *fr_pair_cursor_next(vp_cursor_t *cursor)
 {
 	if (!cursor->first) return NULL;
 
-	cursor->current = cursor->next;
+	cursor->current = fr_pair_cursor_lazy_skip(cursor, cursor->next, NULL);
 	if (cursor->current) {
 		VERIFY_VP(cursor->current);
 
@@ -385,6 +419,8 @@ VALUE_PAIR *fr_pair_cursor_next(vp_cursor_t *cursor)
  */
 VALUE_PAIR *fr_pair_cursor_next_peek(vp_cursor_t *cursor)
 {
+	cursor->next = fr_pair_cursor_lazy_skip(cursor, cursor->next, NULL);
+
 	return cursor->next;
 }
 
@@ -400,6 +436,21 @@ VALUE_PAIR *fr_pair_cursor_current(vp_cursor_t *cursor)
 	return cursor->current;
 }
 
+/** Check whether attributes failed to decode while the cursor was being moved
+ *
+ * The cursor functions return NULL when a #VT_LAZY VALUE_PAIR fails to decode,
+ * as if the list ended there.  This tells that apart from the real end of the list.
+ *
+ * @param cursor to check.
+ * @return
+ *	- true if decoding failed.  fr_strerror() says why.
+ *	- false if it didn't, or there was nothing to decode.
+ */
+bool fr_pair_cursor_failed(vp_cursor_t const *cursor)
+{
+	return cursor->failed;
+}
+
 /** Insert a single VALUE_PAIR at the start of the list
  *
  * @note Will not advance cursor position to new attribute, but will set cursor
@@ -596,8 +647,8 @@ VALUE_PAIR *fr_pair_cursor_remove(vp_cursor_t *cursor)
 	 */
 	if (*(cursor->first) == vp) {
 		*(cursor->first) = vp->next;
-		cursor->current = vp->next;
-		cursor->next = vp->next ? vp->next->next : NULL;
+		cursor->current = fr_pair_cursor_lazy_skip(cursor, vp->next, NULL);
+		cursor->next = cursor->current ? cursor->current->next : NULL;
 		before = NULL;
 		goto fixup;
 	}
@@ -35,11 +35,11 @@ bool fr_tunnel_password_zeros = true;
  * initial intermediate value, to differentiate it from the
  * above.
  */
-ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
+static ssize_t radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char const *secret,
+					     fr_radius_secret_t const *prepared, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
-	int		secretlen;
 	size_t		i, n, encrypted_len, embedded_len;
 
 	encrypted_len = *pwlen;
@@ -73,10 +73,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_radius_md5_secret_init(&context, secret, prepared);
 	fr_md5_copy(&old, &context); /* save intermediate work */
 
 	/*
@@ -152,15 +149,24 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 	return embedded_len;
 }
 
+/** Decode Tunnel-Password encrypted attributes
+ *
+ */
+ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
+{
+	return radius_decode_tunnel_password(passwd, pwlen, secret, NULL, vector);
+}
+
 /** Decode password
  *
  */
-ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret, uint8_t const *vector)
+static ssize_t radius_decode_password(char *passwd, size_t pwlen, char const *secret,
+				      fr_radius_secret_t const *prepared, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	int		i;
-	size_t		n, secretlen;
+	size_t		n;
 
 	/*
 	 *	The RFC's say that the maximum is 128.
@@ -177,10 +183,7 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_radius_md5_secret_init(&context, secret, prepared);
 	fr_md5_copy(&old, &context);	/* save intermediate work */
 
 	/*
@@ -212,6 +215,14 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	return strlen(passwd);
 }
 
+/** Decode password
+ *
+ */
+ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret, uint8_t const *vector)
+{
+	return radius_decode_password(passwd, pwlen, secret, NULL, vector);
+}
+
 /** Check if a set of RADIUS formatted TLVs are OK
  *
  */
@@ -982,11 +993,11 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 		 */
 		case FLAG_ENCRYPT_USER_PASSWORD:
 			if (this->original) {
-				fr_radius_decode_password((char *)buffer, attr_len,
-							  this->secret, this->original->vector);
+				radius_decode_password((char *)buffer, attr_len,
+						       this->secret, this->prepared, this->original->vector);
 			} else {
-				fr_radius_decode_password((char *)buffer, attr_len,
-							  this->secret, this->packet->vector);
+				radius_decode_password((char *)buffer, attr_len,
+						       this->secret, this->prepared, this->packet->vector);
 			}
 			buffer[253] = '\0';
 
@@ -1020,8 +1031,8 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 		 *	not the same as attrlen.
 		 */
 		case FLAG_ENCRYPT_TUNNEL_PASSWORD:
-			if (fr_radius_decode_tunnel_password(buffer, &data_len, this->secret,
-							     this->original ? this->original->vector : nullvector) < 0) {
+			if (radius_decode_tunnel_password(buffer, &data_len, this->secret, this->prepared,
+							  this->original ? this->original->vector : nullvector) < 0) {
 				goto raw;
 			}
 			break;
@@ -133,10 +133,10 @@ int fr_radius_encode_chap_password(uint8_t *output, RADIUS_PACKET *packet, int i
  */
 int fr_radius_encode_tunnel_password(char *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
 {
-	uint8_t		buffer[AUTH_VECTOR_LEN + FR_MAX_STRING_LEN + 3];
+	FR_MD5_CTX	context, old;
 	unsigned char	digest[AUTH_VECTOR_LEN];
 	char		*salt;
-	int		i, n, secretlen;
+	int		i, n;
 	unsigned	len, n2;
 
 	len = *pwlen;
@@ -184,18 +184,17 @@ int fr_radius_encode_tunnel_password(char *passwd, size_t *pwlen, char const *se
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-	memcpy(buffer, secret, secretlen);
+	fr_radius_md5_secret_init(&old, secret, NULL);
 
 	for (n2 = 0; n2 < len; n2 +=AUTH_PASS_LEN) {
+		fr_md5_copy(&context, &old);
 		if (!n2) {
-			memcpy(buffer + secretlen, vector, AUTH_VECTOR_LEN);
-			memcpy(buffer + secretlen + AUTH_VECTOR_LEN, salt, 2);
-			fr_md5_calc(digest, buffer, secretlen + AUTH_VECTOR_LEN + 2);
+			fr_md5_update(&context, vector, AUTH_VECTOR_LEN);
+			fr_md5_update(&context, (uint8_t const *) salt, 2);
 		} else {
-			memcpy(buffer + secretlen, passwd + n2 - AUTH_PASS_LEN, AUTH_PASS_LEN);
-			fr_md5_calc(digest, buffer, secretlen + AUTH_PASS_LEN);
+			fr_md5_update(&context, (uint8_t const *) passwd + n2 - AUTH_PASS_LEN, AUTH_PASS_LEN);
 		}
+		fr_md5_final(digest, &context);
 		for (i = 0; i < AUTH_PASS_LEN; i++) passwd[i + n2] ^= digest[i];
 	}
 	passwd[n2] = 0;
@@ -216,7 +215,7 @@ int fr_radius_encode_password(char *passwd, size_t *pwlen, char const *secret, u
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
-	int		i, n, secretlen;
+	int		i, n;
 	int		len;
 
 	/*
@@ -243,10 +242,7 @@ int fr_radius_encode_password(char *passwd, size_t *pwlen, char const *secret, u
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_radius_md5_secret_init(&context, secret, NULL);
 	fr_md5_copy(&old, &context); /* save intermediate work */
 
 	/*
@@ -270,7 +266,7 @@ int fr_radius_encode_password(char *passwd, size_t *pwlen, char const *secret, u
 }
 
 static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input, size_t inlen,
-			    char const *secret, uint8_t const *vector)
+			    char const *secret, fr_radius_secret_t const *prepared, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
@@ -295,8 +291,7 @@ static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input,
 	}
 	*outlen = len;
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	fr_radius_md5_secret_init(&context, secret, prepared);
 	fr_md5_copy(&old, &context);
 
 	/*
@@ -320,7 +315,7 @@ static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input,
 
 static void encode_tunnel_password(uint8_t *out, ssize_t *outlen,
 				   uint8_t const *input, size_t inlen, size_t freespace,
-				   char const *secret, uint8_t const *vector)
+				   char const *secret, fr_radius_secret_t const *prepared, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
@@ -381,8 +376,7 @@ static void encode_tunnel_password(uint8_t *out, ssize_t *outlen,
 	out[1] = fr_rand();
 	out[2] = inlen;	/* length of the password string */
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	fr_radius_md5_secret_init(&context, secret, prepared);
 	fr_md5_copy(&old, &context);
 
 	fr_md5_update(&context, vector, AUTH_VECTOR_LEN);
@@ -825,7 +819,7 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 */
 	if (da->type != PW_TYPE_STRUCT) switch (vp->da->flags.encrypt) {
 	case FLAG_ENCRYPT_USER_PASSWORD:
-		encode_password(ptr, &len, data, len, ctx->secret, ctx->packet->vector);
+		encode_password(ptr, &len, data, len, ctx->secret, ctx->prepared, ctx->packet->vector);
 		break;
 
 	case FLAG_ENCRYPT_TUNNEL_PASSWORD:
@@ -850,14 +844,15 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 
 			if (offset) ptr[0] = TAG_VALID(vp->tag) ? vp->tag : TAG_NONE;
 			encode_tunnel_password(ptr + offset, &len, data, len,
-					       outlen - offset, ctx->secret, ctx->original->vector);
+					       outlen - offset, ctx->secret, ctx->prepared, ctx->original->vector);
 			len += offset;
 			break;
 		case PW_CODE_ACCOUNTING_REQUEST:
 		case PW_CODE_DISCONNECT_REQUEST:
 		case PW_CODE_COA_REQUEST:
 			ptr[0] = TAG_VALID(vp->tag) ? vp->tag : TAG_NONE;
-			encode_tunnel_password(ptr + 1, &len, data, len, outlen - 1, ctx->secret, ctx->packet->vector);
+			encode_tunnel_password(ptr + 1, &len, data, len, outlen - 1,
+					       ctx->secret, ctx->prepared, ctx->packet->vector);
 			len += offset;
 			break;
 		}
@@ -40,6 +40,8 @@
 fr_thread_local_setup(pcre_jit_stack *, fr_pcre_jit_stack)
 #endif
 
+static int study_flags;		//!< Passed to pcre_study(), set by the first call to regex_compile().
+
 /** Free regex_t structure
  *
  * Calls libpcre specific free functions for the expression and study.
@@ -101,7 +103,6 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 	regex_t *preg;
 
 	static bool setup;
-	static bool study_flags;
 
 	/*
 	 *	Lets us use subcapture copy
@@ -148,29 +149,10 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 
 	if (!runtime) {
 		preg->precompiled = true;
-		preg->extra = pcre_study(preg->compiled, study_flags, &error);
-		if (error) {
+		if (regex_study(preg) < 0) {
 			talloc_free(preg);
-			fr_strerror_printf("Pattern study failed: %s", error);
-
 			return 0;
 		}
-
-#ifdef PCRE_INFO_JIT
-		/*
-		 *	Check to see if the JIT was successful.
-		 *
-		 * 	Not all platforms have JIT support, the pattern
-		 *	may not be jitable, or JIT support may have been
-		 *	disabled.
-		 */
-		if (study_flags & PCRE_STUDY_JIT_COMPILE) {
-			int jitd = 0;
-
-			pcre_fullinfo(preg->compiled, preg->extra, PCRE_INFO_JIT, &jitd);
-			if (jitd) preg->jitd = true;
-		}
-#endif
 	}
 
 	*out = preg;
@@ -178,6 +160,48 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 	return len;
 }
 
+/** Study a compiled expression, and run it through the PCRE JIT if possible
+ *
+ * This is done by regex_compile() for expressions compiled at startup.  Expressions
+ * compiled at runtime may be studied later, once they've been used often enough
+ * to make it worthwhile.
+ *
+ * @param[in] preg	to study.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int regex_study(regex_t *preg)
+{
+	char const *error = NULL;
+
+	if (preg->extra) return 0;
+
+	preg->extra = pcre_study(preg->compiled, study_flags, &error);
+	if (error) {
+		fr_strerror_printf("Pattern study failed: %s", error);
+		return -1;
+	}
+
+#ifdef PCRE_INFO_JIT
+	/*
+	 *	Check to see if the JIT was successful.
+	 *
+	 * 	Not all platforms have JIT support, the pattern
+	 *	may not be jitable, or JIT support may have been
+	 *	disabled.
+	 */
+	if (study_flags & PCRE_STUDY_JIT_COMPILE) {
+		int jitd = 0;
+
+		pcre_fullinfo(preg->compiled, preg->extra, PCRE_INFO_JIT, &jitd);
+		if (jitd) preg->jitd = true;
+	}
+#endif
+
+	return 0;
+}
+
 static const FR_NAME_NUMBER regex_pcre_error_str[] = {
 	{ "PCRE_ERROR_NOMATCH",		PCRE_ERROR_NOMATCH },
 	{ "PCRE_ERROR_NULL",		PCRE_ERROR_NULL },
@@ -386,6 +410,18 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 	return len;
 }
 
+/** Study a compiled expression
+ *
+ * POSIX regular expressions can't be studied, so this does nothing.
+ *
+ * @param[in] preg	to study.
+ * @return 0.
+ */
+int regex_study(UNUSED regex_t *preg)
+{
+	return 0;
+}
+
 /** Binary safe wrapper around regexec
  *
  *  If we have the BSD extensions we don't need to do any special work
@@ -602,6 +602,45 @@ int fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const
 	return sockfd;
 }
 
+/** Allow multiple sockets to be bound to the same IP address and port.
+ *
+ *  This function must be called after fr_socket_server_base(), and
+ *  before fr_socket_server_bind().  When multiple sockets are bound
+ *  to the same address and port, the kernel spreads incoming packets
+ *  across them, with all packets from one client going to the same
+ *  socket.  Each socket can then be serviced by its own thread.
+ *
+ * @param[in] sockfd the socket which was opened via fr_socket_server_base()
+ * @return
+ *	- 0 on success
+ *	- -1 on failure.
+ */
+int fr_socket_server_reuseport(int sockfd)
+{
+#if defined(SO_REUSEPORT_LB) || defined(SO_REUSEPORT)
+	int on = 1;
+
+	/*
+	 *	On FreeBSD, SO_REUSEPORT allows multiple sockets to
+	 *	be bound, but only the last one gets packets.
+	 *	SO_REUSEPORT_LB load balances across all of them.
+	 */
+#  ifdef SO_REUSEPORT_LB
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT_LB, &on, sizeof(on)) < 0) {
+#  else
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+#  endif
+		fr_strerror_printf("Failed setting SO_REUSEPORT: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("Binding multiple sockets to the same port is not supported on this system");
+	return -1;
+#endif
+}
+
 /** Bind to an IPv4 / IPv6, and UDP / TCP socket, server side.
  *
  * @param[in] sockfd the socket which was opened via fr_socket_server_base()
@@ -239,3 +239,206 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 
 	return received;
 }
+
+
+/** Read multiple UDP packets
+ *
+ *  Each packet is read into its own slot in the buffer.  Where
+ *  recvmmsg() is available, one system call reads all of the
+ *  packets.  Otherwise, we call recvfrom() until the socket has no
+ *  more data.
+ *
+ *  The socket is never blocked on.
+ *
+ * @param[in] sockfd we're reading from.
+ * @param[out] buffer where the packets are written.  Must be num * slot_size bytes.
+ * @param[in] slot_size the size of each slot in the buffer.
+ * @param[in] num the maximum number of packets to read.
+ * @param[out] data_size array of num entries, where the length of each packet is written.
+ * @param[out] src array of num entries, where the source address of each packet is written.
+ * @param[out] sizeof_src array of num entries, where the length of each source address is written.
+ * @return
+ *	- > 0 the number of packets read.
+ *	- 0 no packets were ready.
+ *	- < 0 on failure.
+ */
+int udp_recv_batch(int sockfd, uint8_t *buffer, size_t slot_size, int num,
+		   size_t *data_size, struct sockaddr_storage *src, socklen_t *sizeof_src)
+{
+	int			i;
+#ifdef HAVE_RECVMMSG
+	int			received;
+	struct mmsghdr		msgs[UDP_MAX_BATCH];
+	struct iovec		iov[UDP_MAX_BATCH];
+
+	if (num > UDP_MAX_BATCH) num = UDP_MAX_BATCH;
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = buffer + (i * slot_size);
+		iov[i].iov_len = slot_size;
+
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &src[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+	}
+
+	received = recvmmsg(sockfd, msgs, num, MSG_DONTWAIT, NULL);
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("udp_recv_batch failed: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < received; i++) {
+		data_size[i] = msgs[i].msg_len;
+		sizeof_src[i] = msgs[i].msg_hdr.msg_namelen;
+	}
+
+	return received;
+#else
+	for (i = 0; i < num; i++) {
+		ssize_t received;
+
+		sizeof_src[i] = sizeof(src[i]);
+
+		received = recvfrom(sockfd, buffer + (i * slot_size), slot_size, MSG_DONTWAIT,
+				    (struct sockaddr *) &src[i], &sizeof_src[i]);
+		if (received < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) break;
+
+			/*
+			 *	Return the packets we have.  The error
+			 *	will happen again on the next read.
+			 */
+			if (i > 0) break;
+
+			fr_strerror_printf("udp_recv_batch failed: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		data_size[i] = received;
+	}
+
+	return i;
+#endif
+}
+
+
+/** Send multiple UDP packets
+ *
+ *  Where sendmmsg() is available, the packets are sent with as few
+ *  system calls as possible.  Otherwise, each packet is sent
+ *  individually.
+ *
+ *  Packets which can't be sent are skipped, so that one bad
+ *  destination address doesn't prevent the rest of the batch from
+ *  being sent.
+ *
+ * @param[in] sockfd we're writing to.
+ * @param[in] entries the packets to send.
+ * @param[in] num the number of entries.
+ * @return
+ *	- >= 0 the number of packets sent.
+ *	- < 0 on failure, when none of the packets could be sent.
+ */
+int udp_send_batch(int sockfd, udp_batch_entry_t *entries, int num)
+{
+	int			i, sent = 0, failed = 0;
+#ifdef HAVE_SENDMMSG
+	int			batch, done, rcode;
+	struct mmsghdr		msgs[UDP_MAX_BATCH];
+	struct iovec		iov[UDP_MAX_BATCH];
+#  ifdef WITH_UDPFROMTO
+	char			cbuf[UDP_MAX_BATCH][64];
+#  endif
+
+	while (num > 0) {
+		int todo = num;
+
+		if (todo > UDP_MAX_BATCH) todo = UDP_MAX_BATCH;
+
+		memset(msgs, 0, sizeof(msgs[0]) * todo);
+
+		/*
+		 *	Entries with a source address we can't use are
+		 *	left out of the batch.
+		 */
+		for (i = 0, batch = 0; i < todo; i++) {
+			iov[batch].iov_base = entries[i].data;
+			iov[batch].iov_len = entries[i].data_len;
+
+			msgs[batch].msg_hdr.msg_iov = &iov[batch];
+			msgs[batch].msg_hdr.msg_iovlen = 1;
+			msgs[batch].msg_hdr.msg_name = &entries[i].dst;
+			msgs[batch].msg_hdr.msg_namelen = entries[i].sizeof_dst;
+
+#  ifdef WITH_UDPFROMTO
+			if (entries[i].sizeof_src &&
+			    (udpfromto_msghdr(sockfd, &msgs[batch].msg_hdr, cbuf[batch], sizeof(cbuf[batch]),
+					      (struct sockaddr *) &entries[i].src, entries[i].sizeof_src,
+					      entries[i].if_index) < 0)) {
+				if (!failed++) fr_strerror_printf("udp_send_batch failed: %s", fr_syserror(errno));
+				memset(&msgs[batch], 0, sizeof(msgs[batch]));
+				continue;
+			}
+#  endif
+			batch++;
+		}
+
+		done = 0;
+		while (done < batch) {
+			rcode = sendmmsg(sockfd, &msgs[done], batch - done, 0);
+			if (rcode < 0) {
+				if (errno == EINTR) continue;
+
+				/*
+				 *	The error is for the first message
+				 *	we tried to send.  Skip it, and
+				 *	continue with the rest.
+				 */
+				if (!failed++) fr_strerror_printf("udp_send_batch failed: %s", fr_syserror(errno));
+				done++;
+				continue;
+			}
+
+			done += rcode;
+			sent += rcode;
+		}
+
+		entries += todo;
+		num -= todo;
+	}
+#else
+	for (i = 0; i < num; i++) {
+		ssize_t rcode;
+
+#  ifdef WITH_UDPFROMTO
+		if (entries[i].sizeof_src) {
+			rcode = sendfromto(sockfd, entries[i].data, entries[i].data_len, 0,
+					   (struct sockaddr *) &entries[i].src, entries[i].sizeof_src,
+					   (struct sockaddr *) &entries[i].dst, entries[i].sizeof_dst,
+					   entries[i].if_index);
+		} else
+#  endif
+		{
+			rcode = sendto(sockfd, entries[i].data, entries[i].data_len, 0,
+				       (struct sockaddr *) &entries[i].dst, entries[i].sizeof_dst);
+		}
+
+		if (rcode < 0) {
+			if (!failed++) fr_strerror_printf("udp_send_batch failed: %s", fr_syserror(errno));
+			continue;
+		}
+
+		sent++;
+	}
+#endif
+
+	if (!sent && failed) return -1;
+
+	return sent;
+}
@@ -357,32 +357,27 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	return ret;
 }
 
-/** Send packet via a file descriptor, setting the src address and outbound interface
+/** Set the source address and outbound interface in a message header
  *
- * Abstracts away the complexity of using the complexity of using sendmsg().
+ * The caller fills in the iovec and destination address of the message
+ * header, and then calls sendmsg(), or sendmmsg() for many headers.
  *
- * @param[in] fd	The file descriptor to write to.
- * @param[in] buf	Where to read datagram data from.
- * @param[in] len	of datagram data.
- * @param[in] flags	passed unmolested to sendmsg.
+ * @param[in] fd	The file descriptor which will be written to.
+ * @param[in,out] msgh	The message header to update.
+ * @param[in] cbuf	Buffer for the control message.  Must remain valid until the message is sent.
+ * @param[in] cbuf_len	Length of cbuf.
  * @param[in] from	The source address.
  * @param[in] from_len	Length of the structure pointed to by from.
- * @param[in] to	The destination address.
- * @param[in] to_len	Length of the structure pointed to by to.
  * @param[in] if_index	The interface on which to send the datagram.
  *			If automatic interface selection is desired, value should be 0.
  * @return
- *	- 0 on success.
+ *	- 1 if the source address was set.
+ *	- 0 if there is no source address, and the datagram can be sent with sendto().
  *	- -1 on failure.
  */
-int sendfromto(int fd, void *buf, size_t len, int flags,
-	       struct sockaddr *from, socklen_t from_len,
-	       struct sockaddr *to, socklen_t to_len, int if_index)
+int udpfromto_msghdr(UNUSED int fd, struct msghdr *msgh, char *cbuf, size_t cbuf_len,
+		     struct sockaddr *from, socklen_t from_len, int if_index)
 {
-	struct msghdr	msgh;
-	struct iovec	iov;
-	char		cbuf[256];
-
 	/*
 	 *	Unknown address family, die.
 	 */
@@ -437,19 +432,9 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	/*
 	 *	No "from", just use regular sendto.
 	 */
-	if (!from || (from_len == 0)) return sendto(fd, buf, len, flags, to, to_len);
-
-	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
-	memset(&msgh, 0, sizeof(msgh));
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buf;
-	iov.iov_len = len;
+	if (!from || (from_len == 0)) return 0;
 
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_name = to;
-	msgh.msg_namelen = to_len;
+	memset(cbuf, 0, cbuf_len);
 
 # if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
 	if (from->sa_family == AF_INET) {
@@ -459,10 +444,15 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		if (cbuf_len < CMSG_SPACE(sizeof(*pkt))) {
+			errno = EINVAL;
+			return -1;
+		}
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = SOL_IP;
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -477,10 +467,15 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_addr *in;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+		if (cbuf_len < CMSG_SPACE(sizeof(*in))) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -498,10 +493,15 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in6_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		if (cbuf_len < CMSG_SPACE(sizeof(*pkt))) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -513,6 +513,56 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	}
 #  endif	/* IPV6_PKTINFO */
 
+	return 1;
+}
+
+
+/** Send packet via a file descriptor, setting the src address and outbound interface
+ *
+ * Abstracts away the complexity of using the complexity of using sendmsg().
+ *
+ * @param[in] fd	The file descriptor to write to.
+ * @param[in] buf	Where to read datagram data from.
+ * @param[in] len	of datagram data.
+ * @param[in] flags	passed unmolested to sendmsg.
+ * @param[in] from	The source address.
+ * @param[in] from_len	Length of the structure pointed to by from.
+ * @param[in] to	The destination address.
+ * @param[in] to_len	Length of the structure pointed to by to.
+ * @param[in] if_index	The interface on which to send the datagram.
+ *			If automatic interface selection is desired, value should be 0.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sendfromto(int fd, void *buf, size_t len, int flags,
+	       struct sockaddr *from, socklen_t from_len,
+	       struct sockaddr *to, socklen_t to_len, int if_index)
+{
+	int		rcode;
+	struct msghdr	msgh;
+	struct iovec	iov;
+	char		cbuf[256];
+
+	/* Set up control buffer iov and msgh structures. */
+	memset(&msgh, 0, sizeof(msgh));
+	memset(&iov, 0, sizeof(iov));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = to;
+	msgh.msg_namelen = to_len;
+
+	rcode = udpfromto_msghdr(fd, &msgh, cbuf, sizeof(cbuf), from, from_len, if_index);
+	if (rcode < 0) return -1;
+
+	/*
+	 *	No "from", just use regular sendto.
+	 */
+	if (rcode == 0) return sendto(fd, buf, len, flags, to, to_len);
+
 	return sendmsg(fd, &msgh, flags);
 }
 
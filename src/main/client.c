@@ -181,6 +181,14 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 	if (!client) return false;
 
+	/*
+	 *	Hash the secret once, rather than for every packet.
+	 */
+	if (client->secret) {
+		client->prepared = fr_radius_secret_alloc(client, client->secret);
+		if (!client->prepared) return false;
+	}
+
 	/*
 	 *	Hack to fixup wildcard clients
 	 *
@@ -1228,7 +1228,7 @@ static int command_show_home_servers(rad_listen_t *listener, UNUSED int argc, UN
 		cprintf(listener, "%s\t%s\t%d\t%s\t%s\t%s\t%d\n",
 			fr_inet_ntoh(&home->ipaddr, buffer, sizeof(buffer)),
 			home->name, home->port, proto, type, state,
-			home->currently_outstanding);
+			(int) atomic_load_explicit(&home->currently_outstanding, memory_order_relaxed));
 	}
 
 	return CMD_OK;
@@ -2677,6 +2677,22 @@ static int command_stats_state(rad_listen_t *listener, UNUSED int argc, UNUSED c
 	return CMD_OK;
 }
 
+#ifdef HAVE_REGEX
+static int command_stats_regex(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	regex_cache_stats_t stats;
+
+	regex_cache_stats(&stats);
+
+	cprintf(listener, "regex_cache_hits\t\t%" PRIu64 "\n", stats.hits);
+	cprintf(listener, "regex_cache_misses\t%" PRIu64 "\n", stats.misses);
+	cprintf(listener, "regex_cache_evictions\t%" PRIu64 "\n", stats.evictions);
+	cprintf(listener, "regex_cache_studied\t%" PRIu64 "\n", stats.studied);
+
+	return CMD_OK;
+}
+#endif
+
 #ifndef NDEBUG
 static int command_stats_memory(rad_listen_t *listener, int argc, char *argv[])
 {
@@ -2820,7 +2836,8 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 
 	command_print_stats(listener, &home->stats,
 			    (home->type == HOME_TYPE_AUTH), 1);
-	cprintf(listener, "outstanding\t%d\n", home->currently_outstanding);
+	cprintf(listener, "outstanding\t%d\n",
+		(int) atomic_load_explicit(&home->currently_outstanding, memory_order_relaxed));
 	return CMD_OK;
 }
 #endif
@@ -3095,6 +3112,12 @@ static fr_command_table_t command_table_stats[] = {
 	  "stats state - show statistics for states",
 	  command_stats_state, NULL },
 
+#ifdef HAVE_REGEX
+	{ "regex", FR_READ,
+	  "stats regex - show statistics for the cache of regular expressions compiled at runtime",
+	  command_stats_regex, NULL },
+#endif
+
 	{ "socket", FR_READ,
 	  "stats socket <ipaddr> <port> [udp|tcp] "
 	  "- show statistics for given socket",
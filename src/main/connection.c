@@ -33,7 +33,31 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 typedef struct fr_connection fr_connection_t;
+typedef struct fr_connection_thread fr_connection_thread_t;
+
+/** A slot holding an idle connection, which any thread can take without locking the pool
+ */
+typedef _Atomic(fr_connection_t *) fr_connection_slot_t;
+
+/** Whether a connection is reserved, and where it is if it isn't
+ *
+ * Threads with a cache reserve and release connections without the mutex,
+ * so the state is changed with one atomic operation.  Threads holding the
+ * mutex then see either the old state or the new one, never a mixture.
+ */
+typedef enum {
+	FR_CONNECTION_IDLE = 0,			//!< Idle, and in the heap.
+	FR_CONNECTION_CACHED,			//!< Idle, but in a thread cache or an idle slot,
+						//!< instead of in the heap.
+	FR_CONNECTION_RESERVED			//!< Reserved by a thread.
+} fr_connection_state_t;
 
 static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request);
 
@@ -59,17 +83,43 @@ struct fr_connection {
 						//!< lifetime of the connection pool.
 	void		*connection;		//!< Pointer to whatever the module uses for a connection
 						//!< handle.
-	bool		in_use;			//!< Whether the connection is currently reserved.
+	atomic_uint_fast32_t state;		//!< A #fr_connection_state_t.
 
 	int		heap;			//!< For the next connection heap.
 
 	bool		needs_reconnecting;	//!< Reconnect this connection before use.
 
 #ifdef PTHREAD_DEBUG
-	pthread_t	pthread_id;		//!< When 'in_use == true'.
+	pthread_t	pthread_id;		//!< When 'state == FR_CONNECTION_RESERVED'.
 #endif
 };
 
+/** Get the state of a connection
+ *
+ */
+static inline fr_connection_state_t fr_connection_state(fr_connection_t *this)
+{
+	return atomic_load_explicit(&this->state, memory_order_acquire);
+}
+
+/** Change the state of a connection
+ *
+ * Only the thread which owns the connection changes its state, so this
+ * can't fail unless the pool has been corrupted.
+ *
+ * @param[in] this	connection to change.
+ * @param[in] from	state the connection must be in.
+ * @param[in] to	state to change it to.
+ */
+static inline void fr_connection_state_change(fr_connection_t *this, fr_connection_state_t from,
+					      fr_connection_state_t to)
+{
+	uint_fast32_t expected = from;
+
+	(void) fr_cond_assert(atomic_compare_exchange_strong_explicit(&this->state, &expected, to,
+								      memory_order_acq_rel, memory_order_relaxed));
+}
+
 /** A connection pool
  *
  * Defines the configuration of the connection pool, all the counters and
@@ -139,6 +189,70 @@ struct fr_connection_pool_t {
 	fr_connection_pool_reconnect_t	reconnect;	//!< Called during connection pool reconnect.
 
 	fr_connection_pool_state_t	state;	//!< Stats and state of the connection pool.
+
+	atomic_uint_fast32_t	active;		//!< Number of connections in use.  Copied to state.active
+						//!< when the state is read, as threads with a cache
+						//!< change it without holding the mutex.
+	_Atomic(time_t)	last_checked;		//!< Copy of state.last_checked, for threads which
+						//!< decide whether to check the pool without the mutex.
+
+	uint32_t	thread_cache;		//!< Number of idle connections each thread keeps for
+						//!< itself.  0 disables the thread caches, the idle
+						//!< slots, and the spawner thread.
+	pthread_key_t	thread_key;		//!< Finds the cache for the current thread.
+	fr_connection_thread_t *threads;	//!< All thread caches, so they can be freed with the pool.
+	fr_connection_slot_t *slots;		//!< Idle connections shared between threads.  One slot
+						//!< for every connection we may open.
+
+	pthread_t	spawner;		//!< Opens spare connections, so that threads releasing
+						//!< connections don't have to.
+	bool		spawner_running;	//!< Whether the spawner thread was started.
+	bool		spawner_stop;		//!< Tell the spawner thread to exit.
+	uint32_t	spawn_wanted;		//!< How many connections the spawner should open.
+	pthread_cond_t	spawn;			//!< Signalled when spawn_wanted is increased.
+};
+
+/** A connection reserved by a thread
+ *
+ * Entries are matched on the handle, so that 'this' is never dereferenced
+ * unless the thread still holds the handle.  If another thread released
+ * or closed the connection, the entry is stale, and 'this' may have been
+ * freed.  Stale entries are removed when the same handle is next reserved
+ * by this thread, so the entry for a handle the thread holds is always
+ * the one for its current reservation.
+ */
+typedef struct fr_connection_reserved {
+	void			*conn;		//!< Handle which was reserved.
+	fr_connection_t		*this;		//!< Connection holding the handle.
+} fr_connection_reserved_t;
+
+/** Per-thread cache of connections
+ *
+ * Idle connections are taken from, and released to, the cache without
+ * locking the pool.  Other threads only look at the cache with the mutex
+ * held, when they run out of connections, or when the pool is checked.
+ *
+ * Connections reserved by the thread are recorded so that they can be
+ * found again on release without walking the connection list.
+ */
+struct fr_connection_thread {
+	fr_connection_thread_t	*next;		//!< Next thread cache for this pool. (mutex)
+	fr_connection_pool_t	*pool;		//!< Pool the cache belongs to.
+
+	fr_connection_slot_t	*idle;		//!< Idle connections used by this thread first.
+
+	fr_connection_reserved_t *in_use;	//!< Connections this thread has reserved.
+	uint32_t		num_in_use;	//!< Number of reserved connections.
+
+	uint32_t		slot;		//!< Where we start looking for an idle slot.
+
+#ifdef WITH_STATS
+	fr_stats_t		held_stats;	//!< How long connections were held for, since the
+						//!< last time they were added to the pool state.
+#endif
+	struct timeval		last_released;	//!< Last time a connection was released.
+	time_t			last_held_min;	//!< Last time we warned about a low latency event.
+	time_t			last_held_max;	//!< Last time we warned about a high latency event.
 };
 
 static const CONF_PARSER connection_config[] = {
@@ -157,6 +271,7 @@ static const CONF_PARSER connection_config[] = {
 	{ FR_CONF_OFFSET("held_trigger_max", PW_TYPE_TIMEVAL, fr_connection_pool_t, held_trigger_max), .dflt = "0.5" },
 	{ FR_CONF_OFFSET("retry_delay", PW_TYPE_INTEGER, fr_connection_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", PW_TYPE_BOOLEAN, fr_connection_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("thread_cache", PW_TYPE_INTEGER, fr_connection_pool_t, thread_cache), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -304,7 +419,7 @@ static fr_connection_t *fr_connection_find(fr_connection_pool_t *pool, void *con
 			rad_assert(pthread_equal(this->pthread_id, pthread_id) != 0);
 #endif
 
-			rad_assert(this->in_use == true);
+			rad_assert(fr_connection_state(this) == FR_CONNECTION_RESERVED);
 			return this;
 		}
 	}
@@ -475,7 +590,7 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 
 	this->created = now;
 	this->connection = conn;
-	this->in_use = in_use;
+	atomic_init(&this->state, in_use ? FR_CONNECTION_RESERVED : FR_CONNECTION_IDLE);
 
 	this->number = number;
 	gettimeofday(&this->last_reserved, NULL);
@@ -539,25 +654,35 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
  */
 static void fr_connection_close_internal(fr_connection_pool_t *pool, REQUEST *request, fr_connection_t *this)
 {
+	switch (fr_connection_state(this)) {
 	/*
 	 *	If it's in use, release it.
 	 */
-	if (this->in_use) {
+	case FR_CONNECTION_RESERVED:
+	{
 #ifdef PTHREAD_DEBUG
 		pthread_t pthread_id = pthread_self();
 		rad_assert(pthread_equal(this->pthread_id, pthread_id) != 0);
 #endif
 
-		this->in_use = false;
-
-		rad_assert(pool->state.active != 0);
-		pool->state.active--;
+		rad_assert(atomic_load_explicit(&pool->active, memory_order_relaxed) != 0);
+		atomic_fetch_sub_explicit(&pool->active, 1, memory_order_relaxed);
+	}
+		break;
 
-	} else {
-		/*
-		 *	Connection isn't used, remove it from the heap.
-		 */
+	/*
+	 *	Connection isn't used, remove it from the heap.
+	 */
+	case FR_CONNECTION_IDLE:
 		fr_heap_extract(pool->heap, this);
+		break;
+
+	/*
+	 *	Cached connections are only closed once the pool
+	 *	is being freed, and were never in the heap.
+	 */
+	case FR_CONNECTION_CACHED:
+		break;
 	}
 
 	fr_connection_trigger_exec(pool, request, "close");
@@ -569,12 +694,57 @@ static void fr_connection_close_internal(fr_connection_pool_t *pool, REQUEST *re
 	talloc_free(this);
 }
 
+/** Check whether a connection has hit any of its limits
+ *
+ * Verifies that the connection is within idle_timeout, max_uses, and
+ * lifetime values, and doesn't need reconnecting.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] request	The current request.
+ * @param[in] this	Connection to check.
+ * @param[in] now	Current time.
+ * @return
+ *	- true if the connection should be closed.
+ *	- false if the connection can still be used.
+ */
+static bool fr_connection_expired(fr_connection_pool_t *pool, REQUEST *request, fr_connection_t *this, time_t now)
+{
+	if (this->needs_reconnecting) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Closing expired connection (%" PRIu64 "): Needs reconnecting",
+			  this->number);
+		return true;
+	}
+
+	if ((pool->max_uses > 0) &&
+	    (this->num_uses >= pool->max_uses)) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Closing expired connection (%" PRIu64 "): Hit max_uses limit",
+			  this->number);
+		return true;
+	}
+
+	if ((pool->lifetime > 0) &&
+	    ((this->created + pool->lifetime) < now)) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Closing expired connection (%" PRIu64 "): Hit lifetime limit",
+			  this->number);
+		return true;
+	}
+
+	if ((pool->idle_timeout > 0) &&
+	    ((this->last_released.tv_sec + pool->idle_timeout) < now)) {
+		ROPTIONAL(RINFO, INFO, "Closing connection (%" PRIu64 "): Hit idle_timeout, was idle for %u seconds",
+		     	  this->number, (int) (now - this->last_released.tv_sec));
+		return true;
+	}
+
+	return false;
+}
+
 /** Check whether a connection needs to be removed from the pool
  *
  * Will verify that the connection is within idle_timeout, max_uses, and
  * lifetime values. If it is not, the connection will be closed.
  *
- * @note Will only close connections not in use.
+ * @note Will only close connections not in use, and not cached.
  * @note Must be called with the mutex held.
  *
  * @param[in] pool	to modify.
@@ -594,45 +764,375 @@ static int fr_connection_manage(fr_connection_pool_t *pool,
 	rad_assert(this != NULL);
 
 	/*
-	 *	Don't terminated in-use connections
+	 *	Don't terminated in-use connections, or ones
+	 *	which a thread may take without the mutex.
 	 */
-	if (this->in_use) return 1;
+	if (fr_connection_state(this) != FR_CONNECTION_IDLE) return 1;
 
-	if (this->needs_reconnecting) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "Closing expired connection (%" PRIu64 "): Needs reconnecting",
-			  this->number);
-	do_delete:
-		if (pool->state.num <= pool->min) {
-			ROPTIONAL(RDEBUG2, DEBUG2, "You probably need to lower \"min\"");
-		}
-		fr_connection_close_internal(pool, request, this);
-		return 0;
+	if (!fr_connection_expired(pool, request, this, now)) return 1;
+
+	if (pool->state.num <= pool->min) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "You probably need to lower \"min\"");
 	}
+	fr_connection_close_internal(pool, request, this);
 
-	if ((pool->max_uses > 0) &&
-	    (this->num_uses >= pool->max_uses)) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "Closing expired connection (%" PRIu64 "): Hit max_uses limit",
-			  this->number);
-		goto do_delete;
+	return 0;
+}
+
+/** Put the connections in an array of slots back into the heap
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool	to modify.
+ * @param[in] slots	to empty.
+ * @param[in] num	number of slots.
+ * @return the number of connections put back into the heap.
+ */
+static uint32_t fr_connection_slots_drain(fr_connection_pool_t *pool, fr_connection_slot_t *slots, uint32_t num)
+{
+	uint32_t	i, drained = 0;
+	fr_connection_t	*this;
+
+	for (i = 0; i < num; i++) {
+		if (!atomic_load_explicit(&slots[i], memory_order_relaxed)) continue;
+
+		this = atomic_exchange_explicit(&slots[i], NULL, memory_order_acquire);
+		if (!this) continue;
+
+		fr_connection_state_change(this, FR_CONNECTION_CACHED, FR_CONNECTION_IDLE);
+		fr_heap_insert(pool->heap, this);
+		drained++;
 	}
 
-	if ((pool->lifetime > 0) &&
-	    ((this->created + pool->lifetime) < now)) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "Closing expired connection (%" PRIu64 "): Hit lifetime limit",
-			  this->number);
-		goto do_delete;
+	return drained;
+}
+
+/** Put all cached connections back into the heap
+ *
+ * Takes connections from the idle slots, and from the caches of all
+ * threads, so that they can be managed, or used by threads which have
+ * no idle connections of their own.
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool	to modify.
+ * @return the number of connections put back into the heap.
+ */
+static uint32_t fr_connection_cache_drain(fr_connection_pool_t *pool)
+{
+	uint32_t		drained;
+	fr_connection_thread_t	*thread;
+
+	drained = fr_connection_slots_drain(pool, pool->slots, pool->max);
+
+	for (thread = pool->threads; thread != NULL; thread = thread->next) {
+		drained += fr_connection_slots_drain(pool, thread->idle, pool->thread_cache);
 	}
 
-	if ((pool->idle_timeout > 0) &&
-	    ((this->last_released.tv_sec + pool->idle_timeout) < now)) {
-		ROPTIONAL(RINFO, INFO, "Closing connection (%" PRIu64 "): Hit idle_timeout, was idle for %u seconds",
-		     	  this->number, (int) (now - this->last_released.tv_sec));
-		goto do_delete;
+	return drained;
+}
+
+/** Merge the statistics a thread gathered into the pool state
+ *
+ * Threads with a cache record how long they held connections without
+ * holding the mutex.  The results are added to the pool state whenever
+ * the thread next holds the mutex.
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool	to update.
+ * @param[in] thread	cache holding the statistics.
+ */
+static void fr_connection_thread_sync(fr_connection_pool_t *pool, fr_connection_thread_t *thread)
+{
+#ifdef WITH_STATS
+	int i;
+
+	for (i = 0; i < (int) (sizeof(thread->held_stats.elapsed) / sizeof(thread->held_stats.elapsed[0])); i++) {
+		pool->state.held_stats.elapsed[i] += thread->held_stats.elapsed[i];
+		thread->held_stats.elapsed[i] = 0;
 	}
+#endif
 
-	return 1;
+	if (fr_timeval_cmp(&thread->last_released, &pool->state.last_released) > 0) {
+		pool->state.last_released = thread->last_released;
+	}
+	if (thread->last_held_min > pool->state.last_held_min) pool->state.last_held_min = thread->last_held_min;
+	if (thread->last_held_max > pool->state.last_held_max) pool->state.last_held_max = thread->last_held_max;
+}
+
+/** Free a thread cache when its thread exits
+ *
+ * Idle connections in the cache are put back into the heap, so that
+ * other threads can use them.
+ *
+ * @param[in] arg	the thread cache to free.
+ */
+static void _fr_connection_thread_free(void *arg)
+{
+	fr_connection_thread_t	*thread = arg, **last;
+	fr_connection_pool_t	*pool = thread->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (last = &pool->threads; *last != NULL; last = &(*last)->next) {
+		if (*last != thread) continue;
+
+		*last = thread->next;
+		break;
+	}
+
+	(void) fr_connection_slots_drain(pool, thread->idle, pool->thread_cache);
+
+	fr_connection_thread_sync(pool, thread);
+	talloc_free(thread);
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Find or create the cache for the current thread
+ *
+ * @note Must be called with the mutex free.
+ *
+ * @param[in] pool	to find the thread cache for.
+ * @return
+ *	- The cache for the current thread.
+ *	- NULL if thread caches are disabled, or on error.
+ */
+static fr_connection_thread_t *fr_connection_thread(fr_connection_pool_t *pool)
+{
+	fr_connection_thread_t *thread;
+
+	if (!pool->thread_cache) return NULL;
+
+	thread = pthread_getspecific(pool->thread_key);
+	if (thread) return thread;
+
+	/*
+	 *	The cache is parented by the pool, so we need
+	 *	the mutex to allocate it.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+
+	thread = talloc_zero(pool, fr_connection_thread_t);
+	if (!thread) {
+	oom:
+		pthread_mutex_unlock(&pool->mutex);
+		ERROR("Failed allocating thread cache");
+		return NULL;
+	}
+	thread->pool = pool;
+	thread->idle = talloc_zero_array(thread, fr_connection_slot_t, pool->thread_cache);
+	thread->in_use = talloc_array(thread, fr_connection_reserved_t, pool->max);
+	if (!thread->idle || !thread->in_use) {
+		talloc_free(thread);
+		goto oom;
+	}
+
+	/*
+	 *	Start different threads at different slots, so
+	 *	they don't all fight over the first few.
+	 */
+	thread->slot = fr_rand() % pool->max;
+
+	thread->next = pool->threads;
+	pool->threads = thread;
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	(void) pthread_setspecific(pool->thread_key, thread);
+
+	return thread;
 }
 
+/** Take an idle connection from the thread cache, or from the idle slots
+ *
+ * @param[in] pool	to take the connection from.
+ * @param[in] thread	cache for the current thread.
+ * @return
+ *	- An idle connection.
+ *	- NULL if there are no idle connections which can be taken without the mutex.
+ */
+static fr_connection_t *fr_connection_thread_pop(fr_connection_pool_t *pool, fr_connection_thread_t *thread)
+{
+	uint32_t	i, slot;
+	fr_connection_t	*this;
+
+	/*
+	 *	Most recently released first.  Other threads only
+	 *	take from our cache when they've run out, so this
+	 *	is almost always uncontended.
+	 */
+	for (i = pool->thread_cache; i > 0; i--) {
+		if (!atomic_load_explicit(&thread->idle[i - 1], memory_order_relaxed)) continue;
+
+		this = atomic_exchange_explicit(&thread->idle[i - 1], NULL, memory_order_acquire);
+		if (this) return this;
+	}
+
+	for (i = 0; i < pool->max; i++) {
+		slot = (thread->slot + i) % pool->max;
+
+		/*
+		 *	Look before we swap, so that empty slots
+		 *	don't cause cache line bouncing.
+		 */
+		if (!atomic_load_explicit(&pool->slots[slot], memory_order_relaxed)) continue;
+
+		this = atomic_exchange_explicit(&pool->slots[slot], NULL, memory_order_acquire);
+		if (!this) continue;
+
+		thread->slot = slot;
+		return this;
+	}
+
+	return NULL;
+}
+
+/** Put an idle connection into the thread cache, or into the idle slots
+ *
+ * @param[in] pool	to put the connection in.
+ * @param[in] thread	cache for the current thread.
+ * @param[in] this	idle connection.
+ * @return
+ *	- true if the connection was cached.
+ *	- false if there was no space, and the connection should go into the heap.
+ */
+static bool fr_connection_thread_push(fr_connection_pool_t *pool, fr_connection_thread_t *thread, fr_connection_t *this)
+{
+	uint32_t	i, slot;
+	fr_connection_t	*empty;
+
+	/*
+	 *	Straight from reserved to cached, so that threads
+	 *	holding the mutex never see it as being in the heap.
+	 */
+	fr_connection_state_change(this, FR_CONNECTION_RESERVED, FR_CONNECTION_CACHED);
+
+	for (i = 0; i < pool->thread_cache; i++) {
+		if (atomic_load_explicit(&thread->idle[i], memory_order_relaxed)) continue;
+
+		empty = NULL;
+		if (atomic_compare_exchange_strong_explicit(&thread->idle[i], &empty, this,
+							    memory_order_release, memory_order_relaxed)) return true;
+	}
+
+	for (i = 0; i < pool->max; i++) {
+		slot = (thread->slot + i) % pool->max;
+
+		if (atomic_load_explicit(&pool->slots[slot], memory_order_relaxed)) continue;
+
+		empty = NULL;
+		if (!atomic_compare_exchange_strong_explicit(&pool->slots[slot], &empty, this,
+							     memory_order_release, memory_order_relaxed)) continue;
+
+		thread->slot = slot;
+		return true;
+	}
+
+	/*
+	 *	Nobody else can see the connection, so it's
+	 *	reserved until the caller puts it into the heap.
+	 */
+	fr_connection_state_change(this, FR_CONNECTION_CACHED, FR_CONNECTION_RESERVED);
+	return false;
+}
+
+/** Record a connection as being reserved by the current thread
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] thread	cache for the current thread.
+ * @param[in] this	reserved connection.
+ */
+static inline void fr_connection_thread_reserve(fr_connection_pool_t *pool, fr_connection_thread_t *thread,
+						fr_connection_t *this)
+{
+	uint32_t i;
+
+	/*
+	 *	An entry for the same handle was left behind by
+	 *	another thread releasing or closing a connection we
+	 *	reserved.  It's stale, and its connection may have
+	 *	been freed, so only the handle is compared.
+	 */
+	for (i = thread->num_in_use; i > 0; i--) {
+		if (thread->in_use[i - 1].conn != this->connection) continue;
+
+		thread->in_use[i - 1] = thread->in_use[--thread->num_in_use];
+	}
+
+	/*
+	 *	Can only happen if connections are released by a
+	 *	thread other than the one which reserved them.  The
+	 *	connection will be found by walking the list instead.
+	 */
+	if (thread->num_in_use >= pool->max) return;
+
+	thread->in_use[thread->num_in_use].conn = this->connection;
+	thread->in_use[thread->num_in_use].this = this;
+	thread->num_in_use++;
+}
+
+/** Find, and forget, a connection reserved by the current thread
+ *
+ * @note The current thread must hold conn.
+ *
+ * @param[in] thread	cache for the current thread.
+ * @param[in] conn	handle to search for.
+ * @return
+ *	- Connection containing the specified handle.
+ *	- NULL if the current thread didn't reserve the connection.
+ */
+static fr_connection_t *fr_connection_thread_forget(fr_connection_thread_t *thread, void *conn)
+{
+	uint32_t	i;
+	fr_connection_t	*this;
+
+	/*
+	 *	Most recently reserved first, it's the one
+	 *	most likely to be released.
+	 */
+	for (i = thread->num_in_use; i > 0; i--) {
+		if (thread->in_use[i - 1].conn != conn) continue;
+
+		this = thread->in_use[i - 1].this;
+		thread->in_use[i - 1] = thread->in_use[--thread->num_in_use];
+		return this;
+	}
+
+	return NULL;
+}
+
+/** Open connections in the background
+ *
+ * Threads which release connections ask for spares to be opened, and
+ * threads which have no idle connections ask for new ones, instead of
+ * opening them themselves.  That way a slow or unresponsive server only
+ * delays this thread.
+ *
+ * @param[in] arg	the pool to open connections for.
+ * @return NULL.
+ */
+static void *fr_connection_spawner(void *arg)
+{
+	fr_connection_pool_t *pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->spawner_stop) {
+		if (!pool->spawn_wanted) {
+			pthread_cond_wait(&pool->spawn, &pool->mutex);
+			continue;
+		}
+		pool->spawn_wanted--;
+
+		pthread_mutex_unlock(&pool->mutex);
+		(void) fr_connection_spawn(pool, NULL, time(NULL), false, true);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
 
 /** Check whether any connections need to be removed from the pool
  *
@@ -659,12 +1159,20 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 		return 1;
 	}
 
+	/*
+	 *	Cached connections aren't in the heap, and can't be
+	 *	managed or closed while they're cached.  Put them
+	 *	back in the heap, threads will cache them again as
+	 *	they're used.
+	 */
+	if (pool->slots) (void) fr_connection_cache_drain(pool);
+
 	/*
 	 *	Some idle connections are OK, if they're within the
 	 *	configured "spare" range.  Any extra connections
 	 *	outside of that range can be closed.
 	 */
-	idle = pool->state.num - pool->state.active;
+	idle = pool->state.num - atomic_load_explicit(&pool->active, memory_order_relaxed);
 	if (idle <= pool->spare) {
 		extra = 0;
 	} else {
@@ -749,9 +1257,19 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 	 *	a connection. Avoids spurious log messages.
 	 */
 	if (spawn) {
-		pthread_mutex_unlock(&pool->mutex);
-		(void) fr_connection_spawn(pool, request, now, false, true);
-		pthread_mutex_lock(&pool->mutex);
+		/*
+		 *	Don't block the thread releasing a connection.
+		 *	The spawner thread opens the spares.
+		 */
+		if (pool->spawner_running) {
+			if (spawn > pool->spawn_wanted) pool->spawn_wanted = spawn;
+			pthread_cond_signal(&pool->spawn);
+
+		} else {
+			pthread_mutex_unlock(&pool->mutex);
+			(void) fr_connection_spawn(pool, request, now, false, true);
+			pthread_mutex_lock(&pool->mutex);
+		}
 	}
 
 	/*
@@ -763,25 +1281,33 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 		fr_connection_t *found = NULL;
 
 		for (this = pool->tail; this != NULL; this = this->prev) {
-			if (this->in_use) continue;
+			if (fr_connection_state(this) != FR_CONNECTION_IDLE) continue;
 
 			if (!found || (fr_timeval_cmp(&this->last_reserved, &found->last_reserved) < 0)) {
 				found = this;
 			}
 		}
 
-		if (!rad_cond_assert(found)) goto done;
-
-		ROPTIONAL(RDEBUG, DEBUG, "Closing connection (%" PRIu64 "), from %d unused connections",
-			  found->number, extra);
-		fr_connection_close_internal(pool, request, found);
-
 		/*
-		 *	Decrease the delay for the next time we clean up.
+		 *	With thread caches, threads may have cached
+		 *	all of the idle connections again since we
+		 *	drained the caches.
 		 */
-		pool->state.next_delay >>= 1;
-		if (pool->state.next_delay == 0) pool->state.next_delay = 1;
-		pool->delay_interval += pool->state.next_delay;
+		if (!found) {
+			if (!rad_cond_assert(pool->thread_cache > 0)) goto done;
+
+		} else {
+			ROPTIONAL(RDEBUG, DEBUG, "Closing connection (%" PRIu64 "), from %d unused connections",
+				  found->number, extra);
+			fr_connection_close_internal(pool, request, found);
+
+			/*
+			 *	Decrease the delay for the next time we clean up.
+			 */
+			pool->state.next_delay >>= 1;
+			if (pool->state.next_delay == 0) pool->state.next_delay = 1;
+			pool->delay_interval += pool->state.next_delay;
+		}
 	}
 
 	/*
@@ -794,27 +1320,68 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 	}
 
 	pool->state.last_checked = now;
+	atomic_store_explicit(&pool->last_checked, now, memory_order_relaxed);
 done:
 	pthread_mutex_unlock(&pool->mutex);
 
 	return 1;
 }
 
+/** Ask the spawner thread for a connection, and wait for it
+ *
+ * Waits for at most connect_timeout.  The new connection goes into the
+ * heap, where another thread may take it first.
+ *
+ * @note Must be called with the mutex held.  The mutex is still held on return.
+ *
+ * @param[in] pool	to open the connection in.
+ * @param[in] request	The current request.
+ */
+static void fr_connection_spawn_wait(fr_connection_pool_t *pool, REQUEST *request)
+{
+	struct timeval	now, when;
+	struct timespec	ts;
+	int		ret;
+
+	pool->spawn_wanted++;
+	pthread_cond_signal(&pool->spawn);
+
+	gettimeofday(&now, NULL);
+	fr_timeval_add(&when, &now, &pool->connect_timeout);
+	ts.tv_sec = when.tv_sec;
+	ts.tv_nsec = when.tv_usec * 1000;
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Waiting for a new connection to be opened");
+
+	/*
+	 *	done_spawn is signalled whether or not the spawn
+	 *	succeeded.  Either way the caller looks again.
+	 */
+	ret = pthread_cond_timedwait(&pool->done_spawn, &pool->mutex, &ts);
+	if (ret == ETIMEDOUT) ROPTIONAL(RWARN, WARN, "Timed out waiting for a new connection");
+}
+
 /** Get a connection from the connection pool
+ *
+ * If the pool has a spawner thread, new connections are opened by that thread.
+ * Otherwise they're opened by the caller.
  *
  * @note Must be called with the mutex free.
  *
  * @param[in] pool	to reserve the connection from.
  * @param[in] request	The current request.
+ * @param[in] thread	cache for the current thread, to record the connection in.  May be NULL.
  * @param[in] spawn	whether to spawn a new connection
  * @return
  *	- A pointer to the connection handle.
  *	- NULL on error.
  */
-static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *request, bool spawn)
+static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *request,
+					fr_connection_thread_t *thread, bool spawn)
 {
 	time_t now;
 	fr_connection_t *this;
+	bool waited = false;
 
 	if (!pool) return NULL;
 
@@ -827,6 +1394,7 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 	 *	for limits.  If "connection manage" says the link is
 	 *	no longer usable, go grab another one.
 	 */
+retry:
 	do {
 		this = fr_heap_peek(pool->heap);
 		if (!this) break;
@@ -838,9 +1406,16 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 	 */
 	if (this) {
 		fr_heap_extract(pool->heap, this);
+		fr_connection_state_change(this, FR_CONNECTION_IDLE, FR_CONNECTION_RESERVED);
 		goto do_return;
 	}
 
+	/*
+	 *	Other threads may be caching idle connections.  Take
+	 *	them back before opening a new one.
+	 */
+	if (pool->slots && (fr_connection_cache_drain(pool) > 0)) goto retry;
+
 	if (pool->state.num == pool->max) {
 		bool complain = false;
 
@@ -865,12 +1440,23 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 		return NULL;
 	}
 
+	/*
+	 *	Leave opening the connection to the spawner, so
+	 *	that we never call the create callback, and wait
+	 *	at most connect_timeout.
+	 */
+	if (spawn && pool->spawner_running && !waited) {
+		fr_connection_spawn_wait(pool, request);
+		waited = true;
+		goto retry;
+	}
+
 	pthread_mutex_unlock(&pool->mutex);
 
-	if (!spawn) return NULL;
+	if (!spawn || pool->spawner_running) return NULL;
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "%i of %u connections in use.  You  may need to increase \"spare\"",
-	       pool->state.active, pool->state.num);
+	       (int) atomic_load_explicit(&pool->active, memory_order_relaxed), pool->state.num);
 
 	/*
 	 *	Returns unlocked on failure, or locked on success
@@ -879,14 +1465,17 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 	if (!this) return NULL;
 
 do_return:
-	pool->state.active++;
+	atomic_fetch_add_explicit(&pool->active, 1, memory_order_relaxed);
 	this->num_uses++;
 	gettimeofday(&this->last_reserved, NULL);
-	this->in_use = true;
 
 #ifdef PTHREAD_DEBUG
 	this->pthread_id = pthread_self();
 #endif
+	if (thread) {
+		fr_connection_thread_reserve(pool, thread, this);
+		fr_connection_thread_sync(pool, thread);
+	}
 	pthread_mutex_unlock(&pool->mutex);
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ")", this->number);
@@ -1070,6 +1659,7 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	FR_INTEGER_BOUND_CHECK("max", pool->max, <=, 1024);
 	FR_INTEGER_BOUND_CHECK("start", pool->start, <=, pool->max);
 	FR_INTEGER_BOUND_CHECK("spare", pool->spare, <=, (pool->max - pool->min));
+	FR_INTEGER_BOUND_CHECK("thread_cache", pool->thread_cache, <=, pool->max);
 
 	if (pool->lifetime > 0) {
 		FR_INTEGER_COND_CHECK("idle_timeout", pool->idle_timeout, (pool->idle_timeout <= pool->lifetime), 0);
@@ -1093,9 +1683,43 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	 */
 	if (check_config) {
 		pool->start = pool->min = pool->max = 1;
+		pool->thread_cache = 0;
 		return pool;
 	}
 
+	/*
+	 *	Threads keep their own idle connections, and share
+	 *	the rest through the idle slots.  Neither needs the
+	 *	mutex.  New connections are opened by a separate
+	 *	thread, so that releasing a connection never waits
+	 *	for one to open, and getting one waits for at most
+	 *	connect_timeout.
+	 */
+	if (pool->thread_cache > 0) {
+		int ret;
+
+		pool->slots = talloc_zero_array(pool, fr_connection_slot_t, pool->max);
+		if (!pool->slots) {
+			ERROR("%s: Out of memory", __FUNCTION__);
+			goto error;
+		}
+
+		ret = pthread_key_create(&pool->thread_key, _fr_connection_thread_free);
+		if (ret != 0) {
+			ERROR("%s: Failed creating thread cache key: %s", __FUNCTION__, fr_syserror(ret));
+			TALLOC_FREE(pool->slots);
+			goto error;
+		}
+
+		pthread_cond_init(&pool->spawn, NULL);
+		ret = pthread_create(&pool->spawner, NULL, fr_connection_spawner, pool);
+		if (ret != 0) {
+			ERROR("%s: Failed creating spawner thread: %s", __FUNCTION__, fr_syserror(ret));
+			goto error;
+		}
+		pool->spawner_running = true;
+	}
+
 	/*
 	 *	Create all of the connections, unless the admin says
 	 *	not to.
@@ -1143,6 +1767,8 @@ fr_connection_pool_t *fr_connection_pool_copy(TALLOC_CTX *ctx, fr_connection_poo
  */
 fr_connection_pool_state_t const *fr_connection_pool_state(fr_connection_pool_t *pool)
 {
+	pool->state.active = atomic_load_explicit(&pool->active, memory_order_relaxed);
+
 	return &pool->state;
 }
 
@@ -1304,6 +1930,25 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 
 	DEBUG2("Removing connection pool");
 
+	/*
+	 *	Stop the spawner first, it needs the mutex to exit.
+	 */
+	if (pool->spawner_running) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->spawner_stop = true;
+		pthread_cond_signal(&pool->spawn);
+		pthread_mutex_unlock(&pool->mutex);
+
+		pthread_join(pool->spawner, NULL);
+		pool->spawner_running = false;
+	}
+
+	/*
+	 *	Thread caches are freed with the pool.  Stop them
+	 *	being freed again when their threads exit.
+	 */
+	if (pool->slots) (void) pthread_key_delete(pool->thread_key);
+
 	pthread_mutex_lock(&pool->mutex);
 
 	/*
@@ -1327,6 +1972,7 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 	pthread_mutex_destroy(&pool->mutex);
 	pthread_cond_destroy(&pool->done_spawn);
 	pthread_cond_destroy(&pool->done_reconnecting);
+	if (pool->slots) pthread_cond_destroy(&pool->spawn);
 
 	talloc_free(pool);
 }
@@ -1353,7 +1999,145 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
  */
 void *fr_connection_get(fr_connection_pool_t *pool, REQUEST *request)
 {
-	return fr_connection_get_internal(pool, request, true);
+	fr_connection_thread_t	*thread;
+	fr_connection_t		*this;
+	time_t			now;
+
+	if (!pool) return NULL;
+
+	thread = fr_connection_thread(pool);
+	if (!thread) return fr_connection_get_internal(pool, request, NULL, true);
+
+	now = time(NULL);
+
+	/*
+	 *	Try the idle connections which we can take without
+	 *	the mutex, before falling back to the heap.
+	 */
+	while ((this = fr_connection_thread_pop(pool, thread)) != NULL) {
+		/*
+		 *	Straight from cached to reserved, so that
+		 *	threads holding the mutex never see it as
+		 *	being in the heap.
+		 */
+		fr_connection_state_change(this, FR_CONNECTION_CACHED, FR_CONNECTION_RESERVED);
+		atomic_fetch_add_explicit(&pool->active, 1, memory_order_relaxed);
+
+#ifdef PTHREAD_DEBUG
+		this->pthread_id = pthread_self();
+#endif
+
+		/*
+		 *	Cached connections aren't looked at by
+		 *	fr_connection_pool_check(), so enforce the
+		 *	limits here.
+		 */
+		if (fr_connection_expired(pool, request, this, now)) {
+			pthread_mutex_lock(&pool->mutex);
+			fr_connection_close_internal(pool, request, this);
+			pthread_mutex_unlock(&pool->mutex);
+			continue;
+		}
+
+		this->num_uses++;
+		gettimeofday(&this->last_reserved, NULL);
+		fr_connection_thread_reserve(pool, thread, this);
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ")", this->number);
+
+		return this->connection;
+	}
+
+	return fr_connection_get_internal(pool, request, thread, true);
+}
+
+/** Release a connection which was recorded in the thread cache
+ *
+ * The connection goes back into the thread cache, or into the idle slots,
+ * without locking the pool.  Statistics are kept in the thread cache until
+ * the thread next holds the mutex.
+ *
+ * @note Must be called with the mutex free.
+ *
+ * @param[in] pool	to release the connection in.
+ * @param[in] request	The current request.
+ * @param[in] thread	cache for the current thread.
+ * @param[in] this	Connection to release.
+ */
+static void fr_connection_release_cached(fr_connection_pool_t *pool, REQUEST *request,
+					 fr_connection_thread_t *thread, fr_connection_t *this)
+{
+	struct timeval	held;
+	time_t		now;
+	bool		trigger_min = false, trigger_max = false;
+
+	gettimeofday(&this->last_released, NULL);
+	thread->last_released = this->last_released;
+	now = this->last_released.tv_sec;
+
+	fr_timeval_subtract(&held, &this->last_released, &this->last_reserved);
+
+	/*
+	 *	Check we've not exceeded out trigger limits
+	 */
+	if ((pool->held_trigger_min.tv_sec || pool->held_trigger_min.tv_usec) &&
+	    (fr_timeval_cmp(&held, &pool->held_trigger_min) < 0) &&
+	    (thread->last_held_min != now)) {
+		trigger_min = true;
+		thread->last_held_min = now;
+	}
+
+	if ((pool->held_trigger_max.tv_sec || pool->held_trigger_max.tv_usec) &&
+	    (fr_timeval_cmp(&held, &pool->held_trigger_max) > 0) &&
+	    (thread->last_held_max != now)) {
+		trigger_max = true;
+		thread->last_held_max = now;
+	}
+
+	fr_stats_bins(&thread->held_stats, &this->last_reserved, &this->last_released);
+
+	/*
+	 *	Don't cache connections which have hit their limits.
+	 */
+	if (fr_connection_expired(pool, request, this, now)) {
+		pthread_mutex_lock(&pool->mutex);
+		fr_connection_thread_sync(pool, thread);
+		fr_connection_close_internal(pool, request, this);
+		fr_connection_pool_check(pool, request);
+		goto done;
+	}
+
+	atomic_fetch_sub_explicit(&pool->active, 1, memory_order_relaxed);
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Released connection (%" PRIu64 ")", this->number);
+
+	/*
+	 *	Once the connection is in an idle slot, another
+	 *	thread may take it.  So we don't touch it after this.
+	 */
+	if (!fr_connection_thread_push(pool, thread, this)) {
+		pthread_mutex_lock(&pool->mutex);
+		fr_connection_state_change(this, FR_CONNECTION_RESERVED, FR_CONNECTION_IDLE);
+		fr_heap_insert(pool->heap, this);
+		fr_connection_thread_sync(pool, thread);
+		fr_connection_pool_check(pool, request);
+		goto done;
+	}
+
+	/*
+	 *	The pool is checked at most once a second, so only
+	 *	try for the mutex if a check is due.  If another
+	 *	thread holds it, let that thread do the check.
+	 */
+	if ((atomic_load_explicit(&pool->last_checked, memory_order_relaxed) != now) &&
+	    (pthread_mutex_trylock(&pool->mutex) == 0)) {
+		fr_connection_thread_sync(pool, thread);
+		fr_connection_pool_check(pool, request);
+	}
+
+done:
+	if (trigger_min) fr_connection_trigger_exec(pool, request, "min");
+	if (trigger_max) fr_connection_trigger_exec(pool, request, "max");
 }
 
 /** Release a connection
@@ -1368,14 +2152,26 @@ void *fr_connection_get(fr_connection_pool_t *pool, REQUEST *request)
  */
 void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *conn)
 {
+	fr_connection_thread_t *thread;
 	fr_connection_t *this;
 	struct timeval	held;
 	bool trigger_min = false, trigger_max = false;
 
+	if (!pool || !conn) return;
+
+	thread = fr_connection_thread(pool);
+	if (thread) {
+		this = fr_connection_thread_forget(thread, conn);
+		if (this) {
+			fr_connection_release_cached(pool, request, thread, this);
+			return;
+		}
+	}
+
 	this = fr_connection_find(pool, conn);
 	if (!this) return;
 
-	this->in_use = false;
+	fr_connection_state_change(this, FR_CONNECTION_RESERVED, FR_CONNECTION_IDLE);
 
 	/*
 	 *	Record when the connection was last released
@@ -1418,8 +2214,8 @@ void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *c
 	 */
 	fr_heap_insert(pool->heap, this);
 
-	rad_assert(pool->state.active != 0);
-	pool->state.active--;
+	rad_assert(atomic_load_explicit(&pool->active, memory_order_relaxed) != 0);
+	atomic_fetch_sub_explicit(&pool->active, 1, memory_order_relaxed);
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Released connection (%" PRIu64 ")", this->number);
 
@@ -1461,16 +2257,25 @@ void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *c
  */
 void *fr_connection_reconnect(fr_connection_pool_t *pool, REQUEST *request, void *conn)
 {
-	fr_connection_t	*this;
+	fr_connection_thread_t	*thread;
+	fr_connection_t		*this;
 
 	if (!pool || !conn) return NULL;
 
+	/*
+	 *	Must be done before fr_connection_find, as creating
+	 *	the thread cache needs the mutex.
+	 */
+	thread = fr_connection_thread(pool);
+
 	/*
 	 *	If fr_connection_find is successful the pool is now locked
 	 */
 	this = fr_connection_find(pool, conn);
 	if (!this) return NULL;
 
+	if (thread) (void) fr_connection_thread_forget(thread, conn);
+
 	ROPTIONAL(RINFO, INFO, "Deleting inviable connection (%" PRIu64 ")", this->number);
 
 	fr_connection_close_internal(pool, request, this);
@@ -1479,7 +2284,7 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, REQUEST *request, void
 	/*
 	 *	Return an existing connection or spawn a new one.
 	 */
-	return fr_connection_get_internal(pool, request, true);
+	return fr_connection_get_internal(pool, request, thread, true);
 }
 
 /** Delete a connection from the connection pool.
@@ -1498,11 +2303,16 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, REQUEST *request, void
  */
 int fr_connection_close(fr_connection_pool_t *pool, REQUEST *request, void *conn)
 {
+	fr_connection_thread_t *thread = NULL;
 	fr_connection_t *this;
 
+	if (pool) thread = fr_connection_thread(pool);
+
 	this = fr_connection_find(pool, conn);
 	if (!this) return 0;
 
+	if (thread) (void) fr_connection_thread_forget(thread, conn);
+
 	/*
 	 *	Record the last time a connection was closed
 	 */
@@ -2440,7 +2440,7 @@ static int client_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 {
 	if (!request->reply->code) return 0;
 
-	if (fr_radius_encode(request->reply, request->packet, request->client->secret) < 0) {
+	if (fr_radius_encode_prepared(request->reply, request->packet, request->client->prepared) < 0) {
 		RERROR("Failed encoding packet: %s", fr_strerror());
 
 		return -1;
@@ -2451,7 +2451,7 @@ static int client_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 			request->reply->data_len, MAX_PACKET_LEN);
 	}
 
-	if (fr_radius_sign(request->reply, request->packet, request->client->secret) < 0) {
+	if (fr_radius_sign_prepared(request->reply, request->packet, request->client->prepared) < 0) {
 		RERROR("Failed signing packet: %s", fr_strerror());
 
 		return -1;
@@ -2467,8 +2467,8 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	listen_socket_t *sock;
 #endif
 
-	if (fr_radius_verify(request->packet, NULL,
-			     request->client->secret) < 0) {
+	if (fr_radius_verify_prepared(request->packet, NULL,
+				      request->client->prepared) < 0) {
 		return -1;
 	}
 
@@ -2492,14 +2492,14 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	}
 #endif
 
-	return fr_radius_decode(request->packet, NULL,
-				request->client->secret);
+	return fr_radius_decode_prepared(request->packet, NULL,
+					 request->client->prepared);
 }
 
 #ifdef WITH_PROXY
 static int proxy_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 {
-	if (fr_radius_encode(request->proxy->packet, NULL, request->proxy->home_server->secret) < 0) {
+	if (fr_radius_encode_prepared(request->proxy->packet, NULL, request->proxy->home_server->prepared) < 0) {
 		RERROR("Failed encoding proxied packet: %s", fr_strerror());
 
 		return -1;
@@ -2510,7 +2510,7 @@ static int proxy_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 			request->proxy->packet->data_len, MAX_PACKET_LEN);
 	}
 
-	if (fr_radius_sign(request->proxy->packet, NULL, request->proxy->home_server->secret) < 0) {
+	if (fr_radius_sign_prepared(request->proxy->packet, NULL, request->proxy->home_server->prepared) < 0) {
 		RERROR("Failed signing proxied packet: %s", fr_strerror());
 
 		return -1;
@@ -2526,8 +2526,8 @@ static int proxy_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	 *	fr_radius_verify is run in event.c, received_proxy_response()
 	 */
 
-	return fr_radius_decode(request->proxy->reply, request->proxy->packet,
-				request->proxy->home_server->secret);
+	return fr_radius_decode_prepared(request->proxy->reply, request->proxy->packet,
+					 request->proxy->home_server->prepared);
 }
 #endif
 
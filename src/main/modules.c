@@ -33,10 +33,15 @@ RCSID("$Id$")
 #include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/parser.h>
 
-fr_thread_local_setup(rbtree_t *, module_thread_inst_tree)
+/*
+ *	Thread specific instance data, indexed by module_instance_t->number.
+ */
+fr_thread_local_setup(module_thread_instance_t *, module_thread_inst_array)
 
 static TALLOC_CTX *instance_ctx = NULL;
 
+static uint32_t instance_num = 0;	//!< Number of module instances we've bootstrapped.
+
 /*
  *	Ordered by component
  */
@@ -412,6 +417,7 @@ int modules_free(void)
 	 *	Free instances first, then dynamic libraries.
 	 */
 	TALLOC_FREE(instance_ctx);
+	instance_num = 0;
 
 	return 0;
 }
@@ -479,6 +485,10 @@ module_instance_t *module_find_with_method(rlm_components_t *method, CONF_SECTIO
 }
 
 /** Retrieve module/thread specific instance data for a module
+ *
+ * This is called for every module call, so it's a simple array
+ * lookup.  The array is indexed by the number of the module instance,
+ * and is filled in by modules_thread_instantiate().
  *
  * @param[in] instance	to find thread specific data for.
  * @return
@@ -488,70 +498,47 @@ module_instance_t *module_find_with_method(rlm_components_t *method, CONF_SECTIO
 void *module_thread_instance_find(void *instance)
 {
 	module_instance_t		*inst = instance;
-	rbtree_t			*tree = module_thread_inst_tree;
-	module_thread_instance_t	find, *found;
+	module_thread_instance_t	*array = module_thread_inst_array;
 
-	if (!inst->module->thread_instantiate || !inst->module->thread_inst_size) return NULL;
+	if (!array) return NULL;
 
-	memset(&find, 0, sizeof(find));
-	find.inst = inst;
+	rad_assert(inst->number < talloc_array_length(array));
 
-	found = rbtree_finddata(tree, &find);
-	if (!found) return NULL;
-
-	return found->data;
+	return array[inst->number].data;
 }
 
-/** Destructor for module_thread_instance_t
+/** Frees the thread local instance array and any thread local instance data
  *
- * @note This cannot be converted to a talloc destructor,
- *	as we need to call thread_detach *before* any of the children
- *	of the talloc ctx are freed.
- */
-static void _module_thread_instance_free(void *to_free)
-{
-	module_thread_instance_t *thread_inst = talloc_get_type_abort(to_free, module_thread_instance_t);
-
-	if (thread_inst->inst->module->thread_detach) {
-		(void) thread_inst->inst->module->thread_detach(thread_inst->data);
-	}
-
-	talloc_free(thread_inst);
-}
-
-/** Frees the thread local instance free and any thread local instance data
+ * @note This cannot be done in a talloc destructor, as we need to call
+ *	thread_detach *before* any of the children of the array are freed.
  *
- * @param[in] to_free	Thread specific module instance tree to free.
+ * @param[in] to_free	Thread specific module instance array to free.
  */
-static void _module_thread_inst_tree_free(void *to_free)
+static void _module_thread_inst_array_free(void *to_free)
 {
-	rbtree_t *thread_inst_tree = talloc_get_type_abort(to_free , rbtree_t);
+	module_thread_instance_t	*array = talloc_get_type_abort(to_free, module_thread_instance_t);
+	size_t				i;
 
-	rbtree_free(thread_inst_tree);
-}
+	for (i = 0; i < talloc_array_length(array); i++) {
+		if (!array[i].inst) continue;
 
-/** Compare two thread instances based on inst pointer
- *
- * @param[in] a		First thread specific module instance.
- * @param[in] b		Second thread specific module instance.
- * @return
- *	- +1 if a > b.
- *	- -1 if a < b.
- *	- 0 if a == b.
- */
-static int _module_thread_inst_tree_cmp(void const *a, void const *b)
-{
-	module_thread_instance_t const *my_a = a, *my_b = b;
+		/*
+		 *	Modules without thread_inst_size have no
+		 *	thread specific data to detach.
+		 */
+		if (!array[i].inst->module->thread_inst_size) continue;
 
-	if (my_a->inst > my_b->inst) return +1;
-	if (my_a->inst < my_b->inst) return -1;
+		if (array[i].inst->module->thread_detach) {
+			(void) array[i].inst->module->thread_detach(array[i].data);
+		}
+	}
 
-	return 0;
+	talloc_free(array);
 }
 
 typedef struct {
-	rbtree_t	*tree;		//!< Containing the thread instances.
-	fr_event_list_t *el;		//!< Event list for this thread.
+	module_thread_instance_t	*array;		//!< Containing the thread instances.
+	fr_event_list_t			*el;		//!< Event list for this thread.
 } _thread_intantiate_ctx_t;
 
 /** Setup thread specific instance data for a module
@@ -571,13 +558,16 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 
 	if (!inst->module->thread_instantiate) return 0;
 
-	MEM(thread_inst = talloc_zero(NULL, module_thread_instance_t));
+	rad_assert(inst->number < talloc_array_length(thread_inst_ctx->array));
+
+	thread_inst = &thread_inst_ctx->array[inst->number];
 	thread_inst->inst = inst;
 
 	if (inst->module->thread_inst_size) {
 		char *type_name;
 
-		MEM(thread_inst->data = talloc_zero_array(thread_inst, uint8_t, inst->module->thread_inst_size));
+		MEM(thread_inst->data = talloc_zero_array(thread_inst_ctx->array, uint8_t,
+							  inst->module->thread_inst_size));
 
 		/*
 		 *	Fixup the type name, incase something calls
@@ -586,11 +576,9 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 		MEM(type_name = talloc_asprintf(NULL, "rlm_%s_thread_t", inst->name));
 		talloc_set_name(thread_inst->data, "%s", type_name);
 		talloc_free(type_name);
-
-		rbtree_insert(thread_inst_ctx->tree, thread_inst);
 	}
 
-	ret = inst->module->thread_instantiate(inst->cs, inst, thread_inst_ctx->el, thread_inst->data);
+	ret = inst->module->thread_instantiate(inst->cs, inst->data, thread_inst_ctx->el, thread_inst->data);
 	if (ret < 0) {
 		ERROR("Thread instantiation failed for module \"%s\"", inst->name);
 		return -1;
@@ -612,26 +600,29 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 int modules_thread_instantiate(CONF_SECTION *root, fr_event_list_t *el)
 {
 	CONF_SECTION			*modules;
-	rbtree_t			*thread_inst_tree;
 	_thread_intantiate_ctx_t	ctx;
 
 	modules = cf_section_sub_find(root, "modules");
 	if (!modules) return 0;
 
-	thread_inst_tree = module_thread_inst_tree;
-	if (!thread_inst_tree) {
-		MEM(thread_inst_tree = rbtree_create(NULL, _module_thread_inst_tree_cmp,
-						     _module_thread_instance_free, 0));
-		fr_thread_local_set_destructor(module_thread_inst_tree,
-					       _module_thread_inst_tree_free, thread_inst_tree);
+	/*
+	 *	Modules are only bootstrapped once, so the array
+	 *	never needs to grow.
+	 */
+	if (!module_thread_inst_array) {
+		module_thread_instance_t *array;
+
+		MEM(array = talloc_zero_array(NULL, module_thread_instance_t, instance_num));
+		fr_thread_local_set_destructor(module_thread_inst_array,
+					       _module_thread_inst_array_free, array);
 	}
 
 	ctx.el = el;
-	ctx.tree = thread_inst_tree;
+	ctx.array = module_thread_inst_array;
 
 	if (cf_data_walk(modules, module_instance_t, _module_thread_instantiate, &ctx) < 0) {
-		_module_thread_inst_tree_free(thread_inst_tree);	/* make re-entrant */
-		module_thread_inst_tree = NULL;
+		_module_thread_inst_array_free(module_thread_inst_array);	/* make re-entrant */
+		module_thread_inst_array = NULL;
 		return -1;
 	}
 
@@ -883,6 +874,7 @@ static module_instance_t *module_bootstrap(CONF_SECTION *modules, CONF_SECTION *
 	instance->cs = cs;
 	instance->name = instance_name;
 	instance->handle = module;
+	instance->number = instance_num++;
 
 	talloc_set_destructor(instance, _module_instance_free);
 
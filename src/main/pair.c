@@ -76,6 +76,7 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 	if ((check->op == T_OP_REG_EQ) || (check->op == T_OP_REG_NE)) {
 		ssize_t		slen;
 		regex_t		*preg = NULL;
+		regex_cache_entry_t *cached = NULL;
 		regmatch_t	rxmatch[REQUEST_MAX_REGEX + 1];	/* +1 for %{0} (whole match) capture group */
 		size_t		nmatch = sizeof(rxmatch) / sizeof(regmatch_t);
 
@@ -98,7 +99,6 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 			REDEBUG("Error stringifying operand for regular expression");
 
 		regex_error:
-			talloc_free(preg);
 			talloc_free(expr);
 			talloc_free(value);
 			return -2;
@@ -107,7 +107,8 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 		/*
 		 *	Include substring matches.
 		 */
-		slen = regex_compile(request, &preg, expr_p, talloc_array_length(expr_p) - 1, false, false, true, true);
+		slen = regex_cache_compile(request, &preg, &cached, expr_p, talloc_array_length(expr_p) - 1,
+					   false, false, true);
 		if (slen <= 0) {
 			REMARKER(expr_p, -slen, fr_strerror());
 
@@ -125,14 +126,13 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 			/*
 			 *	Add in %{0}. %{1}, etc.
 			 */
-			regex_sub_to_request(request, &preg, value_p, talloc_array_length(value_p) - 1,
+			regex_sub_to_request(request, &preg, cached, value_p, talloc_array_length(value_p) - 1,
 					     rxmatch, nmatch);
 			ret = (slen == 1) ? 0 : -1;
 		} else {
 			ret = (slen != 1) ? 0 : -1;
 		}
 
-		talloc_free(preg);
 		talloc_free(expr);
 		talloc_free(value);
 		goto finish;
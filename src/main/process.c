@@ -239,7 +239,17 @@ static TALLOC_CTX *proxy_ctx = NULL;
 #endif
 
 #ifdef WITH_PROXY
-static pthread_mutex_t proxy_mutex;
+/*
+ *	The proxy hash is sharded by socket.  The packet list has its
+ *	own per-socket locks for allocating IDs.  These mutexes stop a
+ *	REQUEST from being removed from the hash while another thread
+ *	is looking at it.
+ */
+#define PROXY_HASH_SHARDS (64)
+#define PROXY_HASH_MUTEX(_fd) (&proxy_hash_mutex[(_fd) & (PROXY_HASH_SHARDS - 1)])
+
+static pthread_mutex_t proxy_hash_mutex[PROXY_HASH_SHARDS];
+static pthread_mutex_t proxy_mutex;		//!< for opening, freezing and closing sockets
 static bool proxy_no_new_sockets = false;
 #endif
 
@@ -2004,6 +2014,13 @@ static int eol_proxy_listener(void *ctx, void *data)
 
 	if (request->proxy->listener != this) return 0;
 
+	/*
+	 *	Another thread allocated an ID from this socket just
+	 *	before it was frozen, and hasn't yet put the request
+	 *	into the hash.  The request will time out.
+	 */
+	if (!request->in_proxy_hash) return 0;
+
 #ifdef WITH_ACCOUNTING
 	/*
 	 *	Accounting packets should be deleted immediately.
@@ -2017,19 +2034,18 @@ static int eol_proxy_listener(void *ctx, void *data)
 
 	/*
 	 *	The normal "remove_from_proxy_hash" tries to grab the
-	 *	proxy mutex.  We already have it held, so grabbing it
-	 *	again will cause a deadlock.  Instead, call the "no
-	 *	lock" version of the function.
+	 *	proxy hash mutex.  We already have it held, so
+	 *	grabbing it again will cause a deadlock.  Instead,
+	 *	call the "no lock" version of the function.
 	 */
-	rad_assert(request->in_proxy_hash == true);
 	remove_from_proxy_hash_nl(request, false);
 
 	/*
 	 *	Don't mark it as DONE.  The client can retransmit, and
 	 *	the packet SHOULD be re-proxied somewhere else.
 	 *
-	 *	Return "2" means that the rbtree code will remove it
-	 *	from the tree, and we don't need to do it ourselves.
+	 *	Return "2" means that the packet list will remove it
+	 *	from the socket, and we don't need to do it ourselves.
 	 */
 	return 2;
 }
@@ -2058,10 +2074,13 @@ static int eol_listener(void *ctx, void *data)
  ***********************************************************************/
 
 /*
- *	Called with the proxy mutex held
+ *	Called with the proxy hash mutex for the request's socket held.
  */
 static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 {
+	home_server_t	*home;
+	uint_fast32_t	outstanding;
+
 	VERIFY_REQUEST(request);
 
 	if (!request->in_proxy_hash) return;
@@ -2074,21 +2093,30 @@ static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 	 *	requests.  Note that this is NOT the count of sent
 	 *	packets, but whether or not the home server has
 	 *	responded at all.
+	 *
+	 *	Other threads update the counter without a lock, and
+	 *	it's reset to zero when the home server comes back to
+	 *	life.  So we only decrement it if it's not zero.
 	 */
-	if (request->proxy->home_server &&
-	    request->proxy->home_server->currently_outstanding) {
-		request->proxy->home_server->currently_outstanding--;
+	home = request->proxy->home_server;
+	if (!home) goto done;
+
+	outstanding = atomic_load_explicit(&home->currently_outstanding, memory_order_relaxed);
+	while (outstanding > 0) {
+		if (atomic_compare_exchange_weak_explicit(&home->currently_outstanding, &outstanding, outstanding - 1,
+							  memory_order_relaxed, memory_order_relaxed)) break;
+	}
 
+	if (outstanding > 0) {
 		/*
 		 *	If we're NOT sending it packets, AND it's been
 		 *	a while since we got a response, then we don't
 		 *	know if it's alive or dead.
 		 */
-		if ((request->proxy->home_server->currently_outstanding == 0) &&
-		    (request->proxy->home_server->state == HOME_STATE_ALIVE)) {
+		if ((outstanding == 1) && (home->state == HOME_STATE_ALIVE)) {
 			struct timeval when, now;
 
-			when.tv_sec = request->proxy->home_server->last_packet_recv ;
+			when.tv_sec = home->last_packet_recv ;
 			when.tv_usec = 0;
 
 			fr_timeval_add(&when, request_response_window(request), &when);
@@ -2102,13 +2130,14 @@ static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 			 *	haven't seen a packet for a while.
 			 */
 			if (fr_timeval_cmp(&now, &when) > 0) {
-				request->proxy->home_server->state = HOME_STATE_UNKNOWN;
-				request->proxy->home_server->last_packet_sent = 0;
-				request->proxy->home_server->last_packet_recv = 0;
+				home->state = HOME_STATE_UNKNOWN;
+				home->last_packet_sent = 0;
+				home->last_packet_recv = 0;
 			}
 		}
 	}
 
+done:
 #ifdef WITH_TCP
 	rad_assert(request->proxy->listener != NULL);
 	request->proxy->listener->count--;
@@ -2124,6 +2153,8 @@ static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 
 static void remove_from_proxy_hash(REQUEST *request)
 {
+	pthread_mutex_t *mutex;
+
 	VERIFY_REQUEST(request);
 
 	/*
@@ -2132,21 +2163,31 @@ static void remove_from_proxy_hash(REQUEST *request)
 	 */
 	if (!request->in_proxy_hash) return;
 
+	/*
+	 *	The socket doesn't change while the request is in the
+	 *	hash, so we can use it to find the mutex.
+	 */
+	mutex = PROXY_HASH_MUTEX(request->proxy->packet->sockfd);
+
 	/*
 	 *	The "not in hash" flag is definitive.  However, if the
 	 *	flag says that it IS in the hash, there might still be
 	 *	a race condition where it isn't.
+	 *
+	 *	The proxy mutex isn't needed.  The home server
+	 *	counters are atomic, and closing a socket takes the
+	 *	same hash mutex before walking the socket.
 	 */
-	pthread_mutex_lock(&proxy_mutex);
+	pthread_mutex_lock(mutex);
 
 	if (!request->in_proxy_hash) {
-		pthread_mutex_unlock(&proxy_mutex);
+		pthread_mutex_unlock(mutex);
 		return;
 	}
 
 	remove_from_proxy_hash_nl(request, true);
 
-	pthread_mutex_unlock(&proxy_mutex);
+	pthread_mutex_unlock(mutex);
 }
 
 static int insert_into_proxy_hash(REQUEST *request)
@@ -2162,11 +2203,13 @@ static int insert_into_proxy_hash(REQUEST *request)
 	rad_assert(request->proxy->home_server != NULL);
 	rad_assert(proxy_list != NULL);
 
-
-	pthread_mutex_lock(&proxy_mutex);
 	proxy_listener = NULL;
 	request->proxy->packet->count = 1;
 
+	/*
+	 *	The packet list allocates IDs with per-socket locks.
+	 *	We only need the proxy mutex to open a new socket.
+	 */
 	for (tries = 0; tries < 2; tries++) {
 		rad_listen_t *this;
 		listen_socket_t *sock;
@@ -2179,8 +2222,17 @@ static int insert_into_proxy_hash(REQUEST *request)
 
 		if (tries > 0) continue; /* try opening new socket only once */
 
-		if (proxy_no_new_sockets) break;
+		pthread_mutex_lock(&proxy_mutex);
+		if (proxy_no_new_sockets) {
+			pthread_mutex_unlock(&proxy_mutex);
+			break;
+		}
 
+		/*
+		 *	The new socket is used by this thread for
+		 *	its next requests, so that threads don't
+		 *	contend for IDs on the same socket.
+		 */
 		RDEBUG3("proxy: Trying to open a new listener to the home server");
 		this = proxy_new_listener(proxy_ctx, request->proxy->home_server, 0);
 		if (!this) {
@@ -2218,11 +2270,9 @@ static int insert_into_proxy_hash(REQUEST *request)
 		 */
 		pthread_mutex_unlock(&proxy_mutex);
 		radius_update_listener(this);
-		pthread_mutex_lock(&proxy_mutex);
 	}
 
 	if (!proxy_listener || !success) {
-		pthread_mutex_unlock(&proxy_mutex);
 		REDEBUG2("proxy: Failed allocating Id for proxied request");
 	fail:
 		request->proxy->listener = NULL;
@@ -2233,21 +2283,25 @@ static int insert_into_proxy_hash(REQUEST *request)
 	rad_assert(request->proxy->packet->id >= 0);
 
 	request->proxy->listener = proxy_listener;
-	request->in_proxy_hash = true;
-	RDEBUG3("proxy: request is now in proxy hash");
 
 	/*
 	 *	Keep track of maximum outstanding requests to a
 	 *	particular home server.  'max_outstanding' is
 	 *	enforced in home_server_ldb(), in realms.c.
 	 */
-	request->proxy->home_server->currently_outstanding++;
+	atomic_fetch_add_explicit(&request->proxy->home_server->currently_outstanding, 1, memory_order_relaxed);
 
+	/*
+	 *	The listener's count is only changed with the hash
+	 *	mutex for its socket held.
+	 */
+	pthread_mutex_lock(PROXY_HASH_MUTEX(request->proxy->packet->sockfd));
 #ifdef WITH_TCP
 	request->proxy->listener->count++;
 #endif
-
-	pthread_mutex_unlock(&proxy_mutex);
+	request->in_proxy_hash = true;
+	pthread_mutex_unlock(PROXY_HASH_MUTEX(request->proxy->packet->sockfd));
+	RDEBUG3("proxy: request is now in proxy hash");
 
 	RDEBUG3("proxy: allocating destination %s port %d - Id %d",
 	       inet_ntop(request->proxy->packet->dst_ipaddr.af, &request->proxy->packet->dst_ipaddr.ipaddr, buffer, sizeof(buffer)),
@@ -2353,11 +2407,11 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 
 	VERIFY_PACKET(reply);
 
-	pthread_mutex_lock(&proxy_mutex);
+	pthread_mutex_lock(PROXY_HASH_MUTEX(reply->sockfd));
 	packet_p = fr_packet_list_find_byreply(proxy_list, reply);
 
 	if (!packet_p) {
-		pthread_mutex_unlock(&proxy_mutex);
+		pthread_mutex_unlock(PROXY_HASH_MUTEX(reply->sockfd));
 		PROXY("No outstanding request was found for %s packet from host %s port %d - ID %u",
 		       fr_packet_codes[reply->code],
 		       inet_ntop(reply->src_ipaddr.af,
@@ -2384,7 +2438,7 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 
 	request = proxy->parent;
 
-	pthread_mutex_unlock(&proxy_mutex);
+	pthread_mutex_unlock(PROXY_HASH_MUTEX(reply->sockfd));
 
 	VERIFY_REQUEST(request);
 
@@ -2393,7 +2447,7 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 	 *	ignore it.  This does the MD5 calculations in the
 	 *	server core, but I guess we can fix that later.
 	 */
-	if (!proxy->reply && (fr_radius_verify(reply, proxy->packet, proxy->home_server->secret) != 0)) {
+	if (!proxy->reply && (fr_radius_verify_prepared(reply, proxy->packet, proxy->home_server->prepared) != 0)) {
 		RWDEBUG("Discarding invalid reply from host %s port %d - ID: %d: %s",
 			inet_ntop(reply->src_ipaddr.af, &reply->src_ipaddr.ipaddr, buffer, sizeof(buffer)),
 			reply->src_port, reply->id, fr_strerror());
@@ -3705,7 +3759,7 @@ static void mark_home_server_alive(REQUEST *request, home_server_t *home)
 	home->state = HOME_STATE_ALIVE;
 	home->response_timeouts = 0;
 	trigger_exec(request, home->cs, "home_server.alive", false, NULL);
-	home->currently_outstanding = 0;
+	atomic_store_explicit(&home->currently_outstanding, 0, memory_order_relaxed);
 	home->num_sent_pings = 0;
 	home->num_received_pings = 0;
 	gettimeofday(&home->revive_time, NULL);
@@ -3829,7 +3883,7 @@ void revive_home_server(UNUSED struct timeval *now, void *ctx)
 	home->state = HOME_STATE_ALIVE;
 	home->response_timeouts = 0;
 	home_trigger(home, "home_server.alive");
-	home->currently_outstanding = 0;
+	atomic_store_explicit(&home->currently_outstanding, 0, memory_order_relaxed);
 	gettimeofday(&home->revive_time, NULL);
 
 	/*
@@ -5011,7 +5065,9 @@ static int event_new_fd(rad_listen_t *this)
 				fr_exit(1);
 			}
 
-			fr_packet_list_walk(proxy_list, this, eol_proxy_listener);
+			pthread_mutex_lock(PROXY_HASH_MUTEX(this->fd));
+			fr_packet_list_socket_walk(proxy_list, this->fd, this, eol_proxy_listener);
+			pthread_mutex_unlock(PROXY_HASH_MUTEX(this->fd));
 			pthread_mutex_unlock(&proxy_mutex);
 		} else
 #endif
@@ -5368,6 +5424,8 @@ int radius_event_start(bool have_children)
 
 #ifdef WITH_PROXY
 	if (main_config.proxy_requests && !check_config) {
+		int i;
+
 		/*
 		 *	Create the tree for managing proxied requests and
 		 *	responses.
@@ -5379,6 +5437,13 @@ int radius_event_start(bool have_children)
 			return -1;
 		}
 
+		for (i = 0; i < PROXY_HASH_SHARDS; i++) {
+			if (pthread_mutex_init(&proxy_hash_mutex[i], NULL) != 0) {
+				ERROR("Failed to initialize proxy hash mutex: %s", fr_syserror(errno));
+				return -1;
+			}
+		}
+
 		/*
 		 *	The "init_delay" is set to "response_window".
 		 *	Reset it to half of "response_window" in order
@@ -965,6 +965,45 @@ static int rs_get_pairs(TALLOC_CTX *ctx, VALUE_PAIR **out, VALUE_PAIR *vps, fr_d
 	return count;
 }
 
+/** Decode the attributes we need from a packet
+ *
+ * If we're printing packets every attribute is needed.  Otherwise only the
+ * attributes we list, link or filter on are decoded, which skips most of
+ * the decoding work for large packets.
+ */
+static int rs_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+{
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	int		i;
+
+	if (conf->print_packet) return fr_radius_decode(packet, original, secret);
+
+	if (fr_radius_decode_lazy(packet, original, secret) < 0) return -1;
+
+	for (i = 0; i < conf->list_da_num; i++) {
+		if (fr_radius_decode_da(packet, conf->list_da[i]) < 0) return -1;
+	}
+
+	for (i = 0; i < conf->link_da_num; i++) {
+		if (fr_radius_decode_da(packet, conf->link_da[i]) < 0) return -1;
+	}
+
+	for (vp = fr_pair_cursor_init(&cursor, &conf->filter_request_vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (fr_radius_decode_da(packet, vp->da) < 0) return -1;
+	}
+
+	for (vp = fr_pair_cursor_init(&cursor, &conf->filter_response_vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (fr_radius_decode_da(packet, vp->da) < 0) return -1;
+	}
+
+	return 0;
+}
+
 static int _request_free(rs_request_t *request)
 {
 	bool ret;
@@ -1393,7 +1432,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			FILE *log_fp = fr_log_fp;
 
 			fr_log_fp = NULL;
-			ret = fr_radius_decode(current, original ? original->expect : NULL, conf->radius_secret);
+			ret = rs_packet_decode(current, original ? original->expect : NULL, conf->radius_secret);
 			fr_log_fp = log_fp;
 			if (ret != 0) {
 				fr_radius_free(&current);
@@ -1499,7 +1538,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			FILE *log_fp = fr_log_fp;
 
 			fr_log_fp = NULL;
-			ret = fr_radius_decode(current, NULL, conf->radius_secret);
+			ret = rs_packet_decode(current, NULL, conf->radius_secret);
 			fr_log_fp = log_fp;
 
 			if (ret != 0) {
@@ -823,6 +823,12 @@ home_server_t *home_server_afrom_cs(TALLOC_CTX *ctx, realm_config_t *rc, CONF_SE
 		}
 	}
 
+	/*
+	 *	Hash the secret once, rather than for every packet.
+	 */
+	home->prepared = fr_radius_secret_alloc(home, home->secret);
+	if (!home->prepared) goto error;
+
 	/*
 	 *	Virtual servers have some TLS restrictions.
 	 */
@@ -1482,6 +1488,12 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 		home->cs = cs;
 		home->proto = IPPROTO_UDP;
 
+		home->prepared = fr_radius_secret_alloc(home, secret);
+		if (!home->prepared) {
+			talloc_free(home);
+			return 0;
+		}
+
 		p = strchr(name, ':');
 		if (!p) {
 			if (type == HOME_TYPE_AUTH) {
@@ -2427,6 +2439,7 @@ home_server_t *home_server_ldb(char const *realmname,
 	home_server_t	*zombie = NULL;
 	VALUE_PAIR	*vp;
 	uint32_t	hash;
+	uint32_t	found_outstanding = 0;
 
 	/*
 	 *	Determine how to pick choose the home server.
@@ -2509,7 +2522,8 @@ home_server_t *home_server_ldb(char const *realmname,
 	 *	Otherwise, use it.
 	 */
 	for (count = 0; count < pool->num_home_servers; count++) {
-		home_server_t *home = pool->servers[(start + count) % pool->num_home_servers];
+		home_server_t	*home = pool->servers[(start + count) % pool->num_home_servers];
+		uint32_t	outstanding;
 
 		if (!home) continue;
 
@@ -2525,8 +2539,12 @@ home_server_t *home_server_ldb(char const *realmname,
 
 		/*
 		 *	This home server is too busy.  Choose another one.
+		 *
+		 *	The counter is updated by other threads without
+		 *	a lock, so we read it once, and use that.
 		 */
-		if (home->currently_outstanding >= home->max_outstanding) {
+		outstanding = atomic_load_explicit(&home->currently_outstanding, memory_order_relaxed);
+		if (outstanding >= home->max_outstanding) {
 			continue;
 		}
 
@@ -2591,21 +2609,23 @@ home_server_t *home_server_ldb(char const *realmname,
 		 */
 		if (!found) {
 			found = home;
+			found_outstanding = outstanding;
 			continue;
 		}
 
-		RDEBUG3("PROXY %s %d\t%s %d",
-		       found->log_name, found->currently_outstanding,
-		       home->log_name, home->currently_outstanding);
+		RDEBUG3("PROXY %s %u\t%s %u",
+		       found->log_name, found_outstanding,
+		       home->log_name, outstanding);
 
 		/*
 		 *	Prefer this server if it's less busy than the
 		 *	one we had previously found.
 		 */
-		if (home->currently_outstanding < found->currently_outstanding) {
+		if (outstanding < found_outstanding) {
 			RDEBUG3("PROXY Choosing %s: It's less busy than %s",
 			       home->log_name, found->log_name);
 			found = home;
+			found_outstanding = outstanding;
 			continue;
 		}
 
@@ -2613,7 +2633,7 @@ home_server_t *home_server_ldb(char const *realmname,
 		 *	Ignore servers which are busier than the one
 		 *	we found.
 		 */
-		if (home->currently_outstanding > found->currently_outstanding) {
+		if (outstanding > found_outstanding) {
 			RDEBUG3("PROXY Skipping %s: It's busier than %s",
 			       home->log_name, found->log_name);
 			continue;
@@ -2625,6 +2645,7 @@ home_server_t *home_server_ldb(char const *realmname,
 		 */
 		if (((count + 1) * (fr_rand() & 0xffff)) < (uint32_t) 0x10000) {
 			found = home;
+			found_outstanding = outstanding;
 		}
 	} /* loop over the home servers */
 
@@ -28,17 +28,326 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #ifdef HAVE_REGEX
 
 #define REQUEST_DATA_REGEX (0xadbeef00)
 
+/*
+ *	Expressions built at runtime, e.g. from attribute values, are
+ *	compiled once, and kept in a per-thread cache.
+ */
+#define REGEX_CACHE_MAX_ENTRIES	(128)
+#define REGEX_CACHE_STUDY_HITS	(16)	//!< Study (and JIT) expressions used this many times.
+
+typedef struct regex_cache regex_cache_t;
+
+struct regex_cache_entry {
+	char const		*pattern;	//!< The uncompiled expression.
+	size_t			len;		//!< Length of pattern.
+	uint32_t		hash;		//!< Of the pattern and flags.
+	bool			ignore_case;	//!< Flags the expression was compiled with.
+	bool			multiline;
+	bool			subcaptures;
+
+	regex_t			*preg;		//!< Compiled expression.
+	uint64_t		hits;		//!< Number of times the expression has been used.
+	bool			studied;	//!< Whether regex_study() has been called.
+	atomic_uint_fast32_t	refs;		//!< One for the cache, and one for each request with
+						//!< subcaptures pointing to preg.
+
+	regex_cache_entry_t	*prev;		//!< More recently used entry.
+	regex_cache_entry_t	*next;		//!< Less recently used entry.
+};
+
+struct regex_cache {
+	fr_hash_table_t		*table;		//!< Entries, keyed by pattern and flags.
+	regex_cache_entry_t	*head;		//!< Most recently used entry.
+	regex_cache_entry_t	*tail;		//!< Least recently used entry.
+};
+
+fr_thread_local_setup(regex_cache_t *, regex_cache)	/* macro */
+
+/*
+ *	The caches are per-thread, but the counters are shared, so
+ *	that they can be read from any thread.
+ */
+static struct {
+	atomic_uint_fast64_t	hits;
+	atomic_uint_fast64_t	misses;
+	atomic_uint_fast64_t	evictions;
+	atomic_uint_fast64_t	studied;
+} regex_cache_counters;
+
 typedef struct regcapture {
 	regex_t		*preg;		//!< Compiled pattern.
+	regex_cache_entry_t *cached;	//!< Cache entry preg belongs to, if any.
 	char const	*value;		//!< Original string.
 	regmatch_t	*rxmatch;	//!< Match vectors.
 	size_t		nmatch;		//!< Number of match vectors.
 } regcapture_t;
 
+static uint32_t regex_cache_hash(void const *data)
+{
+	regex_cache_entry_t const *c = data;
+
+	return c->hash;
+}
+
+static int regex_cache_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const *a = one;
+	regex_cache_entry_t const *b = two;
+	int ret;
+
+	ret = (a->ignore_case > b->ignore_case) - (a->ignore_case < b->ignore_case);
+	if (ret != 0) return ret;
+
+	ret = (a->multiline > b->multiline) - (a->multiline < b->multiline);
+	if (ret != 0) return ret;
+
+	ret = (a->subcaptures > b->subcaptures) - (a->subcaptures < b->subcaptures);
+	if (ret != 0) return ret;
+
+	if (a->len < b->len) return -1;
+	if (a->len > b->len) return +1;
+
+	return memcmp(a->pattern, b->pattern, a->len);
+}
+
+static void regex_cache_unlink(regex_cache_t *cache, regex_cache_entry_t *c)
+{
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		cache->head = c->next;
+	}
+
+	if (c->next) {
+		c->next->prev = c->prev;
+	} else {
+		cache->tail = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+static void regex_cache_link(regex_cache_t *cache, regex_cache_entry_t *c)
+{
+	c->prev = NULL;
+	c->next = cache->head;
+	if (cache->head) cache->head->prev = c;
+	cache->head = c;
+	if (!cache->tail) cache->tail = c;
+}
+
+/** Drop a reference to a cache entry, and free it if that was the last one
+ *
+ * Requests can be freed by a different thread from the one which owns the
+ * cache, so the count is atomic.
+ */
+static void regex_cache_entry_release(regex_cache_entry_t *c)
+{
+	if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) == 1) talloc_free(c);
+}
+
+/** Remove an entry from the cache
+ *
+ * Entries are freed when the last request using their subcaptures is done with them.
+ */
+static void regex_cache_evict(regex_cache_t *cache, regex_cache_entry_t *c)
+{
+	regex_cache_unlink(cache, c);
+	fr_hash_table_delete(cache->table, c);
+
+	regex_cache_entry_release(c);
+}
+
+static int _regex_cache_free(regex_cache_t *cache)
+{
+	while (cache->head) regex_cache_evict(cache, cache->head);
+
+	return 0;
+}
+
+static void _regex_cache_thread_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+static regex_cache_t *regex_cache_get(void)
+{
+	regex_cache_t *cache = regex_cache;
+
+	if (cache) return cache;
+
+	cache = talloc_zero(NULL, regex_cache_t);
+	if (!cache) return NULL;
+
+	cache->table = fr_hash_table_create(cache, regex_cache_hash, regex_cache_cmp, NULL);
+	if (!cache->table) {
+		talloc_free(cache);
+		return NULL;
+	}
+	talloc_set_destructor(cache, _regex_cache_free);
+
+	fr_thread_local_set_destructor(regex_cache, _regex_cache_thread_free, cache);
+
+	return cache;
+}
+
+/** Compile a regular expression at runtime, or use a cached copy
+ *
+ * Expressions are compiled without studying them, the same as regex_compile()
+ * does for runtime expressions.  Expressions which are used often are studied,
+ * which runs them through the PCRE JIT if it's available.
+ *
+ * @note The compiled expression belongs to the cache, and must not be freed
+ *	by the caller.  It may be passed to regex_sub_to_request(), along with
+ *	the cache entry.
+ *
+ * @param[in] request		The current request.
+ * @param[out] out		Where to write a pointer to the compiled expression.
+ * @param[out] entry		Where to write a pointer to the cache entry which owns it.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] ignore_case	Whether to do case insensitive matching.
+ * @param[in] multiline		If true $ matches newlines.
+ * @param[in] subcaptures	Whether to compile the regular expression to store subcapture
+ *				data.
+ * @return the same as regex_compile().
+ */
+ssize_t regex_cache_compile(REQUEST *request, regex_t **out, regex_cache_entry_t **entry,
+			    char const *pattern, size_t len, bool ignore_case, bool multiline, bool subcaptures)
+{
+	regex_cache_t		*cache;
+	regex_cache_entry_t	*c, my_c;
+	ssize_t			slen;
+	char			*p;
+
+	*out = NULL;
+	*entry = NULL;
+
+	cache = regex_cache_get();
+	if (!cache) {
+		fr_strerror_printf("Out of memory");
+		return 0;
+	}
+
+	my_c.pattern = pattern;
+	my_c.len = len;
+	my_c.ignore_case = ignore_case;
+	my_c.multiline = multiline;
+	my_c.subcaptures = subcaptures;
+	my_c.hash = fr_hash(pattern, len);
+	my_c.hash = fr_hash_update(&ignore_case, sizeof(ignore_case), my_c.hash);
+	my_c.hash = fr_hash_update(&multiline, sizeof(multiline), my_c.hash);
+	my_c.hash = fr_hash_update(&subcaptures, sizeof(subcaptures), my_c.hash);
+
+	c = fr_hash_table_finddata(cache->table, &my_c);
+	if (c) {
+		atomic_fetch_add_explicit(&regex_cache_counters.hits, 1, memory_order_relaxed);
+		c->hits++;
+
+		regex_cache_unlink(cache, c);
+		regex_cache_link(cache, c);
+
+		if (!c->studied && (c->hits >= REGEX_CACHE_STUDY_HITS)) {
+			c->studied = true;
+
+			/*
+			 *	Failing to study isn't fatal, the
+			 *	expression still works.
+			 */
+			if (regex_study(c->preg) < 0) {
+				RWDEBUG("%s", fr_strerror());
+			} else {
+				atomic_fetch_add_explicit(&regex_cache_counters.studied, 1, memory_order_relaxed);
+			}
+		}
+
+		RDEBUG4("Using cached regular expression (%" PRIu64 " hits)", c->hits);
+
+		*out = c->preg;
+		*entry = c;
+		return len;
+	}
+
+	atomic_fetch_add_explicit(&regex_cache_counters.misses, 1, memory_order_relaxed);
+
+	c = talloc_zero(NULL, regex_cache_entry_t);
+	if (!c) {
+		fr_strerror_printf("Out of memory");
+		return 0;
+	}
+
+	/*
+	 *	Copy the pattern, so we don't depend on the
+	 *	caller's buffer.
+	 */
+	c->pattern = p = talloc_memdup(c, pattern, len + 1);
+	if (!p) {
+		talloc_free(c);
+		fr_strerror_printf("Out of memory");
+		return 0;
+	}
+	p[len] = '\0';
+	c->len = len;
+	c->hash = my_c.hash;
+	c->ignore_case = ignore_case;
+	c->multiline = multiline;
+	c->subcaptures = subcaptures;
+	atomic_init(&c->refs, 1);
+
+	slen = regex_compile(c, &c->preg, c->pattern, len, ignore_case, multiline, subcaptures, true);
+	if (slen <= 0) {
+		talloc_free(c);
+		return slen;
+	}
+
+	if (fr_hash_table_num_elements(cache->table) >= REGEX_CACHE_MAX_ENTRIES) {
+		atomic_fetch_add_explicit(&regex_cache_counters.evictions, 1, memory_order_relaxed);
+		regex_cache_evict(cache, cache->tail);
+	}
+
+	if (!fr_hash_table_insert(cache->table, c)) {
+		talloc_free(c);
+		fr_strerror_printf("Failed inserting regular expression into cache");
+		return 0;
+	}
+	regex_cache_link(cache, c);
+
+	*out = c->preg;
+	*entry = c;
+	return slen;
+}
+
+/** Get the regular expression cache counters, summed over all threads
+ *
+ * @param[out] stats	Where to write the counters.
+ */
+void regex_cache_stats(regex_cache_stats_t *stats)
+{
+	stats->hits = atomic_load_explicit(&regex_cache_counters.hits, memory_order_relaxed);
+	stats->misses = atomic_load_explicit(&regex_cache_counters.misses, memory_order_relaxed);
+	stats->evictions = atomic_load_explicit(&regex_cache_counters.evictions, memory_order_relaxed);
+	stats->studied = atomic_load_explicit(&regex_cache_counters.studied, memory_order_relaxed);
+}
+
+static int _regcapture_free(regcapture_t *cap)
+{
+	regex_cache_entry_t *c = cap->cached;
+
+	regex_cache_entry_release(c);
+
+	return 0;
+}
+
 /** Adds subcapture values to request data
  *
  * Allows use of %{n} expansions.
@@ -48,12 +357,14 @@ typedef struct regcapture {
  *
  * @param request Current request.
  * @param preg Compiled pattern. May be set to NULL if reparented to the regcapture struct.
+ * @param cached Cache entry which owns preg, from regex_cache_compile().  NULL if preg
+ *	wasn't compiled by regex_cache_compile().
  * @param value The original value.
  * @param rxmatch Pointers into value.
  * @param nmatch Sizeof rxmatch.
  */
-void regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value, size_t len,
-			  regmatch_t rxmatch[], size_t nmatch)
+void regex_sub_to_request(REQUEST *request, regex_t **preg, regex_cache_entry_t *cached,
+			  char const *value, size_t len, regmatch_t rxmatch[], size_t nmatch)
 {
 	regcapture_t *old_sc, *new_sc;	/* lldb doesn't like new *sigh* */
 	char *p;
@@ -90,6 +401,14 @@ void regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value, s
 	new_sc->value = p;
 	new_sc->nmatch = nmatch;
 
+	new_sc->cached = cached;
+	if (cached) {
+		rad_assert(cached->preg == *preg);
+
+		atomic_fetch_add_explicit(&cached->refs, 1, memory_order_relaxed);
+		new_sc->preg = *preg;
+		talloc_set_destructor(new_sc, _regcapture_free);
+	} else
 #ifdef HAVE_PCRE
 	if (!(*preg)->precompiled) {
 		new_sc->preg = talloc_steal(new_sc, *preg);
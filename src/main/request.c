@@ -67,6 +67,13 @@ static int _request_free(REQUEST *request)
 	request->proxy = NULL;
 #endif
 
+	/*
+	 *	The entries are freed with the request, but in no
+	 *	particular order.  Destructors of other children
+	 *	mustn't walk the list while that happens.
+	 */
+	request->data = NULL;
+
 	/*
 	 *	This is parented separately.
 	 *
@@ -691,7 +691,7 @@ void request_stats_reply(REQUEST *request)
 
 		vp = radius_pair_create(request->reply, &request->reply->vps,
 				       PW_FREERADIUS_STATS_SERVER_OUTSTANDING_REQUESTS, VENDORPEC_FREERADIUS);
-		if (vp) vp->vp_integer = home->currently_outstanding;
+		if (vp) vp->vp_integer = atomic_load_explicit(&home->currently_outstanding, memory_order_relaxed);
 
 		vp = radius_pair_create(request->reply, &request->reply->vps,
 				       PW_FREERADIUS_STATS_SERVER_STATE, VENDORPEC_FREERADIUS);
@@ -394,8 +394,8 @@ int dual_tls_send(rad_listen_t *listener, REQUEST *request)
 	/*
 	 *	Pack the VPs
 	 */
-	if (fr_radius_encode(request->reply, request->packet,
-			     request->client->secret) < 0) {
+	if (fr_radius_encode_prepared(request->reply, request->packet,
+				      request->client->prepared) < 0) {
 		RERROR("Failed encoding packet: %s", fr_strerror());
 		return 0;
 	}
@@ -408,8 +408,8 @@ int dual_tls_send(rad_listen_t *listener, REQUEST *request)
 	/*
 	 *	Sign the packet.
 	 */
-	if (fr_radius_sign(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (fr_radius_sign_prepared(request->reply, request->packet,
+				    request->client->prepared) < 0) {
 		RERROR("Failed signing packet: %s", fr_strerror());
 		return 0;
 	}
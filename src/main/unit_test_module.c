@@ -945,6 +945,12 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	So that modules can yield.  The sections wait for
+	 *	them in unlang_interpret_synchronous().
+	 */
+	request->el = el;
+
 	/*
 	 *	No filter file, OR there's no more input, OR we're
 	 *	reading from a file, and it's different from the
@@ -2535,6 +2535,7 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 	unlang_t *c;
 	unlang_t *child;
 	unlang_group_t *g;
+	char const *name2;
 
 	/*
 	 *	No children?  Die!
@@ -2544,34 +2545,42 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 		return NULL;
 	}
 
-	if (cf_section_name2(cs) != NULL) {
-		cf_log_err_cs(cs, "%s sections cannot have an argument", unlang_ops[mod_type].name);
+	/*
+	 *	"parallel { ... }" waits for all of the children.
+	 *	"parallel first { ... }" finishes when the first
+	 *	child does, and cancels the rest.
+	 */
+	name2 = cf_section_name2(cs);
+	if (name2 && (strcmp(name2, "first") != 0) && (strcmp(name2, "all") != 0)) {
+		cf_log_err_cs(cs, "Invalid argument '%s' for %s section.  Expected 'first' or 'all'",
+			      name2, unlang_ops[mod_type].name);
 		return NULL;
 	}
 
 	c = compile_group(parent, unlang_ctx, cs, group_type, parentgroup_type, mod_type);
 	if (!c) return NULL;
 
-	c->name = c->debug_name = unlang_ops[c->type].name;
+	c->name = unlang_ops[c->type].name;
+	if (name2) {
+		c->debug_name = talloc_asprintf(c, "%s %s", c->name, name2);
+	} else {
+		c->debug_name = c->name;
+	}
 
 	/*
 	 *	Check that all children are of the new type.
+	 *
+	 *	Modules which don't yield are allowed.  They just run
+	 *	to completion before the next child is started.
 	 */
 	g = unlang_generic_to_group(c);
+	g->first = (name2 && (strcmp(name2, "first") == 0));
 
 	for (child = g->children; child != NULL; child = child->next) {
-		unlang_module_call_t *single;
-
 		if (child->type != UNLANG_TYPE_MODULE_CALL) {
 			cf_log_err_cs(cs, "%s sections cannot a child of type %s", unlang_ops[mod_type].name, child->debug_name);
 			return NULL;
 		}
-
-		single = unlang_generic_to_module_call(child);
-		if ((single->module_instance->module->type & RLM_TYPE_RESUMABLE) == 0) {
-			cf_log_err_cs(cs, "%s sections cannot a non-resumable child of %s", unlang_ops[mod_type].name, child->debug_name);
-			return NULL;
-		}
 	}
 
 	return c;
@@ -101,6 +101,17 @@ static void unlang_pop(unlang_stack_t *stack)
 }
 
 
+/** Return the talloc ctx for things which belong to a stack
+ *
+ * @param[in] request		The current request.
+ * @param[in] stack		which is running.
+ * @return the child's ctx for a child of a parallel section, else the request.
+ */
+static inline TALLOC_CTX *unlang_stack_ctx(REQUEST *request, unlang_stack_t *stack)
+{
+	return stack->ctx ? stack->ctx : request;
+}
+
 static unlang_action_t unlang_load_balance(REQUEST *request, unlang_stack_t *stack,
 					   rlm_rcode_t *presult, int *priority)
 {
@@ -269,34 +280,210 @@ static unlang_action_t unlang_group(REQUEST *request, unlang_stack_t *stack,
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
-typedef struct unlang_parallel_t {
-	rlm_rcode_t	rcode;
+static rlm_rcode_t unlang_run(REQUEST *request, unlang_stack_t *stack);
+
+/** What a child of a parallel section is doing
+ *
+ */
+typedef enum {
+	UNLANG_PARALLEL_CHILD_RUNNABLE = 0,		//!< Hasn't been started yet.
+	UNLANG_PARALLEL_CHILD_YIELDED,			//!< Waiting for an event.
+	UNLANG_PARALLEL_CHILD_DONE			//!< Finished, or cancelled.
+} unlang_parallel_child_state_t;
+
+/** A child of a parallel section, running on its own interpreter stack
+ *
+ */
+typedef struct {
+	unlang_parallel_child_state_t	state;		//!< What the child is doing.
+	unlang_t			*instruction;	//!< The child.
+	unlang_stack_t			stack;		//!< The child's interpreter stack.
+} unlang_parallel_child_t;
+
+struct unlang_parallel_t {
+	rlm_rcode_t		rcode;			//!< Result of the children which have finished.
+	int			priority;		//!< Priority of that result.
+
+	int			num_children;		//!< Number of children.
+	int			num_done;		//!< Number of children which have finished.
+
+	unlang_parallel_child_t	children[];		//!< The children, and their stacks.
+};
+
+/** Run, or resume, one child of a parallel section
+ *
+ * The child runs on its own stack.  request->stack is pointed at that
+ * stack while the child runs, so that unlang_yield() and the event
+ * functions see the child, and not the parallel section.
+ *
+ * @param[in] request		The current request.
+ * @param[in] state		of the parallel section.
+ * @param[in] child		to run.
+ */
+static void unlang_parallel_child_run(REQUEST *request, unlang_parallel_t *state, unlang_parallel_child_t *child)
+{
 	int		priority;
+	rlm_rcode_t	rcode;
+	unlang_stack_t	*stack = request->stack;
+
+	child->stack.resumable = false;
+
+	request->stack = &child->stack;
+	rcode = unlang_run(request, &child->stack);
+	request->stack = stack;
+
+	if (rcode == RLM_MODULE_YIELD) {
+		child->state = UNLANG_PARALLEL_CHILD_YIELDED;
+		return;
+	}
 
-	unlang_stack_t	*stacks;
-} unlang_parallel_t;
+	child->state = UNLANG_PARALLEL_CHILD_DONE;
+	state->num_done++;
 
-static unlang_action_t unlang_parallel(UNUSED REQUEST *request, unlang_stack_t *stack,
-				       UNUSED rlm_rcode_t *result, UNUSED int *priority)
+	/*
+	 *	Merge the results by priority, in the same way as
+	 *	the children of a group.  "return" and "reject" from
+	 *	a child can't stop its siblings, so they just win.
+	 */
+	priority = child->instruction->actions[rcode];
+	if (priority == MOD_ACTION_REJECT) {
+		rcode = RLM_MODULE_REJECT;
+		priority = MOD_PRIORITY_MAX;
+
+	} else if (priority == MOD_ACTION_RETURN) {
+		priority = MOD_PRIORITY_MAX;
+	}
+
+	if (priority > state->priority) {
+		state->priority = priority;
+		state->rcode = rcode;
+	}
+}
+
+/** Stop the children of a parallel section which haven't finished
+ *
+ * Yielded children are told that we're done with them.  Their events
+ * and resumptions are then freed, so nothing refers to their stacks
+ * afterwards.  The stacks are also marked as empty, so that a module
+ * which still calls unlang_resumable() for one of them is ignored.
+ *
+ * @param[in] request		The current request.
+ * @param[in] state		of the parallel section.
+ */
+static void unlang_parallel_cancel(REQUEST *request, unlang_parallel_t *state)
 {
+	int		i;
+	unlang_stack_t	*stack = request->stack;
+
+	for (i = 0; i < state->num_children; i++) {
+		unlang_parallel_child_t *child = &state->children[i];
+
+		if (child->state == UNLANG_PARALLEL_CHILD_DONE) continue;
+
+		if (child->state == UNLANG_PARALLEL_CHILD_YIELDED) {
+			RDEBUG2("%s - cancelled", child->instruction->debug_name);
+
+			request->stack = &child->stack;
+			unlang_action(request, FR_ACTION_DONE);
+			request->stack = stack;
+		}
+
+		child->state = UNLANG_PARALLEL_CHILD_DONE;
+		child->stack.depth = 0;
+		TALLOC_FREE(child->stack.ctx);
+	}
+}
+
+static unlang_action_t unlang_parallel(REQUEST *request, unlang_stack_t *stack,
+				       rlm_rcode_t *presult, int *priority)
+{
+	int			i;
 	unlang_stack_frame_t	*frame = &stack->frame[stack->depth];
 	unlang_t		*instruction = frame->instruction;
-	unlang_group_t	*g;
+	unlang_group_t		*g;
+	unlang_parallel_t	*state;
 
 	g = unlang_generic_to_group(instruction);
 
 	if (!frame->resume) {
+		unlang_t *child;
+
 		/*
-		 *	Set up some stacks and a return code.
+		 *	Set up a stack for each child.  The stacks
+		 *	don't go away until the section is done, as
+		 *	the children yield from them.
 		 */
+		state = talloc_zero_size(unlang_stack_ctx(request, stack),
+					 sizeof(*state) + (sizeof(state->children[0]) * g->num_children));
+		if (!state) {
+			*presult = RLM_MODULE_FAIL;
+			*priority = instruction->actions[*presult];
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+		talloc_set_name_const(state, "unlang_parallel_t");
+
+		state->rcode = RLM_MODULE_NOOP;
+		state->priority = -1;
+
+		for (i = 0, child = g->children; child != NULL; child = child->next, i++) {
+			unlang_parallel_child_t *c = &state->children[i];
+
+			rad_assert(i < g->num_children);
+
+			c->instruction = child;
+			c->stack.parent = stack;
+			c->stack.ctx = talloc_new(state);
+			if (!c->stack.ctx) {
+				talloc_free(state);
+				*presult = RLM_MODULE_FAIL;
+				*priority = instruction->actions[*presult];
+				return UNLANG_ACTION_CALCULATE_RESULT;
+			}
+
+			unlang_push(&c->stack, child, frame->result, false);
+			c->stack.frame[c->stack.depth].top_frame = true;
+		}
+		state->num_children = i;
+
+		frame->parallel.state = state;
 	} else {
-		/*
-		 *	Find a resumption child and run it.
-		 */
+		state = talloc_get_type_abort(frame->parallel.state, unlang_parallel_t);
 	}
 
-	unlang_push(stack, g->children, frame->result, true);
-	return UNLANG_ACTION_PUSHED_CHILD;
+	/*
+	 *	Start the children which haven't been started, and
+	 *	resume the ones which have been marked resumable.
+	 *	The rest are still waiting for their events.
+	 */
+	for (i = 0; i < state->num_children; i++) {
+		unlang_parallel_child_t *child = &state->children[i];
+
+		if (child->state == UNLANG_PARALLEL_CHILD_DONE) continue;
+		if ((child->state == UNLANG_PARALLEL_CHILD_YIELDED) && !child->stack.resumable) continue;
+
+		unlang_parallel_child_run(request, state, child);
+
+		if (g->first && state->num_done) break;
+	}
+
+	if (state->num_done < state->num_children) {
+		if (!g->first || !state->num_done) {
+			RDEBUG3("%s - waiting for %d of %d children", instruction->debug_name,
+				state->num_children - state->num_done, state->num_children);
+			*presult = RLM_MODULE_YIELD;
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+
+		unlang_parallel_cancel(request, state);
+	}
+
+	*presult = request->rcode = state->rcode;
+	*priority = instruction->actions[*presult];
+
+	talloc_free(state);
+	frame->parallel.state = NULL;
+
+	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
 static unlang_action_t unlang_case(REQUEST *request, unlang_stack_t *stack,
@@ -1101,7 +1288,8 @@ redo:
 
 		case UNLANG_ACTION_CALCULATE_RESULT:
 			if (result == RLM_MODULE_YIELD) {
-				rad_assert(frame->instruction->type == UNLANG_TYPE_RESUME);
+				rad_assert((frame->instruction->type == UNLANG_TYPE_RESUME) ||
+					   (frame->instruction->type == UNLANG_TYPE_PARALLEL));
 				frame->resume = true;
 				RDEBUG4("** [%i] %s - exited (yield)", stack->depth, __FUNCTION__);
 				return RLM_MODULE_YIELD;
@@ -1279,6 +1467,90 @@ rlm_rcode_t unlang_interpret(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t act
 	return rcode;
 }
 
+/** Order requests waiting in unlang_interpret_synchronous()
+ *
+ * There's only ever one.
+ */
+static int _unlang_synchronous_cmp(void const *one, void const *two)
+{
+	if (one < two) return -1;
+	if (one > two) return +1;
+	return 0;
+}
+
+/** Call a module, and wait for it to finish if it yields
+ *
+ * For code which runs requests outside of a worker, and can't handle
+ * #RLM_MODULE_YIELD.  If the request has an event list, but no backlog, the
+ * event list is serviced here until the request is resumable, and the
+ * section is continued.  Otherwise this is the same as unlang_interpret().
+ */
+rlm_rcode_t unlang_interpret_synchronous(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t action)
+{
+	rlm_rcode_t	rcode;
+	unlang_stack_t	*stack = request->stack;
+	int		depth = stack->depth;
+	fr_heap_t	*backlog;
+
+	rcode = unlang_interpret(request, cs, action);
+	if ((rcode != RLM_MODULE_YIELD) || !request->el || request->backlog) return rcode;
+
+	backlog = fr_heap_create(_unlang_synchronous_cmp, offsetof(REQUEST, heap_id));
+	if (!backlog) {
+		REDEBUG("Failed creating backlog");
+		goto fail;
+	}
+	request->backlog = backlog;
+
+	while (rcode == RLM_MODULE_YIELD) {
+		while (request->heap_id < 0) {
+			/*
+			 *	Nothing can wake the request up.
+			 */
+			if (fr_event_list_num_elements(request->el) == 0) {
+				REDEBUG("Request yielded without waiting for an event");
+				goto fail;
+			}
+
+			if (fr_event_corral(request->el, true) < 0) {
+				if (errno == EINTR) continue;
+
+				REDEBUG("Failed waiting for events: %s", fr_strerror());
+				goto fail;
+			}
+
+			fr_event_service(request->el);
+		}
+
+		(void) fr_heap_extract(backlog, request);
+		rcode = unlang_run(request, stack);
+	}
+
+	/*
+	 *	Pop the section, as unlang_interpret() would have
+	 *	done if it hadn't yielded.
+	 */
+	rad_assert(stack->frame[stack->depth].top_frame);
+	rad_assert(stack->depth > 0);
+	stack->depth--;
+
+done:
+	request->backlog = NULL;
+	if (backlog) fr_heap_delete(backlog);
+
+	return rcode;
+
+fail:
+	/*
+	 *	Tell the module which yielded to stop, and throw
+	 *	away the section.
+	 */
+	unlang_action(request, FR_ACTION_DONE);
+	stack->depth = depth;
+	rcode = RLM_MODULE_FAIL;
+	goto done;
+}
+
 /** Wrap an #fr_event_timer_t providing data needed for unlang events
  *
  */
@@ -1290,11 +1562,21 @@ typedef struct unlang_event_t {
 	void const			*inst;				//!< Module instance to pass to callbacks.
 	void				*thread;			//!< Thread specific module instance.
 	void const			*ctx;				//!< ctx data to pass to callbacks.
+	unlang_stack_t			*stack;				//!< Stack which added the event.
 	fr_event_timer_t		*ev;				//!< Event in this worker's event heap.
 } unlang_event_t;
 
 static int _unlang_event_free(unlang_event_t *ev)
 {
+	/*
+	 *	The event belongs to a child of a parallel section
+	 *	which was cancelled.  The module's request data
+	 *	mustn't point at it any more.
+	 */
+	if (ev->stack->ctx && (request_data_reference(ev->request, ev->ctx, ev->fd) == ev)) {
+		(void) request_data_get(ev->request, ev->ctx, ev->fd);
+	}
+
 	if (ev->ev) {
 		(void) fr_event_timer_delete(ev->request->el, &(ev->ev));
 		return 0;
@@ -1322,11 +1604,28 @@ static void unlang_event_timeout_handler(struct timeval *now, void *ctx)
 #endif
 	void *mutable_ctx;
 	void *mutable_inst;
+	REQUEST *request = ev->request;
+	unlang_stack_t *stack = request->stack;
 
 	memcpy(&mutable_ctx, &ev->ctx, sizeof(mutable_ctx));
 	memcpy(&mutable_inst, &ev->inst, sizeof(mutable_inst));
 
-	ev->timeout_callback(ev->request, mutable_inst, ev->thread, mutable_ctx, now);
+	/*
+	 *	The event is freed below, so it mustn't be found by
+	 *	unlang_event_timeout_delete(), or replaced if the
+	 *	callback adds another timeout with the same ctx.
+	 */
+	(void) request_data_get(request, ev->ctx, -1);
+
+	/*
+	 *	The callback runs with the stack which added the
+	 *	event, so that unlang_resumable() resumes the right
+	 *	child of a parallel section.
+	 */
+	request->stack = ev->stack;
+	ev->timeout_callback(request, mutable_inst, ev->thread, mutable_ctx, now);
+	request->stack = stack;
+
 	talloc_free(ev);
 }
 
@@ -1345,13 +1644,42 @@ static void unlang_event_fd_handler(UNUSED fr_event_list_t *el, int fd, void *ct
 #endif
 	void *mutable_ctx;
 	void *mutable_inst;
+	REQUEST *request = ev->request;
+	unlang_stack_t *stack = request->stack;
 
 	rad_assert(ev->fd == fd);
 
 	memcpy(&mutable_ctx, &ev->ctx, sizeof(mutable_ctx));
 	memcpy(&mutable_inst, &ev->inst, sizeof(mutable_inst));
 
-	ev->fd_callback(ev->request, mutable_inst, ev->thread, mutable_ctx, fd);
+	request->stack = ev->stack;
+	ev->fd_callback(request, mutable_inst, ev->thread, mutable_ctx, fd);
+	request->stack = stack;
+}
+
+/** Find the module call which is running in the current frame
+ *
+ * The module was either called directly, or it yielded and was then resumed.
+ * In the second case it may add events and yield again.
+ *
+ * @param[in] frame		the current frame.
+ * @param[out] thread		the thread specific instance data of the module.
+ * @return the module call.
+ */
+static unlang_module_call_t *unlang_frame_module_call(unlang_stack_frame_t *frame, void **thread)
+{
+	unlang_resumption_t	*mr;
+
+	if (frame->instruction->type == UNLANG_TYPE_MODULE_CALL) {
+		*thread = frame->modcall.thread;
+		return unlang_generic_to_module_call(frame->instruction);
+	}
+
+	rad_assert(frame->instruction->type == UNLANG_TYPE_RESUME);
+
+	mr = unlang_generic_to_resumption(frame->instruction);
+	*thread = mr->thread;
+	return &mr->module;
 }
 
 /** Set a timeout for the request.
@@ -1376,23 +1704,24 @@ int unlang_event_timeout_add(REQUEST *request, fr_unlang_timeout_callback_t call
 	unlang_stack_t		*stack = request->stack;
 	unlang_event_t		*ev;
 	unlang_module_call_t	*sp;
+	void			*thread;
 
 	rad_assert(stack->depth > 0);
 
 	frame = &stack->frame[stack->depth];
 
-	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
-	sp = unlang_generic_to_module_call(frame->instruction);
+	sp = unlang_frame_module_call(frame, &thread);
 
-	ev = talloc_zero(request, unlang_event_t);
+	ev = talloc_zero(unlang_stack_ctx(request, stack), unlang_event_t);
 	if (!ev) return -1;
 
 	ev->request = request;
 	ev->fd = -1;
 	ev->timeout_callback = callback;
 	ev->inst = sp->module_instance->data;
-	ev->thread = frame->modcall.thread;
+	ev->thread = thread;
 	ev->ctx = ctx;
+	ev->stack = stack;
 
 	if (fr_event_timer_insert(request->el, unlang_event_timeout_handler, ev, when, &(ev->ev)) < 0) {
 		REDEBUG("Failed inserting event: %s", fr_strerror());
@@ -1431,23 +1760,24 @@ int unlang_event_fd_readable_add(REQUEST *request, fr_unlang_fd_callback_t callb
 	unlang_stack_t		*stack = request->stack;
 	unlang_event_t		*ev;
 	unlang_module_call_t	*sp;
+	void			*thread;
 
 	rad_assert(stack->depth > 0);
 
 	frame = &stack->frame[stack->depth];
 
-	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
-	sp = unlang_generic_to_module_call(frame->instruction);
+	sp = unlang_frame_module_call(frame, &thread);
 
-	ev = talloc_zero(request, unlang_event_t);
+	ev = talloc_zero(unlang_stack_ctx(request, stack), unlang_event_t);
 	if (!ev) return -1;
 
 	ev->request = request;
 	ev->fd = fd;
 	ev->fd_callback = callback;
 	ev->inst = sp->module_instance->data;
-	ev->thread = frame->modcall.thread;
+	ev->thread = thread;
 	ev->ctx = ctx;
+	ev->stack = stack;
 
 	if (fr_event_fd_insert(request->el, fd, unlang_event_fd_handler, NULL, NULL, ev) < 0) {
 		talloc_free(ev);
@@ -1503,10 +1833,39 @@ int unlang_event_fd_delete(REQUEST *request, void const *ctx, int fd)
  * @note that this schedules the request for resumption.  It does not
  * immediately start running the request.
  *
+ * If the request yielded from a child of a "parallel" section, only
+ * that child is resumed.  request->stack must therefore be the stack
+ * which yielded.  The unlang event callbacks take care of this.
+ * Modules which call this function from their own I/O handlers must
+ * remember request->stack when they yield, and restore it here.
+ *
  * @param[in] request		The current request.
  */
 void unlang_resumable(REQUEST *request)
 {
+	unlang_stack_t *stack;
+
+	/*
+	 *	The child of a parallel section was cancelled, but
+	 *	one of its events fired anyway.  Ignore it.
+	 */
+	for (stack = request->stack; stack->parent != NULL; stack = stack->parent) {
+		if (stack->depth == 0) return;
+	}
+
+	/*
+	 *	Mark the stack which yielded, and all of the parallel
+	 *	sections above it, so that they know which of their
+	 *	children to resume.
+	 */
+	for (stack = request->stack; stack != NULL; stack = stack->parent) stack->resumable = true;
+
+	/*
+	 *	Several children may become resumable before the
+	 *	request runs again.  It only goes into the backlog once.
+	 */
+	if (request->heap_id >= 0) return;
+
 	fr_heap_insert(request->backlog, request);
 }
 
@@ -1531,6 +1890,24 @@ void unlang_action(REQUEST *request, fr_state_action_t action)
 
 	frame = &stack->frame[stack->depth];
 
+	/*
+	 *	Pass the action to every child of the parallel section
+	 *	which is waiting for an event.
+	 */
+	if (frame->instruction->type == UNLANG_TYPE_PARALLEL) {
+		int			i;
+		unlang_parallel_t	*state = talloc_get_type_abort(frame->parallel.state, unlang_parallel_t);
+
+		for (i = 0; i < state->num_children; i++) {
+			if (state->children[i].state != UNLANG_PARALLEL_CHILD_YIELDED) continue;
+
+			request->stack = &state->children[i].stack;
+			unlang_action(request, action);
+			request->stack = stack;
+		}
+		return;
+	}
+
 	rad_assert(frame->instruction->type == UNLANG_TYPE_RESUME);
 
 	mr = unlang_generic_to_resumption(frame->instruction);
@@ -1555,24 +1932,38 @@ rlm_rcode_t unlang_yield(REQUEST *request, fr_unlang_resume_t callback,
 	unlang_stack_frame_t	*frame;
 	unlang_stack_t		*stack = request->stack;
 	unlang_resumption_t	*mr;
-	unlang_module_call_t	*sp;
 
 	rad_assert(stack->depth > 0);
 
 	frame = &stack->frame[stack->depth];
 
+	/*
+	 *	The module yielded again after being resumed.  Keep
+	 *	the resumption, and just change what it calls.
+	 */
+	if (frame->instruction->type == UNLANG_TYPE_RESUME) {
+		mr = unlang_generic_to_resumption(frame->instruction);
+		mr->callback = callback;
+		mr->action_callback = action_callback;
+		mr->ctx = ctx;
+
+		return RLM_MODULE_YIELD;
+	}
+
 	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
-	sp = unlang_generic_to_module_call(frame->instruction);
 
-	mr = talloc(request, unlang_resumption_t);
+	mr = talloc(unlang_stack_ctx(request, stack), unlang_resumption_t);
 	rad_assert(mr != NULL);
 
+	/*
+	 *	unlang_module_call() has already looked up the
+	 *	thread specific instance data.
+	 */
 	memcpy(&mr->module, frame->instruction, sizeof(mr->module));
 	mr->thread = frame->modcall.thread;
 	mr->module.self.type = UNLANG_TYPE_RESUME;
 	mr->callback = callback;
 	mr->action_callback = action_callback;
-	mr->thread = module_thread_instance_find(sp->module_instance);
 	mr->ctx = ctx;
 
 	frame->instruction = unlang_resumption_to_generic(mr);
@@ -121,7 +121,7 @@ static rlm_rcode_t module_method_call(rlm_components_t comp, int idx, REQUEST *r
 	request->module = NULL;
 	request->component = section_type_value[comp].section;
 
-	rcode = unlang_interpret(request, cs, default_component_results[comp]);
+	rcode = unlang_interpret_synchronous(request, cs, default_component_results[comp]);
 
 	request->component = component;
 	request->module = module;
@@ -26,6 +26,12 @@
  * @copyright 2000  Alan DeKok <aland@ox.org>
  */
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #ifdef DEBUG_XLAT
 #  define XLAT_DEBUG RDEBUG3
 #else
@@ -81,6 +87,8 @@ typedef struct xlat_out {
 } xlat_out_t;
 
 
+extern atomic_uint_fast32_t xlat_generation;
+
 ssize_t xlat_tokenize_request(TALLOC_CTX *ctx, REQUEST *request, char const *fmt, xlat_exp_t **head);
 
 xlat_t *xlat_find(char const *name);
@@ -762,6 +762,196 @@ static ssize_t _xlat_eval_compiled(TALLOC_CTX *ctx, char **out, size_t outlen, R
 	return len;
 }
 
+/*
+ *	Format strings passed to xlat_eval() and xlat_aeval() are
+ *	nearly always the same few strings, e.g. SQL queries.  Rather
+ *	than tokenizing them on every call, we keep the parse trees in
+ *	a per-thread cache, keyed by the contents of the format string.
+ */
+#define XLAT_CACHE_MAX_ENTRIES	(256)
+
+typedef struct xlat_cache_entry_t xlat_cache_entry_t;
+
+struct xlat_cache_entry_t {
+	char const		*fmt;		//!< The format string.
+	ssize_t			slen;		//!< What xlat_tokenize_request() returned.
+	xlat_exp_t		*node;		//!< The parse tree.
+
+	xlat_cache_entry_t	*prev;		//!< More recently used entry.
+	xlat_cache_entry_t	*next;		//!< Less recently used entry.
+};
+
+typedef struct xlat_cache_t {
+	fr_hash_table_t		*table;		//!< Entries, keyed by format string.
+	xlat_cache_entry_t	*head;		//!< Most recently used entry.
+	xlat_cache_entry_t	*tail;		//!< Least recently used entry.
+
+	uint_fast32_t		generation;	//!< Value of xlat_generation when the entries were created.
+	int			depth;		//!< Number of expansions in progress.
+} xlat_cache_t;
+
+fr_thread_local_setup(xlat_cache_t *, xlat_cache)	/* macro */
+
+static uint32_t xlat_cache_hash(void const *data)
+{
+	xlat_cache_entry_t const *c = data;
+
+	return fr_hash_string(c->fmt);
+}
+
+static int xlat_cache_cmp(void const *one, void const *two)
+{
+	xlat_cache_entry_t const *a = one;
+	xlat_cache_entry_t const *b = two;
+
+	return strcmp(a->fmt, b->fmt);
+}
+
+static void xlat_cache_unlink(xlat_cache_t *cache, xlat_cache_entry_t *c)
+{
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		cache->head = c->next;
+	}
+
+	if (c->next) {
+		c->next->prev = c->prev;
+	} else {
+		cache->tail = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+static void xlat_cache_link(xlat_cache_t *cache, xlat_cache_entry_t *c)
+{
+	c->prev = NULL;
+	c->next = cache->head;
+	if (cache->head) cache->head->prev = c;
+	cache->head = c;
+	if (!cache->tail) cache->tail = c;
+}
+
+static void xlat_cache_delete(xlat_cache_t *cache, xlat_cache_entry_t *c)
+{
+	xlat_cache_unlink(cache, c);
+	fr_hash_table_delete(cache->table, c);
+	talloc_free(c);
+}
+
+static void _xlat_cache_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Get the xlat cache for this thread, creating it if necessary
+ *
+ * Cached parse trees point to xlat_t structures, so they're thrown
+ * away whenever an xlat function is registered or unregistered.
+ *
+ * @return
+ *	- The cache.
+ *	- NULL if the cache can't be used for this expansion.
+ */
+static xlat_cache_t *xlat_cache_get(void)
+{
+	xlat_cache_t *cache = xlat_cache;
+	uint_fast32_t generation = atomic_load_explicit(&xlat_generation, memory_order_acquire);
+
+	if (!cache) {
+		cache = talloc_zero(NULL, xlat_cache_t);
+		if (!cache) return NULL;
+
+		cache->table = fr_hash_table_create(cache, xlat_cache_hash, xlat_cache_cmp, NULL);
+		if (!cache->table) {
+			talloc_free(cache);
+			return NULL;
+		}
+		cache->generation = generation;
+
+		fr_thread_local_set_destructor(xlat_cache, _xlat_cache_free, cache);
+	}
+
+	if (cache->generation != generation) {
+		/*
+		 *	An outer expansion may still be using one of
+		 *	the old trees.
+		 */
+		if (cache->depth > 0) return NULL;
+
+		while (cache->head) xlat_cache_delete(cache, cache->head);
+		cache->generation = generation;
+	}
+
+	return cache;
+}
+
+/** Find the parse tree for a format string, tokenizing it if it's not in the cache
+ *
+ * @param[in] cache	to search.
+ * @param[in] request	the current request.
+ * @param[in] fmt	the format string.
+ * @param[out] slen	what xlat_tokenize_request() returned for fmt.
+ * @return
+ *	- The cache entry for fmt.
+ *	- NULL if fmt is not in the cache.  If slen is negative, fmt failed to parse,
+ *	  otherwise it could not be added, and the caller should tokenize it itself.
+ */
+static xlat_cache_entry_t *xlat_cache_find(xlat_cache_t *cache, REQUEST *request, char const *fmt, ssize_t *slen)
+{
+	xlat_cache_entry_t	*c, my_c;
+
+	my_c.fmt = fmt;
+	c = fr_hash_table_finddata(cache->table, &my_c);
+	if (c) {
+		xlat_cache_unlink(cache, c);
+		xlat_cache_link(cache, c);
+
+		*slen = c->slen;
+		return c;
+	}
+
+	*slen = 0;
+
+	/*
+	 *	We can only evict entries when no expansion is using
+	 *	them.  Nested expansions of a full cache aren't cached.
+	 */
+	if (fr_hash_table_num_elements(cache->table) >= XLAT_CACHE_MAX_ENTRIES) {
+		if (cache->depth > 0) return NULL;
+
+		xlat_cache_delete(cache, cache->tail);
+	}
+
+	c = talloc_zero(cache, xlat_cache_entry_t);
+	if (!c) return NULL;
+
+	c->fmt = talloc_typed_strdup(c, fmt);
+	if (!c->fmt) {
+	error:
+		talloc_free(c);
+		return NULL;
+	}
+
+	c->slen = xlat_tokenize_request(c, request, fmt, &c->node);
+	if (c->slen < 0) {
+		*slen = c->slen;
+		goto error;
+	}
+
+	/*
+	 *	The tokenizer allocates the tree in the request.
+	 */
+	(void) talloc_steal(c, c->node);
+
+	if (!fr_hash_table_insert(cache->table, c)) goto error;
+	xlat_cache_link(cache, c);
+
+	*slen = c->slen;
+	return c;
+}
+
 static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, REQUEST *request, char const *fmt,
 			   xlat_escape_t escape, void const *escape_ctx) CC_HINT(nonnull (2, 4, 5));
 
@@ -781,17 +971,27 @@ static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, REQUEST *r
 static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, REQUEST *request, char const *fmt,
 			   xlat_escape_t escape, void const *escape_ctx)
 {
-	ssize_t len;
-	xlat_exp_t *node;
+	ssize_t			len = 0;
+	xlat_exp_t		*node = NULL;
+	xlat_cache_t		*cache;
+	xlat_cache_entry_t	*c = NULL;
 
 	RDEBUG2("EXPAND %s", fmt);
 	RINDENT();
 
-	/*
-	 *	Give better errors than the old code.
-	 */
-	len = xlat_tokenize_request(ctx, request, fmt, &node);
+	cache = xlat_cache_get();
+	if (cache) c = xlat_cache_find(cache, request, fmt, &len);
+	if (c) {
+		node = c->node;
+	} else if (len == 0) {
+		/*
+		 *	Give better errors than the old code.
+		 */
+		len = xlat_tokenize_request(ctx, request, fmt, &node);
+	}
+
 	if (len == 0) {
+		if (!c) talloc_free(node);
 		if (*out) {
 			**out = '\0';
 		} else {
@@ -807,8 +1007,14 @@ static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, REQUEST *r
 		return -1;
 	}
 
+	/*
+	 *	Nested expansions must not evict the tree we're
+	 *	walking.
+	 */
+	if (cache) cache->depth++;
 	len = _xlat_eval_compiled(ctx, out, outlen, request, node, escape, escape_ctx);
-	talloc_free(node);
+	if (cache) cache->depth--;
+	if (!c) talloc_free(node);
 
 	REXDENT();
 	RDEBUG2("--> %s", *out);
@@ -36,6 +36,15 @@ RCSID("$Id$")
 
 static rbtree_t *xlat_root = NULL;
 
+/*
+ *	Incremented whenever an xlat function is registered or unregistered,
+ *	so that cached parse trees which point to the old xlat_t are discarded.
+ *
+ *	Written with release ordering, and read with acquire ordering, so
+ *	that a thread which sees the new value also sees the new xlat_t.
+ */
+atomic_uint_fast32_t xlat_generation = ATOMIC_VAR_INIT(0);
+
 #ifdef WITH_UNLANG
 static char const * const xlat_foreach_names[] = {"Foreach-Variable-0",
 						  "Foreach-Variable-1",
@@ -774,6 +783,7 @@ int xlat_register(void *mod_inst, char const *name,
 		c->mod_inst = mod_inst;
 		c->instantiate = instantiate;
 		c->inst_size = inst_size;
+		atomic_fetch_add_explicit(&xlat_generation, 1, memory_order_release);
 		return 0;
 	}
 
@@ -797,6 +807,7 @@ int xlat_register(void *mod_inst, char const *name,
 		talloc_free(c);
 		return -1;
 	}
+	atomic_fetch_add_explicit(&xlat_generation, 1, memory_order_release);
 
 	return 0;
 }
@@ -826,6 +837,7 @@ void xlat_unregister(void *mod_inst, char const *name, UNUSED xlat_func_t func)
 	if (c->mod_inst != mod_inst) return;
 
 	rbtree_deletebydata(xlat_root, c);
+	atomic_fetch_add_explicit(&xlat_generation, 1, memory_order_release);
 }
 
 static int xlat_unregister_callback(void *mod_inst, void *data)
@@ -842,6 +854,7 @@ void xlat_unregister_module(void *instance)
 	if (!xlat_root) return;	/* All xlats have already been freed */
 
 	rbtree_walk(xlat_root, RBTREE_DELETE_ORDER, xlat_unregister_callback, instance);
+	atomic_fetch_add_explicit(&xlat_generation, 1, memory_order_release);
 }
 
 /*
@@ -1075,6 +1088,7 @@ bool xlat_register_redundant(CONF_SECTION *cs)
 void xlat_free(void)
 {
 	TALLOC_FREE(xlat_root);
+	atomic_fetch_add_explicit(&xlat_generation, 1, memory_order_release);
 }
 
 
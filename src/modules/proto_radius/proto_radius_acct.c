@@ -53,7 +53,7 @@ static void acct_running(REQUEST *request, fr_state_action_t action)
 	switch (request->request_state) {
 	case REQUEST_INIT:
 		if (request->packet->data_len != 0) {
-			if (fr_radius_decode(request->packet, NULL, request->client->secret) < 0) {
+			if (fr_radius_decode_prepared(request->packet, NULL, request->client->prepared) < 0) {
 				RDEBUG("Failed decoding RADIUS packet: %s", fr_strerror());
 				goto done;
 			}
@@ -209,12 +209,12 @@ static void acct_running(REQUEST *request, fr_state_action_t action)
 
 		if (RDEBUG_ENABLED) common_packet_debug(request, request->reply, false);
 
-		if (fr_radius_encode(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_encode_prepared(request->reply, request->packet, request->client->prepared) < 0) {
 			RDEBUG("Failed encoding RADIUS reply: %s", fr_strerror());
 			goto done;
 		}
 
-		if (fr_radius_sign(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_sign_prepared(request->reply, request->packet, request->client->prepared) < 0) {
 			RDEBUG("Failed signing RADIUS reply: %s", fr_strerror());
 			goto done;
 		}
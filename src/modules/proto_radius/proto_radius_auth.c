@@ -324,7 +324,7 @@ static void auth_running(REQUEST *request, fr_state_action_t action)
 	switch (request->request_state) {
 	case REQUEST_INIT:
 		if (request->packet->data_len != 0) {
-			if (fr_radius_decode(request->packet, NULL, request->client->secret) < 0) {
+			if (fr_radius_decode_prepared(request->packet, NULL, request->client->prepared) < 0) {
 				RDEBUG("Failed decoding RADIUS packet: %s", fr_strerror());
 				goto done; /* don't reject it, Message-Authenticator might be wrong */
 			}
@@ -766,12 +766,12 @@ static void auth_running(REQUEST *request, fr_state_action_t action)
 		}
 #endif
 
-		if (fr_radius_encode(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_encode_prepared(request->reply, request->packet, request->client->prepared) < 0) {
 			RDEBUG("Failed encoding RADIUS reply: %s", fr_strerror());
 			goto stop_processing;
 		}
 
-		if (fr_radius_sign(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_sign_prepared(request->reply, request->packet, request->client->prepared) < 0) {
 			RDEBUG("Failed signing RADIUS reply: %s", fr_strerror());
 
 			/*
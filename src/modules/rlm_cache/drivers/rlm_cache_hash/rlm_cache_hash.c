@@ -0,0 +1,610 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_hash.c
+ * @brief Sharded hash table based cache.
+ *
+ * Entries are spread over a number of shards by the hash of their key.
+ * Each shard has its own hash table, expiry heap and mutex, so requests
+ * for different keys rarely wait for each other.
+ *
+ * The shard is only known once we see the key, so acquire doesn't lock
+ * anything.  The first operation on a key locks its shard, and release
+ * unlocks it.
+ *
+ * max_entries and max_memory are split evenly between the shards.  Each
+ * shard evicts its least recently used entries when it goes over its share,
+ * so the LRU order is only kept per shard.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/heap.h>
+#include <freeradius-devel/rad_assert.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+typedef struct rlm_cache_hash_entry rlm_cache_hash_entry_t;
+
+/** One part of the cache
+ *
+ */
+typedef struct rlm_cache_hash_shard {
+	fr_hash_table_t		*cache;		//!< Table for looking up cache keys.
+	fr_heap_t		*heap;		//!< For managing entry expiry.
+
+	rlm_cache_hash_entry_t	*head;		//!< Most recently used entry.
+	rlm_cache_hash_entry_t	*tail;		//!< Least recently used entry.
+	size_t			memory;		//!< Bytes used by the shard's entries.
+
+	pthread_mutex_t		mutex;		//!< Protect the table and heap from multiple
+						//!< readers/writers.
+} rlm_cache_hash_shard_t;
+
+typedef struct rlm_cache_hash {
+	uint32_t		num_shards;	//!< How many shards to split the cache into.
+	rlm_cache_hash_shard_t	**shards;	//!< Allocated separately, so that the mutexes
+						//!< don't share cache lines.
+	uint32_t		max_entries;	//!< Per shard.
+	size_t			max_memory;	//!< Per shard.
+
+	atomic_uint_fast32_t	num_entries;	//!< Number of entries in all the shards.
+} rlm_cache_hash_t;
+
+struct rlm_cache_hash_entry {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+	size_t			offset;		//!< Offset used for heap.
+	uint32_t		hash;		//!< Of the key.
+
+	rlm_cache_hash_entry_t	*prev;		//!< More recently used entry.
+	rlm_cache_hash_entry_t	*next;		//!< Less recently used entry.
+	size_t			size;		//!< Bytes used by the entry, its key and maps.
+};
+
+/** The shard locked by a request
+ *
+ */
+typedef struct rlm_cache_hash_handle {
+	rlm_cache_hash_t	*driver;	//!< Driver instance.
+	rlm_cache_hash_shard_t	*shard;		//!< Shard we locked.  NULL until the first
+						//!< operation on a key.
+} rlm_cache_hash_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, rlm_cache_hash_t, num_shards), .dflt = "32" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_hash_entry_t const *c = data;
+
+	return c->hash;
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Compare two entries by expiry time
+ *
+ * There may be multiple entries with the same expiry time.
+ */
+static int cache_heap_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+/** Lock the shard holding a key
+ *
+ * The buckets of the hash tables are chosen by the low bits of the hash,
+ * so the shard is chosen by the high bits.
+ *
+ * A handle is only ever used for one key, so it only locks one shard.
+ * Entries found through the handle are only safe to use while their
+ * shard stays locked, so a handle is never moved to another shard.
+ *
+ * @param[in] request	The current request.
+ * @param[in] handle	of the request.
+ * @param[in] hash	of the key.
+ * @return
+ *	- The locked shard.
+ *	- NULL if the handle already holds a different shard.
+ */
+static rlm_cache_hash_shard_t *cache_shard_lock(REQUEST *request, rlm_cache_hash_handle_t *handle, uint32_t hash)
+{
+	rlm_cache_hash_t	*driver = handle->driver;
+	rlm_cache_hash_shard_t	*shard = driver->shards[(hash >> 16) % driver->num_shards];
+
+	if (handle->shard == shard) return shard;
+
+	if (!rad_cond_assert(!handle->shard)) {
+		RERROR("Cache handle was used for keys in different shards");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	handle->shard = shard;
+
+	RDEBUG3("Mutex acquired");
+
+	return shard;
+}
+
+/** Remove an entry from a shard's LRU list
+ *
+ * @note Must be called with the shard's mutex held.
+ *
+ * @param[in] shard	the entry is in.
+ * @param[in] c		entry to remove.
+ */
+static void cache_lru_unlink(rlm_cache_hash_shard_t *shard, rlm_cache_hash_entry_t *c)
+{
+	if (c->prev) {
+		rad_assert(shard->head != c);
+		c->prev->next = c->next;
+	} else {
+		rad_assert(shard->head == c);
+		shard->head = c->next;
+	}
+	if (c->next) {
+		rad_assert(shard->tail != c);
+		c->next->prev = c->prev;
+	} else {
+		rad_assert(shard->tail == c);
+		shard->tail = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+/** Add an entry to the head of a shard's LRU list
+ *
+ * @note Must be called with the shard's mutex held.
+ *
+ * @param[in] shard	to add the entry to.
+ * @param[in] c		entry to add.
+ */
+static void cache_lru_link_head(rlm_cache_hash_shard_t *shard, rlm_cache_hash_entry_t *c)
+{
+	if (shard->head) shard->head->prev = c;
+
+	c->next = shard->head;
+	c->prev = NULL;
+	shard->head = c;
+	if (!shard->tail) shard->tail = c;
+}
+
+/** Remove an entry from its shard, and free it
+ *
+ */
+static void cache_entry_remove(rlm_cache_config_t const *config, rlm_cache_hash_t *driver,
+			       rlm_cache_hash_shard_t *shard, rlm_cache_entry_t *c)
+{
+	rlm_cache_hash_entry_t *my_c = (rlm_cache_hash_entry_t *)c;
+
+	fr_heap_extract(shard->heap, c);
+	fr_hash_table_delete(shard->cache, c);
+	cache_lru_unlink(shard, my_c);
+
+	shard->memory -= my_c->size;
+	atomic_fetch_sub_explicit(&config->counters->memory, my_c->size, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&driver->num_entries, 1, memory_order_relaxed);
+
+	talloc_free(c);
+}
+
+/** Walk over a shard's hash table
+ *
+ * Used to free any entries left in the table on detach.
+ *
+ * @param ctx unused.
+ * @param data to free.
+ * @return 0
+ */
+static int _cache_entry_free(UNUSED void *ctx, void *data)
+{
+	talloc_free(data);
+
+	return 0;
+}
+
+/** Cleanup a cache_hash instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_hash_t	*driver = instance;
+	uint32_t		i;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_hash_shard_t *shard = driver->shards[i];
+
+		if (!shard) continue;
+
+		if (shard->heap) fr_heap_delete(shard->heap);
+		if (shard->cache) {
+			fr_hash_table_walk(shard->cache, _cache_entry_free, NULL);
+			fr_hash_table_free(shard->cache);
+		}
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Create a new cache_hash instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
+{
+	rlm_cache_hash_t	*driver = instance;
+	uint32_t		i;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
+	/*
+	 *	Round down, so the shards together never go over
+	 *	the limits.  rlm_cache refuses inserts if there are
+	 *	more than max_entries.
+	 */
+	if (config->max_entries && (config->max_entries < driver->num_shards)) {
+		ERROR("max_entries (%u) must be at least the number of shards (%u)",
+		      config->max_entries, driver->num_shards);
+		return -1;
+	}
+	driver->max_entries = config->max_entries / driver->num_shards;
+	driver->max_memory = config->max_memory / driver->num_shards;
+
+	atomic_init(&driver->num_entries, 0);
+
+	MEM(driver->shards = talloc_zero_array(driver, rlm_cache_hash_shard_t *, driver->num_shards));
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_hash_shard_t *shard;
+
+		MEM(shard = driver->shards[i] = talloc_zero(driver->shards, rlm_cache_hash_shard_t));
+
+		/*
+		 *	The cache.
+		 */
+		shard->cache = fr_hash_table_create(shard, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		/*
+		 *	The heap of entries to expire.
+		 */
+		shard->heap = fr_heap_create(cache_heap_cmp, offsetof(rlm_cache_hash_entry_t, offset));
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    REQUEST *request)
+{
+	rlm_cache_hash_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_hash_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_hash_t	*driver = instance;
+	rlm_cache_hash_shard_t	*shard;
+	rlm_cache_hash_entry_t	my_c;
+	rlm_cache_entry_t	*c;
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(request, handle, my_c.hash);
+	if (!shard) return CACHE_ERROR;
+
+	/*
+	 *	Clear out old entries
+	 */
+	c = fr_heap_peek(shard->heap);
+	if (c && (c->expires < request->packet->timestamp.tv_sec)) cache_entry_remove(config, driver, shard, c);
+
+	/*
+	 *	Is there an entry for this key?
+	 */
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) {
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	/*
+	 *	Move it to the head of the LRU list
+	 */
+	if (shard->head != (rlm_cache_hash_entry_t *)c) {
+		cache_lru_unlink(shard, (rlm_cache_hash_entry_t *)c);
+		cache_lru_link_head(shard, (rlm_cache_hash_entry_t *)c);
+	}
+	*out = c;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_hash_t	*driver = instance;
+	rlm_cache_hash_shard_t	*shard;
+	rlm_cache_hash_entry_t	my_c;
+	rlm_cache_entry_t	*c;
+
+	if (!request) return CACHE_ERROR;
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(request, handle, my_c.hash);
+	if (!shard) return CACHE_ERROR;
+
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) return CACHE_MISS;
+
+	cache_entry_remove(config, driver, shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_hash_t	*driver = instance;
+	rlm_cache_hash_shard_t	*shard;
+	rlm_cache_hash_entry_t	*my_c;
+	rlm_cache_entry_t	*old;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&my_c, &c, sizeof(my_c));
+	my_c->hash = fr_hash(c->key, c->key_len);
+
+	/*
+	 *	The key and maps are all allocated in the
+	 *	context of the entry.
+	 */
+	my_c->size = talloc_total_size(my_c);
+	if (driver->max_memory && (my_c->size > driver->max_memory)) {
+		RWDEBUG("Entry uses %zu bytes, which is more than max_memory per shard (%zu bytes)",
+			my_c->size, driver->max_memory);
+		return CACHE_ERROR;
+	}
+
+	shard = cache_shard_lock(request, handle, my_c->hash);
+	if (!shard) return CACHE_ERROR;
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_finddata(shard->cache, my_c);
+	if (old && (old != &my_c->fields)) cache_entry_remove(config, driver, shard, old);
+
+	if (!fr_hash_table_insert(shard->cache, my_c)) {
+		RERROR("Failed adding entry");
+
+		return CACHE_ERROR;
+	}
+
+	if (!fr_heap_insert(shard->heap, my_c)) {
+		fr_hash_table_delete(shard->cache, my_c);
+		RERROR("Failed adding entry to expiry heap");
+
+		return CACHE_ERROR;
+	}
+
+	cache_lru_link_head(shard, my_c);
+	shard->memory += my_c->size;
+	atomic_fetch_add_explicit(&config->counters->memory, my_c->size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&driver->num_entries, 1, memory_order_relaxed);
+
+	/*
+	 *	Make room by evicting the shard's least recently
+	 *	used entries.  The new entry is at the head, and
+	 *	fits on its own, so it's never evicted.
+	 */
+	while (shard->tail != my_c) {
+		if ((!driver->max_entries || (fr_hash_table_num_elements(shard->cache) <= driver->max_entries)) &&
+		    (!driver->max_memory || (shard->memory <= driver->max_memory))) break;
+
+		cache_entry_remove(config, driver, shard, &shard->tail->fields);
+		atomic_fetch_add_explicit(&config->counters->evictions, 1, memory_order_relaxed);
+	}
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(rlm_cache_config_t const *config, void *instance,
+					  REQUEST *request, void *handle,
+					  rlm_cache_entry_t *c)
+{
+	rlm_cache_hash_t	*driver = instance;
+	rlm_cache_hash_shard_t	*shard;
+	int			ret;
+
+#ifdef NDEBUG
+	if (!request) return CACHE_ERROR;
+#endif
+
+	shard = cache_shard_lock(request, handle, ((rlm_cache_hash_entry_t *)c)->hash);
+	if (!shard) return CACHE_ERROR;
+
+	ret = fr_heap_extract(shard->heap, c);
+	rad_assert(ret == 1);
+	if (ret != 1) {					/* Need this check if we're not building with asserts */
+		RERROR("Entry not in heap");
+		return CACHE_ERROR;
+	}
+
+	if (!fr_heap_insert(shard->heap, c)) {
+		cache_entry_remove(config, driver, shard, c);	/* make sure we don't leak entries... */
+		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
+		return CACHE_ERROR;
+	}
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * Doesn't lock anything, so the count may be slightly out of date.
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  REQUEST *request, UNUSED void *handle)
+{
+	rlm_cache_hash_t *driver = instance;
+
+	if (!request) return CACHE_ERROR;
+
+	return atomic_load_explicit(&driver->num_entries, memory_order_relaxed);
+}
+
+/** Create a handle for the request
+ *
+ * No shard is locked until we know the key.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_hash_handle_t *h;
+
+	MEM(h = talloc_zero(request, rlm_cache_hash_handle_t));
+	h->driver = instance;
+
+	*handle = h;
+
+	return 0;
+}
+
+/** Unlock the shard the request used, if any
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_hash_handle_t *h = handle;
+
+	if (h->shard) {
+		pthread_mutex_unlock(&h->shard->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	talloc_free(h);
+}
+
+extern cache_driver_t rlm_cache_hash;
+cache_driver_t rlm_cache_hash = {
+	.name		= "rlm_cache_hash",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_hash_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
@@ -39,11 +39,14 @@ typedef struct rlm_cache_memcached_handle {
 
 typedef struct rlm_cache_memcached {
 	char const 		*options;	//!< Connection options
+	char const		*serialize_name; //!< Format to serialize entries in.
+	cache_serialize_format_t serialize;	//!< Format converted to an enum.
 	fr_connection_pool_t	*pool;
 } rlm_cache_memcached_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("options", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+	{ FR_CONF_OFFSET("serialize", PW_TYPE_STRING, rlm_cache_memcached_t, serialize_name), .dflt = "text" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -105,9 +108,18 @@ static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CON
 {
 	rlm_cache_memcached_t	*driver = instance;
 	memcached_return_t	ret;
+	int			serialize;
 
 	char			buffer[256];
 
+	serialize = fr_str2int(cache_serialize_formats, driver->serialize_name, -1);
+	if (serialize < 0) {
+		cf_log_err_cs(conf, "Invalid 'serialize' value \"%s\", expected 'text' or 'binary'",
+			      driver->serialize_name);
+		return -1;
+	}
+	driver->serialize = serialize;
+
 	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", config->name);
 
 	ret = libmemcached_check_configuration(driver->options, talloc_array_length(driver->options) -1,
@@ -174,10 +186,18 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
 
+	/*
+	 *	Entries may be in either format, whatever
+	 *	we're writing now.
+	 */
 	c = talloc_zero(NULL,  rlm_cache_entry_t);
-	ret = cache_deserialize(c, from_store, len);
+	if (cache_serialized_is_binary((uint8_t *)from_store, len)) {
+		ret = cache_deserialize_binary(c, (uint8_t *)from_store, len);
+	} else {
+		RDEBUG2("%s", from_store);
+		ret = cache_deserialize(c, from_store, len);
+	}
 	free(from_store);
 	if (ret < 0) {
 		RERROR("%s", fr_strerror());
@@ -194,28 +214,49 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
 					 REQUEST *request, void *handle, const rlm_cache_entry_t *c)
 {
+	rlm_cache_memcached_t *driver = instance;
 	rlm_cache_memcached_handle_t *mandle = handle;
 
 	memcached_return_t ret;
 
 	TALLOC_CTX *pool;
-	char *to_store;
+	char *to_store = NULL;
+	size_t len = 0;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
-		talloc_free(pool);
+	/*
+	 *	Fall back to text for entries the binary
+	 *	format can't represent.
+	 */
+	if (driver->serialize == CACHE_SERIALIZE_BINARY) {
+		uint8_t	*bin;
+		ssize_t	slen;
+
+		slen = cache_serialize_binary(pool, &bin, c);
+		if (slen < 0) {
+			RDEBUG2("Serializing entry as text: %s", fr_strerror());
+		} else {
+			to_store = (char *)bin;
+			len = slen;
+		}
+	}
+
+	if (!to_store) {
+		if (cache_serialize(pool, &to_store, c) < 0) {
+			talloc_free(pool);
 
-		return CACHE_ERROR;
+			return CACHE_ERROR;
+		}
+		len = to_store ? talloc_array_length(to_store) - 1 : 0;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
+		            to_store ? to_store : "", len, c->expires, 0);
 	talloc_free(pool);
 	if (ret != MEMCACHED_SUCCESS) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
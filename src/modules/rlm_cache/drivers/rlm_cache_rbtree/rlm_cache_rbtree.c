@@ -19,6 +19,10 @@
  * @file rlm_cache_rbtree.c
  * @brief Simple rbtree based cache.
  *
+ * Entries are also kept on a list, most recently used first.  When the cache
+ * has more than max_entries, or uses more than max_memory, the least recently
+ * used entries are evicted to make room.
+ *
  * @copyright 2014 The FreeRADIUS server project
  */
 #include <freeradius-devel/radiusd.h>
@@ -26,17 +30,27 @@
 #include <freeradius-devel/rad_assert.h>
 #include "../../rlm_cache.h"
 
+typedef struct rlm_cache_rbtree_entry rlm_cache_rbtree_entry_t;
+
 typedef struct rlm_cache_rbtree {
 	rbtree_t		*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t		*heap;		//!< For managing entry expiry.
 
+	rlm_cache_rbtree_entry_t *head;		//!< Most recently used entry.
+	rlm_cache_rbtree_entry_t *tail;		//!< Least recently used entry.
+	size_t			memory;		//!< Bytes used by all the entries.
+
 	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
 } rlm_cache_rbtree_t;
 
-typedef struct rlm_cache_rbtree_entry {
+struct rlm_cache_rbtree_entry {
 	rlm_cache_entry_t	fields;		//!< Entry data.
 	size_t			offset;		//!< Offset used for heap.
-} rlm_cache_rbtree_entry_t;
+
+	rlm_cache_rbtree_entry_t *prev;		//!< More recently used entry.
+	rlm_cache_rbtree_entry_t *next;		//!< Less recently used entry.
+	size_t			size;		//!< Bytes used by the entry, its key and maps.
+};
 
 /** Compare two entries by key
  *
@@ -68,6 +82,68 @@ static int cache_heap_cmp(void const *one, void const *two)
 	return 0;
 }
 
+/** Remove an entry from the LRU list
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] driver	instance.
+ * @param[in] c		entry to remove.
+ */
+static void cache_lru_unlink(rlm_cache_rbtree_t *driver, rlm_cache_rbtree_entry_t *c)
+{
+	if (c->prev) {
+		rad_assert(driver->head != c);
+		c->prev->next = c->next;
+	} else {
+		rad_assert(driver->head == c);
+		driver->head = c->next;
+	}
+	if (c->next) {
+		rad_assert(driver->tail != c);
+		c->next->prev = c->prev;
+	} else {
+		rad_assert(driver->tail == c);
+		driver->tail = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+/** Add an entry to the head of the LRU list
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] driver	instance.
+ * @param[in] c		entry to add.
+ */
+static void cache_lru_link_head(rlm_cache_rbtree_t *driver, rlm_cache_rbtree_entry_t *c)
+{
+	if (driver->head) driver->head->prev = c;
+
+	c->next = driver->head;
+	c->prev = NULL;
+	driver->head = c;
+	if (!driver->tail) driver->tail = c;
+}
+
+/** Remove an entry from the tree, the heap and the LRU list, and free it
+ *
+ * @note Must be called with the mutex held.
+ */
+static void cache_entry_remove(rlm_cache_config_t const *config, rlm_cache_rbtree_t *driver, rlm_cache_entry_t *c)
+{
+	rlm_cache_rbtree_entry_t *my_c = (rlm_cache_rbtree_entry_t *)c;
+
+	fr_heap_extract(driver->heap, c);
+	rbtree_deletebydata(driver->cache, c);
+	cache_lru_unlink(driver, my_c);
+
+	driver->memory -= my_c->size;
+	atomic_fetch_sub_explicit(&config->counters->memory, my_c->size, memory_order_relaxed);
+
+	talloc_free(c);
+}
+
 /** Walk over the cache rbtree
  *
  * Used to free any entries left in the tree on detach.
@@ -163,7 +239,7 @@ static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *con
  * @copydetails cache_entry_find_t
  */
 static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
-				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       rlm_cache_config_t const *config, void *instance,
 				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
 {
 	rlm_cache_rbtree_t *driver = instance;
@@ -176,11 +252,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	 *	Clear out old entries
 	 */
 	c = fr_heap_peek(driver->heap);
-	if (c && (c->expires < request->packet->timestamp.tv_sec)) {
-		fr_heap_extract(driver->heap, c);
-		rbtree_deletebydata(driver->cache, c);
-		talloc_free(c);
-	}
+	if (c && (c->expires < request->packet->timestamp.tv_sec)) cache_entry_remove(config, driver, c);
 
 	/*
 	 *	Is there an entry for this key?
@@ -192,6 +264,14 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		*out = NULL;
 		return CACHE_MISS;
 	}
+
+	/*
+	 *	Move it to the head of the LRU list
+	 */
+	if (driver->head != (rlm_cache_rbtree_entry_t *)c) {
+		cache_lru_unlink(driver, (rlm_cache_rbtree_entry_t *)c);
+		cache_lru_link_head(driver, (rlm_cache_rbtree_entry_t *)c);
+	}
 	*out = c;
 
 	return CACHE_OK;
@@ -203,7 +283,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_expire_t
  */
-static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+static cache_status_t cache_entry_expire(rlm_cache_config_t const *config, void *instance,
 					 REQUEST *request, UNUSED void *handle,
 					 uint8_t const *key, size_t key_len)
 {
@@ -217,9 +297,7 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	c = rbtree_finddata(driver->cache, &my_c);
 	if (!c) return CACHE_MISS;
 
-	fr_heap_extract(driver->heap, c);
-	rbtree_deletebydata(driver->cache, c);
-	talloc_free(c);
+	cache_entry_remove(config, driver, c);
 
 	return CACHE_OK;
 }
@@ -238,12 +316,25 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 
 	rlm_cache_rbtree_t *driver = instance;
 	rlm_cache_entry_t *my_c;
+	rlm_cache_rbtree_entry_t *entry;
 
 	rad_assert(handle == request);
 
 	if (!request) return CACHE_ERROR;
 
 	memcpy(&my_c, &c, sizeof(my_c));
+	entry = (rlm_cache_rbtree_entry_t *)my_c;
+
+	/*
+	 *	The key and maps are all allocated in the
+	 *	context of the entry.
+	 */
+	entry->size = talloc_total_size(my_c);
+	if (config->max_memory && (entry->size > config->max_memory)) {
+		RWDEBUG("Entry uses %zu bytes, which is more than max_memory (%zu bytes)",
+			entry->size, config->max_memory);
+		return CACHE_ERROR;
+	}
 
 	/*
 	 *	Allow overwriting
@@ -266,6 +357,23 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 		return CACHE_ERROR;
 	}
 
+	cache_lru_link_head(driver, entry);
+	driver->memory += entry->size;
+	atomic_fetch_add_explicit(&config->counters->memory, entry->size, memory_order_relaxed);
+
+	/*
+	 *	Make room by evicting the least recently used
+	 *	entries.  The new entry is at the head, and fits
+	 *	on its own, so it's never evicted.
+	 */
+	while (driver->tail != entry) {
+		if ((!config->max_entries || (rbtree_num_elements(driver->cache) <= config->max_entries)) &&
+		    (!config->max_memory || (driver->memory <= config->max_memory))) break;
+
+		cache_entry_remove(config, driver, &driver->tail->fields);
+		atomic_fetch_add_explicit(&config->counters->evictions, 1, memory_order_relaxed);
+	}
+
 	return CACHE_OK;
 }
 
@@ -275,7 +383,7 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
  *
  * @copydetails cache_entry_set_ttl_t
  */
-static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
+static cache_status_t cache_entry_set_ttl(rlm_cache_config_t const *config, void *instance,
 					  REQUEST *request, UNUSED void *handle,
 					  rlm_cache_entry_t *c)
 {
@@ -294,7 +402,7 @@ static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *confi
 	}
 
 	if (!fr_heap_insert(driver->heap, c)) {
-		rbtree_deletebydata(driver->cache, c);	/* make sure we don't leak entries... */
+		cache_entry_remove(config, driver, c);	/* make sure we don't leak entries... */
 		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
 		return CACHE_ERROR;
 	}
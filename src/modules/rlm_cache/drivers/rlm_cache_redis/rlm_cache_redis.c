@@ -27,24 +27,29 @@
 #include <freeradius-devel/rad_assert.h>
 
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
 #include "../../../rlm_redis/redis.h"
 #include "../../../rlm_redis/cluster.h"
 
-static CONF_PARSER driver_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
-
 typedef struct rlm_cache_redis {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
 						//!< Must be first field in this struct.
 
+	char const		*serialize_name; //!< Format to serialize entries in.
+	cache_serialize_format_t serialize;	//!< Format converted to an enum.
+
 	vp_tmpl_t		*created_attr;	//!< LHS of the Cache-Created map.
 	vp_tmpl_t		*expires_attr;	//!< LHS of the Cache-Expires map.
 
 	fr_redis_cluster_t	*cluster;
 } rlm_cache_redis_t;
 
+static CONF_PARSER driver_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("serialize", PW_TYPE_STRING, rlm_cache_redis_t, serialize_name), .dflt = "text" },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Create a new rlm_cache_redis instance
  *
  * @copydetails cache_instantiate_t
@@ -53,11 +58,20 @@ static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CON
 {
 	rlm_cache_redis_t	*driver = instance;
 	char			buffer[256];
+	int			serialize;
 
 	buffer[0] = '\0';
 
 	if (cf_section_parse(conf, driver, driver_config) < 0) return -1;
 
+	serialize = fr_str2int(cache_serialize_formats, driver->serialize_name, -1);
+	if (serialize < 0) {
+		cf_log_err_cs(conf, "Invalid 'serialize' value \"%s\", expected 'text' or 'binary'",
+			      driver->serialize_name);
+		return -1;
+	}
+	driver->serialize = serialize;
+
 	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", config->name);
 
 	driver->cluster = fr_redis_cluster_alloc(driver, conf, &driver->conf, true,
@@ -163,6 +177,28 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_MISS;
 	}
 
+	/*
+	 *	A single element is an entry in the binary format.
+	 */
+	if (reply->elements == 1) {
+		redisReply *blob = reply->element[0];
+
+		if ((blob->type != REDIS_REPLY_STRING) ||
+		    !cache_serialized_is_binary((uint8_t const *)blob->str, blob->len)) {
+			REDEBUG("Invalid entry, expected a single binary string");
+			goto error;
+		}
+
+		c = talloc_zero(NULL, rlm_cache_entry_t);
+		if (cache_deserialize_binary(c, (uint8_t const *)blob->str, blob->len) < 0) {
+			REDEBUG("Failed decoding entry: %s", fr_strerror());
+			talloc_free(c);
+			goto error;
+		}
+		fr_redis_reply_free(reply);
+		goto finish;
+	}
+
 	if (reply->elements % 3) {
 		REDEBUG("Invalid number of reply elements (%zu).  "
 			"Reply must contain triplets of keys operators and values",
@@ -229,9 +265,11 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		talloc_free(map);
 	}
 
+	c->maps = head;
+
+finish:
 	c->key = talloc_memdup(c, key, key_len);
 	c->key_len = key_len;
-	c->maps = head;
 	*out = c;
 
 	return CACHE_OK;
@@ -314,6 +352,34 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	pool = talloc_pool(request, 1024);
 	if (!pool) return CACHE_ERROR;
 
+	/*
+	 *	Store binary entries as a list with a single element,
+	 *	so that either format can be read with LRANGE.
+	 *
+	 *	Fall back to text for entries the binary format
+	 *	can't represent.
+	 */
+	if (driver->serialize == CACHE_SERIALIZE_BINARY) {
+		uint8_t	*bin;
+		ssize_t	slen;
+
+		slen = cache_serialize_binary(pool, &bin, c);
+		if (slen >= 0) {
+			argv = talloc_array(pool, char const *, 3);
+			argv_len = talloc_array(pool, size_t, 3);
+
+			argv[0] = command;
+			argv_len[0] = sizeof(command) - 1;
+			argv[1] = (char const *)c->key;
+			argv_len[1] = c->key_len;
+			argv[2] = (char const *)bin;
+			argv_len[2] = slen;
+
+			goto pipeline;
+		}
+		RDEBUG2("Serializing entry as text: %s", fr_strerror());
+	}
+
 	argv_p = argv = talloc_array(pool, char const *, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 	argv_len_p = argv_len = talloc_array(pool, size_t, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 
@@ -336,6 +402,7 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 		argv_len_p += 3;
 	}
 
+pipeline:
 	RDEBUG3("Pipelining commands");
 
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, c->key, c->key_len, false);
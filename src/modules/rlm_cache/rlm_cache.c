@@ -30,7 +30,11 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/dl.h>
+#include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/util/time.h>
+
+#include <ctype.h>
 
 #include "rlm_cache.h"
 
@@ -41,13 +45,365 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("key", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_cache_config_t, key) },
 	{ FR_CONF_OFFSET("ttl", PW_TYPE_INTEGER, rlm_cache_config_t, ttl), .dflt = "500" },
 	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_cache_config_t, max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_memory", PW_TYPE_SIZE, rlm_cache_config_t, max_memory), .dflt = "0" },
 
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", PW_TYPE_SIGNED, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", PW_TYPE_BOOLEAN, rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_OFFSET("single_flight", PW_TYPE_BOOLEAN, rlm_cache_config_t, single_flight), .dflt = "no" },
+	{ FR_CONF_OFFSET("single_flight_timeout", PW_TYPE_TIMEVAL, rlm_cache_config_t, single_flight_timeout), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("stale_ttl", PW_TYPE_INTEGER, rlm_cache_config_t, stale_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("early_refresh", PW_TYPE_INTEGER, rlm_cache_config_t, early_refresh), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+typedef struct rlm_cache_wait_t rlm_cache_wait_t;
+
+/** Per-thread instance data
+ *
+ */
+typedef struct rlm_cache_thread_t {
+	rlm_cache_t const	*inst;			//!< Instance of rlm_cache.
+	fr_event_list_t		*el;			//!< Event list serviced by this thread.
+	int			pipe_fd[2];		//!< For other threads to tell this one that an
+							//!< entry its requests are waiting for has
+							//!< been fetched.
+	fr_dlist_t		ready;			//!< Waiting requests which can be resumed.
+							//!< Protected by the flights mutex.
+	bool			signalled;		//!< Whether the pipe has been written to since
+							//!< the ready list was last emptied.
+							//!< Protected by the flights mutex.
+} rlm_cache_thread_t;
+
+/** A key which a request is fetching the entry for
+ *
+ */
+typedef struct rlm_cache_flight_t {
+	uint8_t const		*key;			//!< Key of the entry.
+	size_t			key_len;		//!< Length of the key.
+	REQUEST const		*leader;		//!< Request fetching the entry.  Only compared,
+							//!< as it may be running in another thread.
+	struct timeval		expires;		//!< When other requests stop waiting for it.
+	fr_dlist_t		waiters;		//!< Requests waiting for the entry.
+} rlm_cache_flight_t;
+
+struct rlm_cache_flights {
+	pthread_mutex_t		mutex;			//!< Protect the table from multiple readers/writers.
+	fr_hash_table_t		*table;			//!< Keys which are being fetched.
+};
+
+/** Ends a request's flight if the request is freed before it inserts the entry
+ *
+ */
+typedef struct rlm_cache_ticket_t {
+	rlm_cache_t const	*inst;			//!< Instance the flight belongs to.
+	REQUEST const		*leader;		//!< Request fetching the entry.
+	uint8_t const		*key;			//!< Key of the entry.
+	size_t			key_len;		//!< Length of the key.
+	struct timeval		started;		//!< When the request started fetching it.
+} rlm_cache_ticket_t;
+
+/** A request waiting for another to fetch an entry
+ *
+ */
+struct rlm_cache_wait_t {
+	rlm_cache_thread_t	*thread;		//!< Thread the waiting request runs in.
+	REQUEST			*request;		//!< The waiting request.
+	unlang_stack_t		*stack;			//!< Interpreter stack which yielded.
+	uint8_t const		*key;			//!< Key of the entry.
+	size_t			key_len;		//!< Length of the key.
+	struct timeval		expires;		//!< When we stop waiting.
+	fr_dlist_t		entry;			//!< Entry in the flight's waiters, or in the
+							//!< thread's ready list.  Protected by the
+							//!< flights mutex.
+};
+
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
+
+static rlm_rcode_t mod_cache_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
+static uint32_t cache_flight_hash(void const *data)
+{
+	rlm_cache_flight_t const *flight = data;
+
+	return fr_hash(flight->key, flight->key_len);
+}
+
+static int cache_flight_cmp(void const *one, void const *two)
+{
+	rlm_cache_flight_t const *a = one;
+	rlm_cache_flight_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Stop other requests waiting for an entry
+ *
+ * The waiting requests may be running in other threads, so they're moved
+ * to their thread's ready list, and the thread is woken up to resume them.
+ *
+ * @param[in] inst	of rlm_cache.
+ * @param[in] leader	Only end the flight if this request is fetching the entry.
+ *			If NULL, end it regardless.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	Length of the key.
+ */
+static void cache_flight_end(rlm_cache_t const *inst, REQUEST const *leader, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_flight_t	find, *flight;
+	fr_dlist_t		*entry;
+	rlm_cache_wait_t	*waiting;
+	uint8_t			data = 0;
+
+	find.key = key;
+	find.key_len = key_len;
+
+	pthread_mutex_lock(&inst->flights->mutex);
+	flight = fr_hash_table_finddata(inst->flights->table, &find);
+	if (flight && (!leader || (flight->leader == leader))) {
+		fr_hash_table_yank(inst->flights->table, flight);
+
+		while ((entry = FR_DLIST_FIRST(flight->waiters)) != NULL) {
+			waiting = fr_ptr_to_type(rlm_cache_wait_t, entry, entry);
+
+			FR_DLIST_REMOVE(waiting->entry);
+			FR_DLIST_INSERT_TAIL(waiting->thread->ready, waiting->entry);
+
+			if (waiting->thread->signalled) continue;
+
+			(void) write(waiting->thread->pipe_fd[1], &data, 1);
+			waiting->thread->signalled = true;
+		}
+
+		talloc_free(flight);
+	}
+	pthread_mutex_unlock(&inst->flights->mutex);
+}
+
+static int _cache_ticket_free(rlm_cache_ticket_t *ticket)
+{
+	cache_flight_end(ticket->inst, ticket->leader, ticket->key, ticket->key_len);
+
+	return 0;
+}
+
+/** Find out whether another request is fetching an entry
+ *
+ * If no other request is fetching it, or the one which was has taken longer
+ * than single_flight_timeout, the current request becomes the one fetching it.
+ *
+ * @param[in] inst	of rlm_cache.
+ * @param[in] request	Current request.
+ * @param[in] waiting	If not NULL, added to the flight's waiters if another
+ *			request is fetching the entry.  This is done under the
+ *			same lock as the check, so the request can't miss being
+ *			woken up.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	Length of the key.
+ * @return
+ *	- 0 if the current request should fetch the entry.
+ *	- 1 if another request is fetching it.
+ */
+static int cache_flight_start(rlm_cache_t const *inst, REQUEST *request, rlm_cache_wait_t *waiting,
+			      uint8_t const *key, size_t key_len)
+{
+	rlm_cache_flight_t	find, *flight;
+	rlm_cache_ticket_t	*ticket;
+	struct timeval		now;
+
+	/*
+	 *	The request was fetching a different entry, and has
+	 *	given up on it.
+	 */
+	ticket = request_data_get(request, inst->flights, 0);
+	if (ticket && ((ticket->key_len != key_len) || (memcmp(ticket->key, key, key_len) != 0))) {
+		TALLOC_FREE(ticket);
+	}
+
+	find.key = key;
+	find.key_len = key_len;
+
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&inst->flights->mutex);
+	flight = fr_hash_table_finddata(inst->flights->table, &find);
+	if (flight && (flight->leader != request) && (fr_timeval_cmp(&now, &flight->expires) < 0)) {
+		if (waiting) FR_DLIST_INSERT_TAIL(flight->waiters, waiting->entry);
+		pthread_mutex_unlock(&inst->flights->mutex);
+		talloc_free(ticket);
+		return 1;
+	}
+
+	if (!flight) {
+		MEM(flight = talloc_zero(inst->flights, rlm_cache_flight_t));
+		MEM(flight->key = talloc_memdup(flight, key, key_len));
+		flight->key_len = key_len;
+		FR_DLIST_INIT(flight->waiters);
+
+		if (!fr_hash_table_insert(inst->flights->table, flight)) {
+			talloc_free(flight);
+			pthread_mutex_unlock(&inst->flights->mutex);
+			talloc_free(ticket);
+			return 0;
+		}
+	}
+	flight->leader = request;
+	fr_timeval_add(&flight->expires, &now, &inst->config.single_flight_timeout);
+	pthread_mutex_unlock(&inst->flights->mutex);
+
+	if (!ticket) {
+		MEM(ticket = talloc_zero(NULL, rlm_cache_ticket_t));
+		ticket->inst = inst;
+		ticket->leader = request;
+		MEM(ticket->key = talloc_memdup(ticket, key, key_len));
+		ticket->key_len = key_len;
+		ticket->started = now;
+		talloc_set_destructor(ticket, _cache_ticket_free);
+	}
+	request_data_add(request, inst->flights, 0, ticket, true, true, false);
+
+	RDEBUG2("Fetching entry for any other requests which miss");
+
+	return 0;
+}
+
+/** Remove a request from the list it's waiting in
+ *
+ */
+static void cache_wait_unlink(rlm_cache_wait_t *waiting)
+{
+	rlm_cache_t const *inst = waiting->thread->inst;
+
+	pthread_mutex_lock(&inst->flights->mutex);
+	FR_DLIST_REMOVE(waiting->entry);
+	pthread_mutex_unlock(&inst->flights->mutex);
+}
+
+static int _cache_wait_free(rlm_cache_wait_t *waiting)
+{
+	cache_wait_unlink(waiting);
+
+	return 0;
+}
+
+/** Resume a waiting request when it's waited for long enough
+ *
+ */
+static void cache_wait_timeout(REQUEST *request, UNUSED void *instance, UNUSED void *thread, UNUSED void *ctx,
+			       UNUSED struct timeval *fired)
+{
+	unlang_resumable(request);
+}
+
+/** Resume requests whose entries have been fetched by requests in other threads
+ *
+ */
+static void cache_thread_signal(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	rlm_cache_thread_t	*t = ctx;
+	fr_dlist_t		*entry;
+	rlm_cache_wait_t	*waiting;
+	unlang_stack_t		*stack;
+	uint8_t			buffer[64];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	for (;;) {
+		pthread_mutex_lock(&t->inst->flights->mutex);
+		entry = FR_DLIST_FIRST(t->ready);
+		if (!entry) {
+			t->signalled = false;
+			pthread_mutex_unlock(&t->inst->flights->mutex);
+			return;
+		}
+		waiting = fr_ptr_to_type(rlm_cache_wait_t, entry, entry);
+		FR_DLIST_REMOVE(waiting->entry);
+		pthread_mutex_unlock(&t->inst->flights->mutex);
+
+		/*
+		 *	Resume the stack which yielded.  It may be
+		 *	one of the children of a "parallel" section.
+		 */
+		stack = waiting->request->stack;
+		waiting->request->stack = waiting->stack;
+		unlang_resumable(waiting->request);
+		waiting->request->stack = stack;
+	}
+}
+
+/** Wait for another request to fetch an entry, if one is fetching it
+ *
+ * Called when a lookup misses, and the caller is going to fetch the entry
+ * and insert it itself.
+ *
+ * @param[in] inst	of rlm_cache.
+ * @param[in] t		Thread specific data.
+ * @param[in] request	Current request.
+ * @param[in,out] waiting	State of the wait.  NULL if the request hasn't waited yet.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	Length of the key.
+ * @return
+ *	- #RLM_MODULE_YIELD if the request should yield with *waiting as the ctx.
+ *	- #RLM_MODULE_NOTFOUND if the request should fetch the entry itself.
+ */
+static rlm_rcode_t cache_wait(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request,
+			      rlm_cache_wait_t **waiting, uint8_t const *key, size_t key_len)
+{
+	struct timeval	now;
+	bool		first = false;
+
+	/*
+	 *	The table is only there for refreshes.
+	 */
+	if (!inst->config.single_flight) {
+		(void) cache_flight_start(inst, request, NULL, key, key_len);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	gettimeofday(&now, NULL);
+
+	if (!*waiting) {
+		MEM(*waiting = talloc_zero(request, rlm_cache_wait_t));
+		(*waiting)->thread = t;
+		(*waiting)->request = request;
+		MEM((*waiting)->key = talloc_memdup(*waiting, key, key_len));
+		(*waiting)->key_len = key_len;
+		fr_timeval_add(&(*waiting)->expires, &now, &inst->config.single_flight_timeout);
+		FR_DLIST_INIT((*waiting)->entry);
+		talloc_set_destructor(*waiting, _cache_wait_free);
+		first = true;
+	} else if (fr_timeval_cmp(&now, &(*waiting)->expires) >= 0) {
+		RWDEBUG("Timed out waiting for another request to fetch the entry");
+		atomic_fetch_add_explicit(&inst->config.counters->coalesce_timeouts, 1, memory_order_relaxed);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	if (cache_flight_start(inst, request, *waiting, key, key_len) == 0) {
+		if (first) TALLOC_FREE(*waiting);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	/*
+	 *	The request fetching the entry wakes us up when it's
+	 *	inserted.  This is in case it never is.
+	 */
+	if (unlang_event_timeout_add(request, cache_wait_timeout, *waiting, &(*waiting)->expires) < 0) {
+		cache_wait_unlink(*waiting);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	if (first) atomic_fetch_add_explicit(&inst->config.counters->coalesced, 1, memory_order_relaxed);
+
+	RDEBUG2("Waiting for another request to fetch the entry");
+
+	(*waiting)->stack = request->stack;
+
+	return RLM_MODULE_YIELD;
+}
+
 /** Get exclusive use of a handle to access the cache
  *
  */
@@ -120,6 +476,146 @@ static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 	*c = NULL;
 }
 
+/** Update the average time taken to fetch an entry
+ *
+ * Called when a request which was fetching an entry inserts it.
+ */
+static void cache_fetch_time_update(rlm_cache_t const *inst, rlm_cache_ticket_t const *ticket,
+				    uint8_t const *key, size_t key_len)
+{
+	struct timeval	now, elapsed;
+	uint64_t	sample, avg;
+
+	if ((ticket->key_len != key_len) || (memcmp(ticket->key, key, key_len) != 0)) return;
+
+	gettimeofday(&now, NULL);
+	if (fr_timeval_cmp(&now, &ticket->started) < 0) return;
+
+	fr_timeval_subtract(&elapsed, &now, &ticket->started);
+	sample = ((uint64_t) elapsed.tv_sec * USEC) + elapsed.tv_usec;
+
+	/*
+	 *	Exponentially weighted, so it follows the backend as
+	 *	it speeds up or slows down.  Races between threads
+	 *	only lose a sample.
+	 */
+	avg = atomic_load_explicit(&inst->config.counters->fetch_time, memory_order_relaxed);
+	if (avg == 0) {
+		avg = sample;
+	} else {
+		avg = avg - (avg / 8) + (sample / 8);
+	}
+	atomic_store_explicit(&inst->config.counters->fetch_time, avg, memory_order_relaxed);
+}
+
+/** Draw from an exponential distribution with a mean of 1
+ *
+ * i.e. -ln(U) for a uniform U in (0, 1].  log2(U) is approximated linearly
+ * between powers of two, which is close enough for spreading out refreshes,
+ * and avoids linking against libm.
+ */
+static double cache_rand_exp(void)
+{
+	uint32_t	u = fr_rand() | 1;
+	int		msb = 31;
+	double		log2_u;
+
+	while (!(u & (1U << msb))) msb--;
+
+	log2_u = (msb - 32) + ((double) (u - (1U << msb)) / (1U << msb));
+
+	return -log2_u * 0.6931471805599453;	/* ln(2) */
+}
+
+/** Decide whether a request should refresh the entry it found
+ *
+ * The entry is refreshed if it's stale, i.e. it's in the stale_ttl window
+ * after it expired.
+ *
+ * If early_refresh is set, it may also be refreshed before it expires.  This
+ * is XFetch (Vattani et al., "Optimal Probabilistic Cache Stampede Prevention"),
+ * with beta = early_refresh / 100, and delta being the average time requests
+ * take to fetch an entry.  Entries are refreshed earlier the longer it takes,
+ * and lookups for the same entry become more likely to refresh it as it gets
+ * closer to expiring.
+ *
+ * @param[in] inst	of rlm_cache.
+ * @param[in] request	Current request.
+ * @param[in] c		entry which was found.
+ * @param[out] stale	Whether the entry has expired.
+ * @return true if the entry should be refreshed.
+ */
+static bool cache_refresh_due(rlm_cache_t const *inst, REQUEST *request, rlm_cache_entry_t const *c, bool *stale)
+{
+	double	now, fresh_until, delta;
+
+	now = request->packet->timestamp.tv_sec + (request->packet->timestamp.tv_usec / (double) USEC);
+
+	/*
+	 *	Entries are valid up to the end of the second
+	 *	they expire in.
+	 */
+	fresh_until = (c->expires - inst->config.stale_ttl) + 1;
+
+	*stale = (now >= fresh_until);
+	if (*stale) return true;
+
+	if (!inst->config.early_refresh) return false;
+
+	delta = atomic_load_explicit(&inst->config.counters->fetch_time, memory_order_relaxed) / (double) USEC;
+	if (delta == 0) return false;
+
+	return (now + (delta * (inst->config.early_refresh / 100.0) * cache_rand_exp())) >= fresh_until;
+}
+
+/** Check whether the entry a request found needs refreshing
+ *
+ * Only one request refreshes an entry at once.  The others are served the
+ * entry as it is, even if it's stale.
+ *
+ * The refresh isn't done in the background.  The module doesn't know how to
+ * fetch the entry, that's done by the policy which runs when it returns
+ * notfound.  So the request which refreshes the entry pays the cost of
+ * fetching it, as it would on a miss.
+ *
+ * @param[in] inst	of rlm_cache.
+ * @param[in] request	Current request.
+ * @param[in,out] c	entry which was found.  Freed, and set to NULL, if the
+ *			current request should refresh it.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	Length of the key.
+ * @return
+ *	- #RLM_MODULE_OK if the entry should be used.
+ *	- #RLM_MODULE_NOTFOUND if the request should refresh the entry, as if it had missed.
+ */
+static rlm_rcode_t cache_revalidate(rlm_cache_t const *inst, REQUEST *request, rlm_cache_entry_t **c,
+				    uint8_t const *key, size_t key_len)
+{
+	bool stale;
+
+	if (!cache_refresh_due(inst, request, *c, &stale)) return RLM_MODULE_OK;
+
+	if (cache_flight_start(inst, request, NULL, key, key_len) == 1) {
+		if (stale) {
+			RDEBUG2("Entry expired, using it while another request refreshes it");
+			atomic_fetch_add_explicit(&inst->config.counters->stale, 1, memory_order_relaxed);
+		}
+		return RLM_MODULE_OK;
+	}
+
+	if (stale) {
+		RDEBUG2("Entry expired, refreshing it");
+	} else {
+		RDEBUG2("Refreshing entry before it expires");
+	}
+	atomic_fetch_add_explicit(&inst->config.counters->refreshes, 1, memory_order_relaxed);
+
+	cache_free(inst, c);
+	*c = NULL;
+
+	return RLM_MODULE_NOTFOUND;
+}
+
 /** Merge a cached entry into a #REQUEST
  *
  * @return
@@ -206,6 +702,7 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 				RDEBUG("No cache entry found for \"%s\"", p);
 				talloc_free(p);
 			}
+			atomic_fetch_add_explicit(&inst->config.counters->misses, 1, memory_order_relaxed);
 			return RLM_MODULE_NOTFOUND;
 
 		/* FALL-THROUGH */
@@ -231,8 +728,9 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 			talloc_free(p);
 		}
 
-		inst->driver->expire(&inst->config, inst->driver_inst, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
+		atomic_fetch_add_explicit(&inst->config.counters->misses, 1, memory_order_relaxed);
 		return RLM_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
 
@@ -246,6 +744,7 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 
 	c->hits++;
 	*out = c;
+	atomic_fetch_add_explicit(&inst->config.counters->hits, 1, memory_order_relaxed);
 
 	return RLM_MODULE_OK;
 }
@@ -299,7 +798,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		return RLM_MODULE_FAIL;
 	}
@@ -310,7 +809,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	c->key = talloc_memdup(c, key, key_len);
 	c->key_len = key_len;
 	c->created = c->expires = request->packet->timestamp.tv_sec;
-	c->expires += ttl;
+	c->expires += ttl + inst->config.stale_ttl;
 
 	last = &c->maps;
 
@@ -449,6 +948,23 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 
 		case CACHE_OK:
 			RDEBUG("Committed entry, TTL %d seconds", ttl);
+			atomic_fetch_add_explicit(&inst->config.counters->inserts, 1, memory_order_relaxed);
+
+			/*
+			 *	Requests waiting for the entry can
+			 *	now find it.
+			 */
+			if (inst->flights) {
+				rlm_cache_ticket_t *ticket;
+
+				cache_flight_end(inst, NULL, key, key_len);
+
+				ticket = request_data_get(request, inst->flights, 0);
+				if (ticket) {
+					cache_fetch_time_update(inst, ticket, key, key_len);
+					talloc_free(ticket);
+				}
+			}
 			cache_free(inst, &c);
 			return merge ? RLM_MODULE_UPDATED :
 				       RLM_MODULE_OK;
@@ -536,12 +1052,17 @@ static int cache_verify(vp_map_t *map, void *ctx)
  *
  * If you want to cache something different in different sections, configure
  * another cache module.
+ *
+ * @param[in] inst	of rlm_cache.
+ * @param[in] t		Thread specific data.
+ * @param[in] request	Current request.
+ * @param[in] waiting	State of the wait for another request to fetch the entry,
+ *			if the request has been resumed.  Otherwise NULL.
  */
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t cache_process(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request,
+				 rlm_cache_wait_t *waiting)
 {
 	rlm_cache_entry_t	*c = NULL;
-	rlm_cache_t const	*inst = instance;
 
 	rlm_cache_handle_t	*handle;
 
@@ -583,6 +1104,12 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		rad_assert(!inst->driver->acquire || handle);
 
+		if (c && (inst->config.stale_ttl || inst->config.early_refresh)) {
+			cache_revalidate(inst, request, &c, key, key_len);
+		}
+
+		if (!c && inst->flights) goto coalesce;
+
 		rcode = c ? RLM_MODULE_OK:
 			    RLM_MODULE_NOTFOUND;
 		goto finish;
@@ -625,6 +1152,10 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	 */
 	if (merge) {
 		rcode = cache_find(&c, inst, request, &handle, key, key_len);
+		if ((rcode == RLM_MODULE_OK) && (inst->config.stale_ttl || inst->config.early_refresh)) {
+			rcode = cache_revalidate(inst, request, &c, key, key_len);
+		}
+
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -635,6 +1166,14 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 			break;
 
 		case RLM_MODULE_NOTFOUND:
+			/*
+			 *	The caller is going to fetch the entry
+			 *	and insert it, so other requests for
+			 *	the key can wait for it, or be served
+			 *	the stale entry.
+			 */
+			if (!insert && inst->flights) goto coalesce;
+
 			rcode = RLM_MODULE_NOTFOUND;
 			exists = 0;
 			break;
@@ -710,7 +1249,7 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	if (set_ttl && (exists == 1)) {
 		rad_assert(c);
 
-		c->expires = request->packet->timestamp.tv_sec + ttl;
+		c->expires = request->packet->timestamp.tv_sec + ttl + inst->config.stale_ttl;
 
 		switch (cache_set_ttl(inst, request, &handle, c)) {
 		case RLM_MODULE_FAIL:
@@ -754,6 +1293,18 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 		goto finish;
 	}
 
+	goto finish;
+
+coalesce:
+	rcode = cache_wait(inst, t, request, &waiting, key, key_len);
+	if (rcode == RLM_MODULE_YIELD) {
+		/*
+		 *	Leave the control attributes for when
+		 *	the request resumes.
+		 */
+		cache_release(inst, request, &handle);
+		return unlang_yield(request, mod_cache_resume, NULL, waiting);
+	}
 
 finish:
 	cache_free(inst, &c);
@@ -781,6 +1332,32 @@ finish:
 	return rcode;
 }
 
+static rlm_rcode_t mod_cache_it(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_cache_it(void *instance, void *thread, REQUEST *request)
+{
+	return cache_process(instance, thread, request, NULL);
+}
+
+/** Look the entry up again, once it's been fetched or we've waited long enough
+ *
+ */
+static rlm_rcode_t mod_cache_resume(REQUEST *request, void *instance, void *thread, void *ctx)
+{
+	rlm_cache_wait_t	*waiting = talloc_get_type_abort(ctx, rlm_cache_wait_t);
+	rlm_rcode_t		rcode;
+
+	/*
+	 *	If we were woken up by the timeout, we're still in
+	 *	the flight's list of waiters.
+	 */
+	cache_wait_unlink(waiting);
+
+	rcode = cache_process(instance, thread, request, waiting);
+	if (rcode != RLM_MODULE_YIELD) talloc_free(waiting);
+
+	return rcode;
+}
+
 /** Allow single attribute values to be retrieved from the cache
  *
  */
@@ -820,15 +1397,18 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		return -1;
 	}
 
-	switch (cache_find(&c, mod_inst, request, handle, key, key_len)) {
+	switch (cache_find(&c, mod_inst, request, &handle, key, key_len)) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
+		talloc_free(target);
+		cache_release(mod_inst, request, &handle);
 		return 0;
 
 	default:
 		talloc_free(target);
+		cache_release(mod_inst, request, &handle);
 		return -1;
 	}
 
@@ -844,17 +1424,71 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 
 	talloc_free(target);
 
-	/*
-	 *	Check if we found a matching map
-	 */
-	if (!map) return 0;
-
 	cache_free(mod_inst, &c);
 	cache_release(mod_inst, request, &handle);
 
 	return ret;
 }
 
+/** Return the value of one of the cache's counters
+ *
+ * Example:
+@verbatim
+"%{cache_stats:hits}" == 1234
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static ssize_t cache_stats_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
+				void const *mod_inst, UNUSED void const *xlat_inst,
+				REQUEST *request, char const *fmt)
+{
+	rlm_cache_t const	*inst = mod_inst;
+	rlm_cache_counters_t	*counters = inst->config.counters;
+	uint64_t		value;
+
+	while (isspace((uint8_t) *fmt)) fmt++;
+
+	if (strcmp(fmt, "hits") == 0) {
+		value = atomic_load_explicit(&counters->hits, memory_order_relaxed);
+	} else if (strcmp(fmt, "misses") == 0) {
+		value = atomic_load_explicit(&counters->misses, memory_order_relaxed);
+	} else if (strcmp(fmt, "inserts") == 0) {
+		value = atomic_load_explicit(&counters->inserts, memory_order_relaxed);
+	} else if (strcmp(fmt, "evictions") == 0) {
+		value = atomic_load_explicit(&counters->evictions, memory_order_relaxed);
+	} else if (strcmp(fmt, "memory") == 0) {
+		value = atomic_load_explicit(&counters->memory, memory_order_relaxed);
+	} else if (strcmp(fmt, "coalesced") == 0) {
+		value = atomic_load_explicit(&counters->coalesced, memory_order_relaxed);
+	} else if (strcmp(fmt, "coalesce_timeouts") == 0) {
+		value = atomic_load_explicit(&counters->coalesce_timeouts, memory_order_relaxed);
+	} else if (strcmp(fmt, "stale") == 0) {
+		value = atomic_load_explicit(&counters->stale, memory_order_relaxed);
+	} else if (strcmp(fmt, "refreshes") == 0) {
+		value = atomic_load_explicit(&counters->refreshes, memory_order_relaxed);
+	} else if (strcmp(fmt, "fetch_time") == 0) {
+		value = atomic_load_explicit(&counters->fetch_time, memory_order_relaxed);
+	} else if (strcmp(fmt, "entries") == 0) {
+		if (!inst->driver->count) {
+			REDEBUG("Driver %s can't count its entries", inst->driver->name);
+			return -1;
+		}
+		rlm_cache_handle_t *handle = NULL;
+
+		if (cache_acquire(&handle, inst, request) < 0) return -1;
+		value = inst->driver->count(&inst->config, inst->driver_inst, request, handle);
+		cache_release(inst, request, &handle);
+	} else {
+		REDEBUG("Unknown cache statistic \"%s\"", fmt);
+		return -1;
+	}
+
+	MEM(*out = talloc_asprintf(request, "%" PRIu64, value));
+
+	return talloc_array_length(*out) - 1;
+}
+
 /** Free any memory allocated under the instance
  *
  */
@@ -864,6 +1498,11 @@ static int mod_detach(void *instance)
 
 	talloc_free(inst->maps);
 
+	if (inst->flights) {
+		pthread_mutex_destroy(&inst->flights->mutex);
+		talloc_free(inst->flights);
+	}
+
 	/*
 	 *	We need to explicitly free all children, so if the driver
 	 *	parented any memory off the instance, their destructors
@@ -888,7 +1527,8 @@ static int mod_detach(void *instance)
  */
 static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 {
-	rlm_cache_t *inst = instance;
+	rlm_cache_t	*inst = instance;
+	char		buffer[256];
 
 	inst->cs = conf;
 
@@ -900,6 +1540,24 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	 */
 	xlat_register(inst, inst->config.name, cache_xlat, NULL, NULL, 0, 0);
 
+	/*
+	 *	And the one which returns the counters
+	 */
+	MEM(inst->config.counters = talloc_zero(inst, rlm_cache_counters_t));
+	atomic_init(&inst->config.counters->hits, 0);
+	atomic_init(&inst->config.counters->misses, 0);
+	atomic_init(&inst->config.counters->inserts, 0);
+	atomic_init(&inst->config.counters->evictions, 0);
+	atomic_init(&inst->config.counters->memory, 0);
+	atomic_init(&inst->config.counters->coalesced, 0);
+	atomic_init(&inst->config.counters->coalesce_timeouts, 0);
+	atomic_init(&inst->config.counters->stale, 0);
+	atomic_init(&inst->config.counters->refreshes, 0);
+	atomic_init(&inst->config.counters->fetch_time, 0);
+
+	snprintf(buffer, sizeof(buffer), "%s_stats", inst->config.name);
+	xlat_register(inst, buffer, cache_stats_xlat, NULL, NULL, 0, 0);
+
 	return 0;
 }
 
@@ -973,6 +1631,33 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	Refreshes use the same table as single_flight, so
+	 *	that only one request refreshes an entry at once.
+	 */
+	if (inst->config.single_flight || inst->config.stale_ttl || inst->config.early_refresh) {
+		if (!inst->config.single_flight_timeout.tv_sec && !inst->config.single_flight_timeout.tv_usec) {
+			cf_log_err_cs(conf, "Must set 'single_flight_timeout' to non-zero");
+			return -1;
+		}
+
+		/*
+		 *	Not parented by the instance, as the instance
+		 *	data is read only once it's instantiated.
+		 */
+		MEM(inst->flights = talloc_zero(NULL, rlm_cache_flights_t));
+		if (pthread_mutex_init(&inst->flights->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			TALLOC_FREE(inst->flights);
+			return -1;
+		}
+		inst->flights->table = fr_hash_table_create(inst->flights, cache_flight_hash, cache_flight_cmp, NULL);
+		if (!inst->flights->table) {
+			cf_log_err_cs(conf, "Failed creating single flight table");
+			return -1;
+		}
+	}
+
 	update = cf_section_sub_find(inst->cs, "update");
 	if (!update) {
 		cf_log_err_cs(conf, "Must have an 'update' section in order to cache anything");
@@ -996,6 +1681,71 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/** Create a pipe for other threads to wake up this one's waiting requests
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_cache_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_cache_t const	*inst = instance;
+	rlm_cache_thread_t	*t = thread;
+
+	t->inst = inst;
+	t->el = el;
+	t->pipe_fd[0] = t->pipe_fd[1] = -1;
+	FR_DLIST_INIT(t->ready);
+
+	if (!inst->config.single_flight) return 0;
+
+	if (pipe(t->pipe_fd) < 0) {
+		ERROR("Failed creating pipe: %s", fr_syserror(errno));
+		t->pipe_fd[0] = t->pipe_fd[1] = -1;
+		return -1;
+	}
+
+#ifdef F_SETNOSIGPIPE
+	{
+		int on = 1;
+
+		(void) fcntl(t->pipe_fd[0], F_SETNOSIGPIPE, &on);
+		(void) fcntl(t->pipe_fd[1], F_SETNOSIGPIPE, &on);
+	}
+#endif
+	fr_nonblock(t->pipe_fd[0]);
+	fr_nonblock(t->pipe_fd[1]);
+
+	if (fr_event_fd_insert(el, t->pipe_fd[0], cache_thread_signal, NULL, NULL, t) < 0) {
+		ERROR("Failed inserting event for pipe: %s", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Close the pipe
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_cache_thread_t	*t = thread;
+
+	if (t->pipe_fd[0] < 0) return 0;
+
+	(void) fr_event_fd_delete(t->el, t->pipe_fd[0]);
+	close(t->pipe_fd[0]);
+	close(t->pipe_fd[1]);
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -1009,10 +1759,13 @@ rad_module_t rlm_cache = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "cache",
 	.inst_size	= sizeof(rlm_cache_t),
+	.thread_inst_size	= sizeof(rlm_cache_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_cache_it,
 		[MOD_PREACCT]		= mod_cache_it,
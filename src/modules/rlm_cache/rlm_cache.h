@@ -27,6 +27,12 @@ RCSIDH(cache_h, "$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/dl.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 typedef struct cache_driver cache_driver_t;
 
 typedef void rlm_cache_handle_t;
@@ -40,6 +46,31 @@ typedef enum {
 	CACHE_MISS	= 1				//!< Cache entry notfound
 } cache_status_t;
 
+/** Counters for an instance of rlm_cache
+ *
+ * Updated by rlm_cache and by its driver, without any locks.
+ */
+typedef struct rlm_cache_counters_t {
+	atomic_uint_fast64_t	hits;			//!< Lookups which found a valid entry.
+	atomic_uint_fast64_t	misses;			//!< Lookups which didn't.
+	atomic_uint_fast64_t	inserts;		//!< Entries added to the cache.
+	atomic_uint_fast64_t	evictions;		//!< Entries removed by the driver before they
+							//!< expired, to make room for new ones.
+	atomic_uint_fast64_t	memory;			//!< Bytes used by entries.  Only for drivers
+							//!< which enforce max_memory.
+	atomic_uint_fast64_t	coalesced;		//!< Misses which waited for another request
+							//!< to fetch the entry.
+	atomic_uint_fast64_t	coalesce_timeouts;	//!< Misses which gave up waiting.
+	atomic_uint_fast64_t	stale;			//!< Expired entries served while another
+							//!< request refreshed them.
+	atomic_uint_fast64_t	refreshes;		//!< Hits treated as misses, so that the
+							//!< entry would be refreshed.
+	atomic_uint_fast64_t	fetch_time;		//!< Moving average of how long requests take
+							//!< to fetch an entry after a miss (usec).
+} rlm_cache_counters_t;
+
+typedef struct rlm_cache_flights rlm_cache_flights_t;
+
 /** Configuration for the rlm_cache module
  *
  * This is separate from the #rlm_cache_t struct, to limit driver's visibility of
@@ -51,8 +82,18 @@ typedef struct rlm_cache_config_t {
 	vp_tmpl_t		*key;			//!< What to expand to get the value of the key.
 	uint32_t		ttl;			//!< How long an entry is valid for.
 	uint32_t		max_entries;		//!< Maximum entries allowed.
+	size_t			max_memory;		//!< Maximum bytes used by entries.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+	bool			single_flight;		//!< Make misses for a key wait while the first
+							//!< request to miss fetches the entry.
+	struct timeval		single_flight_timeout;	//!< How long they wait.
+	uint32_t		stale_ttl;		//!< How long entries are served for after they
+							//!< expire, while they're refreshed.
+	uint32_t		early_refresh;		//!< How eagerly entries are refreshed before
+							//!< they expire, as a percentage.  0 disables.
+
+	rlm_cache_counters_t	*counters;		//!< Hit, miss and eviction counters.
 } rlm_cache_config_t;
 
 /*
@@ -72,6 +113,10 @@ typedef struct rlm_cache_t {
 	vp_map_t		*maps;			//!< Attribute map applied to users.
 							//!< and profiles.
 	CONF_SECTION		*cs;
+
+	rlm_cache_flights_t	*flights;		//!< Keys which are being fetched, if
+							//!< single_flight, stale_ttl or early_refresh
+							//!< are enabled.
 } rlm_cache_t;
 
 typedef struct rlm_cache_entry_t {
@@ -223,6 +268,9 @@ typedef cache_status_t	(*cache_entry_set_ttl_t)(rlm_cache_config_t const *config
  *
  * @note This callback is optional. Though max_entries will not be enforced if it is not provided.
  *
+ * Drivers which evict entries to stay within max_entries should never return more than
+ * max_entries, so that inserts aren't refused.
+ *
  * @param[in] config for this instance of the rlm_cache module.
  * @param[in] instance Driver specific instance data.
  * @param[in] request The current request.
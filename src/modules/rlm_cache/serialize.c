@@ -25,9 +25,45 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/rad_assert.h>
+
 #include "rlm_cache.h"
 #include "serialize.h"
 
+const FR_NAME_NUMBER cache_serialize_formats[] = {
+	{ "text",	CACHE_SERIALIZE_TEXT },
+	{ "binary",	CACHE_SERIALIZE_BINARY },
+
+	{ NULL,		-1 }
+};
+
+/*
+ *	The binary format (all integers in network byte order) is:
+ *
+ *	uint8_t		CACHE_BINARY_MAGIC
+ *	uint8_t		CACHE_BINARY_VERSION
+ *	uint64_t	created
+ *	uint64_t	expires
+ *
+ *	followed by, for each map:
+ *
+ *	uint8_t		operator
+ *	uint8_t		list
+ *	int8_t		tag
+ *	uint8_t		data type
+ *	int32_t		instance number
+ *	uint32_t	vendor
+ *	uint32_t	attribute
+ *	uint32_t	value length
+ *	uint8_t		value[length]
+ *
+ *	The magic can't start a text entry, so the two can be told apart.
+ */
+#define CACHE_BINARY_MAGIC	0xfc
+#define CACHE_BINARY_VERSION	1
+#define CACHE_BINARY_HDR_LEN	18
+#define CACHE_BINARY_MAP_LEN	20
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -172,3 +208,407 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 
 	return 0;
 }
+
+/** Return how many bytes the binary format uses for a value
+ *
+ * @param[in] data	to encode.
+ * @return
+ *	- The number of bytes.
+ *	- -1 if the type can't be encoded.
+ */
+static ssize_t cache_binary_value_len(value_box_t const *data)
+{
+	switch (data->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		return data->length;
+
+	case PW_TYPE_SIZE:
+	case PW_TYPE_DECIMAL:
+		return 8;
+
+	case PW_TYPE_TIMEVAL:
+		return 12;
+
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV4_PREFIX:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IPV6_PREFIX:
+	case PW_TYPE_IFID:
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_BOOLEAN:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_SIGNED:
+	case PW_TYPE_DATE:
+	case PW_TYPE_ABINARY:
+		return value_box_field_sizes[data->type];
+
+	default:
+		fr_strerror_printf("Can't serialize values of type %s",
+				   fr_int2str(dict_attr_types, data->type, "<INVALID>"));
+		return -1;
+	}
+}
+
+/** Write a value in the binary format
+ *
+ * @param[out] out	Where to write the value.  Must have room for
+ *			cache_binary_value_len() bytes.
+ * @param[in] data	to encode.
+ */
+static void cache_binary_value_encode(uint8_t *out, value_box_t const *data)
+{
+	value_box_t	net;
+	uint64_t	u64;
+	uint32_t	u32;
+
+	switch (data->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		if (data->length) memcpy(out, data->datum.octets, data->length);
+		return;
+
+	case PW_TYPE_SIZE:
+		u64 = htonll((uint64_t) data->datum.size);
+		memcpy(out, &u64, sizeof(u64));
+		return;
+
+	case PW_TYPE_DECIMAL:
+		memcpy(&u64, &data->datum.decimal, sizeof(u64));
+		u64 = htonll(u64);
+		memcpy(out, &u64, sizeof(u64));
+		return;
+
+	case PW_TYPE_TIMEVAL:
+		u64 = htonll((uint64_t) data->datum.timeval.tv_sec);
+		memcpy(out, &u64, sizeof(u64));
+		u32 = htonl((uint32_t) data->datum.timeval.tv_usec);
+		memcpy(out + sizeof(u64), &u32, sizeof(u32));
+		return;
+
+	/*
+	 *	Integers need their byte order reversing, everything
+	 *	else is already in network byte order.
+	 */
+	default:
+		value_box_hton(&net, data);
+		memcpy(out, ((uint8_t *)&net) + value_box_offsets[data->type], value_box_field_sizes[data->type]);
+		return;
+	}
+}
+
+/** Read a value in the binary format
+ *
+ * @param[in] ctx	to allocate string and octets buffers in.
+ * @param[out] out	Where to write the value.
+ * @param[in] type	of the value.
+ * @param[in] enumv	the attribute the value is for.
+ * @param[in] in	encoded value.
+ * @param[in] inlen	length of the encoded value.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_binary_value_decode(TALLOC_CTX *ctx, value_box_t *out, PW_TYPE type,
+				     fr_dict_attr_t const *enumv, uint8_t const *in, size_t inlen)
+{
+	value_box_t	net;
+	uint64_t	u64;
+	uint32_t	u32;
+
+	memset(out, 0, sizeof(*out));
+	out->type = type;
+
+	switch (type) {
+	case PW_TYPE_STRING:
+		out->datum.strvalue = talloc_bstrndup(ctx, (char const *)in, inlen);
+		if (!out->datum.strvalue) return -1;
+		out->length = inlen;
+		return 0;
+
+	case PW_TYPE_OCTETS:
+		out->datum.octets = talloc_memdup(ctx, in, inlen);
+		if (!out->datum.octets) return -1;
+		talloc_set_type(out->datum.octets, uint8_t);
+		out->length = inlen;
+		return 0;
+
+	default:
+		break;
+	}
+
+	memset(&net, 0, sizeof(net));
+	net.type = type;
+	if ((ssize_t) inlen != cache_binary_value_len(&net)) {
+		fr_strerror_printf("Invalid length %zu for value of type %s", inlen,
+				   fr_int2str(dict_attr_types, type, "<INVALID>"));
+		return -1;
+	}
+
+	switch (type) {
+	case PW_TYPE_SIZE:
+		memcpy(&u64, in, sizeof(u64));
+		out->datum.size = (size_t) ntohll(u64);
+		break;
+
+	case PW_TYPE_DECIMAL:
+		memcpy(&u64, in, sizeof(u64));
+		u64 = ntohll(u64);
+		memcpy(&out->datum.decimal, &u64, sizeof(u64));
+		break;
+
+	case PW_TYPE_TIMEVAL:
+		memcpy(&u64, in, sizeof(u64));
+		out->datum.timeval.tv_sec = (time_t) ntohll(u64);
+		memcpy(&u32, in + sizeof(u64), sizeof(u32));
+		out->datum.timeval.tv_usec = (suseconds_t) ntohl(u32);
+		break;
+
+	/*
+	 *	hton and ntoh are the same operation.
+	 */
+	default:
+		memcpy(((uint8_t *)&net) + value_box_offsets[type], in, inlen);
+		value_box_hton(out, &net);
+		break;
+	}
+	out->length = value_box_field_sizes[type];
+	if (fr_dict_enum_types[type]) out->datum.enumv = enumv;
+
+	return 0;
+}
+
+/** Serialize a cache entry in a compact binary format
+ *
+ * Attributes are identified by their numbers, and values are written in
+ * their binary form, so the entry can be decoded without any parsing.
+ *
+ * Only attributes which can be found by vendor and number (i.e. not the
+ * children of TLVs) can be serialized.
+ *
+ * @param ctx to alloc the buffer in.
+ * @param out Where to write pointer to serialized cache entry.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- The length of the serialized entry.
+ *	- -1 on failure.  The entry can still be serialized as text.
+ */
+ssize_t cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c)
+{
+	vp_map_t	*map;
+	size_t		len = CACHE_BINARY_HDR_LEN;
+	uint8_t		*buff, *p;
+	uint64_t	u64;
+	uint32_t	u32;
+	int32_t		s32;
+
+	/*
+	 *	Work out how big the buffer needs to be, and
+	 *	check we can encode everything.
+	 */
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const	*da = map->lhs->tmpl_da;
+		ssize_t			vlen;
+
+		if ((map->lhs->type != TMPL_TYPE_ATTR) || (map->rhs->type != TMPL_TYPE_DATA)) {
+			fr_strerror_printf("Can't serialize map \"%s\"", map->lhs->name);
+			return -1;
+		}
+
+		if (fr_dict_attr_by_num(NULL, da->vendor, da->attr) != da) {
+			fr_strerror_printf("Can't serialize \"%s\", it can't be found by number", da->name);
+			return -1;
+		}
+
+		vlen = cache_binary_value_len(&map->rhs->tmpl_value_box);
+		if (vlen < 0) return -1;
+
+		len += CACHE_BINARY_MAP_LEN + vlen;
+	}
+
+	MEM(p = buff = talloc_array(ctx, uint8_t, len));
+
+	*p++ = CACHE_BINARY_MAGIC;
+	*p++ = CACHE_BINARY_VERSION;
+
+	u64 = htonll((uint64_t) c->created);
+	memcpy(p, &u64, sizeof(u64));
+	p += sizeof(u64);
+
+	u64 = htonll((uint64_t) c->expires);
+	memcpy(p, &u64, sizeof(u64));
+	p += sizeof(u64);
+
+	for (map = c->maps; map; map = map->next) {
+		value_box_t const	*data = &map->rhs->tmpl_value_box;
+		ssize_t			vlen = cache_binary_value_len(data);
+
+		*p++ = map->op;
+		*p++ = map->lhs->tmpl_list;
+		*p++ = (uint8_t) map->lhs->tmpl_tag;
+		*p++ = data->type;
+
+		s32 = htonl(map->lhs->tmpl_num);
+		memcpy(p, &s32, sizeof(s32));
+		p += sizeof(s32);
+
+		u32 = htonl(map->lhs->tmpl_da->vendor);
+		memcpy(p, &u32, sizeof(u32));
+		p += sizeof(u32);
+
+		u32 = htonl(map->lhs->tmpl_da->attr);
+		memcpy(p, &u32, sizeof(u32));
+		p += sizeof(u32);
+
+		u32 = htonl((uint32_t) vlen);
+		memcpy(p, &u32, sizeof(u32));
+		p += sizeof(u32);
+
+		cache_binary_value_encode(p, data);
+		p += vlen;
+	}
+	rad_assert((size_t)(p - buff) == len);
+
+	*out = buff;
+
+	return len;
+}
+
+/** Check whether a serialized entry is in the binary format
+ *
+ * @param in serialized entry.
+ * @param inlen length of the serialized entry.
+ * @return true if the entry should be decoded with cache_deserialize_binary().
+ */
+bool cache_serialized_is_binary(uint8_t const *in, size_t inlen)
+{
+	return (inlen > 0) && (in[0] == CACHE_BINARY_MAGIC);
+}
+
+/** Converts a binary cache entry back into a structure
+ *
+ * @param c Cache entry to populate (should already be allocated)
+ * @param in Binary representation of cache entry.
+ * @param inlen Length of the binary data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	vp_map_t	**last = &c->maps;
+	uint8_t const	*p = in, *end = in + inlen;
+	uint64_t	u64;
+	uint32_t	u32;
+	int32_t		s32;
+
+	if ((inlen < CACHE_BINARY_HDR_LEN) || (p[0] != CACHE_BINARY_MAGIC)) {
+		fr_strerror_printf("Serialized entry isn't in the binary format");
+		return -1;
+	}
+
+	if (p[1] != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported binary format version %u", p[1]);
+		return -1;
+	}
+	p += 2;
+
+	memcpy(&u64, p, sizeof(u64));
+	c->created = (time_t) ntohll(u64);
+	p += sizeof(u64);
+
+	memcpy(&u64, p, sizeof(u64));
+	c->expires = (time_t) ntohll(u64);
+	p += sizeof(u64);
+
+	while (p < end) {
+		vp_map_t		*map;
+		fr_dict_attr_t const	*da;
+		FR_TOKEN		op;
+		pair_lists_t		list;
+		int8_t			tag;
+		PW_TYPE			type;
+		unsigned int		vendor, attr;
+		size_t			vlen;
+
+		if ((size_t)(end - p) < CACHE_BINARY_MAP_LEN) {
+			fr_strerror_printf("Truncated map header");
+			return -1;
+		}
+
+		op = p[0];
+		list = p[1];
+		tag = (int8_t) p[2];
+		type = p[3];
+		p += 4;
+
+		memcpy(&s32, p, sizeof(s32));
+		s32 = ntohl(s32);
+		p += sizeof(s32);
+
+		memcpy(&u32, p, sizeof(u32));
+		vendor = ntohl(u32);
+		p += sizeof(u32);
+
+		memcpy(&u32, p, sizeof(u32));
+		attr = ntohl(u32);
+		p += sizeof(u32);
+
+		memcpy(&u32, p, sizeof(u32));
+		vlen = ntohl(u32);
+		p += sizeof(u32);
+
+		if (vlen > (size_t)(end - p)) {
+			fr_strerror_printf("Value length %zu overflows the entry", vlen);
+			return -1;
+		}
+
+		if (!fr_int2str(fr_tokens_table, op, NULL) || !fr_int2str(pair_lists, list, NULL)) {
+			fr_strerror_printf("Invalid operator or list");
+			return -1;
+		}
+
+		da = fr_dict_attr_by_num(NULL, vendor, attr);
+		if (!da) {
+			fr_strerror_printf("Unknown attribute %u (vendor %u).  Check local dictionaries", attr, vendor);
+			return -1;
+		}
+
+		if (da->type != type) {
+			fr_strerror_printf("Attribute \"%s\" has type %s, but the serialized value is %s.  "
+					   "Check local dictionaries", da->name,
+					   fr_int2str(dict_attr_types, da->type, "<INVALID>"),
+					   fr_int2str(dict_attr_types, type, "<INVALID>"));
+			return -1;
+		}
+
+		MEM(map = talloc_zero(c, vp_map_t));
+		map->op = op;
+
+		/*
+		 *	The names aren't needed to apply the map, so
+		 *	don't spend time printing them.
+		 */
+		MEM(map->lhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_ATTR, da->name, -1, T_BARE_WORD));
+		map->lhs->tmpl_request = REQUEST_CURRENT;
+		map->lhs->tmpl_list = list;
+		map->lhs->tmpl_da = da;
+		map->lhs->tmpl_tag = tag;
+		map->lhs->tmpl_num = s32;
+
+		MEM(map->rhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_DATA, NULL, 0, T_INVALID));
+		if (cache_binary_value_decode(map->rhs, &map->rhs->tmpl_value_box, type, da, p, vlen) < 0) {
+			talloc_free(map);
+			return -1;
+		}
+		p += vlen;
+
+		*last = map;
+		last = &(*last)->next;
+	}
+
+	return 0;
+}
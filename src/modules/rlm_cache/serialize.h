@@ -25,5 +25,19 @@
  */
 RCSIDH(serialize_h, "$Id$")
 
+/** Formats cache entries can be serialized in
+ *
+ */
+typedef enum {
+	CACHE_SERIALIZE_TEXT = 0,				//!< "<attr> <op> <value>" lines.
+	CACHE_SERIALIZE_BINARY					//!< Attribute numbers and binary values.
+} cache_serialize_format_t;
+
+extern const FR_NAME_NUMBER cache_serialize_formats[];
+
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
 int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen);
+
+ssize_t cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c);
+bool cache_serialized_is_binary(uint8_t const *in, size_t inlen);
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen);
@@ -176,6 +176,7 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	rlm_couchbase_handle_t *handle = NULL;  /* connection pool handle */
 	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
 	VALUE_PAIR *vp;                         /* radius value pair linked list */
+	vp_cursor_t cursor;                     /* value pair list cursor */
 	char buffer[MAX_KEY_SIZE];
 	char const *dockey;			/* our document key */
 	char document[MAX_VALUE_SIZE];          /* our document body */
@@ -300,7 +301,9 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	}
 
 	/* loop through pairs and add to json document */
-	for (vp = request->packet->vps; vp; vp = vp->next) {
+	for (vp = fr_pair_cursor_init(&cursor, &request->packet->vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
 		/* map attribute to element */
 		if (mod_attribute_to_element(vp->da->name, inst->map, &element) == 0) {
 			/* debug */
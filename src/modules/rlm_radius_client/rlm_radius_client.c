@@ -26,6 +26,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/udp.h>
 #include <freeradius-devel/rad_assert.h>
 
@@ -64,6 +65,7 @@ typedef struct radius_client_conn {
 typedef struct rlm_radius_client_request {
 	rlm_radius_client_instance_t const	*inst;
 	REQUEST					*request;
+	unlang_stack_t				*stack;		/* the stack which is waiting for the reply */
 	rlm_rcode_t				rcode;
 
 	rlm_radius_client_conn_t		*conn;
@@ -109,6 +111,7 @@ static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
 	rlm_radius_client_request_t *ccr;
 	RADIUS_PACKET *reply, **packet_p;
 	REQUEST *request;
+	unlang_stack_t *stack;
 	char buffer[INET6_ADDRSTRLEN];
 
 	/*
@@ -150,7 +153,7 @@ static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
 	/*
 	 *	If the reply fails the signature validation, it's not a real reply.
 	 */
-	if (fr_radius_verify(reply, ccr->packet, ccr->inst->home_server->secret) < 0) {
+	if (fr_radius_verify_prepared(reply, ccr->packet, ccr->inst->home_server->prepared) < 0) {
 		REDEBUG("Reply verification failed for home server %s", ccr->inst->home_server->name);
 		fr_radius_free(&reply);
 		return;
@@ -173,7 +176,15 @@ static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
 	unlang_event_timeout_delete(ccr->request, ccr);
 
 	ccr->rcode = RLM_MODULE_OK;
+
+	/*
+	 *	Resume the stack which sent the packet.  It may be
+	 *	one of the children of a "parallel" section.
+	 */
+	stack = ccr->request->stack;
+	ccr->request->stack = ccr->stack;
 	unlang_resumable(ccr->request);
+	ccr->request->stack = stack;
 }
 
 static void mod_proxy_no_reply(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
@@ -426,6 +437,8 @@ static rlm_rcode_t mod_wait_for_reply(REQUEST *request, rlm_radius_client_instan
 
 	unlang_event_timeout_add(request, mod_proxy_no_reply, ccr, &timeout);
 
+	ccr->stack = request->stack;
+
 	return unlang_yield(request, mod_resume_continue, mod_action_dup, ccr);
 }
 
@@ -178,6 +178,11 @@ static home_server_t *srvr_blk_to_home_server(TALLOC_CTX *ctx,
 	hs->port = port;
 	hs->proto = IPPROTO_TCP;
 	hs->secret = talloc_strdup(hs, "radsec");
+	hs->prepared = fr_radius_secret_alloc(hs, hs->secret);
+	if (!hs->prepared) {
+		talloc_free(hs);
+		return NULL;
+	}
 	hs->response_window.tv_sec = 30;
 	hs->last_packet_recv = time(NULL);
 
@@ -54,9 +54,11 @@ static inline void _rest_io_demux(rlm_rest_thread_t *thread, CURLM *mandle)
 		switch (m->msg) {
 		case CURLMSG_DONE:
 		{
-			REQUEST		*request = NULL;
-			CURL		*candle = m->easy_handle;
-			CURLcode	ret;
+			REQUEST			*request;
+			rlm_rest_handle_t	*randle = NULL;
+			CURL			*candle = m->easy_handle;
+			CURLcode		ret;
+			unlang_stack_t		*stack;
 
 			rad_assert(candle);
 
@@ -64,9 +66,10 @@ static inline void _rest_io_demux(rlm_rest_thread_t *thread, CURLM *mandle)
 
 			thread->transfers--;
 
-			ret = curl_easy_getinfo(candle, CURLINFO_PRIVATE, &request);
+			ret = curl_easy_getinfo(candle, CURLINFO_PRIVATE, &randle);
 			if (!fr_cond_assert(ret == CURLE_OK)) return;
 
+			request = randle->request;
 			VERIFY_REQUEST(request);
 
 			/*
@@ -76,7 +79,15 @@ static inline void _rest_io_demux(rlm_rest_thread_t *thread, CURLM *mandle)
 				REDEBUG("%s (%i)", curl_easy_strerror(m->data.result), m->data.result);
 			}
 
+			/*
+			 *	Resume the stack which started the
+			 *	transfer.  It may be one of the
+			 *	children of a "parallel" section.
+			 */
+			stack = request->stack;
+			request->stack = randle->stack;
 			unlang_resumable(request);
+			request->stack = stack;
 		}
 
 		default:
@@ -378,11 +389,14 @@ int rest_io_request_enqueue(rlm_rest_thread_t *t, REQUEST *request, void *handle
 	VERIFY_REQUEST(request);
 
 	/*
-	 *	Stick the current request in the curl handle's
-	 *	private data.  This makes it simple to resume
-	 *	the request in the demux function later...
+	 *	Stick the handle in the curl handle's private
+	 *	data.  This makes it simple to resume the request
+	 *	(and the interpreter stack which is waiting for
+	 *	it) in the demux function later...
 	 */
-	curl_easy_setopt(candle, CURLOPT_PRIVATE, request);
+	randle->request = request;
+	randle->stack = request->stack;
+	curl_easy_setopt(candle, CURLOPT_PRIVATE, randle);
 
 	ret = curl_multi_add_handle(t->mandle, candle);
 	if (ret != CURLE_OK) {
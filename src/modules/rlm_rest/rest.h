@@ -25,6 +25,7 @@
 RCSIDH(other_h, "$Id$")
 
 #include <freeradius-devel/connection.h>
+#include <freeradius-devel/interpreter.h>
 #include "config.h"
 
 #define CURL_NO_OLDIES 1
@@ -247,6 +248,8 @@ typedef struct {
 typedef struct {
 	CURL			*candle;	//!< Libcurl easy handle
 	rlm_rest_curl_context_t	*ctx;		//!< Context, re-initialised after each request.
+	REQUEST			*request;	//!< Request which is using the handle.
+	unlang_stack_t		*stack;		//!< Interpreter stack which is waiting for the transfer.
 } rlm_rest_handle_t;
 
 /*
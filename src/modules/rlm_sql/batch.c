@@ -0,0 +1,703 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file batch.c
+ * @brief Write accounting queries in batches.
+ *
+ * Each thread queues the expanded queries, and the request yields until
+ * its row has been written.  The queue is written when it holds
+ * accounting.batch.size rows, or when the oldest row has waited for
+ * accounting.batch.interval.  The queue is in memory only, so requests
+ * aren't answered until their rows are in the database.  There's no spool
+ * on disk, as the detail module and sites-available/buffered-sql already
+ * provide one.
+ *
+ * Consecutive single row INSERTs into the same table with the same columns
+ * are written as one multi-row INSERT.  If that fails, the rows are written
+ * one by one, so that one bad row doesn't lose the others.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include	<freeradius-devel/radiusd.h>
+#include	<freeradius-devel/interpreter.h>
+#include	<freeradius-devel/rad_assert.h>
+
+#include	<ctype.h>
+
+#include	"rlm_sql.h"
+
+#define USEC (1000000)
+
+/** A request waiting for its row to be written
+ *
+ */
+struct rlm_sql_batch_wait {
+	REQUEST			*request;		//!< Request which queued the row.
+	unlang_stack_t		*stack;			//!< Interpreter stack which yielded.  NULL if
+							//!< the request hasn't yielded yet.
+	rlm_sql_batch_row_t	*row;			//!< Row being written.  NULL once it has been.
+	rlm_rcode_t		rcode;			//!< Result of writing the row.
+};
+
+/** Find where the VALUES tuple of a single row INSERT starts
+ *
+ * @param[in] query	to check.
+ * @return
+ *	- Length of the query before the tuple.
+ *	- 0 if the query isn't "INSERT ... VALUES (...)", with nothing
+ *	  after the tuple.
+ */
+static size_t sql_batch_insert_prefix(char const *query)
+{
+	char const	*p = query, *values = NULL, *tuple;
+	char		quote = '\0';
+	int		depth = 0;
+
+	while (isspace((uint8_t) *p)) p++;
+	if (strncasecmp(p, "insert", 6) != 0) return 0;
+
+	/*
+	 *	Find VALUES, skipping quoted identifiers.
+	 */
+	for (p += 6; *p; p++) {
+		if (quote) {
+			if (*p == quote) quote = '\0';
+			continue;
+		}
+
+		if ((*p == '\'') || (*p == '"') || (*p == '`')) {
+			quote = *p;
+			continue;
+		}
+
+		if ((strncasecmp(p, "values", 6) == 0) &&
+		    !isalnum((uint8_t) p[-1]) && (p[-1] != '_') &&
+		    !isalnum((uint8_t) p[6]) && (p[6] != '_')) {
+			values = p;
+			break;
+		}
+	}
+	if (!values) return 0;
+
+	for (p = values + 6; isspace((uint8_t) *p); p++);
+	if (*p != '(') return 0;
+	tuple = p;
+
+	/*
+	 *	Find the end of the tuple, skipping quoted values.
+	 */
+	for (; *p; p++) {
+		if (quote) {
+			if ((*p == '\\') && p[1]) {
+				p++;
+				continue;
+			}
+			if (*p == quote) quote = '\0';
+			continue;
+		}
+
+		switch (*p) {
+		case '\'':
+		case '"':
+			quote = *p;
+			break;
+
+		case '(':
+			depth++;
+			break;
+
+		case ')':
+			if (--depth == 0) goto done;
+			break;
+
+		default:
+			break;
+		}
+	}
+	return 0;
+
+done:
+	for (p++; isspace((uint8_t) *p) || (*p == ';'); p++);
+	if (*p) return 0;
+
+	return tuple - query;
+}
+
+/** Length of the VALUES tuple of a row, without any trailing whitespace or ';'
+ *
+ */
+static size_t sql_batch_tuple_len(rlm_sql_batch_row_t const *row)
+{
+	char const *tuple = row->query[0] + row->prefix_len;
+	size_t len = strlen(tuple);
+
+	while ((len > 0) && (isspace((uint8_t) tuple[len - 1]) || (tuple[len - 1] == ';'))) len--;
+
+	return len;
+}
+
+/** Run a query we don't need the result of
+ *
+ */
+static sql_rcode_t sql_batch_query(rlm_sql_t const *inst, rlm_sql_handle_t **handle, char const *query)
+{
+	sql_rcode_t rcode;
+
+	rcode = rlm_sql_query(inst, NULL, handle, query);
+	if (rcode == RLM_SQL_OK) (inst->driver->sql_finish_query)(*handle, inst->config);
+
+	return rcode;
+}
+
+/** Write a row with its redundant set of queries, as acct_redundant() would
+ *
+ * In a transaction, each query but the last runs inside a savepoint.  If the
+ * driver suggests trying the next query, the savepoint is rolled back, so
+ * that the transaction can carry on with the next query.
+ *
+ * @param[in] inst		rlm_sql instance.
+ * @param[in,out] handle	to write the row with.  Set to NULL if we couldn't reconnect.
+ * @param[in] row		to write.
+ * @param[in] strict		If true, the row is being written in a transaction, and
+ *				any other failure is an error.
+ * @return
+ *	- #RLM_SQL_OK if a query updated something, or no query did.
+ *	- Another code on error.
+ */
+static sql_rcode_t sql_batch_row_write(rlm_sql_t const *inst, rlm_sql_handle_t **handle,
+				       rlm_sql_batch_row_t *row, bool strict)
+{
+	size_t		i, num = talloc_array_length(row->query);
+	sql_rcode_t	rcode;
+	int		numaffected;
+	bool		savepoint;
+
+	for (i = 0; i < num; i++) {
+		savepoint = strict && ((i + 1) < num);
+		if (savepoint) {
+			rcode = sql_batch_query(inst, handle, "SAVEPOINT rlm_sql_batch");
+			if (rcode != RLM_SQL_OK) return rcode;
+		}
+
+		rcode = rlm_sql_query(inst, NULL, handle, row->query[i]);
+		if (rcode == RLM_SQL_ALT_QUERY) {
+			if (savepoint) {
+				rcode = sql_batch_query(inst, handle, "ROLLBACK TO SAVEPOINT rlm_sql_batch");
+				if (rcode != RLM_SQL_OK) return rcode;
+				continue;
+			}
+			if (!strict) continue;
+		}
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		numaffected = (inst->driver->sql_affected_rows)(*handle, inst->config);
+		(inst->driver->sql_finish_query)(*handle, inst->config);
+
+		if (savepoint) {
+			rcode = sql_batch_query(inst, handle, "RELEASE SAVEPOINT rlm_sql_batch");
+			if (rcode != RLM_SQL_OK) return rcode;
+		}
+
+		if (numaffected > 0) break;
+	}
+
+	row->done = true;
+
+	return RLM_SQL_OK;
+}
+
+/** Write a row, and the rows after it inserting into the same columns, as one INSERT
+ *
+ * Only the run of rows immediately after the first one is merged.  Merging
+ * a row from after some other query would write the rows out of order, e.g.
+ * a Start after the Stop for the same session.
+ *
+ * If there's nothing to merge the row with, or the INSERT fails, none of
+ * the rows can be merged again, and they're left for the caller to write
+ * one by one.
+ *
+ * @param[in] inst		rlm_sql instance.
+ * @param[in,out] handle	to write the rows with.  Set to NULL if we couldn't reconnect.
+ * @param[in] first		row to write.
+ * @param[out] merged		Incremented by the number of rows written.
+ * @param[out] fallback		Incremented by the number of rows left to write one by one.
+ * @return
+ *	- 1 if the rows were written.
+ *	- 0 if there was nothing to merge the row with.
+ *	- -1 if the INSERT failed.
+ */
+static int sql_batch_insert_write(rlm_sql_t const *inst, rlm_sql_handle_t **handle,
+				  rlm_sql_batch_row_t *first, uint64_t *merged, uint64_t *fallback)
+{
+	rlm_sql_batch_row_t	*row, **rows;
+	char			*query;
+	size_t			i, num = 0;
+	sql_rcode_t		rcode;
+
+	for (row = first; row; row = row->next) num++;
+	MEM(rows = talloc_array(NULL, rlm_sql_batch_row_t *, num));
+
+	num = 0;
+	for (row = first; row; row = row->next) {
+		if (row->done || (row->prefix_len != first->prefix_len) ||
+		    (strncmp(row->query[0], first->query[0], first->prefix_len) != 0)) break;
+
+		rows[num++] = row;
+	}
+
+	/*
+	 *	Nothing to merge it with.
+	 */
+	if (num == 1) {
+		talloc_free(rows);
+		first->prefix_len = 0;
+		return 0;
+	}
+
+	MEM(query = talloc_strndup(rows, first->query[0], first->prefix_len));
+	for (i = 0; i < num; i++) {
+		if (i > 0) MEM(query = talloc_strdup_append_buffer(query, ", "));
+		MEM(query = talloc_strndup_append_buffer(query, rows[i]->query[0] + rows[i]->prefix_len,
+							 sql_batch_tuple_len(rows[i])));
+	}
+
+	DEBUG2("Inserting %zu rows with one query", num);
+
+	rcode = sql_batch_query(inst, handle, query);
+	for (i = 0; i < num; i++) {
+		if (rcode == RLM_SQL_OK) {
+			rows[i]->done = true;
+		} else {
+			rows[i]->prefix_len = 0;
+		}
+	}
+	talloc_free(rows);
+
+	if (rcode != RLM_SQL_OK) {
+		*fallback += num;
+		return -1;
+	}
+	*merged += num;
+
+	return 1;
+}
+
+/** Write the rows of a batch
+ *
+ * @param[in] inst		rlm_sql instance.
+ * @param[in,out] handle	to write the rows with.  Set to NULL if we couldn't reconnect.
+ * @param[in] head		First row of the batch.
+ * @param[in] strict		If true, stop at the first error.
+ * @param[out] merged		Incremented by the number of rows written by multi-row INSERTs.
+ * @param[out] fallback		Incremented by the number of rows written one by one,
+ *				after their multi-row INSERT failed.
+ * @param[out] dropped		Incremented by the number of rows which couldn't be written.
+ * @return
+ *	- 0 on success.
+ *	- -1 if strict, and a query failed.
+ */
+static int sql_batch_write(rlm_sql_t const *inst, rlm_sql_handle_t **handle, rlm_sql_batch_row_t *head,
+			   bool strict, uint64_t *merged, uint64_t *fallback, uint64_t *dropped)
+{
+	rlm_sql_batch_row_t	*row;
+	sql_rcode_t		rcode;
+	int			ret;
+
+	for (row = head; row; row = row->next) {
+		if (row->done) continue;
+
+		/*
+		 *	If the INSERT fails, this row is written
+		 *	below, and the others when the loop gets
+		 *	to them.
+		 */
+		if (*handle && row->prefix_len) {
+			ret = sql_batch_insert_write(inst, handle, row, merged, fallback);
+			if (ret > 0) continue;
+			if ((ret < 0) && strict) return -1;
+		}
+
+		rcode = *handle ? sql_batch_row_write(inst, handle, row, strict) : RLM_SQL_RECONNECT;
+		if (rcode == RLM_SQL_OK) continue;
+		if (strict) return -1;
+
+		ERROR("Dropping queued query (%s): %s",
+		      fr_int2str(sql_rcode_table, rcode, "<INVALID>"), row->query[0]);
+		row->done = true;
+		row->failed = true;
+		(*dropped)++;
+	}
+
+	return 0;
+}
+
+/** Tell a request that its row has been written, or dropped
+ *
+ * @param[in] wait	Request waiting for the row.
+ * @param[in] rcode	to return from the module.
+ */
+static void sql_batch_wait_done(rlm_sql_batch_wait_t *wait, rlm_rcode_t rcode)
+{
+	REQUEST		*request = wait->request;
+	unlang_stack_t	*stack;
+
+	wait->row->wait = NULL;
+	wait->row = NULL;
+	wait->rcode = rcode;
+
+	/*
+	 *	The batch was written while the request was
+	 *	queueing its row.  It sees the result without
+	 *	yielding.
+	 */
+	if (!wait->stack) return;
+
+	/*
+	 *	Resume the stack which yielded.  It may be
+	 *	one of the children of a "parallel" section.
+	 */
+	stack = request->stack;
+	request->stack = wait->stack;
+	unlang_resumable(request);
+	request->stack = stack;
+}
+
+/** The request was freed while it was waiting for its row
+ *
+ * The row is still written, there's just nobody to tell.
+ */
+static int _sql_batch_wait_free(rlm_sql_batch_wait_t *wait)
+{
+	if (wait->row) wait->row->wait = NULL;
+
+	return 0;
+}
+
+/** The row has been written, or dropped
+ *
+ */
+static rlm_rcode_t sql_batch_resume(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_sql_batch_wait_t	*wait = ctx;
+	rlm_rcode_t		rcode = wait->rcode;
+
+	talloc_free(wait);
+
+	return rcode;
+}
+
+/** The request was cancelled while it was waiting for its row
+ *
+ */
+static void sql_batch_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+			     fr_state_action_t action)
+{
+	rlm_sql_batch_wait_t	*wait = ctx;
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelled while waiting for queued query to be written");
+
+	talloc_free(wait);
+}
+
+/** Write the rows queued by this thread
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] t		Thread specific data holding the batch.
+ */
+void sql_batch_flush(rlm_sql_t const *inst, rlm_sql_thread_t *t)
+{
+	rlm_sql_batch_t		*batch = &t->batch;
+	rlm_sql_batch_row_t	*head, *row, *next;
+	rlm_sql_handle_t	*handle;
+	rlm_sql_batch_stats_t	*stats = inst->batch_stats;
+	uint32_t		num;
+	uint64_t		merged = 0, fallback = 0, dropped = 0, usec;
+	struct timeval		now, latency;
+
+	if (!batch->num) return;
+
+	if (batch->ev) fr_event_timer_delete(batch->el, &batch->ev);
+
+	/*
+	 *	Take the rows off the queue, so that it's empty
+	 *	while they're written.
+	 */
+	head = batch->head;
+	num = batch->num;
+	batch->head = NULL;
+	batch->tail = &batch->head;
+	batch->num = 0;
+
+	gettimeofday(&now, NULL);
+	fr_timeval_subtract(&latency, &now, &batch->first);
+	usec = (latency.tv_sec * (uint64_t)USEC) + latency.tv_usec;
+
+	handle = fr_connection_get(inst->pool, NULL);
+	if (!handle) {
+		for (row = head; row; row = row->next) {
+			ERROR("Dropping queued query (no connection): %s", row->query[0]);
+			row->failed = true;
+		}
+		dropped = num;
+		goto finish;
+	}
+
+	if (!inst->config->accounting.batch_transaction) {
+		(void) sql_batch_write(inst, &handle, head, false, &merged, &fallback, &dropped);
+		goto finish;
+	}
+
+	if (sql_batch_query(inst, &handle, "BEGIN") == RLM_SQL_OK) {
+		if ((sql_batch_write(inst, &handle, head, true, &merged, &fallback, &dropped) == 0) &&
+		    (sql_batch_query(inst, &handle, "COMMIT") == RLM_SQL_OK)) goto finish;
+
+		if (handle) (void) sql_batch_query(inst, &handle, "ROLLBACK");
+	}
+
+	/*
+	 *	The transaction failed, write the rows one by one.
+	 */
+	WARN("Batch of %u rows failed, writing them one by one", num);
+
+	for (row = head; row; row = row->next) {
+		row->done = false;
+		row->prefix_len = 0;
+	}
+	merged = 0;
+	fallback = num;
+	if (!handle) handle = fr_connection_get(inst->pool, NULL);
+	(void) sql_batch_write(inst, &handle, head, false, &merged, &fallback, &dropped);
+
+finish:
+	if (handle) fr_connection_release(inst->pool, NULL, handle);
+
+	for (row = head; row; row = next) {
+		next = row->next;
+		if (row->wait) sql_batch_wait_done(row->wait, row->failed ? RLM_MODULE_FAIL : RLM_MODULE_OK);
+		talloc_free(row);
+	}
+
+	DEBUG2("Wrote batch of %u rows (%" PRIu64 " merged, %" PRIu64 " one by one, %" PRIu64 " dropped), "
+	       "oldest queued for %" PRIu64 "us", num, merged, fallback, dropped, usec);
+
+	pthread_mutex_lock(&stats->mutex);
+	stats->batches++;
+	stats->rows += num;
+	stats->merged += merged;
+	stats->fallback += fallback;
+	stats->dropped += dropped;
+	if (num > stats->max_size) stats->max_size = num;
+	stats->latency += usec;
+	if (usec > stats->max_latency) stats->max_latency = usec;
+	pthread_mutex_unlock(&stats->mutex);
+}
+
+/** Write the batch once the oldest row has waited long enough
+ *
+ */
+static void _sql_batch_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	rlm_sql_thread_t *t = ctx;
+
+	sql_batch_flush(t->inst, t);
+}
+
+/** Queue the queries for an accounting packet, and yield until they're written
+ *
+ * The whole redundant set of queries is expanded, as the request
+ * may be gone by the time they're run.  If it is, they're still run.
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] t		Thread specific data holding the batch.
+ * @param[in] request	The current request.
+ * @param[in] handle	used to escape the queries.
+ * @param[in] section	the queries are from.
+ * @param[in] pair	First query of the redundant set.
+ * @param[in] attr	Name of the redundant set.
+ * @return
+ *	- #RLM_MODULE_YIELD if the queries were queued.
+ *	- #RLM_MODULE_OK if they were queued and written straight away.
+ *	- #RLM_MODULE_NOOP if there were no queries.
+ *	- #RLM_MODULE_FAIL if we couldn't expand them, or couldn't write them.
+ */
+rlm_rcode_t sql_batch_enqueue(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+			      rlm_sql_handle_t *handle, sql_acct_section_t *section,
+			      CONF_PAIR *pair, char const *attr)
+{
+	rlm_sql_batch_t		*batch = &t->batch;
+	rlm_sql_batch_row_t	*row;
+	rlm_sql_batch_wait_t	*wait;
+	rlm_rcode_t		rcode;
+	char const		*value;
+	char			*expanded;
+	size_t			num = 0;
+
+	MEM(row = talloc_zero(NULL, rlm_sql_batch_row_t));
+	MEM(row->query = talloc_array(row, char *, 0));
+
+	for (; pair; pair = cf_pair_find_next(section->cs, pair, attr)) {
+		value = cf_pair_value(pair);
+		if (!value) break;
+
+		if (xlat_aeval(row, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+			talloc_free(row);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (!*expanded) {
+			talloc_free(expanded);
+			break;
+		}
+
+		MEM(row->query = talloc_realloc(row, row->query, char *, num + 1));
+		row->query[num++] = expanded;
+	}
+
+	if (num == 0) {
+		RDEBUG("Ignoring null query");
+		talloc_free(row);
+		return RLM_MODULE_NOOP;
+	}
+
+	rlm_sql_query_log(inst, request, section, row->query[0]);
+
+	row->prefix_len = sql_batch_insert_prefix(row->query[0]);
+
+	MEM(wait = talloc_zero(request, rlm_sql_batch_wait_t));
+	wait->request = request;
+	wait->row = row;
+	row->wait = wait;
+	talloc_set_destructor(wait, _sql_batch_wait_free);
+
+	*batch->tail = row;
+	batch->tail = &row->next;
+
+	if (batch->num++ == 0) {
+		gettimeofday(&batch->first, NULL);
+
+		if (batch->el) {
+			struct timeval when;
+
+			fr_timeval_add(&when, &batch->first, &section->batch_interval);
+			if (fr_event_timer_insert(batch->el, _sql_batch_timeout, t, &when, &batch->ev) < 0) {
+				RWDEBUG("Failed inserting batch timer: %s", fr_strerror());
+			}
+		}
+	}
+
+	RDEBUG2("Queued query, %u rows waiting", batch->num);
+
+	if (batch->num >= section->batch_size) sql_batch_flush(inst, t);
+
+	if (!wait->row) {
+		rcode = wait->rcode;
+		talloc_free(wait);
+		return rcode;
+	}
+
+	wait->stack = request->stack;
+
+	return unlang_yield(request, sql_batch_resume, sql_batch_action, wait);
+}
+
+static int _sql_batch_stats_free(rlm_sql_batch_stats_t *stats)
+{
+	pthread_mutex_destroy(&stats->mutex);
+
+	return 0;
+}
+
+/** Allocate the batch statistics of an instance
+ *
+ * @param[in] inst	rlm_sql instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_batch_stats_init(rlm_sql_t *inst)
+{
+	int ret;
+
+	MEM(inst->batch_stats = talloc_zero(inst, rlm_sql_batch_stats_t));
+
+	ret = pthread_mutex_init(&inst->batch_stats->mutex, NULL);
+	if (ret != 0) {
+		ERROR("Failed initialising batch mutex: %s", fr_syserror(ret));
+		TALLOC_FREE(inst->batch_stats);
+		return -1;
+	}
+	talloc_set_destructor(inst->batch_stats, _sql_batch_stats_free);
+
+	return 0;
+}
+
+/** Return one of the batch statistics
+ *
+ * "batches", "rows", "merged", "fallback", "dropped", "size_avg", "size_max",
+ * "latency_avg" or "latency_max".  Latencies are in microseconds, and are
+ * how long the oldest row of each batch was queued for.
+ *
+ * Example: "%{sql_batch:size_avg}"
+ */
+ssize_t sql_batch_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen,
+		       void const *mod_inst, UNUSED void const *xlat_inst,
+		       REQUEST *request, char const *fmt)
+{
+	rlm_sql_t const		*inst = mod_inst;
+	rlm_sql_batch_stats_t	*stats = inst->batch_stats;
+	uint64_t		value;
+
+	while (isspace((uint8_t) *fmt)) fmt++;
+
+	pthread_mutex_lock(&stats->mutex);
+	if (strcmp(fmt, "batches") == 0) {
+		value = stats->batches;
+	} else if (strcmp(fmt, "rows") == 0) {
+		value = stats->rows;
+	} else if (strcmp(fmt, "merged") == 0) {
+		value = stats->merged;
+	} else if (strcmp(fmt, "fallback") == 0) {
+		value = stats->fallback;
+	} else if (strcmp(fmt, "dropped") == 0) {
+		value = stats->dropped;
+	} else if (strcmp(fmt, "size_avg") == 0) {
+		value = stats->batches ? stats->rows / stats->batches : 0;
+	} else if (strcmp(fmt, "size_max") == 0) {
+		value = stats->max_size;
+	} else if (strcmp(fmt, "latency_avg") == 0) {
+		value = stats->batches ? stats->latency / stats->batches : 0;
+	} else if (strcmp(fmt, "latency_max") == 0) {
+		value = stats->max_latency;
+	} else {
+		pthread_mutex_unlock(&stats->mutex);
+		REDEBUG("Unknown batch statistic \"%s\"", fmt);
+		return -1;
+	}
+	pthread_mutex_unlock(&stats->mutex);
+
+	MEM(*out = talloc_asprintf(request, "%" PRIu64, value));
+
+	return talloc_array_length(*out) - 1;
+}
@@ -192,28 +192,14 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
-					      char const *query)
+/** Classify the result of a query, which is in conn->result
+ *
+ */
+static sql_rcode_t sql_query_result(rlm_sql_postgres_conn_t *conn)
 {
-	rlm_sql_postgres_conn_t *conn = handle->conn;
 	ExecStatusType status;
 	int numfields = 0;
 
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  Returns a PGresult pointer or possibly a null pointer.
-	 *  A non-null pointer will generally be returned except in
-	 *  out-of-memory conditions or serious errors such as inability
-	 *  to send the command to the server. If a null pointer is
-	 *  returned, it should be treated like a PGRES_FATAL_ERROR
-	 *  result.
-	 */
-	conn->result = PQexec(conn->db, query);
-
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -283,6 +269,193 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	return RLM_SQL_ERROR;
 }
 
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Returns a PGresult pointer or possibly a null pointer.
+	 *  A non-null pointer will generally be returned except in
+	 *  out-of-memory conditions or serious errors such as inability
+	 *  to send the command to the server. If a null pointer is
+	 *  returned, it should be treated like a PGRES_FATAL_ERROR
+	 *  result.
+	 */
+	conn->result = PQexec(conn->db, query);
+
+	return sql_query_result(conn);
+}
+
+/** Finish sending a query
+ *
+ * We only wait for the socket to become readable, so the whole query has to
+ * be sent now.  Queries are nearly always smaller than the socket buffer.  If
+ * not, block until the rest has been sent.
+ */
+static sql_rcode_t sql_flush(rlm_sql_postgres_conn_t *conn)
+{
+	int ret;
+
+	ret = PQflush(conn->db);
+	if (ret > 0) {
+		if (PQsetnonblocking(conn->db, 0) < 0) {
+			ERROR("Failed setting connection blocking: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+		ret = PQflush(conn->db);
+	}
+	if (ret < 0) {
+		ERROR("Failed sending query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/** Send a query without waiting for the result
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_submit(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						     char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (PQsetnonblocking(conn->db, 1) < 0) {
+		ERROR("Failed setting connection non-blocking: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQuery(conn->db, query)) {
+		ERROR("Failed sending query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_flush(conn);
+}
+
+/** Read whatever part of the result has arrived
+ *
+ * As with PQexec, if the query returned several results, only the last one is kept.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_poll(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	PGresult *result;
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading query result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	while (!PQisBusy(conn->db)) {
+		result = PQgetResult(conn->db);
+		if (!result) return sql_query_result(conn);
+
+		if (conn->result) PQclear(conn->result);
+		conn->result = result;
+	}
+
+	return RLM_SQL_PENDING;
+}
+
+/** Prepare a statement on the connection
+ *
+ * The server keeps the statement until the connection is closed.  We only
+ * keep its name.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_stmt_prepare(void **out, rlm_sql_handle_t *handle,
+						     UNUSED rlm_sql_config_t *config, rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	char			*name;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	MEM(name = talloc_typed_asprintf(conn, "freeradius_%i", stmt->id));
+
+	conn->result = PQprepare(conn->db, name, stmt->query, stmt->num_params, NULL);
+	rcode = sql_query_result(conn);
+	if (conn->result) {
+		PQclear(conn->result);
+		conn->result = NULL;
+	}
+	if (rcode != RLM_SQL_OK) {
+		talloc_free(name);
+		return rcode;
+	}
+
+	*out = name;
+
+	return RLM_SQL_OK;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_stmt_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						     void *prepared, rlm_sql_stmt_t const *stmt,
+						     char const * const *values)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	conn->result = PQexecPrepared(conn->db, prepared, stmt->num_params, values, NULL, NULL, 0);
+
+	return sql_query_result(conn);
+}
+
+/** Send a prepared statement without waiting for the result
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_stmt_submit(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						    void *prepared, rlm_sql_stmt_t const *stmt,
+						    char const * const *values)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (PQsetnonblocking(conn->db, 1) < 0) {
+		ERROR("Failed setting connection non-blocking: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQueryPrepared(conn->db, prepared, stmt->num_params, values, NULL, NULL, 0)) {
+		ERROR("Failed sending statement: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_flush(conn);
+}
+
+static int sql_socket_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) return -1;
+
+	return PQsocket(conn->db);
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
 	return sql_query(handle, config, query);
@@ -542,5 +715,11 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_submit		= sql_query_submit,
+	.sql_socket_fd			= sql_socket_fd,
+	.sql_query_poll			= sql_query_poll,
+	.sql_stmt_prepare		= sql_stmt_prepare,
+	.sql_stmt_execute		= sql_stmt_execute,
+	.sql_stmt_submit		= sql_stmt_submit
 };
@@ -53,8 +53,18 @@ typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	bool prepared;		//!< statement is one of our prepared statements, so is
+				//!< reset rather than finalized.
 } rlm_sql_sqlite_conn_t;
 
+/** A statement prepared by sql_stmt_prepare
+ *
+ * Allocated in the context of the connection, and finalized before it's closed.
+ */
+typedef struct rlm_sql_sqlite_stmt {
+	sqlite3_stmt *statement;
+} rlm_sql_sqlite_stmt_t;
+
 typedef struct rlm_sql_sqlite {
 	char const	*filename;
 	uint32_t	busy_timeout;
@@ -374,6 +384,12 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	Finalize the prepared statements, or the
+	 *	database can't be closed.
+	 */
+	talloc_free_children(conn);
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
@@ -383,6 +399,13 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 	return 0;
 }
 
+static int _sql_stmt_free(rlm_sql_sqlite_stmt_t *stmt)
+{
+	(void) sqlite3_finalize(stmt->statement);
+
+	return 0;
+}
+
 static void _sql_greatest(sqlite3_context *ctx, int num_values, sqlite3_value **values)
 {
 	int i;
@@ -490,6 +513,58 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+static sql_rcode_t sql_stmt_prepare(void **out, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				    rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	rlm_sql_sqlite_stmt_t	*prepared;
+	sql_rcode_t		rcode;
+	char const		*z_tail;
+	int			status;
+
+	MEM(prepared = talloc_zero(conn, rlm_sql_sqlite_stmt_t));
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	status = sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &prepared->statement, &z_tail);
+#else
+	status = sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &prepared->statement, &z_tail);
+#endif
+	rcode = sql_check_error(conn->db, status);
+	if (rcode != RLM_SQL_OK) {
+		talloc_free(prepared);
+		return rcode;
+	}
+	talloc_set_destructor(prepared, _sql_stmt_free);
+
+	*out = prepared;
+
+	return RLM_SQL_OK;
+}
+
+/** Bind the values to a prepared statement
+ *
+ * As with sql_select_query, the statement is run by sql_fetch_row.
+ */
+static sql_rcode_t sql_stmt_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, void *prepared,
+				    rlm_sql_stmt_t const *stmt, char const * const *values)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	int			i, status;
+
+	conn->statement = ((rlm_sql_sqlite_stmt_t *) prepared)->statement;
+	conn->prepared = true;
+	conn->col_count = 0;
+
+	for (i = 0; i < stmt->num_params; i++) {
+		status = sqlite3_bind_text(conn->statement, i + 1, values[i], -1, SQLITE_TRANSIENT);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	return RLM_SQL_OK;
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -610,7 +685,16 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Prepared statements are kept for the next
+		 *	request.
+		 */
+		if (conn->prepared) {
+			(void) sqlite3_reset(conn->statement);
+			conn->prepared = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -809,5 +893,7 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_stmt_prepare		= sql_stmt_prepare,
+	.sql_stmt_execute		= sql_stmt_execute
 };
@@ -65,11 +65,19 @@ static const CONF_PARSER type_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("size", PW_TYPE_INTEGER, rlm_sql_config_t, accounting.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("interval", PW_TYPE_TIMEVAL, rlm_sql_config_t, accounting.batch_interval), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("transaction", PW_TYPE_BOOLEAN, rlm_sql_config_t, accounting.batch_transaction), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER acct_config[] = {
 	{ FR_CONF_OFFSET("reference", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.logfile) },
 
 	{ FR_CONF_POINTER("type", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) type_config },
+	{ FR_CONF_POINTER("batch", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -98,6 +106,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("default_user_profile", PW_TYPE_STRING, rlm_sql_config_t, default_profile), .dflt = "" },
 	{ FR_CONF_OFFSET("client_query", PW_TYPE_STRING, rlm_sql_config_t, client_query), .dflt = "SELECT id,nasname,shortname,type,secret FROM nas" },
 	{ FR_CONF_OFFSET("open_query", PW_TYPE_STRING, rlm_sql_config_t, connect_query) },
+	{ FR_CONF_OFFSET("prepare_statements", PW_TYPE_BOOLEAN, rlm_sql_config_t, prepare_statements), .dflt = "yes" },
 
 	{ FR_CONF_OFFSET("authorize_check_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
 	{ FR_CONF_OFFSET("authorize_reply_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_reply_query) },
@@ -727,31 +736,70 @@ int sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username)
 	return 0;
 }
 
-/*
- *	Do a set/unset user, so it's a bit clearer what's going on.
+/** Run a select query, as a prepared statement if it was compiled into one
+ *
+ * @param[in] inst	of rlm_sql.
+ * @param[in] request	Current request.
+ * @param[in] handle	to run the query on.
+ * @param[in] fmt	of the query.
+ * @param[in] stmt	compiled from fmt, may be NULL.
+ * @return
+ *	- 0 on success.  The caller must finish the select query.
+ *	- -1 on failure.
+ */
+static int sql_select_tmpl(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			   char const *fmt, rlm_sql_stmt_t const *stmt)
+{
+	char		*expanded = NULL;
+	char		**values;
+	sql_rcode_t	ret;
+
+	if (stmt) {
+		if (sql_stmt_values(request, &values, request, *handle, stmt) < 0) {
+			REDEBUG("Error generating query");
+			return -1;
+		}
+
+		ret = rlm_sql_select_stmt(inst, request, handle, stmt, values);
+		talloc_free(values);
+	} else {
+		if (xlat_aeval(request, &expanded, request, fmt, inst->sql_escape_func, *handle) < 0) {
+			REDEBUG("Error generating query");
+			return -1;
+		}
+
+		ret = rlm_sql_select_query(inst, request, handle, expanded);
+		talloc_free(expanded);
+	}
+
+	return (ret == RLM_SQL_OK) ? 0 : -1;	/* error handled by rlm_sql_select_* */
+}
+
+/** Get check or reply pairs, with a query which may have been compiled into a statement
+ *
+ * @return the same as sql_getvpdata().
  */
-#define sql_unset_user(_i, _r) fr_pair_delete_by_num(&_r->packet->vps, _i->sql_user->vendor, _i->sql_user->attr, TAG_ANY)
+static int sql_getvpdata_tmpl(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			      VALUE_PAIR **pair, char const *fmt, rlm_sql_stmt_t const *stmt)
+{
+	if (sql_select_tmpl(inst, request, handle, fmt, stmt) < 0) return -1;
+
+	return sql_getvpdata_result(ctx, inst, request, handle, pair);
+}
 
 static int sql_get_grouplist(rlm_sql_t const *inst, rlm_sql_handle_t **handle, REQUEST *request,
 			     rlm_sql_grouplist_t **phead)
 {
-	char    *expanded = NULL;
 	int     num_groups = 0;
 	rlm_sql_row_t row;
 	rlm_sql_grouplist_t *entry;
-	int ret;
 
 	/* NOTE: sql_set_user should have been run before calling this function */
 
 	entry = *phead = NULL;
 
 	if (!inst->config->groupmemb_query || !*inst->config->groupmemb_query) return 0;
-	if (xlat_aeval(request, &expanded, request, inst->config->groupmemb_query,
-			 inst->sql_escape_func, *handle) < 0) return -1;
-
-	ret = rlm_sql_select_query(inst, request, handle, expanded);
-	talloc_free(expanded);
-	if (ret != RLM_SQL_OK) return -1;
+	if (sql_select_tmpl(inst, request, handle, inst->config->groupmemb_query, inst->groupmemb_stmt) < 0) return -1;
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
 		if (!row[0]){
@@ -862,7 +910,6 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 	VALUE_PAIR		*check_tmp = NULL, *reply_tmp = NULL, *sql_group = NULL;
 	rlm_sql_grouplist_t	*head = NULL, *entry = NULL;
 
-	char			*expanded = NULL;
 	int			rows;
 
 	rad_assert(request->packet != NULL);
@@ -918,18 +965,9 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 			vp_cursor_t cursor;
 			VALUE_PAIR *vp;
 
-			/*
-			 *	Expand the group query
-			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_check_query,
-					 inst->sql_escape_func, *handle) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata_tmpl(request, inst, request, handle, &check_tmp,
+						  inst->config->authorize_group_check_query,
+						  inst->authorize_group_check_stmt);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -971,15 +1009,9 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_reply_query,
-					 inst->sql_escape_func, *handle) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata_tmpl(request->reply, inst, request, handle, &reply_tmp,
+						  inst->config->authorize_group_reply_query,
+						  inst->authorize_group_reply_stmt);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -1158,6 +1190,18 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	 */
 	if (inst->driver->sql_fields) map_proc_register(inst, inst->name, mod_map_proc, sql_map_verify, 0);
 
+	/*
+	 *	Register the xlat which returns the batch statistics
+	 */
+	if (inst->config->accounting.batch_size) {
+		char buffer[256];
+
+		if (sql_batch_stats_init(inst) < 0) goto error;
+
+		snprintf(buffer, sizeof(buffer), "%s_batch", inst->name);
+		xlat_register(inst, buffer, sql_batch_xlat, NULL, NULL, 0, 0);
+	}
+
 	return 0;
 }
 
@@ -1209,6 +1253,12 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->config->postauth.cs = cf_section_sub_find(conf, "post-auth");
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
+	if (inst->config->accounting.batch_size) {
+		FR_INTEGER_BOUND_CHECK("accounting.batch.size", inst->config->accounting.batch_size, <=, 10000);
+		FR_TIMEVAL_BOUND_CHECK("accounting.batch.interval", &inst->config->accounting.batch_interval, >=, 0, 1000);
+		FR_TIMEVAL_BOUND_CHECK("accounting.batch.interval", &inst->config->accounting.batch_interval, <=, 10, 0);
+	}
+
 	/*
 	 *	Cache the SQL-User-Name fr_dict_attr_t, so we can be slightly
 	 *	more efficient about creating SQL-User-Name attributes.
@@ -1234,6 +1284,20 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 				inst->driver->sql_escape_func :
 				sql_escape_func;
 
+	/*
+	 *	Compile the authorization queries, so that each
+	 *	connection only has to parse them once.
+	 */
+	inst->authorize_check_stmt = sql_stmt_compile(inst, "authorize_check_query",
+						      inst->config->authorize_check_query);
+	inst->authorize_reply_stmt = sql_stmt_compile(inst, "authorize_reply_query",
+						      inst->config->authorize_reply_query);
+	inst->authorize_group_check_stmt = sql_stmt_compile(inst, "authorize_group_check_query",
+							    inst->config->authorize_group_check_query);
+	inst->authorize_group_reply_stmt = sql_stmt_compile(inst, "authorize_group_reply_query",
+							    inst->config->authorize_group_reply_query);
+	inst->groupmemb_stmt = sql_stmt_compile(inst, "group_membership_query", inst->config->groupmemb_query);
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, true, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err_cs(conf, "Failed creating log file context");
@@ -1258,17 +1322,419 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+/** Create the connections used by requests in this thread
+ *
+ * Only if the driver can run queries without blocking, and the "pool"
+ * section has a "per_thread" subsection.  Otherwise all threads use the
+ * pool created by mod_instantiate().
+ *
+ * The thread's pool uses the settings in "pool", with the ones in
+ * "per_thread" replacing them.  So the limits for each thread can be
+ * set without changing the limits of the shared pool.
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_sql.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sql_t		*inst = instance;
+	rlm_sql_thread_t	*t = thread;
+	CONF_SECTION		*cs, *per_thread;
+	CONF_ITEM		*ci;
+
+	t->inst = inst;
+	t->batch.tail = &t->batch.head;
+	t->batch.el = el;
+
+	if (!inst->driver->sql_query_submit) return 0;
+
+	cs = cf_section_sub_find(conf, "pool");
+	if (!cs) return 0;
+
+	per_thread = cf_section_sub_find(cs, "per_thread");
+	if (!per_thread) return 0;
+
+	/*
+	 *	Parse a copy of the pool section, so that the
+	 *	threads don't all parse the same one at once.
+	 */
+	t->pool_cs = cf_section_dup(NULL, cs, "pool", NULL, true);
+	if (!t->pool_cs) return -1;
+
+	for (ci = cf_item_find_next(per_thread, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(per_thread, ci)) {
+		CONF_PAIR *cp, *old;
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		old = cf_pair_find(t->pool_cs, cf_pair_attr(cp));
+		if (!old) {
+			cf_pair_add(t->pool_cs, cf_pair_dup(t->pool_cs, cp));
+			continue;
+		}
+
+		if (cf_pair_replace(t->pool_cs, old, cf_pair_value(cp)) < 0) {
+			ERROR("Failed setting pool.per_thread.%s", cf_pair_attr(cp));
+			TALLOC_FREE(t->pool_cs);
+			return -1;
+		}
+	}
+
+	t->pool = fr_connection_pool_init(NULL, t->pool_cs, inst, mod_conn_create, NULL, inst->name);
+	if (!t->pool) {
+		ERROR("Pool instantiation failed");
+		TALLOC_FREE(t->pool_cs);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write any queued rows, and close the connections used by requests in this thread
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_sql_thread_t	*t = thread;
+
+	if (t->inst) sql_batch_flush(t->inst, t);
+
+	if (t->pool) fr_connection_pool_free(t->pool);
+	talloc_free(t->pool_cs);
+
+	return 0;
+}
+
+/** Process the groups of the user, and then the profile
+ *
+ * @param[in] inst		rlm_sql instance.
+ * @param[in] request		The current request.
+ * @param[in,out] handle	to run the queries on.
+ * @param[in,out] rcode		of authorize so far.
+ * @param[in,out] user_found	whether the user was found in any table.
+ * @param[in,out] do_fall_through	whether to process the groups and the profile.
+ * @return
+ *	- 0 on success, or if the group queries failed.
+ *	- -1 if we couldn't set the profile.
+ */
+static int sql_autz_groups(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			   rlm_rcode_t *rcode, bool *user_found, sql_fall_through_t *do_fall_through)
+{
+	VALUE_PAIR *user_profile = NULL;
+
+	if ((*do_fall_through == FALL_THROUGH_YES) ||
+	    (inst->config->read_groups && (*do_fall_through == FALL_THROUGH_DEFAULT))) {
+		rlm_rcode_t ret;
+
+		RDEBUG3("... falling-through to group processing");
+		ret = rlm_sql_process_groups(inst, request, handle, do_fall_through);
+		switch (ret) {
+		/*
+		 *	Nothing bad happened, continue...
+		 */
+		case RLM_MODULE_UPDATED:
+			*rcode = RLM_MODULE_UPDATED;
+			/* FALL-THROUGH */
+		case RLM_MODULE_OK:
+			if (*rcode != RLM_MODULE_UPDATED) {
+				*rcode = RLM_MODULE_OK;
+			}
+			/* FALL-THROUGH */
+		case RLM_MODULE_NOOP:
+			*user_found = true;
+			break;
+
+		case RLM_MODULE_NOTFOUND:
+			break;
+
+		default:
+			*rcode = ret;
+			return 0;
+		}
+	}
+
+	/*
+	 *	Repeat the above process with the default profile or User-Profile
+	 */
+	if ((*do_fall_through == FALL_THROUGH_YES) ||
+	    (inst->config->read_profiles && (*do_fall_through == FALL_THROUGH_DEFAULT))) {
+		rlm_rcode_t ret;
+
+		/*
+		 *  Check for a default_profile or for a User-Profile.
+		 */
+		RDEBUG3("... falling-through to profile processing");
+		user_profile = fr_pair_find_by_num(request->control, 0, PW_USER_PROFILE, TAG_ANY);
+
+		char const *profile = user_profile ?
+				      user_profile->vp_strvalue :
+				      inst->config->default_profile;
+
+		if (!profile || !*profile) {
+			return 0;
+		}
+
+		RDEBUG2("Checking profile %s", profile);
+
+		if (sql_set_user(inst, request, profile) < 0) {
+			REDEBUG("Error setting profile");
+			*rcode = RLM_MODULE_FAIL;
+			return -1;
+		}
+
+		ret = rlm_sql_process_groups(inst, request, handle, do_fall_through);
+		switch (ret) {
+		/*
+		 *	Nothing bad happened, continue...
+		 */
+		case RLM_MODULE_UPDATED:
+			*rcode = RLM_MODULE_UPDATED;
+			/* FALL-THROUGH */
+		case RLM_MODULE_OK:
+			if (*rcode != RLM_MODULE_UPDATED) {
+				*rcode = RLM_MODULE_OK;
+			}
+			/* FALL-THROUGH */
+		case RLM_MODULE_NOOP:
+			*user_found = true;
+			break;
+
+		case RLM_MODULE_NOTFOUND:
+			break;
+
+		default:
+			*rcode = ret;
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	State of authorize, when the queries run while the request yields.
+ */
+typedef struct sql_autz_ctx {
+	rlm_sql_async_t		async;			//!< The check or reply query.
+	char			*query;			//!< Expanded query.
+	char			**values;		//!< Or values of the statement's parameters.
+	rlm_rcode_t		rcode;			//!< Result so far.
+	bool			user_found;		//!< Whether the user was found in any table.
+	sql_fall_through_t	do_fall_through;	//!< Whether to process groups and profiles.
+} sql_autz_ctx_t;
+
+static rlm_rcode_t sql_autz_finish(REQUEST *request, sql_autz_ctx_t *autz, rlm_rcode_t rcode)
+{
+	rlm_sql_t const *inst = autz->async.inst;
+
+	fr_connection_release(autz->async.thread->pool, request, autz->async.handle);
+	sql_unset_user(inst, request);
+	talloc_free(autz);
+
+	return rcode;
+}
+
+/** Do the group and profile processing, once the check and reply queries are done
+ *
+ * The group queries run in a loop which depends on the result of each query, so
+ * they still block.  They use a connection from the pool shared by all threads.
+ */
+static rlm_rcode_t sql_autz_release(REQUEST *request, sql_autz_ctx_t *autz, bool groups)
+{
+	rlm_sql_t const		*inst = autz->async.inst;
+	rlm_sql_handle_t	*handle;
+
+	if (groups) {
+		fr_connection_release(autz->async.thread->pool, request, autz->async.handle);
+		autz->async.handle = NULL;
+
+		handle = fr_connection_get(inst->pool, request);
+		if (!handle) return sql_autz_finish(request, autz, RLM_MODULE_FAIL);
+
+		if (sql_autz_groups(inst, request, &handle, &autz->rcode, &autz->user_found,
+				    &autz->do_fall_through) < 0) {
+			fr_connection_release(inst->pool, request, handle);
+			return sql_autz_finish(request, autz, autz->rcode);
+		}
+
+		fr_connection_release(inst->pool, request, handle);
+	}
+
+	if (!autz->user_found) autz->rcode = RLM_MODULE_NOTFOUND;
+
+	return sql_autz_finish(request, autz, autz->rcode);
+}
+
+static rlm_rcode_t sql_autz_query(REQUEST *request, sql_autz_ctx_t *autz, char const *fmt,
+				  rlm_sql_stmt_t const *stmt, fr_unlang_resume_t resume)
+{
+	rlm_sql_t const *inst = autz->async.inst;
+
+	if (stmt) {
+		if (sql_stmt_values(autz, &autz->values, request, autz->async.handle, stmt) < 0) {
+			REDEBUG("Error generating query");
+			return sql_autz_finish(request, autz, RLM_MODULE_FAIL);
+		}
+
+		return rlm_sql_stmt_yield(request, &autz->async, stmt, autz->values, resume, autz);
+	}
+
+	if (xlat_aeval(autz, &autz->query, request, fmt, inst->sql_escape_func, autz->async.handle) < 0) {
+		REDEBUG("Error generating query");
+		return sql_autz_finish(request, autz, RLM_MODULE_FAIL);
+	}
+
+	return rlm_sql_query_yield(request, &autz->async, autz->query, true, resume, autz);
+}
+
+static rlm_rcode_t mod_authorize_reply_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_sql_t const	*inst = instance;
+	sql_autz_ctx_t	*autz = talloc_get_type_abort(ctx, sql_autz_ctx_t);
+	VALUE_PAIR	*reply_tmp = NULL;
+	int		rows = -1;
+
+	TALLOC_FREE(autz->query);
+	TALLOC_FREE(autz->values);
+
+	if (autz->async.rcode == RLM_SQL_OK) {
+		rows = sql_getvpdata_result(request->reply, inst, request, &autz->async.handle, &reply_tmp);
+	}
+	if (rows < 0) {
+		REDEBUG("SQL query error getting reply attributes");
+		fr_pair_list_free(&reply_tmp);
+		return sql_autz_finish(request, autz, RLM_MODULE_FAIL);
+	}
+
+	if (rows == 0) return sql_autz_release(request, autz, true);
+
+	autz->do_fall_through = fall_through(reply_tmp);
+
+	RDEBUG2("User found in radreply table, merging reply items");
+	autz->user_found = true;
+
+	rdebug_pair_list(L_DBG_LVL_2, request, reply_tmp, NULL);
+
+	radius_pairmove(request, &request->reply->vps, reply_tmp, true);
+
+	autz->rcode = RLM_MODULE_OK;
+
+	/*
+	 *	Neither group checks or profiles will work without
+	 *	a group membership query.
+	 */
+	return sql_autz_release(request, autz, (inst->config->groupmemb_query != NULL));
+}
+
+static rlm_rcode_t sql_autz_reply(REQUEST *request, sql_autz_ctx_t *autz)
+{
+	rlm_sql_t const *inst = autz->async.inst;
+
+	if (inst->config->authorize_reply_query) {
+		return sql_autz_query(request, autz, inst->config->authorize_reply_query, inst->authorize_reply_stmt,
+				      mod_authorize_reply_resume);
+	}
+
+	return sql_autz_release(request, autz, (inst->config->groupmemb_query != NULL));
+}
+
+static rlm_rcode_t mod_authorize_check_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_sql_t const	*inst = instance;
+	sql_autz_ctx_t	*autz = talloc_get_type_abort(ctx, sql_autz_ctx_t);
+	VALUE_PAIR	*check_tmp = NULL;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	int		rows = -1;
+
+	TALLOC_FREE(autz->query);
+	TALLOC_FREE(autz->values);
+
+	if (autz->async.rcode == RLM_SQL_OK) {
+		rows = sql_getvpdata_result(request, inst, request, &autz->async.handle, &check_tmp);
+	}
+	if (rows < 0) {
+		REDEBUG("Failed getting check attributes");
+		fr_pair_list_free(&check_tmp);
+		return sql_autz_finish(request, autz, RLM_MODULE_FAIL);
+	}
+
+	if (rows == 0) return sql_autz_release(request, autz, true);
+
+	/*
+	 *	Only do this if *some* check pairs were returned
+	 */
+	RDEBUG2("User found in radcheck table");
+	autz->user_found = true;
+	if (paircompare(request, request->packet->vps, check_tmp, &request->reply->vps) != 0) {
+		fr_pair_list_free(&check_tmp);
+		return sql_autz_release(request, autz, true);
+	}
+
+	RDEBUG2("Conditional check items matched, merging assignment check items");
+	RINDENT();
+	for (vp = fr_pair_cursor_init(&cursor, &check_tmp);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (!fr_assignment_op[vp->op]) continue;
+
+		rdebug_pair(2, request, vp, NULL);
+	}
+	REXDENT();
+	radius_pairmove(request, &request->control, check_tmp, true);
+
+	autz->rcode = RLM_MODULE_OK;
+
+	return sql_autz_reply(request, autz);
+}
+
+/** Authorize, running the check and reply queries while the request yields
+ *
+ */
+static rlm_rcode_t mod_authorize_async(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request)
+{
+	sql_autz_ctx_t *autz;
+
+	MEM(autz = talloc_zero(request, sql_autz_ctx_t));
+	autz->async.inst = inst;
+	autz->async.thread = t;
+	autz->rcode = RLM_MODULE_NOOP;
+	autz->do_fall_through = FALL_THROUGH_DEFAULT;
+
+	autz->async.handle = fr_connection_get(t->pool, request);
+	if (!autz->async.handle) return sql_autz_finish(request, autz, RLM_MODULE_FAIL);
+
+	/*
+	 *	Query the check table to find any conditions associated with this user/realm/whatever...
+	 */
+	if (inst->config->authorize_check_query) {
+		return sql_autz_query(request, autz, inst->config->authorize_check_query, inst->authorize_check_stmt,
+				      mod_authorize_check_resume);
+	}
+
+	return sql_autz_reply(request, autz);
+}
+
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
 {
 	rlm_rcode_t rcode = RLM_MODULE_NOOP;
 
 	rlm_sql_t const *inst = instance;
+	rlm_sql_thread_t *t = thread;
 	rlm_sql_handle_t  *handle;
 
 	VALUE_PAIR *check_tmp = NULL;
 	VALUE_PAIR *reply_tmp = NULL;
-	VALUE_PAIR *user_profile = NULL;
 
 	bool	user_found = false;
 
@@ -1276,8 +1742,6 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 
 	int	rows;
 
-	char	*expanded = NULL;
-
 	rad_assert(request->packet != NULL);
 	rad_assert(request->reply != NULL);
 
@@ -1295,6 +1759,11 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		return RLM_MODULE_FAIL;
 	}
 
+	/*
+	 *	The driver can run queries without blocking.
+	 */
+	if (t->pool) return mod_authorize_async(inst, t, request);
+
 	/*
 	 *	Reserve a socket
 	 *
@@ -1314,15 +1783,8 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_check_query,
-				 inst->sql_escape_func, handle) < 0) {
-			REDEBUG("Failed generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata_tmpl(request, inst, request, &handle, &check_tmp,
+					  inst->config->authorize_check_query, inst->authorize_check_stmt);
 		if (rows < 0) {
 			REDEBUG("Failed getting check attributes");
 			rcode = RLM_MODULE_FAIL;
@@ -1362,15 +1824,8 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		/*
 		 *	Now get the reply pairs since the paircompare matched
 		 */
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_reply_query,
-				 inst->sql_escape_func, handle) < 0) {
-			REDEBUG("Error generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata_tmpl(request->reply, inst, request, &handle, &reply_tmp,
+					  inst->config->authorize_reply_query, inst->authorize_reply_stmt);
 		if (rows < 0) {
 			REDEBUG("SQL query error getting reply attributes");
 			rcode = RLM_MODULE_FAIL;
@@ -1399,91 +1854,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	if (!inst->config->groupmemb_query) goto release;
 
 skipreply:
-	if ((do_fall_through == FALL_THROUGH_YES) ||
-	    (inst->config->read_groups && (do_fall_through == FALL_THROUGH_DEFAULT))) {
-		rlm_rcode_t ret;
-
-		RDEBUG3("... falling-through to group processing");
-		ret = rlm_sql_process_groups(inst, request, &handle, &do_fall_through);
-		switch (ret) {
-		/*
-		 *	Nothing bad happened, continue...
-		 */
-		case RLM_MODULE_UPDATED:
-			rcode = RLM_MODULE_UPDATED;
-			/* FALL-THROUGH */
-		case RLM_MODULE_OK:
-			if (rcode != RLM_MODULE_UPDATED) {
-				rcode = RLM_MODULE_OK;
-			}
-			/* FALL-THROUGH */
-		case RLM_MODULE_NOOP:
-			user_found = true;
-			break;
-
-		case RLM_MODULE_NOTFOUND:
-			break;
-
-		default:
-			rcode = ret;
-			goto release;
-		}
-	}
-
-	/*
-	 *	Repeat the above process with the default profile or User-Profile
-	 */
-	if ((do_fall_through == FALL_THROUGH_YES) ||
-	    (inst->config->read_profiles && (do_fall_through == FALL_THROUGH_DEFAULT))) {
-		rlm_rcode_t ret;
-
-		/*
-		 *  Check for a default_profile or for a User-Profile.
-		 */
-		RDEBUG3("... falling-through to profile processing");
-		user_profile = fr_pair_find_by_num(request->control, 0, PW_USER_PROFILE, TAG_ANY);
-
-		char const *profile = user_profile ?
-				      user_profile->vp_strvalue :
-				      inst->config->default_profile;
-
-		if (!profile || !*profile) {
-			goto release;
-		}
-
-		RDEBUG2("Checking profile %s", profile);
-
-		if (sql_set_user(inst, request, profile) < 0) {
-			REDEBUG("Error setting profile");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		ret = rlm_sql_process_groups(inst, request, &handle, &do_fall_through);
-		switch (ret) {
-		/*
-		 *	Nothing bad happened, continue...
-		 */
-		case RLM_MODULE_UPDATED:
-			rcode = RLM_MODULE_UPDATED;
-			/* FALL-THROUGH */
-		case RLM_MODULE_OK:
-			if (rcode != RLM_MODULE_UPDATED) {
-				rcode = RLM_MODULE_OK;
-			}
-			/* FALL-THROUGH */
-		case RLM_MODULE_NOOP:
-			user_found = true;
-			break;
-
-		case RLM_MODULE_NOTFOUND:
-			break;
-
-		default:
-			rcode = ret;
-			goto release;
-		}
-	}
+	if (sql_autz_groups(inst, request, &handle, &rcode, &user_found, &do_fall_through) < 0) goto error;
 
 	/*
 	 *	At this point the key (user) hasn't be found in the check table, the reply table
@@ -1509,6 +1880,134 @@ error:
 	return rcode;
 }
 
+/*
+ *	State of acct_redundant(), when the queries run while the request yields.
+ */
+typedef struct sql_acct_ctx {
+	rlm_sql_async_t		async;			//!< The query being run.
+	sql_acct_section_t	*section;		//!< Section the queries are from.
+	CONF_PAIR		*pair;			//!< Query being run.
+	char const		*attr;			//!< Name of the redundant set of queries.
+	char			*query;			//!< Expanded query.
+} sql_acct_ctx_t;
+
+static rlm_rcode_t acct_redundant_finish(REQUEST *request, sql_acct_ctx_t *acct, rlm_rcode_t rcode)
+{
+	rlm_sql_t const *inst = acct->async.inst;
+
+	fr_connection_release(acct->async.thread->pool, request, acct->async.handle);
+	sql_unset_user(inst, request);
+	talloc_free(acct);
+
+	return rcode;
+}
+
+static rlm_rcode_t acct_redundant_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
+/** Expand and run the current query of the redundant set
+ *
+ */
+static rlm_rcode_t acct_redundant_next(REQUEST *request, sql_acct_ctx_t *acct)
+{
+	rlm_sql_t const	*inst = acct->async.inst;
+	char const	*value;
+
+	value = cf_pair_value(acct->pair);
+	if (!value) {
+		RDEBUG("Ignoring null query");
+		return acct_redundant_finish(request, acct, RLM_MODULE_NOOP);
+	}
+
+	if (xlat_aeval(acct, &acct->query, request, value, inst->sql_escape_func, acct->async.handle) < 0) {
+		return acct_redundant_finish(request, acct, RLM_MODULE_FAIL);
+	}
+
+	if (!*acct->query) {
+		RDEBUG("Ignoring null query");
+		return acct_redundant_finish(request, acct, RLM_MODULE_NOOP);
+	}
+
+	rlm_sql_query_log(inst, request, acct->section, acct->query);
+
+	return rlm_sql_query_yield(request, &acct->async, acct->query, false, acct_redundant_resume, acct);
+}
+
+static rlm_rcode_t acct_redundant_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_sql_t const	*inst = instance;
+	sql_acct_ctx_t	*acct = talloc_get_type_abort(ctx, sql_acct_ctx_t);
+	int		numaffected;
+
+	TALLOC_FREE(acct->query);
+	RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, acct->async.rcode, "<INVALID>"));
+
+	switch (acct->async.rcode) {
+	case RLM_SQL_OK:
+		break;
+
+	case RLM_SQL_QUERY_INVALID:
+		return acct_redundant_finish(request, acct, RLM_MODULE_INVALID);
+
+	case RLM_SQL_ALT_QUERY:
+		goto next;
+
+	default:
+		return acct_redundant_finish(request, acct, RLM_MODULE_FAIL);
+	}
+	rad_assert(acct->async.handle);
+
+	/*
+	 *  We need to have updated something for the query to have been
+	 *  counted as successful.
+	 */
+	numaffected = (inst->driver->sql_affected_rows)(acct->async.handle, inst->config);
+	(inst->driver->sql_finish_query)(acct->async.handle, inst->config);
+	RDEBUG("%i record(s) updated", numaffected);
+
+	if (numaffected > 0) return acct_redundant_finish(request, acct, RLM_MODULE_OK);
+
+next:
+	/*
+	 *  We assume all entries with the same name form a redundant
+	 *  set of queries.
+	 */
+	acct->pair = cf_pair_find_next(acct->section->cs, acct->pair, acct->attr);
+	if (!acct->pair) {
+		RDEBUG("No additional queries configured");
+		return acct_redundant_finish(request, acct, RLM_MODULE_NOOP);
+	}
+
+	RDEBUG("Trying next query...");
+
+	return acct_redundant_next(request, acct);
+}
+
+/** acct_redundant(), with the queries running while the request yields
+ *
+ */
+static rlm_rcode_t acct_redundant_async(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+					sql_acct_section_t *section, CONF_PAIR *pair, char const *attr)
+{
+	sql_acct_ctx_t *acct;
+
+	MEM(acct = talloc_zero(request, sql_acct_ctx_t));
+	acct->async.inst = inst;
+	acct->async.thread = t;
+	acct->section = section;
+	acct->pair = pair;
+	acct->attr = attr;
+
+	acct->async.handle = fr_connection_get(t->pool, request);
+	if (!acct->async.handle) {
+		talloc_free(acct);
+		return RLM_MODULE_FAIL;
+	}
+
+	sql_set_user(inst, request, NULL);
+
+	return acct_redundant_next(request, acct);
+}
+
 /*
  *	Generic function for failing between a bunch of queries.
  *
@@ -1519,7 +2018,8 @@ error:
  *	doesn't update any rows, the next matching config item is used.
  *
  */
-static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+static rlm_rcode_t acct_redundant(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+				  sql_acct_section_t *section)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
@@ -1571,6 +2071,11 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 	RDEBUG2("Using query template '%s'", attr);
 
+	/*
+	 *	The driver can run queries without blocking.
+	 */
+	if (t->pool && !section->batch_size) return acct_redundant_async(inst, t, request, section, pair, attr);
+
 	handle = fr_connection_get(inst->pool, request);
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
@@ -1580,6 +2085,17 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 	sql_set_user(inst, request, NULL);
 
+	/*
+	 *	Queue the queries, and write them later with
+	 *	those of other requests.  The request yields
+	 *	until they've been written.
+	 */
+	if (section->batch_size) {
+		rcode = sql_batch_enqueue(inst, t, request, handle, section, pair, attr);
+
+		goto finish;
+	}
+
 	while (true) {
 		value = cf_pair_value(pair);
 		if (!value) {
@@ -1686,13 +2202,13 @@ finish:
 /*
  *	Accounting: Insert or update session data in our sql table
  */
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sql_t const *inst = instance;
 
 	if (inst->config->accounting.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->accounting);
+		return acct_redundant(inst, thread, request, &inst->config->accounting);
 	}
 
 	return RLM_MODULE_NOOP;
@@ -1901,13 +2417,13 @@ release:
 /*
  *	Postauth: Write a record of the authentication attempt
  */
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sql_t const *inst = instance;
 
 	if (inst->config->postauth.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->postauth);
+		return acct_redundant(inst, thread, request, &inst->config->postauth);
 	}
 
 	return RLM_MODULE_NOOP;
@@ -1928,6 +2444,9 @@ rad_module_t rlm_sql = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
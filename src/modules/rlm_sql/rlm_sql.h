@@ -51,6 +51,7 @@ typedef enum {
 	RLM_SQL_RECONNECT = 1,		//!< Stale connection, should reconnect.
 	RLM_SQL_ALT_QUERY,		//!< Key constraint violation, use an alternative query.
 	RLM_SQL_NO_MORE_ROWS,		//!< No more rows available
+	RLM_SQL_PENDING,		//!< Query was sent, but the result isn't available yet.
 } sql_rcode_t;
 
 typedef enum {
@@ -82,6 +83,11 @@ typedef struct sql_acct_section {
 	char const		*logfile;
 
 	char const		**query;			/* for xlat parsing */
+
+	uint32_t		batch_size;			//!< Rows to queue before writing them.
+								//!< 0 means write each row immediately.
+	struct timeval		batch_interval;			//!< Longest time a row stays queued.
+	bool			batch_transaction;		//!< Write each batch in one transaction.
 } sql_acct_section_t;
 
 typedef struct sql_config {
@@ -136,6 +142,10 @@ typedef struct sql_config {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepare_statements;		//!< Run the authorization queries as
+								//!< prepared statements, if the driver
+								//!< supports them.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -159,8 +169,26 @@ typedef struct rlm_sql_handle {
 	rlm_sql_t const		*inst;				//!< The rlm_sql instance this connection belongs to.
 	TALLOC_CTX		*log_ctx;			//!< Talloc pool used to avoid allocing memory
 								//!< when log strings need to be copied.
+	void			**stmts;			//!< The driver's prepared statements, indexed
+								//!< by rlm_sql_stmt_t id.  Allocated on first use.
 } rlm_sql_handle_t;
 
+/** A query template, compiled into a statement with parameters
+ *
+ * Each single quoted string in the template which contains an expansion
+ * becomes a parameter, written as $1, $2... in the query.  The expansions
+ * aren't escaped for SQL, as the values are never part of the query.
+ */
+typedef struct rlm_sql_stmt {
+	int			id;				//!< Index into the prepared statements
+								//!< of each connection.  Unique across
+								//!< all instances.
+	char const		*name;				//!< Config item the template came from.
+	char const		*query;				//!< Query with placeholders for the parameters.
+	char const		**param;			//!< xlat format of each parameter.
+	int			num_params;			//!< Number of parameters.
+} rlm_sql_stmt_t;
+
 extern const FR_NAME_NUMBER sql_rcode_table[];
 /*
  *	Capabilities flags for drivers
@@ -218,6 +246,41 @@ typedef struct rlm_sql_driver_t {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/*
+	 *	Optional.  Drivers which can run queries without blocking
+	 *	provide all three.
+	 *
+	 *	sql_query_submit sends the query, and returns #RLM_SQL_OK if
+	 *	it was sent.  Once sql_socket_fd becomes readable,
+	 *	sql_query_poll returns #RLM_SQL_PENDING until the result is
+	 *	available, and then the same codes as sql_query.  After that,
+	 *	the result is used as if sql_query or sql_select_query had
+	 *	been called.
+	 */
+	sql_rcode_t (*sql_query_submit)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query);
+	int (*sql_socket_fd)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+	sql_rcode_t (*sql_query_poll)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+	/*
+	 *	Optional.  Drivers which support prepared statements
+	 *	provide sql_stmt_prepare and sql_stmt_execute, and
+	 *	sql_stmt_submit too if they provide sql_query_submit.
+	 *
+	 *	sql_stmt_prepare is called once per statement, per
+	 *	connection.  It writes whatever the driver needs to run
+	 *	the statement to *out, which must be freed along with the
+	 *	connection.  sql_stmt_execute and sql_stmt_submit are
+	 *	then used in the same way as sql_select_query and
+	 *	sql_query_submit, with one value for each of the
+	 *	statement's parameters.
+	 */
+	sql_rcode_t (*sql_stmt_prepare)(void **out, rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					rlm_sql_stmt_t const *stmt);
+	sql_rcode_t (*sql_stmt_execute)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, void *prepared,
+					rlm_sql_stmt_t const *stmt, char const * const *values);
+	sql_rcode_t (*sql_stmt_submit)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, void *prepared,
+				       rlm_sql_stmt_t const *stmt, char const * const *values);
 } rlm_sql_driver_t;
 
 struct sql_inst {
@@ -242,8 +305,100 @@ struct sql_inst {
 
 	char const		*name;			//!< Module instance name.
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
+
+	struct rlm_sql_batch_stats *batch_stats;	//!< Totals for the batches written by all threads.
+
+	rlm_sql_stmt_t		*authorize_check_stmt;	//!< Compiled form of the authorization queries.
+	rlm_sql_stmt_t		*authorize_reply_stmt;	//!< NULL where the query can't be prepared.
+	rlm_sql_stmt_t		*authorize_group_check_stmt;
+	rlm_sql_stmt_t		*authorize_group_reply_stmt;
+	rlm_sql_stmt_t		*groupmemb_stmt;
 };
 
+typedef struct rlm_sql_batch_wait rlm_sql_batch_wait_t;
+
+/** A row queued for writing
+ *
+ * The queries are expanded when the row is queued, as the request
+ * may be gone by the time the row is written.
+ */
+typedef struct rlm_sql_batch_row {
+	struct rlm_sql_batch_row *next;			//!< Next row in the order they were queued.
+	char			**query;		//!< Expanded redundant set of queries.
+	size_t			prefix_len;		//!< Length of query[0] up to its VALUES tuple.
+							//!< 0 if query[0] can't be part of a multi-row INSERT.
+	bool			done;			//!< Whether the row has been written.
+	bool			failed;			//!< Whether the row was dropped.
+	rlm_sql_batch_wait_t	*wait;			//!< Request waiting for the row to be written.
+							//!< NULL if the request is gone.
+} rlm_sql_batch_row_t;
+
+/** Rows queued by one thread
+ *
+ */
+typedef struct rlm_sql_batch {
+	rlm_sql_batch_row_t	*head;			//!< Oldest row.
+	rlm_sql_batch_row_t	**tail;			//!< Where to link the next row.
+	uint32_t		num;			//!< Number of rows queued.
+	struct timeval		first;			//!< When the oldest row was queued.
+
+	fr_event_list_t		*el;			//!< Event list of the thread.
+	fr_event_timer_t	*ev;			//!< Writes the rows after batch_interval.
+} rlm_sql_batch_t;
+
+/** Totals for the batches written by all threads
+ *
+ * Read with the "<instance>_batch" xlat.
+ */
+typedef struct rlm_sql_batch_stats {
+	pthread_mutex_t		mutex;
+	uint64_t		batches;		//!< Batches written.
+	uint64_t		rows;			//!< Rows in those batches.
+	uint64_t		merged;			//!< Rows written by multi-row INSERTs.
+	uint64_t		fallback;		//!< Rows written one by one after a batch failed.
+	uint64_t		dropped;		//!< Rows which couldn't be written at all.
+	uint32_t		max_size;		//!< Largest batch.
+	uint64_t		latency;		//!< Total time (usec) the oldest rows were queued.
+	uint64_t		max_latency;		//!< Longest time (usec) a row was queued.
+} rlm_sql_batch_stats_t;
+
+/** Thread specific instance data
+ *
+ * The pool is only created if the driver can run queries without blocking,
+ * and "pool.per_thread" is set.  Requests running in this thread then yield
+ * while their queries run.
+ *
+ * The batch is only used if accounting.batch.size is set.
+ */
+typedef struct rlm_sql_thread {
+	rlm_sql_t const		*inst;			//!< Instance of rlm_sql.
+	CONF_SECTION		*pool_cs;		//!< Copy of the pool configuration.
+	fr_connection_pool_t	*pool;			//!< Connections used by requests in this thread.
+
+	rlm_sql_batch_t		batch;			//!< Accounting rows waiting to be written.
+} rlm_sql_thread_t;
+
+/** A query which runs while the request yields
+ *
+ * Embedded in the state of the module method which runs the query.
+ */
+typedef struct rlm_sql_async {
+	rlm_sql_t const		*inst;			//!< Instance of rlm_sql.
+	rlm_sql_thread_t	*thread;		//!< Thread the query runs in.
+	rlm_sql_handle_t	*handle;		//!< Connection the query runs on.  NULL if we
+							//!< couldn't reconnect.
+	char const		*query;			//!< Query to run.
+	rlm_sql_stmt_t const	*stmt;			//!< Statement to run instead, if not NULL.
+	char			**values;		//!< Values of the statement's parameters.
+	bool			select;			//!< Whether the query returns rows.
+	int			fd;			//!< Socket we're waiting on.
+	int			tries;			//!< How many times we've sent the query.
+	sql_rcode_t		rcode;			//!< Result of the query.
+
+	fr_unlang_resume_t	resume;			//!< Called when the query is done.
+	void			*uctx;			//!< Context for the resume function.
+} rlm_sql_async_t;
+
 typedef struct sql_grouplist {
 	char			*name;
 	struct sql_grouplist	*next;
@@ -253,12 +408,39 @@ void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *ti
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
 int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
+int		sql_getvpdata_result(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair);
 int		sql_read_clients(rlm_sql_handle_t *handle);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+rlm_rcode_t	rlm_sql_query_yield(REQUEST *request, rlm_sql_async_t *async, char const *query, bool select,
+				    fr_unlang_resume_t resume, void *uctx) CC_HINT(nonnull (1, 2, 3, 5));
+rlm_rcode_t	rlm_sql_stmt_yield(REQUEST *request, rlm_sql_async_t *async, rlm_sql_stmt_t const *stmt,
+				   char **values, fr_unlang_resume_t resume, void *uctx) CC_HINT(nonnull (1, 2, 3, 4, 5));
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
+
+/*
+ *	Do a set/unset user, so it's a bit clearer what's going on.
+ */
+#define sql_unset_user(_i, _r) fr_pair_delete_by_num(&_r->packet->vps, _i->sql_user->vendor, _i->sql_user->attr, TAG_ANY)
+
+rlm_sql_stmt_t	*sql_stmt_compile(rlm_sql_t *inst, char const *name, char const *query);
+int		sql_stmt_values(TALLOC_CTX *ctx, char ***out, REQUEST *request, rlm_sql_handle_t *handle,
+				rlm_sql_stmt_t const *stmt);
+sql_rcode_t	sql_stmt_prepared(void **out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				  rlm_sql_stmt_t const *stmt);
+sql_rcode_t	rlm_sql_select_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				    rlm_sql_stmt_t const *stmt, char **values) CC_HINT(nonnull (1, 3, 4, 5));
+
+rlm_rcode_t	sql_batch_enqueue(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+				  rlm_sql_handle_t *handle, sql_acct_section_t *section,
+				  CONF_PAIR *pair, char const *attr);
+void		sql_batch_flush(rlm_sql_t const *inst, rlm_sql_thread_t *t);
+int		sql_batch_stats_init(rlm_sql_t *inst);
+ssize_t		sql_batch_xlat(TALLOC_CTX *ctx, char **out, size_t outlen,
+			       void const *mod_inst, void const *xlat_inst,
+			       REQUEST *request, char const *fmt);
 #endif
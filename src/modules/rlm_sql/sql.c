@@ -50,6 +50,7 @@ const FR_NAME_NUMBER sql_rcode_table[] = {
 	{ "query invalid",	RLM_SQL_QUERY_INVALID	},
 	{ "no connection",	RLM_SQL_RECONNECT	},
 	{ "no more rows",	RLM_SQL_NO_MORE_ROWS	},
+	{ "pending",		RLM_SQL_PENDING		},
 	{ NULL, 0 }
 };
 
@@ -483,6 +484,275 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	return RLM_SQL_ERROR;
 }
 
+/** Check the result of a query run by rlm_sql_query_yield()
+ *
+ * Does the same error handling as rlm_sql_query() and rlm_sql_select_query().
+ *
+ * @param request Current request.
+ * @param async the query.
+ * @param ret what the driver returned.
+ * @return the result to give to the caller.
+ */
+static sql_rcode_t sql_async_result(REQUEST *request, rlm_sql_async_t *async, sql_rcode_t ret)
+{
+	rlm_sql_t const *inst = async->inst;
+
+	if (ret == RLM_SQL_OK) return ret;
+
+	/*
+	 *	We couldn't reconnect, so there's nothing to clean up.
+	 */
+	if (!async->handle) return RLM_SQL_RECONNECT;
+
+	if (async->select) {
+		rlm_sql_print_error(inst, request, async->handle, false);
+		(inst->driver->sql_finish_select_query)(async->handle, inst->config);
+		return ret;
+	}
+
+	switch (ret) {
+	case RLM_SQL_ERROR:
+		if (!(inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY)) {
+			ret = RLM_SQL_ALT_QUERY;
+			goto alt_query;
+		}
+		/* FALL-THROUGH */
+
+	default:
+		rlm_sql_print_error(inst, request, async->handle, false);
+		(inst->driver->sql_finish_query)(async->handle, inst->config);
+		break;
+
+	case RLM_SQL_ALT_QUERY:
+	alt_query:
+		rlm_sql_print_error(inst, request, async->handle, true);
+		(inst->driver->sql_finish_query)(async->handle, inst->config);
+		break;
+	}
+
+	return ret;
+}
+
+static rlm_rcode_t sql_async_run(REQUEST *request, rlm_sql_async_t *async, sql_rcode_t ret);
+
+/** The socket of a running query is readable
+ *
+ */
+static void sql_async_readable(REQUEST *request, void *instance, UNUSED void *thread, void *ctx, int fd)
+{
+	rlm_sql_t const	*inst = instance;
+	rlm_sql_async_t	*async = ctx;
+	sql_rcode_t	ret;
+
+	ret = (inst->driver->sql_query_poll)(async->handle, inst->config);
+	if (ret == RLM_SQL_PENDING) return;
+
+	async->rcode = ret;
+
+	(void) unlang_event_fd_delete(request, async, fd);
+	unlang_resumable(request);
+}
+
+/** The query is done, or the connection failed
+ *
+ */
+static rlm_rcode_t sql_async_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_sql_async_t	*async = ctx;
+
+	return sql_async_run(request, async, async->rcode);
+}
+
+/** The request was cancelled while the query was running
+ *
+ */
+static void sql_async_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+			     fr_state_action_t action)
+{
+	rlm_sql_async_t	*async = ctx;
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending SQL query");
+
+	if (async->fd >= 0) (void) unlang_event_fd_delete(request, async, async->fd);
+
+	/*
+	 *	The result of the query will still arrive, so the
+	 *	connection can't be used for anything else.
+	 */
+	if (async->handle) {
+		fr_connection_close(async->thread->pool, request, async->handle);
+		async->handle = NULL;
+	}
+
+	/*
+	 *	The resume function won't be called, so it can't
+	 *	remove SQL-User-Name.
+	 */
+	sql_unset_user(async->inst, request);
+}
+
+/** Send the query, reconnecting if necessary, and yield until the result arrives
+ *
+ * Once the query is done, the caller's resume function is called.
+ *
+ * @param request Current request.
+ * @param async the query.
+ * @param ret #RLM_SQL_RECONNECT if the query needs to be (re)sent, otherwise the
+ *	result of the query.
+ * @return what the resume function returned, or #RLM_MODULE_YIELD.
+ */
+static rlm_rcode_t sql_async_run(REQUEST *request, rlm_sql_async_t *async, sql_rcode_t ret)
+{
+	rlm_sql_t const		*inst = async->inst;
+	fr_connection_pool_t	*pool = async->thread->pool;
+	int			count;
+	void			*mutable, *prepared;
+
+	count = fr_connection_pool_state(pool)->num;
+
+	/*
+	 *  As with rlm_sql_query(), we try with each of the existing
+	 *  connections, then try to create a new connection, then give up.
+	 */
+	while (ret == RLM_SQL_RECONNECT) {
+		if (async->tries > count) {
+			RERROR("Hit reconnection limit");
+			ret = RLM_SQL_ERROR;
+			break;
+		}
+
+		if (async->tries++ > 0) {
+			async->handle = fr_connection_reconnect(pool, request, async->handle);
+			if (!async->handle) break;
+		}
+
+		if (async->stmt) {
+			RDEBUG2("Executing select statement: %s", async->query);
+
+			/*
+			 *	Preparing the statement blocks, but only
+			 *	happens once per connection.
+			 */
+			ret = sql_stmt_prepared(&prepared, inst, request, async->handle, async->stmt);
+			if (ret == RLM_SQL_OK) {
+				ret = (inst->driver->sql_stmt_submit)(async->handle, inst->config, prepared, async->stmt,
+								      (char const * const *) async->values);
+			}
+		} else {
+			RDEBUG2("Executing %squery: %s", async->select ? "select " : "", async->query);
+
+			ret = (inst->driver->sql_query_submit)(async->handle, inst->config, async->query);
+		}
+		if (ret != RLM_SQL_OK) continue;
+
+		async->fd = (inst->driver->sql_socket_fd)(async->handle, inst->config);
+		if ((async->fd < 0) ||
+		    (unlang_event_fd_readable_add(request, sql_async_readable, async, async->fd) < 0)) {
+			REDEBUG("Failed waiting for query result");
+
+			/*
+			 *	The query was sent, so the connection
+			 *	can't be used for anything else.
+			 */
+			fr_connection_close(pool, request, async->handle);
+			async->handle = NULL;
+			break;
+		}
+
+		return unlang_yield(request, sql_async_resume, sql_async_action, async);
+	}
+
+	async->rcode = sql_async_result(request, async, ret);
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	return async->resume(request, mutable, async->thread, async->uctx);
+}
+
+/** Run a query without blocking the thread
+ *
+ * The request yields until the result of the query is available.  The resume function is
+ * then called, with async->rcode set to the same codes as #rlm_sql_query (or
+ * #rlm_sql_select_query if select is true) would have returned.  The resume function
+ * may run another query, or call fr_connection_release on async->handle.
+ *
+ * @note Only for drivers which provide sql_query_submit, and with async->handle reserved
+ *	from the thread's connection pool.
+ *
+ * @param request Current request.
+ * @param async the query, with inst, thread and handle set.
+ * @param query to execute.  Must remain valid until the resume function is called.
+ * @param select whether the query returns rows.
+ * @param resume called when the query is done.
+ * @param uctx passed to the resume function.
+ * @return what the resume function returned, or #RLM_MODULE_YIELD.
+ */
+rlm_rcode_t rlm_sql_query_yield(REQUEST *request, rlm_sql_async_t *async, char const *query, bool select,
+				fr_unlang_resume_t resume, void *uctx)
+{
+	rad_assert(async->handle);
+	rad_assert(async->inst->driver->sql_query_submit);
+
+	async->query = query;
+	async->stmt = NULL;
+	async->values = NULL;
+	async->select = select;
+	async->fd = -1;
+	async->tries = 0;
+	async->resume = resume;
+	async->uctx = uctx;
+
+	/* There's no query to run, return an error */
+	if (query[0] == '\0') {
+		void *mutable;
+
+		REDEBUG("Zero length query");
+		async->rcode = RLM_SQL_QUERY_INVALID;
+
+		memcpy(&mutable, &async->inst, sizeof(mutable));
+
+		return resume(request, mutable, async->thread, uctx);
+	}
+
+	return sql_async_run(request, async, RLM_SQL_RECONNECT);
+}
+
+/** Run a statement which returns rows without blocking the thread
+ *
+ * The same as rlm_sql_query_yield(), with async->rcode set to the same codes as
+ * #rlm_sql_select_stmt would have returned.
+ *
+ * @note Only for drivers which provide sql_stmt_submit.
+ *
+ * @param request Current request.
+ * @param async the query, with inst, thread and handle set.
+ * @param stmt to run.
+ * @param values of the statement's parameters.  Must remain valid until the resume
+ *	function is called.
+ * @param resume called when the statement is done.
+ * @param uctx passed to the resume function.
+ * @return what the resume function returned, or #RLM_MODULE_YIELD.
+ */
+rlm_rcode_t rlm_sql_stmt_yield(REQUEST *request, rlm_sql_async_t *async, rlm_sql_stmt_t const *stmt,
+			       char **values, fr_unlang_resume_t resume, void *uctx)
+{
+	rad_assert(async->handle);
+	rad_assert(async->inst->driver->sql_stmt_submit);
+
+	async->query = stmt->query;
+	async->stmt = stmt;
+	async->values = values;
+	async->select = true;
+	async->fd = -1;
+	async->tries = 0;
+	async->resume = resume;
+	async->uctx = uctx;
+
+	return sql_async_run(request, async, RLM_SQL_RECONNECT);
+}
+
 
 /*************************************************************************
  *
@@ -494,8 +764,6 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
 		  VALUE_PAIR **pair, char const *query)
 {
-	rlm_sql_row_t	row;
-	int		rows = 0;
 	sql_rcode_t	rcode;
 
 	rad_assert(request);
@@ -503,6 +771,29 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_
 	rcode = rlm_sql_select_query(inst, request, handle, query);
 	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
 
+	return sql_getvpdata_result(ctx, inst, request, handle, pair);
+}
+
+/** Convert the rows of a select query into pairs
+ *
+ * Used by sql_getvpdata(), after rlm_sql_select_stmt(), and after select queries
+ * run by rlm_sql_query_yield() or rlm_sql_stmt_yield().  Finishes the select query.
+ *
+ * @param[in] ctx to allocate the pairs in.
+ * @param[in] inst #rlm_sql_t instance data.
+ * @param[in] request Current request.
+ * @param[in] handle the select query was run on.
+ * @param[out] pair where to add the pairs.
+ * @return
+ *	- The number of rows.
+ *	- -1 on error.
+ */
+int sql_getvpdata_result(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			 VALUE_PAIR **pair)
+{
+	rlm_sql_row_t	row;
+	int		rows = 0;
+
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
 		if (sql_fr_pair_list_afrom_str(ctx, request, pair, row) != 0) {
 			REDEBUG("Error parsing user data from database result");
@@ -0,0 +1,363 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file stmt.c
+ * @brief Run query templates as prepared statements.
+ *
+ * Query templates are compiled when the module is instantiated.  Each
+ * connection prepares a statement the first time it's used, and keeps it
+ * until the connection is closed.  Requests then only expand the values
+ * of the parameters, instead of expanding, escaping and parsing the
+ * whole query.
+ *
+ * Templates which can't be compiled are run as before.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include	<freeradius-devel/radiusd.h>
+#include	<freeradius-devel/rad_assert.h>
+
+#include	<ctype.h>
+
+#include	"rlm_sql.h"
+
+/*
+ *	Statements are numbered across all instances, as instances
+ *	can share a connection pool.
+ */
+static int num_stmts;
+
+/** Find the end of an expansion
+ *
+ * @param[in] p	pointing to the '%' of "%{".
+ * @return the char after the closing '}', or NULL if there isn't one.
+ */
+static char const *sql_stmt_xlat_end(char const *p)
+{
+	int depth = 0;
+
+	for (; *p; p++) {
+		if (*p == '{') depth++;
+		if ((*p == '}') && (--depth == 0)) return p + 1;
+	}
+
+	return NULL;
+}
+
+/** Compile a query template into a statement with parameters
+ *
+ * The template can be compiled if every expansion is inside a single
+ * quoted string.  Those strings become parameters, with the quotes
+ * removed and any doubled quotes undone.  Strings without expansions
+ * are left in the query.
+ *
+ * Backslashes aren't allowed, as what they do in strings depends on the
+ * database.
+ *
+ * @param[in] inst	of rlm_sql.  The statement is allocated in its context.
+ * @param[in] name	of the config item the template came from.
+ * @param[in] query	template to compile.  May be NULL.
+ * @return
+ *	- The statement.
+ *	- NULL if the template can't be compiled, or the driver doesn't support
+ *	  prepared statements.
+ */
+rlm_sql_stmt_t *sql_stmt_compile(rlm_sql_t *inst, char const *name, char const *query)
+{
+	rlm_sql_stmt_t		*stmt;
+	char			*out, *param = NULL;
+	char const		*p, *q, *start;
+	bool			has_xlat;
+
+	if (!query || !inst->config->prepare_statements) return NULL;
+
+	if (!inst->driver->sql_stmt_prepare || !inst->driver->sql_stmt_execute ||
+	    (inst->driver->sql_query_submit && !inst->driver->sql_stmt_submit)) return NULL;
+
+	MEM(stmt = talloc_zero(inst, rlm_sql_stmt_t));
+	stmt->name = name;
+	MEM(out = talloc_strdup(stmt, ""));
+
+	p = query;
+	while (*p) {
+		switch (*p) {
+		case '%':
+			DEBUG2("Not preparing %s: it has an expansion outside a quoted string", name);
+			goto error;
+
+		case '\\':
+			DEBUG2("Not preparing %s: it contains a backslash", name);
+			goto error;
+
+		/*
+		 *	Identifiers, or strings in some dialects.
+		 *	Either way they have to be constant.
+		 */
+		case '"':
+			q = strchr(p + 1, '"');
+			if (!q || (memchr(p, '%', q - p) != NULL) || (memchr(p, '\'', q - p) != NULL)) {
+				DEBUG2("Not preparing %s: it has an expansion or quote inside a double quoted string",
+				       name);
+				goto error;
+			}
+			MEM(out = talloc_strndup_append_buffer(out, p, (q + 1) - p));
+			p = q + 1;
+			continue;
+
+		case '\'':
+			break;
+
+		default:
+			MEM(out = talloc_strndup_append_buffer(out, p, 1));
+			p++;
+			continue;
+		}
+
+		/*
+		 *	A single quoted string.
+		 */
+		start = p++;
+		has_xlat = false;
+		MEM(param = talloc_strdup(stmt, ""));
+
+		for (;;) {
+			if (*p == '\0') {
+				DEBUG2("Not preparing %s: it has an unterminated string", name);
+				goto error;
+			}
+
+			if (*p == '\\') {
+				DEBUG2("Not preparing %s: it contains a backslash", name);
+				goto error;
+			}
+
+			if (*p == '\'') {
+				if (p[1] != '\'') break;
+
+				/*
+				 *	A doubled quote is a quote in the string.
+				 */
+				MEM(param = talloc_strndup_append_buffer(param, p, 1));
+				p += 2;
+				continue;
+			}
+
+			if (*p == '%') {
+				has_xlat = true;
+
+				/*
+				 *	Copy the expansion as-is, it may
+				 *	contain quotes of its own.
+				 */
+				if (p[1] == '{') {
+					q = sql_stmt_xlat_end(p);
+					if (!q) {
+						DEBUG2("Not preparing %s: it has an unterminated expansion", name);
+						goto error;
+					}
+					MEM(param = talloc_strndup_append_buffer(param, p, q - p));
+					p = q;
+					continue;
+				}
+			}
+
+			MEM(param = talloc_strndup_append_buffer(param, p, 1));
+			p++;
+		}
+		p++;
+
+		if (!has_xlat) {
+			MEM(out = talloc_strndup_append_buffer(out, start, p - start));
+			TALLOC_FREE(param);
+			continue;
+		}
+
+		/*
+		 *	E'...', N'...' etc. can't be replaced
+		 *	by a parameter.
+		 */
+		if ((start > query) && isalnum((uint8_t) start[-1])) {
+			DEBUG2("Not preparing %s: it has an expansion inside a prefixed string", name);
+			goto error;
+		}
+
+		MEM(stmt->param = talloc_realloc(stmt, stmt->param, char const *, stmt->num_params + 1));
+		stmt->param[stmt->num_params++] = param;
+		param = NULL;
+
+		MEM(out = talloc_asprintf_append_buffer(out, "$%i", stmt->num_params));
+	}
+
+	stmt->query = out;
+	stmt->id = num_stmts++;
+
+	DEBUG2("Prepared %s with %i parameter(s): %s", name, stmt->num_params, stmt->query);
+
+	return stmt;
+
+error:
+	talloc_free(stmt);
+	return NULL;
+}
+
+/** Expand the values of a statement's parameters
+ *
+ * The values are only escaped if the driver uses the default escape function,
+ * as it changes the data as well as making it safe.  The escaping done by
+ * drivers' own escape functions is only needed for values which are part of
+ * the query.
+ *
+ * @param[in] ctx	to allocate the values in.
+ * @param[out] out	Where to write the values.
+ * @param[in] request	Current request.
+ * @param[in] handle	the statement will run on.
+ * @param[in] stmt	to expand the parameters of.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_stmt_values(TALLOC_CTX *ctx, char ***out, REQUEST *request, rlm_sql_handle_t *handle,
+		    rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_t const	*inst = handle->inst;
+	xlat_escape_t	escape = inst->driver->sql_escape_func ? NULL : inst->sql_escape_func;
+	char		**values;
+	int		i;
+
+	MEM(values = talloc_zero_array(ctx, char *, stmt->num_params));
+
+	for (i = 0; i < stmt->num_params; i++) {
+		if (xlat_aeval(values, &values[i], request, stmt->param[i], escape, handle) < 0) {
+			talloc_free(values);
+			return -1;
+		}
+		RDEBUG2("$%i = \"%s\"", i + 1, values[i]);
+	}
+
+	*out = values;
+
+	return 0;
+}
+
+/** Get the prepared form of a statement, preparing it if this connection hasn't already
+ *
+ * @note Errors are left for the caller to print, as with the driver's other functions.
+ *
+ * @param[out] out	Where to write the driver's prepared statement.
+ * @param[in] inst	of rlm_sql.
+ * @param[in] request	Current request, may be NULL.
+ * @param[in] handle	to prepare the statement on.
+ * @param[in] stmt	to prepare.
+ * @return the same codes as the driver's sql_stmt_prepare.
+ */
+sql_rcode_t sql_stmt_prepared(void **out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+			      rlm_sql_stmt_t const *stmt)
+{
+	sql_rcode_t	ret;
+	size_t		len = talloc_array_length(handle->stmts);
+
+	if ((size_t) stmt->id >= len) {
+		MEM(handle->stmts = talloc_realloc(handle, handle->stmts, void *, num_stmts));
+		memset(handle->stmts + len, 0, (num_stmts - len) * sizeof(*handle->stmts));
+	}
+
+	if (!handle->stmts[stmt->id]) {
+		ROPTIONAL(RDEBUG3, DEBUG3, "Preparing %s", stmt->name);
+
+		ret = (inst->driver->sql_stmt_prepare)(&handle->stmts[stmt->id], handle, inst->config, stmt);
+		if (ret != RLM_SQL_OK) return ret;
+	}
+
+	*out = handle->stmts[stmt->id];
+
+	return RLM_SQL_OK;
+}
+
+/** Run a statement which returns rows, reconnecting if necessary
+ *
+ * The same as rlm_sql_select_query(), but for statements.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param stmt to run.
+ * @param values of the statement's parameters, from sql_stmt_values().
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ */
+sql_rcode_t rlm_sql_select_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				rlm_sql_stmt_t const *stmt, char **values)
+{
+	sql_rcode_t	ret = RLM_SQL_ERROR;
+	int		i, count;
+	void		*prepared;
+
+	/* Caller should check they have a valid handle */
+	rad_assert(*handle);
+
+	count = fr_connection_pool_state(inst->pool)->num;
+
+	for (i = 0; i < (count + 1); i++) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing select statement: %s", stmt->query);
+
+		ret = sql_stmt_prepared(&prepared, inst, request, *handle, stmt);
+		if (ret == RLM_SQL_OK) {
+			ret = (inst->driver->sql_stmt_execute)(*handle, inst->config, prepared, stmt,
+							       (char const * const *) values);
+		}
+		switch (ret) {
+		case RLM_SQL_OK:
+			break;
+
+		/*
+		 *	The new connection will have to prepare the
+		 *	statement again.
+		 */
+		case RLM_SQL_RECONNECT:
+			*handle = fr_connection_reconnect(inst->pool, request, *handle);
+			/* Reconnection failed */
+			if (!*handle) return RLM_SQL_RECONNECT;
+			/* Reconnection succeeded, try again with the new handle */
+			continue;
+
+		case RLM_SQL_QUERY_INVALID:
+		case RLM_SQL_ERROR:
+		default:
+			rlm_sql_print_error(inst, request, *handle, false);
+			(inst->driver->sql_finish_select_query)(*handle, inst->config);
+			break;
+		}
+
+		return ret;
+	}
+
+	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+
+	return RLM_SQL_ERROR;
+}
@@ -1,8 +1,16 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk module_lookup_test.mk cache_serialize_test.mk xlat_eval_test.mk radius_verify_test.mk radius_decode_test.mk md5_mb_test.mk sql_stmt_test.mk
 
 #
 #  These require pthread.
 #
 ifneq "$(findstring thread,${CFLAGS})" ""
-SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk schedule_test.mk radius_schedule_test.mk
+SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk schedule_test.mk radius_schedule_test.mk radius_skew_test.mk receiver_batch_test.mk packet_list_test.mk connection_pool_test.mk cache_shard_test.mk
+endif
+
+#
+#  This one requires sqlite, which is only there if the sqlite driver
+#  was built.
+#
+ifneq "$(findstring rlm_sql_sqlite,${ALL_TGTS})" ""
+SUBMAKEFILES += sql_stmt_sqlite_test.mk
 endif
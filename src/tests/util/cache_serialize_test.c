@@ -0,0 +1,230 @@
+/*
+ * cache_serialize_test.c	Benchmark for serializing cache entries.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "../../modules/rlm_cache/rlm_cache.h"
+#include "../../modules/rlm_cache/serialize.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_loops = 100000;
+
+/*
+ *	A typical entry, as cached for a user by sites/default.
+ */
+static char const *entry_maps[] = {
+	"&reply:Reply-Message := 'Hello, this is a cached reply'",
+	"&reply:Session-Timeout := 3600",
+	"&reply:Idle-Timeout := 600",
+	"&reply:Framed-IP-Address := 192.0.2.1",
+	"&reply:Framed-IPv6-Prefix := 2001:db8::/64",
+	"&reply:Class += 0x0102030405060708090a0b0c0d0e0f10",
+	"&reply:Filter-Id += 'std.ingress'",
+	"&reply:Filter-Id += 'std.egress'",
+	"&control:Auth-Type := Accept",
+	NULL
+};
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: cache_serialize_test [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -n <num>               Number of times to serialize and deserialize the entry.  Default is 100000.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Check that an entry survived the round trip.
+ */
+static void entry_verify(rlm_cache_entry_t const *c, rlm_cache_entry_t const *copy, cache_serialize_format_t format)
+{
+	vp_map_t const	*a, *b;
+	int		i;
+	char const	*name = fr_int2str(cache_serialize_formats, format, "<INVALID>");
+
+	if ((copy->created != c->created) || (copy->expires != c->expires)) {
+		fprintf(stderr, "cache_serialize_test: %s entry has the wrong times\n", name);
+		exit(1);
+	}
+
+	for (a = c->maps, b = copy->maps, i = 0; a && b; a = a->next, b = b->next, i++) {
+		if ((b->lhs->type != TMPL_TYPE_ATTR) ||
+		    (a->lhs->tmpl_da != b->lhs->tmpl_da) ||
+		    (a->lhs->tmpl_list != b->lhs->tmpl_list) ||
+		    (a->lhs->tmpl_tag != b->lhs->tmpl_tag) ||
+		    (a->op != b->op) ||
+		    (b->rhs->type != TMPL_TYPE_DATA) ||
+		    (value_box_cmp(&a->rhs->tmpl_value_box, &b->rhs->tmpl_value_box) != 0)) {
+			fprintf(stderr, "cache_serialize_test: %s entry differs at \"%s\"\n", name, entry_maps[i]);
+			exit(1);
+		}
+	}
+
+	if (a || b) {
+		fprintf(stderr, "cache_serialize_test: %s entry has the wrong number of maps\n", name);
+		exit(1);
+	}
+
+	MPRINT1("%s entry is the same after deserializing\n", name);
+}
+
+/*
+ *	Serialize and deserialize the entry num_loops times.
+ *	The first copy is compared with the original.
+ */
+static void run_test(rlm_cache_entry_t const *c, cache_serialize_format_t format)
+{
+	int		i;
+	size_t		len = 0;
+	fr_time_t	start, end;
+
+	start = fr_time();
+
+	for (i = 0; i < num_loops; i++) {
+		TALLOC_CTX		*ctx;
+		rlm_cache_entry_t	*copy;
+
+		ctx = talloc_pool(NULL, 4096);
+		rad_assert(ctx != NULL);
+
+		copy = talloc_zero(ctx, rlm_cache_entry_t);
+
+		if (format == CACHE_SERIALIZE_BINARY) {
+			uint8_t	*bin;
+			ssize_t	slen;
+
+			slen = cache_serialize_binary(ctx, &bin, c);
+			if (slen < 0) {
+			error:
+				fr_perror("cache_serialize_test");
+				exit(1);
+			}
+			len = slen;
+
+			if (cache_deserialize_binary(copy, bin, len) < 0) goto error;
+		} else {
+			char	*text;
+
+			if (cache_serialize(ctx, &text, c) < 0) goto error;
+			len = talloc_array_length(text) - 1;
+
+			if (cache_deserialize(copy, text, len) < 0) goto error;
+		}
+
+		if (i == 0) entry_verify(c, copy, format);
+
+		talloc_free(ctx);
+	}
+
+	end = fr_time();
+
+	printf("%s: %zu bytes, %.0f entries/s\n",
+	       fr_int2str(cache_serialize_formats, format, "<INVALID>"), len,
+	       ((double) num_loops * NANOSEC) / (end - start));
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	char const		*dict_dir = DICTDIR;
+	fr_dict_t		*dict = NULL;
+	rlm_cache_entry_t	*entry;
+	vp_map_t		**last;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hn:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_loops = atoi(optarg);
+			if (num_loops <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("cache_serialize_test");
+		return 1;
+	}
+
+	entry = talloc_zero(NULL, rlm_cache_entry_t);
+	rad_assert(entry != NULL);
+
+	entry->key = (uint8_t const *) "bob";
+	entry->key_len = 3;
+	entry->created = time(NULL);
+	entry->expires = entry->created + 3600;
+
+	last = &entry->maps;
+	for (i = 0; entry_maps[i] != NULL; i++) {
+		if (map_afrom_attr_str(entry, last, entry_maps[i],
+				       REQUEST_CURRENT, PAIR_LIST_REPLY, REQUEST_CURRENT, PAIR_LIST_REQUEST) < 0) {
+			fr_perror("cache_serialize_test");
+			return 1;
+		}
+
+		/*
+		 *	rlm_cache stores values, not the strings they
+		 *	were parsed from.
+		 */
+		if (tmpl_cast_in_place((*last)->rhs, (*last)->lhs->tmpl_da->type, (*last)->lhs->tmpl_da) < 0) {
+			fr_perror("cache_serialize_test");
+			return 1;
+		}
+		MPRINT1("Added %s\n", entry_maps[i]);
+		last = &(*last)->next;
+	}
+
+	run_test(entry, CACHE_SERIALIZE_TEXT);
+	run_test(entry, CACHE_SERIALIZE_BINARY);
+
+	talloc_free(entry);
+	talloc_free(dict);
+
+	return 0;
+}
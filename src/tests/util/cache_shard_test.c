@@ -0,0 +1,313 @@
+/*
+ * cache_shard_test.c	Benchmark for cache lookups from multiple threads.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "../../modules/rlm_cache/rlm_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define MAX_THREADS (64)
+#define MAX_SHARDS (1024)
+
+/*
+ *	The drivers are linked in, rather than loaded.
+ */
+extern cache_driver_t rlm_cache_hash;
+extern cache_driver_t rlm_cache_rbtree;
+
+typedef struct cache_test_thread_t {
+	int		id;			//!< ID of the thread 0..N
+	pthread_t	pthread_id;		//!< pthread ID of the thread
+	uint32_t	seed;			//!< for picking keys
+	REQUEST		*request;		//!< passed to the driver
+	uint64_t	num_lookups;		//!< lookups done
+	uint64_t	num_inserts;		//!< entries replaced
+} cache_test_thread_t;
+
+static int			debug_lvl = 0;
+static int			num_lookups = 1000000;
+static int			num_keys = 10000;
+static int			insert_every = 10;
+static int			num_shards = 32;
+
+static rlm_cache_config_t	config;
+static rlm_cache_counters_t	counters;
+static cache_driver_t const	*driver;
+static void			*driver_inst;
+
+/*
+ *	Add an entry for a key, as rlm_cache does after a miss.
+ */
+static void cache_test_insert(REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_entry_t *c;
+
+	c = driver->alloc(&config, driver_inst, request);
+	rad_assert(c != NULL);
+
+	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
+	c->created = request->packet->timestamp.tv_sec;
+	c->expires = c->created + 3600;
+
+	if (driver->insert(&config, driver_inst, request, handle, c) != CACHE_OK) {
+		fprintf(stderr, "cache_shard_test: Failed inserting entry\n");
+		exit(1);
+	}
+}
+
+/*
+ *	Do what rlm_cache does: look up a key, and every so often
+ *	replace the entry.
+ */
+static void *cache_thread(void *arg)
+{
+	int			i;
+	cache_test_thread_t	*ct = arg;
+	REQUEST			*request = ct->request;
+
+	for (i = 0; i < num_lookups; i++) {
+		rlm_cache_entry_t	*c;
+		void			*handle;
+		uint8_t			key[32];
+		size_t			key_len;
+		bool			insert;
+
+		/*
+		 *	xorshift
+		 */
+		ct->seed ^= ct->seed << 13;
+		ct->seed ^= ct->seed >> 17;
+		ct->seed ^= ct->seed << 5;
+
+		insert = ((ct->seed % insert_every) == 0);
+
+		key_len = snprintf((char *) key, sizeof(key), "user%u", (unsigned int) ((ct->seed >> 8) % num_keys));
+
+		if (driver->acquire(&handle, &config, driver_inst, request) < 0) {
+		error:
+			fprintf(stderr, "cache_shard_test: Lookup failed\n");
+			exit(1);
+		}
+
+		if (driver->find(&c, &config, driver_inst, request, handle, key, key_len) != CACHE_OK) goto error;
+		if (insert) {
+			cache_test_insert(request, handle, key, key_len);
+			ct->num_inserts++;
+		}
+
+		driver->release(&config, driver_inst, request, handle);
+
+		ct->num_lookups++;
+	}
+
+	MPRINT1("Thread %d done, %" PRIu64 " lookups\n", ct->id, ct->num_lookups);
+
+	return NULL;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: cache_shard_test [OPTS]\n");
+	fprintf(stderr, "  -g                     Use rlm_cache_rbtree, which has one global mutex.\n");
+	fprintf(stderr, "  -i <num>               Replace an entry every <num> lookups.  Default is 10.\n");
+	fprintf(stderr, "  -k <num>               Number of keys.  Default is 10000.\n");
+	fprintf(stderr, "  -n <num>               Number of lookups per thread.  Default is 1000000.\n");
+	fprintf(stderr, "  -s <num>               Number of shards for rlm_cache_hash.  Default is 32.\n");
+	fprintf(stderr, "  -t <num>               Number of threads.  Default is 4.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static REQUEST *cache_test_request_alloc(TALLOC_CTX *ctx)
+{
+	REQUEST *request;
+
+	request = request_alloc(ctx);
+	rad_assert(request != NULL);
+
+	request->packet = fr_radius_alloc(request, false);
+	rad_assert(request->packet != NULL);
+	gettimeofday(&request->packet->timestamp, NULL);
+
+	return request;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	int			num_threads = 4;
+	uint64_t		lookups, inserts;
+	fr_time_t		start, end;
+	pthread_attr_t		attr;
+	cache_test_thread_t	threads[MAX_THREADS];
+	CONF_SECTION		*cs;
+	REQUEST			*request;
+	char			buffer[16];
+
+	fr_time_start();
+
+	driver = &rlm_cache_hash;
+
+	while ((c = getopt(argc, argv, "ghi:k:n:s:t:x")) != EOF) switch (c) {
+		case 'g':
+			driver = &rlm_cache_rbtree;
+			break;
+
+		case 'i':
+			insert_every = atoi(optarg);
+			if (insert_every <= 0) usage();
+			break;
+
+		case 'k':
+			num_keys = atoi(optarg);
+			if (num_keys <= 0) usage();
+			break;
+
+		case 'n':
+			num_lookups = atoi(optarg);
+			if (num_lookups <= 0) usage();
+			break;
+
+		case 's':
+			num_shards = atoi(optarg);
+			if ((num_shards <= 0) || (num_shards > MAX_SHARDS)) usage();
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if ((num_threads <= 0) || (num_threads > MAX_THREADS)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	/*
+	 *	Configure and instantiate the driver, as rlm_cache does.
+	 */
+	config.driver_name = driver->name;
+	config.ttl = 3600;
+	config.counters = &counters;
+
+	cs = cf_section_alloc(NULL, driver->name, NULL);
+	rad_assert(cs != NULL);
+	snprintf(buffer, sizeof(buffer), "%d", num_shards);
+	cf_pair_add(cs, cf_pair_alloc(cs, "shards", buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+
+	driver_inst = talloc_zero_size(cs, driver->inst_size);
+	rad_assert(driver_inst != NULL);
+
+	if ((driver->config && (cf_section_parse(cs, driver_inst, driver->config) < 0)) ||
+	    (driver->instantiate(&config, driver_inst, cs) < 0)) {
+		fprintf(stderr, "cache_shard_test: Failed instantiating %s\n", driver->name);
+		exit(1);
+	}
+
+	request = cache_test_request_alloc(cs);
+	for (i = 0; i < num_keys; i++) {
+		void	*handle;
+		uint8_t	key[32];
+		size_t	key_len;
+
+		key_len = snprintf((char *) key, sizeof(key), "user%u", i);
+
+		if (driver->acquire(&handle, &config, driver_inst, request) < 0) exit(1);
+		cache_test_insert(request, handle, key, key_len);
+		driver->release(&config, driver_inst, request, handle);
+	}
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	memset(threads, 0, sizeof(threads));
+
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].seed = 2463534242U + i;
+		threads[i].request = cache_test_request_alloc(cs);
+	}
+
+	start = fr_time();
+
+	for (i = 0; i < num_threads; i++) {
+		(void) pthread_create(&threads[i].pthread_id, &attr, cache_thread, &threads[i]);
+	}
+
+	lookups = inserts = 0;
+	for (i = 0; i < num_threads; i++) {
+		(void) pthread_join(threads[i].pthread_id, NULL);
+		lookups += threads[i].num_lookups;
+		inserts += threads[i].num_inserts;
+	}
+
+	end = fr_time();
+
+	/*
+	 *	Replacing entries mustn't lose or duplicate any.
+	 */
+	{
+		void		*handle;
+		uint32_t	count;
+
+		if (driver->acquire(&handle, &config, driver_inst, request) < 0) exit(1);
+		count = driver->count(&config, driver_inst, request, handle);
+		driver->release(&config, driver_inst, request, handle);
+
+		if (count != (uint32_t) num_keys) {
+			fprintf(stderr, "cache_shard_test: Found %u entries, expected %d\n", count, num_keys);
+			exit(1);
+		}
+	}
+
+	printf("%s, %d threads, %d keys: %" PRIu64 " lookups (%" PRIu64 " inserts)\n",
+	       driver->name, num_threads, num_keys, lookups, inserts);
+	printf("%.0f lookups/s\n", ((double) lookups * NANOSEC) / (end - start));
+
+	if (driver->detach) driver->detach(driver_inst);
+	talloc_free(cs);
+
+	return 0;
+}
@@ -0,0 +1,7 @@
+TARGET := cache_shard_test
+
+SOURCES		:= cache_shard_test.c ../../modules/rlm_cache/drivers/rlm_cache_hash/rlm_cache_hash.c \
+		   ../../modules/rlm_cache/drivers/rlm_cache_rbtree/rlm_cache_rbtree.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
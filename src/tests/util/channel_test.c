@@ -25,6 +25,8 @@ RCSID("$Id$")
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/channel.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/fr_log.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -34,17 +36,14 @@ RCSID("$Id$")
 #include <pthread.h>
 #endif
 
-#include <sys/event.h>
-
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
-#define MAX_KEVENTS		(10)
 
 #define MPRINT1 if (debug_lvl) printf
 #define MPRINT2 if (debug_lvl > 1) printf
 
 static int		debug_lvl = 0;
-static int		kq_master, kq_worker;
+static fr_event_list_t	*el_master, *el_worker;
 static fr_atomic_queue_t *aq_master, *aq_worker;
 static fr_control_t	*control_master, *control_worker;
 static int		max_messages = 10;
@@ -52,6 +51,14 @@ static int		max_control_plane = 0;
 static int		max_outstanding = 1;
 static bool		touch_memory = false;
 
+/*
+ *	Only the master writes these.
+ */
+static int		num_woken_replies = 0;
+static fr_time_t	latency_min = 0;
+static fr_time_t	latency_max = 0;
+static fr_time_t	latency_total = 0;
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: channel_test [OPTS]\n");
@@ -64,6 +71,20 @@ static void NEVER_RETURNS usage(void)
 	exit(1);
 }
 
+static void master_user_event(UNUSED int kq, uintptr_t ident, void *ctx)
+{
+	fr_channel_t *channel = ctx;
+
+	(void) fr_channel_service_user(channel, control_master, ident);
+}
+
+static void worker_user_event(UNUSED int kq, uintptr_t ident, void *ctx)
+{
+	fr_channel_t *channel = ctx;
+
+	(void) fr_channel_service_user(channel, control_worker, ident);
+}
+
 static void *channel_master(void *arg)
 {
 	bool running, signaled_close;
@@ -75,7 +96,6 @@ static void *channel_master(void *arg)
 	fr_channel_t *channel = arg;
 	fr_channel_t *new_channel;
 	fr_channel_event_t ce;
-	struct kevent events[MAX_KEVENTS];
 
 	ctx = talloc_init("channel_master");
 	if (!ctx) _exit(1);
@@ -192,13 +212,11 @@ check_close:
 		MPRINT1("Master waiting on events.\n");
 		rad_assert(num_messages <= max_messages);
 
-		num_events = kevent(kq_master, NULL, 0, events, MAX_KEVENTS, NULL);
-		MPRINT1("Master kevent returned %d\n", num_events);
+		num_events = fr_event_corral(el_master, true);
+		MPRINT1("Master corral returned %d\n", num_events);
 
 		if (num_events < 0) {
-			if (num_events == EINTR) continue;
-
-			fprintf(stderr, "Failed waiting for kevent: %s\n", strerror(errno));
+			fprintf(stderr, "Failed waiting for events: %s\n", fr_strerror());
 			exit(1);
 		}
 
@@ -207,9 +225,7 @@ check_close:
 		/*
 		 *	Service the events.
 		 */
-		for (i = 0; i < num_events; i++) {
-			(void) fr_channel_service_kevent(channel, control_master, &events[i]);
-		}
+		fr_event_service(el_master);
 
 		now = fr_time();
 
@@ -240,10 +256,24 @@ check_close:
 				}
 
 				do {
+					fr_time_t latency;
+
 					num_replies++;
 					num_outstanding--;
 					MPRINT1("Master got reply %d, outstanding=%d, %d/%d sent.\n",
 						num_replies, num_outstanding, num_messages, max_messages);
+
+					/*
+					 *	The time from the worker sending
+					 *	the reply, to us being woken up
+					 *	to read it.
+					 */
+					latency = (now > reply->m.when) ? (now - reply->m.when) : 0;
+					if (!latency_min || (latency < latency_min)) latency_min = latency;
+					if (latency > latency_max) latency_max = latency;
+					latency_total += latency;
+					num_woken_replies++;
+
 					fr_message_done(&reply->m);
 				} while ((reply = fr_channel_recv_reply(channel)) != NULL);
 				break;
@@ -302,7 +332,6 @@ static void *channel_worker(void *arg)
 	TALLOC_CTX *ctx;
 	fr_channel_t *channel = arg;
 	fr_channel_event_t ce;
-	struct kevent events[MAX_KEVENTS];
 
 	ctx = talloc_init("channel_worker");
 	if (!ctx) _exit(1);
@@ -316,27 +345,22 @@ static void *channel_worker(void *arg)
 	MPRINT1("\tWorker started.\n");
 
 	while (running) {
-		int i;
 		fr_time_t now;
 		fr_channel_t *new_channel;
 
 		MPRINT1("\tWorker waiting on events.\n");
 
-		num_events = kevent(kq_worker, NULL, 0, events, MAX_KEVENTS, NULL);
-		MPRINT1("\tWorker kevent returned %d events\n", num_events);
+		num_events = fr_event_corral(el_worker, true);
+		MPRINT1("\tWorker corral returned %d events\n", num_events);
 
 		if (num_events < 0) {
-			if (num_events == EINTR) continue;
-
-			fprintf(stderr, "Failed waiting for kevent: %s\n", strerror(errno));
+			fprintf(stderr, "Failed waiting for events: %s\n", fr_strerror());
 			exit(1);
 		}
 
 		if (num_events == 0) continue;
 
-		for (i = 0; i < num_events; i++) {
-			(void) fr_channel_service_kevent(channel, control_worker, &events[i]);
-		}
+		fr_event_service(el_worker);
 
 		MPRINT1("\tWorker servicing control-plane aq %p\n", aq_worker);
 
@@ -518,11 +542,11 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	kq_master = kqueue();
-	rad_assert(kq_master >= 0);
+	el_master = fr_event_list_create(autofree, NULL, NULL);
+	rad_assert(el_master != NULL);
 
-	kq_worker = kqueue();
-	rad_assert(kq_worker >= 0);
+	el_worker = fr_event_list_create(autofree, NULL, NULL);
+	rad_assert(el_worker != NULL);
 
 	aq_master = fr_atomic_queue_create(autofree, max_control_plane);
 	rad_assert(aq_master != NULL);
@@ -530,10 +554,10 @@ int main(int argc, char *argv[])
 	aq_worker = fr_atomic_queue_create(autofree, max_control_plane);
 	rad_assert(aq_worker != NULL);
 
-	control_master = fr_control_create(autofree, kq_master, aq_master);
+	control_master = fr_control_create(autofree, fr_event_list_kq(el_master), aq_master);
 	rad_assert(control_master != NULL);
 
-	control_worker = fr_control_create(autofree, kq_worker, aq_worker);
+	control_worker = fr_control_create(autofree, fr_event_list_kq(el_worker), aq_worker);
 	rad_assert(control_worker != NULL);
 
 	channel = fr_channel_create(autofree, control_master, control_worker);
@@ -542,6 +566,9 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	(void) fr_event_user_insert(el_master, master_user_event, channel);
+	(void) fr_event_user_insert(el_worker, worker_user_event, channel);
+
 	/*
 	 *	Start the two threads, with the channel.
 	 */
@@ -554,11 +581,14 @@ int main(int argc, char *argv[])
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
 
-	close(kq_master);
-	close(kq_worker);
-
 	fr_channel_debug(channel, stdout);
 
+	if (num_woken_replies) {
+		printf("%d replies after wakeup, latency min/avg/max %.1f/%.1f/%.1f usec\n",
+		       num_woken_replies, latency_min / 1000.0,
+		       (latency_total / 1000.0) / num_woken_replies, latency_max / 1000.0);
+	}
+
 	talloc_free(autofree);
 
 	return 0;
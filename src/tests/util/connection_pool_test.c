@@ -0,0 +1,233 @@
+/*
+ * connection_pool_test.c	Benchmark for reserving connections from multiple threads.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/connection.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define MAX_THREADS (256)
+
+typedef struct fr_pool_thread_t {
+	int		id;			//!< ID of the thread 0..N
+	pthread_t	pthread_id;		//!< pthread ID of the thread
+	uint64_t	num_reserved;		//!< connections reserved and released
+	uint64_t	num_failed;		//!< times we couldn't reserve a connection
+} fr_pool_thread_t;
+
+static int			debug_lvl = 0;
+static int			num_reserves = 1000000;
+static int			work = 0;
+
+static fr_connection_pool_t	*pool;
+
+/*
+ *	The "connection" is just a counter, so that the benchmark
+ *	measures the pool, and not the back end.
+ */
+static void *connection_create(TALLOC_CTX *ctx, UNUSED void *opaque, UNUSED struct timeval const *timeout)
+{
+	return talloc_zero(ctx, uint64_t);
+}
+
+/*
+ *	Do what the modules do: reserve a connection, use it, and
+ *	release it.
+ */
+static void *pool_thread(void *arg)
+{
+	int i, j;
+	fr_pool_thread_t *pt = arg;
+	uint64_t *conn;
+
+	for (i = 0; i < num_reserves; i++) {
+		conn = fr_connection_get(pool, NULL);
+		if (!conn) {
+			pt->num_failed++;
+			continue;
+		}
+
+		for (j = 0; j < work; j++) (*(uint64_t volatile *) conn)++;
+
+		fr_connection_release(pool, NULL, conn);
+		pt->num_reserved++;
+	}
+
+	MPRINT1("Thread %d done, %" PRIu64 " connections reserved\n", pt->id, pt->num_reserved);
+
+	return NULL;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: connection_pool_test [OPTS]\n");
+	fprintf(stderr, "  -c <num>               Idle connections cached per thread.  Default is 0 (no caches).\n");
+	fprintf(stderr, "  -m <num>               Maximum number of connections.  Default is 64.\n");
+	fprintf(stderr, "  -n <num>               Number of connections reserved per thread.  Default is 1000000.\n");
+	fprintf(stderr, "  -t <num>               Number of threads.  Default is 4.\n");
+	fprintf(stderr, "  -w <num>               Work done with each connection.  Default is 0.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void pool_config(CONF_SECTION *cs, char const *attr, char const *fmt, ...)
+{
+	va_list		ap;
+	char		buffer[64];
+	CONF_PAIR	*cp;
+
+	va_start(ap, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+
+	cp = cf_pair_alloc(cs, attr, buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	rad_assert(cp != NULL);
+	cf_pair_add(cs, cp);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	int			num_threads = 4;
+	int			max = 64;
+	int			thread_cache = 0;
+	uint64_t		reserved, failed;
+	fr_time_t		start, end;
+	TALLOC_CTX		*ctx;
+	CONF_SECTION		*cs;
+	pthread_attr_t		attr;
+	fr_pool_thread_t	threads[MAX_THREADS];
+	fr_connection_pool_state_t const *state;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "c:hm:n:t:w:x")) != EOF) switch (c) {
+		case 'c':
+			thread_cache = atoi(optarg);
+			if (thread_cache < 0) usage();
+			break;
+
+		case 'm':
+			max = atoi(optarg);
+			if ((max <= 0) || (max > 1024)) usage();
+			break;
+
+		case 'n':
+			num_reserves = atoi(optarg);
+			if (num_reserves <= 0) usage();
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if ((num_threads <= 0) || (num_threads > MAX_THREADS)) usage();
+			break;
+
+		case 'w':
+			work = atoi(optarg);
+			if (work < 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			rad_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (thread_cache > max) usage();
+
+	if (!debug_lvl) default_log.dst = L_DST_NULL;
+
+	ctx = talloc_init("connection_pool_test");
+
+	/*
+	 *	Enough connections for every thread, so that we
+	 *	measure contention, and not starvation.
+	 */
+	cs = cf_section_alloc(NULL, "pool", NULL);
+	rad_assert(cs != NULL);
+	pool_config(cs, "start", "%d", max);
+	pool_config(cs, "min", "%d", max);
+	pool_config(cs, "max", "%d", max);
+	pool_config(cs, "spare", "0");
+	pool_config(cs, "idle_timeout", "0");
+	pool_config(cs, "thread_cache", "%d", thread_cache);
+
+	pool = fr_connection_pool_init(ctx, cs, ctx, connection_create, NULL, "connection_pool_test");
+	if (!pool) {
+		fprintf(stderr, "connection_pool_test: Failed creating pool: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	memset(threads, 0, sizeof(threads));
+
+	start = fr_time();
+
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		(void) pthread_create(&threads[i].pthread_id, &attr, pool_thread, &threads[i]);
+	}
+
+	reserved = failed = 0;
+	for (i = 0; i < num_threads; i++) {
+		(void) pthread_join(threads[i].pthread_id, NULL);
+		reserved += threads[i].num_reserved;
+		failed += threads[i].num_failed;
+	}
+
+	end = fr_time();
+
+	state = fr_connection_pool_state(pool);
+	rad_assert(state->active == 0);
+
+	printf("thread_cache %d, %d threads, %u connections: %" PRIu64 " reserved (%" PRIu64 " failed)\n",
+	       thread_cache, num_threads, state->num, reserved, failed);
+	printf("%.0f reserve/release per second\n", ((double) reserved * NANOSEC) / (end - start));
+
+	talloc_free(ctx);
+	talloc_free(cs);
+
+	return 0;
+}
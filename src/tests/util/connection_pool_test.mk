@@ -0,0 +1,7 @@
+TARGET := connection_pool_test
+
+SOURCES		:= connection_pool_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
@@ -25,8 +25,9 @@ RCSID("$Id$")
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/fr_log.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -42,16 +43,26 @@ RCSID("$Id$")
 #define CONTROL_MAGIC 0xabcd6809
 
 static int		debug_lvl = 0;
-static int		kq = -1;
+static fr_event_list_t	*el = NULL;
 static fr_atomic_queue_t *aq;
 static size_t		max_messages = 10;
 static int		aq_size = 16;
+static int		send_delay = 0;
 static fr_control_t	*control = NULL;
 static fr_ring_buffer_t *rb = NULL;
 
+/*
+ *	Only the master writes these.
+ */
+static size_t		num_wakeups = 0;
+static fr_time_t	latency_min = 0;
+static fr_time_t	latency_max = 0;
+static fr_time_t	latency_total = 0;
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: control_test [OPTS]\n");
+	fprintf(stderr, "  -d <usec>              Wait between sending messages.\n");
 	fprintf(stderr, "  -m <messages>	  Send number of messages.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -61,8 +72,16 @@ static void NEVER_RETURNS usage(void)
 typedef struct my_message_t {
 	uint32_t		header;
 	size_t			counter;
+	fr_time_t		when;
 } my_message_t;
 
+static void control_master_user(UNUSED int kq, uintptr_t ident, UNUSED void *ctx)
+{
+	rad_assert(fr_control_message_service_user(control, ident) > 0);
+
+	num_wakeups++;
+}
+
 static void *control_master(UNUSED void *arg)
 {
 	TALLOC_CTX *ctx;
@@ -79,17 +98,20 @@ static void *control_master(UNUSED void *arg)
 		int num_events;
 		ssize_t data_size;
 		my_message_t m;
-		struct kevent kev;
+		fr_time_t now, latency;
 
 	wait_for_events:
 		MPRINT1("Master waiting for events.\n");
 
-		num_events = kevent(kq, NULL, 0, &kev, 1, NULL);
+		num_events = fr_event_corral(el, true);
 		if (num_events < 0) {
-			fprintf(stderr, "Failed reading kevent: %s\n", strerror(errno));
+			fprintf(stderr, "Failed waiting for events: %s\n", fr_strerror());
 			exit(1);
 		}
 
+		fr_event_service(el);
+		now = fr_time();
+
 		MPRINT1("Master draining the control plane.\n");
 
 		while (true) {
@@ -110,6 +132,15 @@ static void *control_master(UNUSED void *arg)
 
 			rad_assert(m.header == CONTROL_MAGIC);
 
+			/*
+			 *	The time from the message being sent,
+			 *	to us being woken up to read it.
+			 */
+			latency = (now > m.when) ? (now - m.when) : 0;
+			if (!latency_min || (latency < latency_min)) latency_min = latency;
+			if (latency > latency_max) latency_max = latency;
+			latency_total += latency;
+
 			if (m.counter == (max_messages - 1)) goto do_exit;
 		}
 	}
@@ -138,7 +169,10 @@ static void *control_worker(UNUSED void *arg)
 		m.header = CONTROL_MAGIC;
 		m.counter = i;
 
+		if (send_delay) usleep(send_delay);
+
 retry:
+		m.when = fr_time();
 		if (fr_control_message_send(control, rb, FR_CONTROL_ID_CHANNEL, &m, sizeof(m)) < 0) {
 			MPRINT1("\tWorker retrying message %zu\n", i);
 			usleep(10);
@@ -166,11 +200,16 @@ int main(int argc, char *argv[])
 
 	fr_time_start();
 
-	while ((c = getopt(argc, argv, "hm:o:tx")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "d:hm:o:tx")) != EOF) switch (c) {
 		case 'x':
 			debug_lvl++;
 			break;
 
+		case 'd':
+			send_delay = atoi(optarg);
+			if (send_delay < 0) usage();
+			break;
+
 		case 'm':
 			max_messages = atoi(optarg);
 			break;
@@ -185,18 +224,23 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	kq = kqueue();
-	rad_assert(kq >= 0);
+	el = fr_event_list_create(autofree, NULL, NULL);
+	rad_assert(el != NULL);
 
 	aq = fr_atomic_queue_create(autofree, aq_size);
 	rad_assert(aq != NULL);
 
-	control = fr_control_create(autofree, kq, aq);
+	control = fr_control_create(autofree, fr_event_list_kq(el), aq);
 	if (!control) {
 		fprintf(stderr, "control_test: Failed to create control plane\n");
 		exit(1);
 	}
 
+	if (fr_event_user_insert(el, control_master_user, NULL) < 0) {
+		fprintf(stderr, "control_test: Failed to add user event handler\n");
+		exit(1);
+	}
+
 	rb = fr_ring_buffer_create(autofree, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
 	if (!rb) exit(1);
 
@@ -212,7 +256,9 @@ int main(int argc, char *argv[])
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
 
-	close(kq);
+	printf("control_test: %zu messages, %zu wakeups, latency min/avg/max %.1f/%.1f/%.1f usec\n",
+	       max_messages, num_wakeups, latency_min / 1000.0,
+	       (latency_total / 1000.0) / max_messages, latency_max / 1000.0);
 
 	talloc_free(autofree);
 
@@ -0,0 +1,199 @@
+/*
+ * md5_mb_test.c	Check the multi-buffer MD5 engines against known answers.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+/*
+ *	Enough messages for several full lanes of every engine, plus
+ *	a partial one.
+ */
+#define NUM_MSGS	(203)
+#define MAX_MSG_LEN	(300)
+
+static int		debug_lvl = 0;
+
+/*
+ *	The test suite from RFC 1321.
+ */
+static struct {
+	char const	*in;
+	char const	*digest;
+} rfc1321[] = {
+	{ "", "d41d8cd98f00b204e9800998ecf8427e" },
+	{ "a", "0cc175b9c0f1b6a831c399e269772661" },
+	{ "abc", "900150983cd24fb0d6963f7d28e17f72" },
+	{ "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+	{ "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+	{ "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+	  "d174ab98d277d9f5a5611c2c9f419d9f" },
+	{ "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+	  "57edf4a22be3c955ac49da2e2107b67a" }
+};
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: md5_mb_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Hash the RFC 1321 messages as one batch.
+ */
+static int test_rfc1321(void)
+{
+	size_t			i, num = sizeof(rfc1321) / sizeof(rfc1321[0]);
+	int			fails = 0;
+	fr_md5_mb_msg_t		msgs[sizeof(rfc1321) / sizeof(rfc1321[0])];
+	uint8_t			out[sizeof(rfc1321) / sizeof(rfc1321[0])][MD5_DIGEST_LENGTH];
+	char			hex[(MD5_DIGEST_LENGTH * 2) + 1];
+
+	for (i = 0; i < num; i++) {
+		msgs[i].ctx = NULL;
+		msgs[i].in = (uint8_t const *) rfc1321[i].in;
+		msgs[i].inlen = strlen(rfc1321[i].in);
+		msgs[i].out = out[i];
+	}
+
+	fr_md5_mb_calc(msgs, num);
+
+	for (i = 0; i < num; i++) {
+		fr_bin2hex(hex, out[i], sizeof(out[i]));
+		if (strcmp(hex, rfc1321[i].digest) == 0) continue;
+
+		fprintf(stderr, "md5_mb_test: %s: MD5(\"%s\") = %s, expected %s\n",
+			fr_md5_mb_engine_name(), rfc1321[i].in, hex, rfc1321[i].digest);
+		fails++;
+	}
+
+	return fails;
+}
+
+/*
+ *	Hash random messages of every length up to a few blocks, some
+ *	continuing from a saved state the way the HMAC pads are, and
+ *	compare them with fr_md5_update(), which is OpenSSL's MD5 when
+ *	the server is built with OpenSSL.
+ */
+static int test_random(void)
+{
+	int			i, fails = 0;
+	size_t			j;
+	static uint8_t		in[NUM_MSGS][MAX_MSG_LEN];
+	static uint8_t		out[NUM_MSGS][MD5_DIGEST_LENGTH];
+	static uint8_t		expected[NUM_MSGS][MD5_DIGEST_LENGTH];
+	static FR_MD5_CTX	prefix[NUM_MSGS];
+	fr_md5_mb_msg_t		msgs[NUM_MSGS];
+
+	for (i = 0; i < NUM_MSGS; i++) {
+		FR_MD5_CTX	context;
+		uint8_t		pad[MD5_BLOCK_LENGTH * 2];
+
+		msgs[i].in = in[i];
+		msgs[i].inlen = (i * 37) % MAX_MSG_LEN;
+		msgs[i].out = out[i];
+		msgs[i].ctx = NULL;
+
+		for (j = 0; j < msgs[i].inlen; j++) in[i][j] = fr_rand();
+
+		/*
+		 *	A prefix of a whole block, as with the HMAC pads,
+		 *	or of part of a block.
+		 */
+		if (i % 3) {
+			memset(pad, i, sizeof(pad));
+			fr_md5_init(&prefix[i]);
+			fr_md5_update(&prefix[i], pad, (i % 3) == 1 ? MD5_BLOCK_LENGTH : MD5_BLOCK_LENGTH + 6);
+			msgs[i].ctx = &prefix[i];
+
+			fr_md5_copy(&context, &prefix[i]);
+		} else {
+			fr_md5_init(&context);
+		}
+
+		fr_md5_update(&context, in[i], msgs[i].inlen);
+		fr_md5_final(expected[i], &context);
+	}
+
+	fr_md5_mb_calc(msgs, NUM_MSGS);
+
+	for (i = 0; i < NUM_MSGS; i++) {
+		if (memcmp(out[i], expected[i], sizeof(out[i])) == 0) continue;
+
+		fprintf(stderr, "md5_mb_test: %s: Wrong digest for message %i (%zu bytes%s)\n",
+			fr_md5_mb_engine_name(), i, msgs[i].inlen, msgs[i].ctx ? ", with prefix" : "");
+		fails++;
+	}
+
+	return fails;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, fails = 0;
+	fr_md5_mb_engine_t	engine;
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	for (engine = FR_MD5_MB_SCALAR; engine <= FR_MD5_MB_AVX2; engine++) {
+		if (fr_md5_mb_engine_set(engine) < 0) {
+			MPRINT1("Skipping engine %i: %s\n", engine, fr_strerror());
+			continue;
+		}
+
+		fails += test_rfc1321();
+		fails += test_random();
+
+		MPRINT1("%s: done\n", fr_md5_mb_engine_name());
+	}
+
+	(void) fr_md5_mb_engine_set(FR_MD5_MB_AUTO);
+
+	if (fails) {
+		fprintf(stderr, "md5_mb_test: %i digests were wrong\n", fails);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * module_lookup_test.c	Benchmark for calling modules, and finding their thread specific data.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modpriv.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define MAX_INSTANCES (1024)
+#define MAX_CALLS (256)
+
+/*
+ *	Symbols which the server sources expect the binary to define.
+ *	This is the same as unit_test_module.
+ */
+char const *radacct_dir = NULL;
+char const *radlog_dir = NULL;
+bool log_stripped_names = false;
+
+char const *radiusd_version = RADIUSD_VERSION_STRING_BUILD("module_lookup_test");
+
+int listen_compile(UNUSED CONF_SECTION *server, UNUSED CONF_SECTION *cs)
+{
+	return 0;
+}
+
+int listen_bootstrap(UNUSED CONF_SECTION *server, UNUSED CONF_SECTION *cs, UNUSED char const *server_name)
+{
+	return 0;
+}
+
+void listen_free(UNUSED rad_listen_t **head)
+{
+	return;
+}
+
+static int			debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: module_lookup_test [OPTS]\n");
+	fprintf(stderr, "  -c <num>               Module calls per request.  Default is 20.\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -i <num>               Number of module instances.  Default is 30.\n");
+	fprintf(stderr, "  -L <libdir>            Where to load the modules from.\n");
+	fprintf(stderr, "  -n <num>               Number of requests.  Default is 1000000.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int				c, i, j;
+	int				num_calls = 20;
+	int				num_instances = 30;
+	int				num_requests = 1000000;
+	char const			*dict_dir = DICTDIR;
+	fr_dict_t			*dict = NULL;
+	uintptr_t			sum = 0;
+	fr_time_t			start, find_time, call_time;
+	CONF_SECTION			*root, *modules, *authorize;
+	fr_event_list_t			*el;
+	REQUEST				*request;
+	module_instance_t		*calls[MAX_CALLS];
+	char				name[32];
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "c:D:hi:L:n:x")) != EOF) switch (c) {
+		case 'c':
+			num_calls = atoi(optarg);
+			if ((num_calls <= 0) || (num_calls > MAX_CALLS)) usage();
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'i':
+			num_instances = atoi(optarg);
+			if ((num_instances <= 0) || (num_instances > MAX_INSTANCES)) usage();
+			break;
+
+		case 'L':
+			radlib_dir = optarg;
+			break;
+
+		case 'n':
+			num_requests = atoi(optarg);
+			if (num_requests <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+	error:
+		fr_perror("module_lookup_test");
+		exit(1);
+	}
+
+	/*
+	 *	Configure num_instances instances of rlm_always,
+	 *	called m0, m1, ...
+	 */
+	root = cf_section_alloc(NULL, "main", NULL);
+	modules = cf_section_alloc(root, "modules", NULL);
+	rad_assert(root && modules);
+	cf_section_add(root, modules);
+
+	for (i = 0; i < num_instances; i++) {
+		CONF_SECTION *cs;
+
+		snprintf(name, sizeof(name), "m%d", i);
+
+		cs = cf_section_alloc(modules, "always", name);
+		rad_assert(cs != NULL);
+		cf_pair_add(cs, cf_pair_alloc(cs, "rcode", "ok", T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+		cf_section_add(modules, cs);
+	}
+
+	if (modules_bootstrap(root) < 0) goto error;
+	if (modules_instantiate(root) < 0) goto error;
+
+	el = fr_event_list_create(root, NULL, NULL);
+	rad_assert(el != NULL);
+
+	if (modules_thread_instantiate(root, el) < 0) goto error;
+
+	/*
+	 *	The modules called by each request.  The same list is
+	 *	used for all requests, as with a fixed virtual server.
+	 */
+	authorize = cf_section_alloc(root, "authorize", NULL);
+	rad_assert(authorize != NULL);
+	cf_section_add(root, authorize);
+
+	for (i = 0; i < num_calls; i++) {
+		snprintf(name, sizeof(name), "m%ld", random() % num_instances);
+
+		calls[i] = module_find(modules, name);
+		rad_assert(calls[i] != NULL);
+
+		cf_pair_add(authorize, cf_pair_alloc(authorize, name, NULL, T_OP_EQ, T_BARE_WORD, T_EOL));
+	}
+
+	if (unlang_compile(authorize, MOD_AUTHORIZE) < 0) goto error;
+
+	request = request_alloc(root);
+	rad_assert(request != NULL);
+	request->packet = fr_radius_alloc(request, false);
+	request->reply = fr_radius_alloc(request, false);
+	rad_assert(request->packet && request->reply);
+	request->el = el;
+
+	/*
+	 *	What unlang_module_call() does for each call.
+	 */
+	start = fr_time();
+	for (i = 0; i < num_requests; i++) {
+		for (j = 0; j < num_calls; j++) sum += (uintptr_t) module_thread_instance_find(calls[j]);
+	}
+	find_time = fr_time() - start;
+
+	MPRINT1("Checksum %" PRIuPTR "\n", sum);
+
+	/*
+	 *	And the whole dispatch, through the interpreter.
+	 */
+	start = fr_time();
+	for (i = 0; i < num_requests; i++) {
+		if (unlang_interpret(request, authorize, RLM_MODULE_NOOP) != RLM_MODULE_OK) {
+			fprintf(stderr, "module_lookup_test: Modules didn't return ok\n");
+			exit(1);
+		}
+	}
+	call_time = fr_time() - start;
+
+	printf("%d instances, %d calls per request, %d requests\n", num_instances, num_calls, num_requests);
+	printf("module_thread_instance_find:\t%.2f ns per call\n",
+	       ((double) find_time) / ((double) num_requests * num_calls));
+	printf("unlang_interpret:\t\t%.2f ns per module call\n",
+	       ((double) call_time) / ((double) num_requests * num_calls));
+
+	talloc_free(request);
+	modules_free();
+	talloc_free(root);
+	talloc_free(dict);
+
+	return 0;
+}
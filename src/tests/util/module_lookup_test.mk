@@ -0,0 +1,29 @@
+TARGET := module_lookup_test
+
+#
+#  modules.c and the interpreter are only linked into the server
+#  binaries, so we build them in, as unit_test_module does.
+#
+SOURCES		:= module_lookup_test.c \
+		   ${top_srcdir}/src/main/acct.c \
+		   ${top_srcdir}/src/main/auth.c \
+		   ${top_srcdir}/src/main/client.c \
+		   ${top_srcdir}/src/main/crypt.c \
+		   ${top_srcdir}/src/main/files.c \
+		   ${top_srcdir}/src/main/mainconfig.c \
+		   ${top_srcdir}/src/main/modules.c \
+		   ${top_srcdir}/src/main/soh.c \
+		   ${top_srcdir}/src/main/state.c \
+		   ${top_srcdir}/src/main/session.c \
+		   ${top_srcdir}/src/main/version.c \
+		   ${top_srcdir}/src/main/virtual_servers.c \
+		   ${top_srcdir}/src/main/unlang_compile.c \
+		   ${top_srcdir}/src/main/unlang_interpret.c \
+		   ${top_srcdir}/src/main/realms.c
+
+ifneq ($(OPENSSL_LIBS),)
+include ${top_srcdir}/src/main/tls.mk
+endif
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS) $(LCRYPT)
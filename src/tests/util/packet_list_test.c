@@ -0,0 +1,262 @@
+/*
+ * packet_list_test.c	Benchmark for allocating proxy IDs from multiple threads.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define MAX_THREADS (64)
+#define MAX_WINDOW (256)
+
+typedef struct fr_packet_thread_t {
+	int		id;			//!< ID of the thread 0..N
+	pthread_t	pthread_id;		//!< pthread ID of the thread
+	uint64_t	num_packets;		//!< packets which went through alloc / find / free
+	uint64_t	num_failed;		//!< times we couldn't allocate an ID
+} fr_packet_thread_t;
+
+static int		debug_lvl = 0;
+static int		num_packets = 1000000;
+static int		window = 32;
+static bool		global_lock = false;
+static fr_ipaddr_t	home_ipaddr;
+static uint16_t		home_port = 1812;
+
+static fr_packet_list_t	*pl;
+static pthread_mutex_t	pl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *	Do what the proxy code does: allocate a window of IDs, find
+ *	each one again from a fake reply, and then free it.
+ */
+static void *packet_thread(void *arg)
+{
+	int i, j, sent;
+	fr_packet_thread_t *pt = arg;
+	RADIUS_PACKET *packets[MAX_WINDOW];
+	RADIUS_PACKET reply;
+
+	for (i = 0; i < window; i++) {
+		packets[i] = fr_radius_alloc(NULL, false);
+		rad_assert(packets[i] != NULL);
+	}
+
+	memset(&reply, 0, sizeof(reply));
+
+	for (i = 0; i < num_packets; i += window) {
+		/*
+		 *	Send a window of packets.
+		 */
+		for (j = 0, sent = 0; j < window; j++) {
+			RADIUS_PACKET *packet = packets[j];
+			bool rcode;
+
+			packet->dst_ipaddr = home_ipaddr;
+			packet->dst_port = home_port;
+			packet->src_ipaddr.af = AF_UNSPEC;
+			packet->src_port = 0;
+
+			if (global_lock) pthread_mutex_lock(&pl_mutex);
+			rcode = fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packets[j], NULL);
+			if (global_lock) pthread_mutex_unlock(&pl_mutex);
+
+			if (!rcode) {
+				packet->id = -1;
+				pt->num_failed++;
+				continue;
+			}
+			sent++;
+		}
+
+		/*
+		 *	Receive the replies.
+		 */
+		for (j = 0; j < window; j++) {
+			RADIUS_PACKET *packet = packets[j];
+			RADIUS_PACKET **packet_p;
+
+			if (packet->id < 0) continue;
+
+			reply.sockfd = packet->sockfd;
+			reply.id = packet->id;
+			reply.src_ipaddr = packet->dst_ipaddr;
+			reply.src_port = packet->dst_port;
+			reply.dst_ipaddr = packet->src_ipaddr;
+			reply.dst_port = packet->src_port;
+
+			if (global_lock) pthread_mutex_lock(&pl_mutex);
+			packet_p = fr_packet_list_find_byreply(pl, &reply);
+			rad_assert(packet_p == &packets[j]);
+
+			if (!fr_packet_list_id_free(pl, packet, true)) {
+				fprintf(stderr, "packet_list_test: Failed freeing ID %d\n", reply.id);
+				exit(1);
+			}
+			if (global_lock) pthread_mutex_unlock(&pl_mutex);
+		}
+
+		pt->num_packets += sent;
+	}
+
+	for (i = 0; i < window; i++) talloc_free(packets[i]);
+
+	MPRINT1("Thread %d done, %" PRIu64 " packets\n", pt->id, pt->num_packets);
+
+	return NULL;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: packet_list_test [OPTS]\n");
+	fprintf(stderr, "  -g                     Use one global mutex, instead of per-socket locks.\n");
+	fprintf(stderr, "  -n <num>               Number of packets per thread.  Default is 1000000.\n");
+	fprintf(stderr, "  -s <num>               Number of sockets.  Default is 4.\n");
+	fprintf(stderr, "  -t <num>               Number of threads.  Default is 4.\n");
+	fprintf(stderr, "  -w <num>               Outstanding packets per thread.  Default is 32.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	int			num_sockets = 4;
+	int			num_threads = 4;
+	uint64_t		packets, failed;
+	fr_time_t		start, end;
+	fr_ipaddr_t		my_ipaddr;
+	pthread_attr_t		attr;
+	fr_packet_thread_t	threads[MAX_THREADS];
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "ghn:s:t:w:x")) != EOF) switch (c) {
+		case 'g':
+			global_lock = true;
+			break;
+
+		case 'n':
+			num_packets = atoi(optarg);
+			if (num_packets <= 0) usage();
+			break;
+
+		case 's':
+			num_sockets = atoi(optarg);
+			if ((num_sockets <= 0) || (num_sockets > 256)) usage();
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if ((num_threads <= 0) || (num_threads > MAX_THREADS)) usage();
+			break;
+
+		case 'w':
+			window = atoi(optarg);
+			if ((window <= 0) || (window > MAX_WINDOW)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	memset(&home_ipaddr, 0, sizeof(home_ipaddr));
+	home_ipaddr.af = AF_INET;
+	home_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+	home_ipaddr.prefix = 32;
+
+	my_ipaddr = home_ipaddr;
+
+	pl = fr_packet_list_create(1);
+	if (!pl) {
+		fprintf(stderr, "packet_list_test: Failed creating packet list\n");
+		exit(1);
+	}
+
+	for (i = 0; i < num_sockets; i++) {
+		int sockfd;
+
+		sockfd = fr_socket(&my_ipaddr, 0);
+		if (sockfd < 0) {
+			fprintf(stderr, "packet_list_test: Failed creating socket: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		if (!fr_packet_list_socket_add(pl, sockfd, IPPROTO_UDP, &home_ipaddr, home_port, NULL)) {
+			fprintf(stderr, "packet_list_test: Failed adding socket: %s\n", fr_strerror());
+			exit(1);
+		}
+	}
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	memset(threads, 0, sizeof(threads));
+
+	start = fr_time();
+
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		(void) pthread_create(&threads[i].pthread_id, &attr, packet_thread, &threads[i]);
+	}
+
+	packets = failed = 0;
+	for (i = 0; i < num_threads; i++) {
+		(void) pthread_join(threads[i].pthread_id, NULL);
+		packets += threads[i].num_packets;
+		failed += threads[i].num_failed;
+	}
+
+	end = fr_time();
+
+	rad_assert(fr_packet_list_num_elements(pl) == 0);
+	rad_assert(fr_packet_list_num_outgoing(pl) == 0);
+
+	printf("%s locking, %d threads, %d sockets: %" PRIu64 " packets (%" PRIu64 " failed allocations)\n",
+	       global_lock ? "global" : "per-socket", num_threads, num_sockets, packets, failed);
+	printf("%.0f packets/s\n", ((double) packets * NANOSEC) / (end - start));
+
+	fr_packet_list_free(pl);
+
+	return 0;
+}
@@ -0,0 +1,7 @@
+TARGET := packet_list_test
+
+SOURCES		:= packet_list_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
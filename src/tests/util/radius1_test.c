@@ -22,6 +22,7 @@
 
 RCSID("$Id$")
 
+#include <freeradius-devel/libradius.h>
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/worker.h>
 #include <freeradius-devel/inet.h>
@@ -29,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/radius.h>
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -37,11 +39,8 @@ RCSID("$Id$")
 #include <pthread.h>
 #include <signal.h>
 
-#include <sys/event.h>
-
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
-#define MAX_KEVENTS		(10)
 #define MAX_WORKERS		(1024)
 
 #define MPRINT1 if (debug_lvl) printf
@@ -79,15 +78,22 @@ static bool		quiet = false;
 static fr_ipaddr_t	my_ipaddr;
 static int		my_port;
 static char const	*secret = "testing123";
+static fr_radius_secret_t	*prepared = NULL;
+static bool		precompute = true;
 
 static fr_schedule_worker_t workers[MAX_WORKERS];
 
+static fr_message_set_t	*ms_master;
+static int		which_worker;
+static bool		control_plane_signal;
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: radius_test [OPTS]\n");
 	fprintf(stderr, "  -c <control-plane>     Size of the control plane queue.\n");
 	fprintf(stderr, "  -i <address>[:port]    Set IP address and optional port.\n");
 	fprintf(stderr, "  -q                     quiet - suppresses worker stats.\n");
+	fprintf(stderr, "  -P                     Hash the shared secret for every reply, instead of once.\n");
 	fprintf(stderr, "  -s <secret>            Set shared secret.\n");
 	fprintf(stderr, "  -w N                   Create N workers.  Default is 1.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
@@ -115,19 +121,30 @@ static ssize_t test_encode(void const *packet_ctx, REQUEST *request, uint8_t *bu
 
 	MPRINT1("\t\tENCODE >>> request %zd - data %p %p room %zd\n", request->number, packet_ctx, buffer, buffer_len);
 
+	if (buffer_len < 38) return -1;
+
 	buffer[0] = PW_CODE_ACCESS_ACCEPT;
 	buffer[1] = pc->id;
 	buffer[2] = 0;
-	buffer[3] = 20;
+	buffer[3] = 38;
 
 	memcpy(buffer + 4, pc->vector, 16);
-	
+
+	/*
+	 *	Sign the reply with a Message-Authenticator, which
+	 *	is where most of the shared secret hashing is.
+	 */
+	buffer[20] = PW_MESSAGE_AUTHENTICATOR;
+	buffer[21] = 18;
+	memset(buffer + 22, 0, 16);
+	fr_radius_hmac_md5(buffer + 22, buffer, 38, secret, prepared);
+
 	fr_md5_init(&context);
-	fr_md5_update(&context, buffer, 20);
+	fr_md5_update(&context, buffer, 38);
 	fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
 	fr_md5_final(buffer + 4, &context);
 
-	return 20;
+	return 38;
 }
 
 static size_t test_nak(void const *packet_ctx, uint8_t *const packet, size_t packet_len, UNUSED uint8_t *reply, UNUSED size_t reply_len)
@@ -201,42 +218,134 @@ static void send_reply(int sockfd, fr_channel_data_t *reply)
 }
 
 
+static void master_socket_read(UNUSED fr_event_list_t *el, int sockfd, void *ctx)
+{
+	int rcode;
+	uint8_t *packet, *attr, *end;
+	size_t total_len;
+	ssize_t data_size;
+	fr_packet_ctx_t *pc;
+	fr_channel_data_t *cd, *reply;
+
+		cd = (fr_channel_data_t *) fr_message_reserve(ms_master, 4096);
+		rad_assert(cd != NULL);
+
+		pc = talloc(ctx, fr_packet_ctx_t);
+		rad_assert(pc != NULL);
+		pc->salen = sizeof(pc->src);
+
+		data_size = recvfrom(sockfd, cd->m.data, cd->m.rb_size, 0,
+				     (struct sockaddr *) &pc->src, &pc->salen);
+		MPRINT1("Master got packet size %zd\n", data_size);
+		if (data_size <= 20) {
+			MPRINT1("Master ignoring packet (data length %zd)\n",
+				data_size);
+
+		discard:
+			fr_message_done(&cd->m); /* yeah, re-use it for the next packet... */
+			return;
+		}
+
+		/*
+		 *	Verify the packet before doing anything more with it.
+		 */
+		packet = cd->m.data;
+		if (packet[0] != PW_CODE_ACCESS_REQUEST) {
+			MPRINT1("Master ignoring packet code %u\n", packet[0]);
+			goto discard;
+		}
+
+		total_len = (packet[2] << 8) | packet[3];
+		if (total_len < 20) {
+			MPRINT1("Master ignoring packet (header length %zu)\n",
+				total_len);
+			goto discard;
+		}
+		if (total_len > (size_t) data_size) {
+			MPRINT1("Master ignoring truncated packet (read %zd, says %zu)\n",
+				data_size, total_len);
+			goto discard;
+		}
+
+		attr = packet + 20;
+		end = packet + data_size;
+		while (attr < end) {
+			if ((end - attr) < 2) goto discard;
+			if (attr[0] == 0) goto discard;
+			if (attr[1] < 2) goto discard;
+			if ((attr + attr[1]) > end) goto discard;
+
+			attr += attr[1];
+		}
+
+		(void) fr_message_alloc(ms_master, &cd->m, total_len);
+
+		MPRINT1("Master sending packet size %zd to worker %d\n", cd->m.data_size, which_worker);
+		cd->m.when = fr_time();
+
+		cd->ctx = pc;
+		pc->id = packet[1];
+		memcpy(pc->vector, packet + 4, 16);
+
+		rcode = fr_channel_send_request(workers[which_worker].ch, cd, &reply);
+		if (rcode < 0) {
+			fprintf(stderr, "Failed sending request: %s\n", strerror(errno));
+			exit(1);
+		}
+		which_worker++;
+		if (which_worker >= num_workers) which_worker = 0;
+
+		rad_assert(rcode == 0);
+		if (reply) send_reply(sockfd, reply);
+}
+
+/*
+ *	@todo this should NOT take a channel pointer
+ */
+static void master_user_event(UNUSED int kq, uintptr_t ident, void *ctx)
+{
+	fr_control_t *control_master = ctx;
+
+	(void) fr_channel_service_user(workers[0].ch, control_master, ident);
+	control_plane_signal = true;
+}
+
 static void master_process(TALLOC_CTX *ctx)
 {
 	bool running;
-	int rcode, i, num_events, which_worker;
+	int rcode, i, num_events;
 	int num_outstanding;
-	fr_message_set_t *ms;
 	fr_channel_t *ch;
 	fr_channel_event_t ce;
 	pthread_attr_t	pthread_attr;
 	fr_schedule_worker_t *sw;
-	struct kevent events[MAX_KEVENTS];
-	int kq_master;
+	fr_event_list_t *el_master;
 	fr_atomic_queue_t *aq_master;
 	fr_control_t *control_master;
 	int sockfd;
 
 	MPRINT1("Master started.\n");
 
-	ms = fr_message_set_create(ctx, MAX_MESSAGES, sizeof(fr_channel_data_t), MAX_MESSAGES * 1024);
-	if (!ms) {
+	ms_master = fr_message_set_create(ctx, MAX_MESSAGES, sizeof(fr_channel_data_t), MAX_MESSAGES * 1024);
+	if (!ms_master) {
 		fprintf(stderr, "Failed creating message set\n");
 		exit(1);
 	}
 
 	/*
-	 *	Create the KQ and associated sockets.
+	 *	Create the event list and associated sockets.
 	 */
-	kq_master = kqueue();
-	rad_assert(kq_master >= 0);
+	el_master = fr_event_list_create(ctx, NULL, NULL);
+	rad_assert(el_master != NULL);
 
 	aq_master = fr_atomic_queue_create(ctx, max_control_plane);
 	rad_assert(aq_master != NULL);
 
-	control_master = fr_control_create(ctx, kq_master, aq_master);
+	control_master = fr_control_create(ctx, fr_event_list_kq(el_master), aq_master);
 	rad_assert(control_master != NULL);
 
+	(void) fr_event_user_insert(el_master, master_user_event, control_master);
+
 	sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
 	if (sockfd < 0) {
 		fprintf(stderr, "radius_test: Failed creating socket: %s\n", fr_strerror());
@@ -249,11 +358,10 @@ static void master_process(TALLOC_CTX *ctx)
 	}
 
 	/*
-	 *	Set up the KQ filter for reading.
+	 *	Set up the event list for reading.
 	 */
-	EV_SET(&events[0], sockfd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(kq_master, events, 1, NULL, 0, NULL) < 0) {
-		fprintf(stderr, "Failed setting KQ for EVFILT_READ: %s\n", fr_strerror());
+	if (fr_event_fd_insert(el_master, sockfd, master_socket_read, NULL, NULL, ctx) < 0) {
+		fprintf(stderr, "Failed adding socket to the event list: %s\n", fr_strerror());
 		exit(1);
 	}
 
@@ -305,19 +413,16 @@ static void master_process(TALLOC_CTX *ctx)
 	running = true;
 
 	while (running) {
-		bool control_plane_signal;
 		fr_time_t now;
-		fr_channel_data_t *cd, *reply;
+		fr_channel_data_t *reply;
 
 		MPRINT1("Master waiting on events.\n");
 
-		num_events = kevent(kq_master, NULL, 0, events, MAX_KEVENTS, NULL);
-		MPRINT1("Master kevent returned %d\n", num_events);
+		num_events = fr_event_corral(el_master, true);
+		MPRINT1("Master corral returned %d\n", num_events);
 
 		if (num_events < 0) {
-			if (num_events == EINTR) continue;
-
-			fprintf(stderr, "Failed waiting for kevent: %s\n", strerror(errno));
+			fprintf(stderr, "Failed waiting for events: %s\n", fr_strerror());
 			exit(1);
 		}
 
@@ -327,94 +432,8 @@ static void master_process(TALLOC_CTX *ctx)
 
 		/*
 		 *	Service the events.
-		 *
-		 *	@todo this should NOT take a channel pointer
 		 */
-		for (i = 0; i < num_events; i++) {
-			uint8_t *packet, *attr, *end;
-			size_t total_len;
-			ssize_t data_size;
-			fr_packet_ctx_t *pc;
-
-			if (events[i].filter == EVFILT_USER) {
-				(void) fr_channel_service_kevent(workers[0].ch, control_master, &events[i]);
-				control_plane_signal = true;
-				break;
-			}
-
-			rad_assert(events[i].filter == EVFILT_READ);
-
-			cd = (fr_channel_data_t *) fr_message_reserve(ms, 4096);
-			rad_assert(cd != NULL);
-
-			pc = talloc(ctx, fr_packet_ctx_t);
-			rad_assert(pc != NULL);
-			pc->salen = sizeof(pc->src);
-
-			data_size = recvfrom(sockfd, cd->m.data, cd->m.rb_size, 0,
-					     (struct sockaddr *) &pc->src, &pc->salen);
-			MPRINT1("Master got packet size %zd\n", data_size);
-			if (data_size <= 20) {
-				MPRINT1("Master ignoring packet (data length %zd)\n",
-					data_size);
-
-			discard:
-				fr_message_done(&cd->m); /* yeah, re-use it for the next packet... */
-				continue;
-			}
-
-			/*
-			 *	Verify the packet before doing anything more with it.
-			 */
-			packet = cd->m.data;
-			if (packet[0] != PW_CODE_ACCESS_REQUEST) {
-				MPRINT1("Master ignoring packet code %u\n", packet[0]);
-				goto discard;
-			}
-
-			total_len = (packet[2] << 8) | packet[3];
-			if (total_len < 20) {
-				MPRINT1("Master ignoring packet (header length %zu)\n",
-					total_len);
-				goto discard;
-			}
-			if (total_len > (size_t) data_size) {
-				MPRINT1("Master ignoring truncated packet (read %zd, says %zu)\n",
-					data_size, total_len);
-				goto discard;
-			}
-
-			attr = packet + 20;
-			end = packet + data_size;
-			while (attr < end) {
-				if ((end - attr) < 2) goto discard;
-				if (attr[0] == 0) goto discard;
-				if (attr[1] < 2) goto discard;
-				if ((attr + attr[1]) > end) goto discard;
-
-				attr += attr[1];
-			}
-
-			(void) fr_message_alloc(ms, &cd->m, total_len);
-
-			MPRINT1("Master sending packet size %zd to worker %d\n", cd->m.data_size, which_worker);
-			cd->m.when = fr_time();
-
-			cd->ctx = pc;
-			pc->id = packet[1];
-			memcpy(pc->vector, packet + 4, 16);
-
-			rcode = fr_channel_send_request(workers[which_worker].ch, cd, &reply);
-			if (rcode < 0) {
-				fprintf(stderr, "Failed sending request: %s\n", strerror(errno));
-				exit(1);
-			}
-			which_worker++;
-			if (which_worker >= num_workers) which_worker = 0;
-
-			rad_assert(rcode == 0);
-			if (reply) send_reply(sockfd, reply);
-		}
+		fr_event_service(el_master);
 
 		if (!control_plane_signal) continue;
 
@@ -506,14 +525,14 @@ static void master_process(TALLOC_CTX *ctx)
 	 *	Force all messages to be garbage collected
 	 */
 	MPRINT2("GC\n");
-	fr_message_set_gc(ms);
+	fr_message_set_gc(ms_master);
 
-	if (debug_lvl > 1) fr_message_set_debug(ms, stdout);
+	if (debug_lvl > 1) fr_message_set_debug(ms_master, stdout);
 
 	/*
 	 *	After the garbage collection, all messages marked "done" MUST also be marked "free".
 	 */
-	rcode = fr_message_set_messages_used(ms);
+	rcode = fr_message_set_messages_used(ms_master);
 	MPRINT2("Master messages used = %d\n", rcode);
 	rad_assert(rcode == 0);
 	close(sockfd);
@@ -537,7 +556,7 @@ int main(int argc, char *argv[])
 	my_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
 	my_port = 1812;
 
-	while ((c = getopt(argc, argv, "c:hi:qs:w:x")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "c:hi:Pqs:w:x")) != EOF) switch (c) {
 		case 'x':
 			debug_lvl++;
 			break;
@@ -554,6 +573,10 @@ int main(int argc, char *argv[])
 			my_port = port16;
 			break;
 
+		case 'P':
+			precompute = false;
+			break;
+
 		case 'q':
 			quiet = true;
 			break;
@@ -582,6 +605,14 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
+	if (precompute) {
+		prepared = fr_radius_secret_alloc(autofree, secret);
+		if (!prepared) {
+			fprintf(stderr, "Failed allocating secret\n");
+			exit(1);
+		}
+	}
+
 	signal(SIGTERM, sig_ignore);
 
 	if (debug_lvl) {
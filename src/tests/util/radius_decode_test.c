@@ -0,0 +1,420 @@
+/*
+ * radius_decode_test.c	Benchmark for decoding RADIUS packets, fully and lazily.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define VENDORPEC_CISCO		(9)
+
+static int		debug_lvl = 0;
+static int		num_loops = 100000;
+static int		num_vsas = 16;
+static char		*secret;
+
+static fr_dict_attr_t const *user_name;
+static fr_dict_attr_t const *acct_status_type;
+static fr_dict_attr_t const *acct_session_id;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: radius_decode_test [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -n <num>               Number of times to decode the packet.  Default is 100000.\n");
+	fprintf(stderr, "  -v <num>               Number of Cisco-AVPair attributes in the packet.  Default is 16.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Add an attribute to the packet being built.
+ */
+static uint8_t *add_attr(uint8_t *p, uint8_t type, void const *value, size_t len)
+{
+	p[0] = type;
+	p[1] = len + 2;
+	memcpy(p + 2, value, len);
+
+	return p + 2 + len;
+}
+
+/*
+ *	Build an Accounting-Request with a few standard attributes, and
+ *	a lot of vendor attributes which nothing looks at.
+ */
+static RADIUS_PACKET *packet_alloc(TALLOC_CTX *ctx)
+{
+	RADIUS_PACKET	*packet;
+	uint8_t		data[4096], *p, *end;
+	uint8_t		vsa[253];
+	uint8_t		frag[260];
+	uint32_t	status = htonl(1);
+	uint32_t	vendor = htonl(VENDORPEC_CISCO);
+	int		i;
+
+	memset(data, 0, sizeof(data));
+	data[0] = PW_CODE_ACCOUNTING_REQUEST;
+	data[1] = 1;
+
+	p = data + RADIUS_HDR_LEN;
+	end = data + sizeof(data);
+
+	p = add_attr(p, PW_USER_NAME, "bob", 3);
+	p = add_attr(p, PW_ACCT_SESSION_ID, "0123456789abcdef", 16);
+	p = add_attr(p, PW_ACCT_STATUS_TYPE, &status, sizeof(status));
+
+	/*
+	 *	Vendor-Id, then Cisco-AVPair.
+	 */
+	memcpy(vsa, &vendor, sizeof(vendor));
+	vsa[4] = 1;
+	vsa[5] = 200;
+	memset(vsa + 6, 'x', 198);
+	memcpy(vsa + 6, "subscriber:accounting-list=", 27);
+
+	for (i = 0; (i < num_vsas) && ((p + 2 + 204) <= end); i++) {
+		p = add_attr(p, PW_VENDOR_SPECIFIC, vsa, 204);
+	}
+
+	/*
+	 *	An EAP-Message split over two attributes.
+	 */
+	memset(frag, 0, sizeof(frag));
+	frag[0] = 2;			/* Response */
+	frag[2] = 0x01;
+	frag[3] = 0x04;			/* 260 bytes */
+	frag[4] = 1;			/* Identity */
+	memset(frag + 5, 'e', 255);
+	p = add_attr(p, PW_EAP_MESSAGE, frag, 253);
+	p = add_attr(p, PW_EAP_MESSAGE, frag + 253, 7);
+
+	/*
+	 *	A long extended attribute split over two attributes,
+	 *	with the "more" flag set on the first.
+	 */
+	memset(frag, 'l', sizeof(frag));
+	frag[0] = 200;
+	frag[1] = 0x80;
+	p = add_attr(p, PW_EXTENDED_ATTRIBUTE_5, frag, 253);
+	frag[1] = 0x00;
+	p = add_attr(p, PW_EXTENDED_ATTRIBUTE_5, frag, 2 + 10);
+
+	data[2] = ((p - data) >> 8) & 0xff;
+	data[3] = (p - data) & 0xff;
+
+	packet = fr_radius_alloc(ctx, false);
+	rad_assert(packet != NULL);
+
+	packet->code = data[0];
+	packet->id = data[1];
+	packet->data_len = p - data;
+	packet->data = talloc_memdup(packet, data, packet->data_len);
+
+	return packet;
+}
+
+static int count_pairs(VALUE_PAIR *vps)
+{
+	vp_cursor_t	cursor;
+	int		count = 0;
+
+	for (fr_pair_cursor_init(&cursor, &vps); fr_pair_cursor_current(&cursor); fr_pair_cursor_next(&cursor)) count++;
+
+	return count;
+}
+
+/*
+ *	Check that every attribute from full decoding is in the lazy
+ *	list, with the same value.  The lists may be in a different
+ *	order, and unknown attributes get new dictionary attributes
+ *	each time they're decoded, so compare by number.
+ */
+static int compare_pairs(VALUE_PAIR *full, VALUE_PAIR *lazy)
+{
+	vp_cursor_t	full_cursor, lazy_cursor;
+	VALUE_PAIR	*a, *b;
+	bool		*used;
+	int		i, count, fails = 0;
+
+	count = count_pairs(lazy);
+	if (count != count_pairs(full)) {
+		fprintf(stderr, "radius_decode_test: Lazy decoding produced %i attributes, expected %i\n",
+			count, count_pairs(full));
+		return 1;
+	}
+
+	used = talloc_zero_array(NULL, bool, count);
+	rad_assert(used != NULL);
+
+	for (a = fr_pair_cursor_init(&full_cursor, &full); a; a = fr_pair_cursor_next(&full_cursor)) {
+		for (b = fr_pair_cursor_init(&lazy_cursor, &lazy), i = 0;
+		     b;
+		     b = fr_pair_cursor_next(&lazy_cursor), i++) {
+			if (used[i]) continue;
+			if ((a->da->attr != b->da->attr) || (a->da->vendor != b->da->vendor)) continue;
+			if (a->da->parent->attr != b->da->parent->attr) continue;
+			if (fr_pair_cmp(a, b) != 1) continue;
+
+			used[i] = true;
+			break;
+		}
+
+		if (!b) {
+			fprintf(stderr, "radius_decode_test: Lazy decoding didn't produce %s with the same value\n",
+				a->da->name);
+			fails++;
+		}
+	}
+
+	talloc_free(used);
+
+	return fails;
+}
+
+/*
+ *	Malformed attributes must be found when the packet is indexed,
+ *	as full decoding would find them.
+ */
+static int test_malformed(RADIUS_PACKET *packet)
+{
+	uint8_t		*attr = packet->data + RADIUS_HDR_LEN;
+	uint8_t		type = attr[0], len = attr[1];
+	int		fails = 0;
+
+	attr[1] = 1;
+	if (fr_radius_decode_lazy(packet, NULL, secret) == 0) {
+		fprintf(stderr, "radius_decode_test: Indexed a packet with a short attribute\n");
+		fr_pair_list_free(&packet->vps);
+		fails++;
+	}
+
+	attr[1] = len;
+
+	attr[0] = 0;
+	if (fr_radius_decode_lazy(packet, NULL, secret) == 0) {
+		fprintf(stderr, "radius_decode_test: Indexed a packet with attribute 0\n");
+		fr_pair_list_free(&packet->vps);
+		fails++;
+	}
+	attr[0] = type;
+
+	return fails;
+}
+
+/*
+ *	Too many attributes must be found, either when the packet is
+ *	indexed, or when it's decoded.  Once decoding has failed, it
+ *	must keep failing.
+ */
+static int test_max_attributes(RADIUS_PACKET *packet, int count)
+{
+	uint32_t	max = fr_max_attributes;
+	vp_cursor_t	cursor;
+	int		fails = 0;
+
+	fr_max_attributes = count - 1;
+
+	if (fr_radius_decode_lazy(packet, NULL, secret) == 0) {
+		if (fr_pair_cursor_init(&cursor, &packet->vps) || !fr_pair_cursor_failed(&cursor)) {
+			fprintf(stderr, "radius_decode_test: Decoded more than %i attributes\n", count - 1);
+			fails++;
+		}
+
+		if (fr_radius_decode_remaining(packet) == 0) {
+			fprintf(stderr, "radius_decode_test: Decoding worked after it had failed\n");
+			fails++;
+		}
+
+		fr_pair_list_free(&packet->vps);
+	}
+
+	fr_max_attributes = max;
+
+	return fails;
+}
+
+/*
+ *	Decode every attribute, then find the ones we want.
+ */
+static void run_test_full(RADIUS_PACKET *packet)
+{
+	int		i;
+	fr_time_t	start, end;
+
+	start = fr_time();
+
+	for (i = 0; i < num_loops; i++) {
+		if (fr_radius_decode(packet, NULL, secret) < 0) {
+		error:
+			fr_perror("radius_decode_test");
+			exit(1);
+		}
+
+		if (!fr_pair_find_by_da(packet->vps, user_name, TAG_ANY) ||
+		    !fr_pair_find_by_da(packet->vps, acct_status_type, TAG_ANY) ||
+		    !fr_pair_find_by_da(packet->vps, acct_session_id, TAG_ANY)) goto error;
+
+		fr_pair_list_free(&packet->vps);
+	}
+
+	end = fr_time();
+
+	printf("full: %zu bytes, %.0f packets/s\n", packet->data_len,
+	       ((double) num_loops * NANOSEC) / (end - start));
+}
+
+/*
+ *	Index the packet, and only decode the attributes we want.
+ */
+static void run_test_lazy(RADIUS_PACKET *packet)
+{
+	int		i;
+	fr_time_t	start, end;
+
+	start = fr_time();
+
+	for (i = 0; i < num_loops; i++) {
+		if (fr_radius_decode_lazy(packet, NULL, secret) < 0) {
+		error:
+			fr_perror("radius_decode_test");
+			exit(1);
+		}
+
+		if (!fr_pair_find_by_da(packet->vps, user_name, TAG_ANY) ||
+		    !fr_pair_find_by_da(packet->vps, acct_status_type, TAG_ANY) ||
+		    !fr_pair_find_by_da(packet->vps, acct_session_id, TAG_ANY)) goto error;
+
+		fr_pair_list_free(&packet->vps);
+	}
+
+	end = fr_time();
+
+	printf("lazy: %zu bytes, %.0f packets/s\n", packet->data_len,
+	       ((double) num_loops * NANOSEC) / (end - start));
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	VALUE_PAIR		*full;
+	char const		*dict_dir = DICTDIR;
+	fr_dict_t		*dict = NULL;
+	RADIUS_PACKET		*packet;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hn:v:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_loops = atoi(optarg);
+			if (num_loops <= 0) usage();
+			break;
+
+		case 'v':
+			num_vsas = atoi(optarg);
+			if (num_vsas < 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+	error:
+		fr_perror("radius_decode_test");
+		return 1;
+	}
+
+	user_name = fr_dict_attr_by_num(NULL, 0, PW_USER_NAME);
+	acct_status_type = fr_dict_attr_by_num(NULL, 0, PW_ACCT_STATUS_TYPE);
+	acct_session_id = fr_dict_attr_by_num(NULL, 0, PW_ACCT_SESSION_ID);
+	rad_assert(user_name && acct_status_type && acct_session_id);
+
+	secret = talloc_typed_strdup(NULL, "testing123");
+	packet = packet_alloc(NULL);
+
+	/*
+	 *	Lazy decoding must produce the same attributes as
+	 *	full decoding, once everything has been asked for.
+	 */
+	if (fr_radius_decode(packet, NULL, secret) < 0) goto error;
+	full = packet->vps;
+	packet->vps = NULL;
+
+	if (fr_radius_decode_lazy(packet, NULL, secret) < 0) goto error;
+	if (!fr_pair_find_by_da(packet->vps, user_name, TAG_ANY)) goto error;
+	if (!packet->index) {
+		fprintf(stderr, "radius_decode_test: Finding one attribute decoded the whole packet\n");
+		return 1;
+	}
+
+	if (fr_radius_decode_remaining(packet) < 0) goto error;
+	if (packet->index) {
+		fprintf(stderr, "radius_decode_test: Packet still has attributes to decode\n");
+		return 1;
+	}
+	if (compare_pairs(full, packet->vps) != 0) return 1;
+	fr_pair_list_free(&packet->vps);
+
+	/*
+	 *	Walking the list with a cursor decodes everything too.
+	 */
+	if (fr_radius_decode_lazy(packet, NULL, secret) < 0) goto error;
+	if (compare_pairs(full, packet->vps) != 0) return 1;
+	MPRINT1("Decoded %i attributes\n", count_pairs(packet->vps));
+	fr_pair_list_free(&packet->vps);
+
+	if (test_malformed(packet) != 0) return 1;
+	if (test_max_attributes(packet, count_pairs(full)) != 0) return 1;
+	fr_pair_list_free(&full);
+
+	run_test_full(packet);
+	run_test_lazy(packet);
+
+	talloc_free(packet);
+	talloc_free(secret);
+	talloc_free(dict);
+
+	return 0;
+}
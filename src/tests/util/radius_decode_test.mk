@@ -0,0 +1,6 @@
+TARGET := radius_decode_test
+
+SOURCES		:= radius_decode_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
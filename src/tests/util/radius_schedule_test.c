@@ -26,9 +26,10 @@ RCSID("$Id$")
 #include <freeradius-devel/inet.h>
 #include <freeradius-devel/radius.h>
 #include <freeradius-devel/md5.h>
+#include <freeradius-devel/udp.h>
+#include <freeradius-devel/util/track.h>
 #include <freeradius-devel/rad_assert.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -42,26 +43,49 @@ RCSID("$Id$")
 
 #define MPRINT1 if (debug_lvl) printf
 
+#define MAX_NETWORKS (16)
+
+/*
+ *	How long replies are cached for duplicate detection.
+ */
+#define CLEANUP_DELAY (5 * (fr_time_t) NANOSEC)
+
+/*
+ *	How many packets each socket tracks, before new ones are dropped.
+ */
+#define MAX_TRACKED (1 << 16)
+
+/*
+ *	One socket, read by one network thread.  Only that thread
+ *	touches the tracking table and counters.
+ */
+typedef struct fr_test_socket_t {
+	int		sockfd;
+	fr_tracking_t	*ft;			//!< duplicate detection for this shard
+
+	uint64_t	num_requests;		//!< requests sent to a worker
+	uint64_t	num_cached;		//!< duplicates answered from the cache
+	uint64_t	num_in_progress;	//!< duplicates of requests still being processed
+	uint64_t	num_invalid;		//!< packets which failed verification
+} fr_test_socket_t;
+
 typedef struct fr_packet_ctx_t {
 	uint8_t		vector[16];
 	uint8_t		id;
 
+	int		sockfd;
 	struct sockaddr_storage src;
 	socklen_t	salen;
+
+	fr_test_socket_t *sock;
+	fr_tracking_entry_t *entry;		//!< tracking entry for this request
+	fr_time_t	timestamp;		//!< when the request was received
 } fr_packet_ctx_t;
 
 static int		debug_lvl = 0;
 static fr_ipaddr_t	my_ipaddr;
 static int		my_port;
-static char const	*secret = "testing123";
-
-/*
- *	@todo fix this...
- *
- *	Declare these here until we move all of the new field to the REQUEST.
- */
-extern int		fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const *port_name, bool async);
-extern int		fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const *interface);
+static fr_radius_secret_t *secret;
 
 static int test_decode(void const *packet_ctx, uint8_t *const data, size_t data_len, REQUEST *request)
 {
@@ -92,7 +116,7 @@ static ssize_t test_encode(void const *packet_ctx, REQUEST *request, uint8_t *bu
 	
 	fr_md5_init(&context);
 	fr_md5_update(&context, buffer, 20);
-	fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
+	fr_md5_update(&context, (uint8_t const *) secret->secret, strlen(secret->secret));
 	fr_md5_final(buffer + 4, &context);
 
 	return 20;
@@ -111,9 +135,259 @@ static fr_transport_final_t test_process(REQUEST *request, fr_transport_action_t
 	return FR_TRANSPORT_REPLY;
 }
 
+/*
+ *	The same secret is used for every client.
+ */
+static fr_radius_secret_t const *test_secret_find(UNUSED void *uctx, UNUSED fr_ipaddr_t const *src_ipaddr, UNUSED uint16_t src_port)
+{
+	return secret;
+}
+
+/*
+ *	Check the packet against the tracking table.  Returns false if
+ *	the packet shouldn't go to a worker.
+ */
+static bool test_track_request(fr_test_socket_t *sock, int sockfd, fr_packet_ctx_t *pc, uint8_t *buffer)
+{
+	fr_time_t now;
+	fr_ipaddr_t src_ipaddr;
+	uint16_t src_port;
+	fr_tracking_entry_t *entry;
+
+	if (!fr_ipaddr_from_sockaddr(&pc->src, pc->salen, &src_ipaddr, &src_port)) return false;
+
+	now = fr_time();
+	(void) fr_radius_tracking_expire(sock->ft, now);
+
+	switch (fr_radius_tracking_entry_insert(sock->ft, buffer, now, &src_ipaddr, src_port, &entry)) {
+	case FR_TRACKING_UNUSED:
+		return false;
+
+	/*
+	 *	Answer duplicates from the cache, without going to a
+	 *	worker.  Duplicates of requests which are still being
+	 *	processed are ignored.
+	 */
+	case FR_TRACKING_SAME:
+		if (entry->replied) {
+			if (entry->reply_len) {
+				(void) sendto(sockfd, entry->reply, entry->reply_len, 0,
+					      (struct sockaddr *) &pc->src, pc->salen);
+			}
+			sock->num_cached++;
+		} else {
+			sock->num_in_progress++;
+		}
+
+		MPRINT1("\t\tDUP <<< socket %d - id %d\n", sockfd, buffer[1]);
+		return false;
+
+	case FR_TRACKING_NEW:
+	case FR_TRACKING_DIFFERENT:
+		break;
+	}
+
+	pc->sockfd = sockfd;
+	pc->id = buffer[1];
+	memcpy(pc->vector, buffer + 4, 16);
+
+	pc->sock = sock;
+	pc->entry = entry;
+	pc->timestamp = now;
+	sock->num_requests++;
+
+	return true;
+}
+
+static ssize_t test_read(int sockfd, void *ctx, void **packet_ctx, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t data_size;
+	fr_packet_ctx_t *pc;
+	fr_test_socket_t *sock = ctx;
+	RADIUS_PACKET packet;
+
+	pc = talloc_zero(NULL, fr_packet_ctx_t);
+	if (!pc) return -1;
+
+	pc->salen = sizeof(pc->src);
+
+	data_size = recvfrom(sockfd, buffer, buffer_len, 0, (struct sockaddr *) &pc->src, &pc->salen);
+	MPRINT1("\t\tREAD <<< socket %d - data size %zd\n", sockfd, data_size);
+
+	if (data_size < 20) {
+	discard:
+		talloc_free(pc);
+		return 0;
+	}
+
+	memset(&packet, 0, sizeof(packet));
+	packet.code = buffer[0];
+	packet.id = buffer[1];
+	packet.data = buffer;
+	packet.data_len = data_size;
+	memcpy(packet.vector, buffer + 4, sizeof(packet.vector));
+	(void) fr_ipaddr_from_sockaddr(&pc->src, pc->salen, &packet.src_ipaddr, &packet.src_port);
+
+	if (fr_radius_verify_prepared(&packet, NULL, secret) < 0) {
+		MPRINT1("\t\tINVALID <<< socket %d - %s\n", sockfd, fr_strerror());
+		sock->num_invalid++;
+		goto discard;
+	}
+
+	if (!test_track_request(sock, sockfd, pc, buffer)) goto discard;
+
+	*packet_ctx = pc;
+	return data_size;
+}
+
+/*
+ *	Read many packets, and verify them all at once.
+ */
+static int test_read_batch(int sockfd, void *ctx, void **packet_ctx, size_t *data_size,
+			   uint8_t *buffer, size_t slot_size, int num)
+{
+	int i, received;
+	fr_test_socket_t *sock = ctx;
+	struct sockaddr_storage src[UDP_MAX_BATCH];
+	socklen_t salen[UDP_MAX_BATCH];
+
+	if (num > UDP_MAX_BATCH) num = UDP_MAX_BATCH;
+
+	received = fr_radius_recv_batch(sockfd, buffer, slot_size, num, data_size, src, salen,
+					test_secret_find, sock);
+	MPRINT1("\t\tREAD <<< socket %d - %d packets\n", sockfd, received);
+	if (received <= 0) return received;
+
+	for (i = 0; i < received; i++) {
+		fr_packet_ctx_t *pc;
+
+		packet_ctx[i] = NULL;
+
+		if (!data_size[i]) {
+			sock->num_invalid++;
+			continue;
+		}
+
+		pc = talloc_zero(NULL, fr_packet_ctx_t);
+		if (!pc) {
+			data_size[i] = 0;
+			continue;
+		}
+
+		memcpy(&pc->src, &src[i], salen[i]);
+		pc->salen = salen[i];
+
+		if (!test_track_request(sock, sockfd, pc, buffer + (i * slot_size))) {
+			talloc_free(pc);
+			data_size[i] = 0;
+			continue;
+		}
+
+		packet_ctx[i] = pc;
+	}
+
+	return received;
+}
+
+/*
+ *	Cache the reply, so that we can answer duplicates.
+ */
+static void test_track_reply(fr_packet_ctx_t *pc, uint8_t *buffer, size_t buffer_len)
+{
+	/*
+	 *	NAKs are short, and aren't sent.
+	 */
+	if (buffer_len < 20) buffer_len = 0;
+
+	(void) fr_radius_tracking_entry_reply(pc->sock->ft, pc->entry, pc->timestamp,
+					      buffer, buffer_len, fr_time());
+}
+
+static ssize_t test_write(void *packet_ctx, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t rcode = 0;
+	fr_packet_ctx_t *pc = packet_ctx;
+
+	MPRINT1("\t\tWRITE >>> request %d - data %p size %zd\n", pc->id, buffer, buffer_len);
+
+	/*
+	 *	NAKs are short, and aren't sent.
+	 */
+	if (buffer_len >= 20) {
+		rcode = sendto(pc->sockfd, buffer, buffer_len, 0, (struct sockaddr *) &pc->src, pc->salen);
+	}
+
+	test_track_reply(pc, buffer, buffer_len);
+
+	talloc_free(pc);
+	return rcode;
+}
+
+static int test_write_batch(void **packet_ctx, uint8_t **buffer, size_t *buffer_len, int num)
+{
+	int i, j, count, sent = 0;
+	bool done[UDP_MAX_BATCH];
+	udp_batch_entry_t entries[UDP_MAX_BATCH];
+
+	rad_assert(num <= UDP_MAX_BATCH);
+
+	memset(done, 0, sizeof(done[0]) * num);
+
+	/*
+	 *	Send all of the replies for one socket at once.
+	 */
+	for (i = 0; i < num; i++) {
+		fr_packet_ctx_t *pc = packet_ctx[i];
+		int rcode;
+
+		if (done[i]) continue;
+
+		count = 0;
+		for (j = i; j < num; j++) {
+			fr_packet_ctx_t *other = packet_ctx[j];
+
+			if (done[j] || (other->sockfd != pc->sockfd)) continue;
+
+			done[j] = true;
+
+			MPRINT1("\t\tWRITE >>> request %d - data %p size %zd\n", other->id, buffer[j], buffer_len[j]);
+
+			test_track_reply(other, buffer[j], buffer_len[j]);
+
+			/*
+			 *	NAKs are short, and aren't sent.
+			 */
+			if (buffer_len[j] < 20) continue;
+
+			memset(&entries[count], 0, sizeof(entries[count]));
+			entries[count].data = buffer[j];
+			entries[count].data_len = buffer_len[j];
+			memcpy(&entries[count].dst, &other->src, other->salen);
+			entries[count].sizeof_dst = other->salen;
+			count++;
+		}
+
+		if (!count) continue;
+
+		rcode = udp_send_batch(pc->sockfd, entries, count);
+		MPRINT1("\t\tWRITE >>> socket %d - sent %d of %d replies\n", pc->sockfd, rcode, count);
+		if (rcode > 0) sent += rcode;
+	}
+
+	for (i = 0; i < num; i++) {
+		talloc_free(packet_ctx[i]);
+	}
+
+	return sent;
+}
+
 static fr_transport_t transport = {
 	.name = "schedule-test",
-	.id = 1,
+	.id = 0,
+	.read = test_read,
+	.read_batch = test_read_batch,
+	.write = test_write,
+	.write_batch = test_write_batch,
 	.decode = test_decode,
 	.encode = test_encode,
 	.nak = test_nak,
@@ -122,11 +396,98 @@ static fr_transport_t transport = {
 
 static fr_transport_t *transports = &transport;
 
+/** Send each request multiple times, to exercise duplicate detection
+ *
+ *  Each of the client sockets has a different source port, so the
+ *  requests are spread across the network threads.
+ *
+ * @param[in] num_packets the number of different requests to send.
+ * @param[in] num_copies how many times each request is sent.
+ * @return the number of replies received.
+ */
+static uint64_t retransmit_client(int num_packets, int num_copies)
+{
+	int			i, j, num_sockets;
+	int			client[MAX_NETWORKS];
+	uint8_t			packet[20 + 18], reply[64];
+	uint64_t		received = 0;
+	struct sockaddr_storage	dst;
+	socklen_t		dstlen;
+
+	if (!fr_ipaddr_to_sockaddr(&my_ipaddr, my_port, &dst, &dstlen)) {
+		fprintf(stderr, "schedule_test: Failed converting server address\n");
+		return 0;
+	}
+
+	for (num_sockets = 0; num_sockets < MAX_NETWORKS; num_sockets++) {
+		client[num_sockets] = socket(my_ipaddr.af, SOCK_DGRAM, 0);
+		if (client[num_sockets] < 0) break;
+
+		if ((connect(client[num_sockets], (struct sockaddr *) &dst, dstlen) < 0) ||
+		    (fr_nonblock(client[num_sockets]) < 0)) {
+			close(client[num_sockets]);
+			break;
+		}
+	}
+
+	if (!num_sockets) {
+		fprintf(stderr, "schedule_test: Failed creating client sockets: %s\n", strerror(errno));
+		return 0;
+	}
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = PW_CODE_ACCESS_REQUEST;
+	packet[3] = sizeof(packet);
+	packet[20] = PW_MESSAGE_AUTHENTICATOR;
+	packet[21] = 18;
+
+	for (i = 0; i < num_packets; i++) {
+		int sockfd = client[i % num_sockets];
+
+		packet[1] = (i / num_sockets) & 0xff;
+		for (j = 0; j < 16; j += 4) {
+			uint32_t r = fr_rand();
+
+			memcpy(packet + 4 + j, &r, sizeof(r));
+		}
+
+		memset(packet + 22, 0, 16);
+		fr_radius_hmac_md5(packet + 22, packet, sizeof(packet), secret->secret, secret);
+
+		for (j = 0; j < num_copies; j++) {
+			(void) send(sockfd, packet, sizeof(packet), 0);
+		}
+
+		/*
+		 *	Don't let the replies fill up the socket buffers.
+		 */
+		for (j = 0; j < num_sockets; j++) {
+			while (recv(client[j], reply, sizeof(reply), 0) > 0) received++;
+		}
+	}
+
+	/*
+	 *	Wait for the last replies to come back.
+	 */
+	usleep(100000);
+
+	for (j = 0; j < num_sockets; j++) {
+		while (recv(client[j], reply, sizeof(reply), 0) > 0) received++;
+		close(client[j]);
+	}
+
+	return received;
+}
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: schedule_test [OPTS]\n");
-	fprintf(stderr, "  -n <num>               Start num network threads\n");
+	fprintf(stderr, "  -c <cpu>[,<cpu>...]    Pin the network threads to these CPUs.\n");
+	fprintf(stderr, "  -n <num>               Start num network threads, each with its own socket.\n");
 	fprintf(stderr, "  -i <address>[:port]    Set IP address and optional port.\n");
+	fprintf(stderr, "  -p <num>               Send num requests from an internal client, and exit.\n");
+	fprintf(stderr, "  -r <num>               Send each of those requests num times.  Default is 1.\n");
+	fprintf(stderr, "  -R                     Read one packet at a time, instead of with recvmmsg().\n");
 	fprintf(stderr, "  -s <secret>            Set shared secret.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -135,11 +496,16 @@ static void NEVER_RETURNS usage(void)
 
 int main(int argc, char *argv[])
 {
-	int c;
+	int c, i;
 	int num_networks = 1;
 	int num_workers = 2;
+	int num_cpus = 0;
+	int cpus[MAX_NETWORKS];
+	int num_packets = 0;
+	int num_copies = 1;
 	uint16_t	port16 = 0;
-	int sockfd;
+	fr_test_socket_t sock[MAX_NETWORKS];
+	char const	*secret_str = "testing123";
 	TALLOC_CTX	*autofree = talloc_init("main");
 	fr_schedule_t	*sched;
 
@@ -152,7 +518,24 @@ int main(int argc, char *argv[])
 	my_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
 	my_port = 1812;
 
-	while ((c = getopt(argc, argv, "i:n:s:w:x")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "c:i:n:p:r:Rs:w:x")) != EOF) switch (c) {
+		case 'c':
+		{
+			char *p = optarg;
+
+			while (*p) {
+				if (num_cpus >= MAX_NETWORKS) usage();
+
+				cpus[num_cpus++] = strtol(p, &p, 10);
+				if (*p == ',') {
+					p++;
+				} else if (*p) {
+					usage();
+				}
+			}
+		}
+			break;
+
 		case 'i':
 			if (fr_inet_pton_port(&my_ipaddr, &port16, optarg, -1, AF_INET, true, false) < 0) {
 				fprintf(stderr, "Failed parsing ipaddr: %s\n", fr_strerror());
@@ -163,11 +546,25 @@ int main(int argc, char *argv[])
 
 		case 'n':
 			num_networks = atoi(optarg);
-			if ((num_networks <= 0) || (num_networks > 16)) usage();
+			if ((num_networks <= 0) || (num_networks > MAX_NETWORKS)) usage();
+			break;
+
+		case 'p':
+			num_packets = atoi(optarg);
+			if (num_packets <= 0) usage();
+			break;
+
+		case 'r':
+			num_copies = atoi(optarg);
+			if (num_copies <= 0) usage();
+			break;
+
+		case 'R':
+			transport.read_batch = NULL;
 			break;
 
 		case 's':
-			secret = optarg;
+			secret_str = optarg;
 			break;
 
 		case 'w':
@@ -185,6 +582,16 @@ int main(int argc, char *argv[])
 			usage();
 	}
 
+	/*
+	 *	Precompute the MD5 state for the secret, which
+	 *	fr_radius_recv_batch() uses.
+	 */
+	secret = fr_radius_secret_alloc(autofree, secret_str);
+	if (!secret) {
+		fprintf(stderr, "schedule_test: Failed allocating secret\n");
+		exit(1);
+	}
+
 #if 0
 	argc -= (optind - 1);
 	argv += (optind - 1);
@@ -196,33 +603,75 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
-	if (sockfd < 0) {
-		fprintf(stderr, "radius_test: Failed creating socket: %s\n", fr_strerror());
+	if (num_cpus && (fr_schedule_network_affinity(sched, cpus, num_cpus) < 0)) {
+		fprintf(stderr, "schedule_test: Failed pinning network threads to CPUs\n");
 		exit(1);
 	}
 
-	if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
-		fprintf(stderr, "radius_test: Failed binding to socket: %s\n", fr_strerror());
-		exit(1);
-	}
-
-#if 0
 	/*
-	 *	Set up the KQ filter for reading.
+	 *	One socket per network thread, all bound to the same
+	 *	IP address and port.
 	 */
-	EV_SET(&events[0], sockfd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(kq_master, events, 1, NULL, 0, NULL) < 0) {
-		fprintf(stderr, "Failed setting KQ for EVFILT_READ: %s\n", fr_strerror());
-		exit(1);
+	memset(sock, 0, sizeof(sock));
+
+	for (i = 0; i < num_networks; i++) {
+		sock[i].ft = fr_radius_tracking_create(autofree, CLEANUP_DELAY, MAX_TRACKED);
+		if (!sock[i].ft) {
+			fprintf(stderr, "radius_test: Failed creating tracking table\n");
+			exit(1);
+		}
+
+		sock[i].sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
+		if (sock[i].sockfd < 0) {
+			fprintf(stderr, "radius_test: Failed creating socket: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		if ((num_networks > 1) && (fr_socket_server_reuseport(sock[i].sockfd) < 0)) {
+			fprintf(stderr, "radius_test: Failed sharing socket: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		if (fr_socket_server_bind(sock[i].sockfd, &my_ipaddr, &my_port, NULL) < 0) {
+			fprintf(stderr, "radius_test: Failed binding to socket: %s\n", fr_strerror());
+			exit(1);
+		}
 	}
-#endif
 
-	(void) fr_schedule_socket_add(sched, sockfd, &sockfd, &transport);
+	for (i = 0; i < num_networks; i++) {
+		(void) fr_schedule_socket_add(sched, sock[i].sockfd, &sock[i], &transport);
+	}
 
-	sleep(10);
+	if (!num_packets) {
+		sleep(10);
+
+	} else {
+		uint64_t received, requests = 0, cached = 0, in_progress = 0, invalid = 0;
+		fr_time_t start, end;
+
+		start = fr_time();
+		received = retransmit_client(num_packets, num_copies);
+		end = fr_time();
+
+		(void) fr_schedule_destroy(sched);
+		sched = NULL;
+
+		for (i = 0; i < num_networks; i++) {
+			requests += sock[i].num_requests;
+			cached += sock[i].num_cached;
+			in_progress += sock[i].num_in_progress;
+			invalid += sock[i].num_invalid;
+		}
+
+		printf("sent %" PRIu64 " packets, received %" PRIu64 " replies\n",
+		       ((uint64_t) num_packets) * num_copies, received);
+		printf("%" PRIu64 " requests went to workers, %" PRIu64 " duplicates answered from cache, "
+		       "%" PRIu64 " duplicates dropped while in progress\n", requests, cached, in_progress);
+		if (invalid) printf("%" PRIu64 " packets failed verification\n", invalid);
+		printf("%.0f packets/s\n", ((double) num_packets * num_copies * NANOSEC) / (end - start));
+	}
 
-	(void) fr_schedule_destroy(sched);
+	if (sched) (void) fr_schedule_destroy(sched);
 
 	talloc_free(autofree);
 
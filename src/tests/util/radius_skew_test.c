@@ -0,0 +1,454 @@
+/*
+ * radius_skew_test.c	Latency benchmark for the scheduler, when work per packet is skewed.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/schedule.h>
+#include <freeradius-devel/inet.h>
+#include <freeradius-devel/radius.h>
+#include <freeradius-devel/md5.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+/*
+ *	The client sends a marker in the first byte of the request
+ *	authenticator, which tells the worker how much work to do.
+ */
+#define WORK_FAST	(0)
+#define WORK_SLOW	(1)
+
+typedef struct fr_packet_ctx_t {
+	uint8_t		vector[16];
+	uint8_t		id;
+
+	int		sockfd;
+	struct sockaddr_storage src;
+	socklen_t	salen;
+} fr_packet_ctx_t;
+
+/*
+ *	Client side tracking of outstanding packets.
+ */
+typedef struct fr_skew_packet_t {
+	bool		in_use;
+	fr_time_t	sent;
+} fr_skew_packet_t;
+
+static int		debug_lvl = 0;
+static fr_ipaddr_t	my_ipaddr;
+static int		my_port;
+static char const	*secret = "testing123";
+
+static int		num_packets = 10000;
+static int		window = 64;
+static int		skew = 100;
+static int		fast_usec = 50;
+static int		slow_usec = 20000;
+
+/*
+ *	@todo fix this...
+ *
+ *	Declare these here until we move all of the new field to the REQUEST.
+ */
+extern int		fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const *port_name, bool async);
+extern int		fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const *interface);
+
+static ssize_t test_read(int sockfd, UNUSED void *ctx, void **packet_ctx, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t data_size;
+	fr_packet_ctx_t *pc;
+
+	pc = talloc_zero(NULL, fr_packet_ctx_t);
+	if (!pc) return -1;
+
+	pc->salen = sizeof(pc->src);
+
+	data_size = recvfrom(sockfd, buffer, buffer_len, 0, (struct sockaddr *) &pc->src, &pc->salen);
+	if (data_size < 20) {
+		talloc_free(pc);
+		return 0;
+	}
+
+	pc->sockfd = sockfd;
+	pc->id = buffer[1];
+	memcpy(pc->vector, buffer + 4, 16);
+
+	*packet_ctx = pc;
+	return data_size;
+}
+
+static ssize_t test_write(void *packet_ctx, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t rcode = 0;
+	fr_packet_ctx_t *pc = packet_ctx;
+
+	/*
+	 *	NAKs are short, and aren't sent.
+	 */
+	if (buffer_len >= 20) {
+		rcode = sendto(pc->sockfd, buffer, buffer_len, 0, (struct sockaddr *) &pc->src, pc->salen);
+	}
+
+	talloc_free(pc);
+	return rcode;
+}
+
+static int test_decode(void const *packet_ctx, UNUSED uint8_t *const data, UNUSED size_t data_len, REQUEST *request)
+{
+	fr_packet_ctx_t const *pc = packet_ctx;
+
+	request->number = pc->id;
+
+	return 0;
+}
+
+static ssize_t test_encode(void const *packet_ctx, UNUSED REQUEST *request, uint8_t *buffer, UNUSED size_t buffer_len)
+{
+	FR_MD5_CTX context;
+	fr_packet_ctx_t const *pc = packet_ctx;
+
+	buffer[0] = PW_CODE_ACCESS_ACCEPT;
+	buffer[1] = pc->id;
+	buffer[2] = 0;
+	buffer[3] = 20;
+
+	memcpy(buffer + 4, pc->vector, 16);
+
+	fr_md5_init(&context);
+	fr_md5_update(&context, buffer, 20);
+	fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
+	fr_md5_final(buffer + 4, &context);
+
+	return 20;
+}
+
+static size_t test_nak(UNUSED void const *packet_ctx, UNUSED uint8_t *const packet, UNUSED size_t packet_len,
+		       UNUSED uint8_t *reply, UNUSED size_t reply_len)
+{
+	return 10;
+}
+
+/*
+ *	Fast packets burn CPU.  Slow packets block, as if the worker
+ *	was waiting on a database.
+ */
+static fr_transport_final_t test_process(REQUEST *request, UNUSED fr_transport_action_t action)
+{
+	fr_packet_ctx_t const *pc = request->packet_ctx;
+
+	if (pc->vector[0] == WORK_SLOW) {
+		usleep(slow_usec);
+
+	} else {
+		fr_time_t end;
+
+		end = fr_time() + (fr_time_t) fast_usec * 1000;
+		while (fr_time() < end) {
+			/* spin */
+		}
+	}
+
+	return FR_TRANSPORT_REPLY;
+}
+
+static fr_transport_t transport = {
+	.name = "skew-test",
+	.id = 0,
+	.read = test_read,
+	.write = test_write,
+	.decode = test_decode,
+	.encode = test_encode,
+	.nak = test_nak,
+	.process = test_process,
+};
+
+static fr_transport_t *transports = &transport;
+
+static int fr_time_cmp(void const *one, void const *two)
+{
+	fr_time_t const *a = one;
+	fr_time_t const *b = two;
+
+	if (*a < *b) return -1;
+	if (*a > *b) return +1;
+
+	return 0;
+}
+
+#define PERCENTILE(_p) (latency[((num_latency - 1) * (_p)) / 1000] / 1000)
+
+/** Send packets to the server, and track how long each one takes.
+ *
+ */
+static void client_run(TALLOC_CTX *ctx)
+{
+	int			sockfd, i, id;
+	int			num_sent, num_received, num_lost, num_latency, num_outstanding;
+	fr_time_t		start, end, *latency;
+	fr_skew_packet_t	packets[256];
+	struct sockaddr_storage	dst;
+	socklen_t		dstlen;
+	struct timeval		tv;
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd < 0) {
+		fprintf(stderr, "radius_skew_test: Failed creating client socket: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if (fr_ipaddr_to_sockaddr(&my_ipaddr, my_port, &dst, &dstlen) < 0) {
+		fprintf(stderr, "radius_skew_test: Failed converting address: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	if (connect(sockfd, (struct sockaddr *) &dst, dstlen) < 0) {
+		fprintf(stderr, "radius_skew_test: Failed connecting client socket: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	/*
+	 *	Don't wait forever for lost packets.
+	 */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	(void) setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	latency = talloc_array(ctx, fr_time_t, num_packets);
+	rad_assert(latency != NULL);
+
+	memset(packets, 0, sizeof(packets));
+
+	num_sent = num_received = num_lost = num_latency = num_outstanding = 0;
+	id = 0;
+
+	start = fr_time();
+
+	while ((num_sent < num_packets) || (num_outstanding > 0)) {
+		uint8_t		buffer[4096];
+		ssize_t		data_size;
+		fr_time_t	now;
+
+		/*
+		 *	Fill the window.
+		 */
+		while ((num_sent < num_packets) && (num_outstanding < window)) {
+			while (packets[id].in_use) id = (id + 1) & 0xff;
+
+			memset(buffer, 0, 20);
+			buffer[0] = PW_CODE_ACCESS_REQUEST;
+			buffer[1] = id;
+			buffer[2] = 0;
+			buffer[3] = 20;
+			buffer[4] = ((num_sent % skew) == 0) ? WORK_SLOW : WORK_FAST;
+			memcpy(buffer + 5, &num_sent, sizeof(num_sent));
+
+			packets[id].in_use = true;
+			packets[id].sent = fr_time();
+
+			if (send(sockfd, buffer, 20, 0) < 0) {
+				fprintf(stderr, "radius_skew_test: Failed sending packet: %s\n", strerror(errno));
+				exit(1);
+			}
+
+			MPRINT1("Client sent %d with ID %d\n", num_sent, id);
+
+			num_sent++;
+			num_outstanding++;
+			id = (id + 1) & 0xff;
+		}
+
+		data_size = recv(sockfd, buffer, sizeof(buffer), 0);
+		if (data_size < 0) {
+			if ((errno == EINTR)) continue;
+
+			/*
+			 *	Timeout: everything outstanding is lost.
+			 */
+			for (i = 0; i < 256; i++) {
+				if (!packets[i].in_use) continue;
+
+				packets[i].in_use = false;
+				num_lost++;
+				num_outstanding--;
+			}
+			continue;
+		}
+
+		now = fr_time();
+
+		if ((data_size < 20) || !packets[buffer[1]].in_use) continue;
+
+		MPRINT1("Client received reply for ID %d\n", buffer[1]);
+
+		latency[num_latency++] = now - packets[buffer[1]].sent;
+		packets[buffer[1]].in_use = false;
+		num_received++;
+		num_outstanding--;
+	}
+
+	end = fr_time();
+
+	close(sockfd);
+
+	printf("packets sent %d, received %d, lost %d\n", num_sent, num_received, num_lost);
+	printf("one in %d packets takes %dus (blocking), others take %dus (cpu)\n", skew, slow_usec, fast_usec);
+
+	if (!num_latency) return;
+
+	qsort(latency, num_latency, sizeof(latency[0]), fr_time_cmp);
+
+	printf("elapsed %.3fs, %.0f packets/s\n", ((double) (end - start)) / NANOSEC,
+	       ((double) num_received * NANOSEC) / (end - start));
+	printf("latency (us) p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64 "\n",
+	       PERCENTILE(500), PERCENTILE(900), PERCENTILE(990), PERCENTILE(999),
+	       latency[num_latency - 1] / 1000);
+
+	talloc_free(latency);
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: radius_skew_test [OPTS]\n");
+	fprintf(stderr, "  -c <count>             Send count packets.  Default is 10000.\n");
+	fprintf(stderr, "  -f <usec>              CPU time spent on fast packets.  Default is 50.\n");
+	fprintf(stderr, "  -i <address>[:port]    Set IP address and optional port.\n");
+	fprintf(stderr, "  -k <num>               One in num packets is slow.  Default is 100.\n");
+	fprintf(stderr, "  -l <usec>              Time slow packets block for.  Default is 20000.\n");
+	fprintf(stderr, "  -s <secret>            Set shared secret.\n");
+	fprintf(stderr, "  -W <num>               Keep num packets outstanding.  Default is 64.\n");
+	fprintf(stderr, "  -w <num>               Start num worker threads.  Default is 4.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int num_workers = 4;
+	uint16_t	port16 = 0;
+	int sockfd;
+	TALLOC_CTX	*autofree = talloc_init("main");
+	fr_schedule_t	*sched;
+
+	fr_time_start();
+
+	fr_log_init(&default_log, false);
+
+	memset(&my_ipaddr, 0, sizeof(my_ipaddr));
+	my_ipaddr.af = AF_INET;
+	my_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+	my_port = 1812;
+
+	while ((c = getopt(argc, argv, "c:f:hi:k:l:s:W:w:x")) != EOF) switch (c) {
+		case 'c':
+			num_packets = atoi(optarg);
+			if (num_packets <= 0) usage();
+			break;
+
+		case 'f':
+			fast_usec = atoi(optarg);
+			if (fast_usec < 0) usage();
+			break;
+
+		case 'i':
+			if (fr_inet_pton_port(&my_ipaddr, &port16, optarg, -1, AF_INET, true, false) < 0) {
+				fprintf(stderr, "Failed parsing ipaddr: %s\n", fr_strerror());
+				exit(1);
+			}
+			my_port = port16;
+			break;
+
+		case 'k':
+			skew = atoi(optarg);
+			if (skew <= 0) usage();
+			break;
+
+		case 'l':
+			slow_usec = atoi(optarg);
+			if (slow_usec < 0) usage();
+			break;
+
+		case 's':
+			secret = optarg;
+			break;
+
+		case 'W':
+			window = atoi(optarg);
+			if ((window <= 0) || (window > 255)) usage();
+			break;
+
+		case 'w':
+			num_workers = atoi(optarg);
+			if ((num_workers <= 0) || (num_workers > 1024)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	sched = fr_schedule_create(autofree, &default_log, 1, num_workers, 1, &transports, NULL, NULL);
+	if (!sched) {
+		fprintf(stderr, "radius_skew_test: Failed to create scheduler\n");
+		exit(1);
+	}
+
+	sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
+	if (sockfd < 0) {
+		fprintf(stderr, "radius_skew_test: Failed creating socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
+		fprintf(stderr, "radius_skew_test: Failed binding to socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	(void) fr_schedule_socket_add(sched, sockfd, &sockfd, &transport);
+
+	client_run(autofree);
+
+	(void) fr_schedule_destroy(sched);
+
+	talloc_free(autofree);
+
+	return 0;
+}
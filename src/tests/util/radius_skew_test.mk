@@ -0,0 +1,7 @@
+TARGET := radius_skew_test
+
+SOURCES		:= radius_skew_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
@@ -0,0 +1,262 @@
+/*
+ * radius_verify_test.c	Benchmark for verifying the authenticators of RADIUS packets.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_packets = 1024;
+static int		num_loops = 100;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: radius_verify_test [OPTS]\n");
+	fprintf(stderr, "  -l <num>               Number of times to verify the packets.  Default is 100.\n");
+	fprintf(stderr, "  -n <num>               Number of packets to verify.  Default is 1024.\n");
+	fprintf(stderr, "  -P                     Don't precompute the shared secret state.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Add an attribute to the packet being built.
+ */
+static uint8_t *add_attr(uint8_t *p, uint8_t type, void const *value, size_t len)
+{
+	p[0] = type;
+	p[1] = len + 2;
+	memcpy(p + 2, value, len);
+
+	return p + 2 + len;
+}
+
+/*
+ *	Build a signed Accounting-Request.  The Class attribute
+ *	varies in length, so that packets need different numbers
+ *	of MD5 blocks.
+ */
+static RADIUS_PACKET *packet_alloc(TALLOC_CTX *ctx, int id, char const *secret, fr_radius_secret_t const *prepared)
+{
+	RADIUS_PACKET	*packet;
+	uint8_t		data[512], *p, *ma;
+	uint8_t		class[64];
+	char		buffer[32];
+	uint32_t	status = htonl(1);
+	uint32_t	nas = htonl(0xc0000201);
+	FR_MD5_CTX	context;
+
+	memset(data, 0, sizeof(data));
+	data[0] = PW_CODE_ACCOUNTING_REQUEST;
+	data[1] = id & 0xff;
+
+	p = data + RADIUS_HDR_LEN;
+	snprintf(buffer, sizeof(buffer), "user-%d", id);
+	p = add_attr(p, PW_USER_NAME, buffer, strlen(buffer));
+	snprintf(buffer, sizeof(buffer), "%016x", id);
+	p = add_attr(p, PW_ACCT_SESSION_ID, buffer, strlen(buffer));
+	p = add_attr(p, PW_ACCT_STATUS_TYPE, &status, sizeof(status));
+	p = add_attr(p, PW_NAS_IP_ADDRESS, &nas, sizeof(nas));
+	memset(class, id, sizeof(class));
+	p = add_attr(p, PW_CLASS, class, 1 + ((id * 7) % (sizeof(class) - 1)));
+
+	ma = p + 2;
+	p = add_attr(p, PW_MESSAGE_AUTHENTICATOR, class, AUTH_VECTOR_LEN);
+	memset(ma, 0, AUTH_VECTOR_LEN);
+
+	data[2] = ((p - data) >> 8) & 0xff;
+	data[3] = (p - data) & 0xff;
+
+	fr_radius_hmac_md5(ma, data, p - data, secret, prepared);
+
+	fr_md5_init(&context);
+	fr_md5_update(&context, data, p - data);
+	fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
+	fr_md5_final(data + 4, &context);
+
+	packet = fr_radius_alloc(ctx, false);
+	rad_assert(packet != NULL);
+
+	packet->code = data[0];
+	packet->id = data[1];
+	packet->data_len = p - data;
+	packet->data = talloc_memdup(packet, data, packet->data_len);
+	memcpy(packet->vector, data + 4, sizeof(packet->vector));
+
+	return packet;
+}
+
+/*
+ *	Verify the packets one at a time.
+ */
+static void run_test_single(RADIUS_PACKET **packets, char const **secrets, fr_radius_secret_t const **prepared)
+{
+	int		i, j, rcode;
+	fr_time_t	start, end;
+
+	start = fr_time();
+
+	for (i = 0; i < num_loops; i++) {
+		for (j = 0; j < num_packets; j++) {
+			if (prepared[j]) {
+				rcode = fr_radius_verify_prepared(packets[j], NULL, prepared[j]);
+			} else {
+				rcode = fr_radius_verify(packets[j], NULL, secrets[j]);
+			}
+
+			if (rcode < 0) {
+				fr_perror("radius_verify_test");
+				exit(1);
+			}
+		}
+	}
+
+	end = fr_time();
+
+	printf("fr_radius_verify: %.0f packets/s\n",
+	       ((double) num_loops * num_packets * NANOSEC) / (end - start));
+}
+
+/*
+ *	Verify the packets in one batch.
+ */
+static void run_test_batch(RADIUS_PACKET **packets, char const **secrets, fr_radius_secret_t const **prepared,
+			   int *rcodes, fr_md5_mb_engine_t engine)
+{
+	int		i;
+	fr_time_t	start, end;
+
+	if (fr_md5_mb_engine_set(engine) < 0) {
+		MPRINT1("Skipping engine %i: %s\n", engine, fr_strerror());
+		return;
+	}
+
+	start = fr_time();
+
+	for (i = 0; i < num_loops; i++) {
+		if (fr_radius_verify_batch(packets, NULL, secrets, prepared, rcodes, num_packets) != 0) {
+			fr_perror("radius_verify_test");
+			exit(1);
+		}
+	}
+
+	end = fr_time();
+
+	printf("fr_radius_verify_batch (%s): %.0f packets/s\n", fr_md5_mb_engine_name(),
+	       ((double) num_loops * num_packets * NANOSEC) / (end - start));
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	bool			precompute = true;
+	TALLOC_CTX		*ctx;
+	char const		*secret = "testing123";
+	fr_radius_secret_t	*secret_prepared = NULL;
+	char const		**secrets;
+	fr_radius_secret_t const **prepared;
+	RADIUS_PACKET		**packets;
+	int			*rcodes;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "hl:n:Px")) != EOF) switch (c) {
+		case 'l':
+			num_loops = atoi(optarg);
+			if (num_loops <= 0) usage();
+			break;
+
+		case 'n':
+			num_packets = atoi(optarg);
+			if (num_packets <= 0) usage();
+			break;
+
+		case 'P':
+			precompute = false;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	ctx = talloc_init("radius_verify_test");
+	rad_assert(ctx != NULL);
+
+	if (precompute) {
+		secret_prepared = fr_radius_secret_alloc(ctx, secret);
+		rad_assert(secret_prepared != NULL);
+	}
+
+	packets = talloc_array(ctx, RADIUS_PACKET *, num_packets);
+	secrets = talloc_array(ctx, char const *, num_packets);
+	prepared = talloc_array(ctx, fr_radius_secret_t const *, num_packets);
+	rcodes = talloc_array(ctx, int, num_packets);
+	rad_assert(packets && secrets && prepared && rcodes);
+
+	for (i = 0; i < num_packets; i++) {
+		packets[i] = packet_alloc(ctx, i, secret, secret_prepared);
+		secrets[i] = secret;
+		prepared[i] = secret_prepared;
+		MPRINT1("Packet %i is %zu bytes\n", i, packets[i]->data_len);
+	}
+
+	/*
+	 *	The batch must agree with fr_radius_verify(),
+	 *	including for bad packets.
+	 */
+	packets[0]->data[RADIUS_HDR_LEN + 2] ^= 0xff;
+	if ((fr_radius_verify_batch(packets, NULL, secrets, prepared, rcodes, num_packets) != 1) || (rcodes[0] != -1)) {
+		fprintf(stderr, "radius_verify_test: Batch failed to detect a modified packet\n");
+		exit(1);
+	}
+	MPRINT1("Modified packet: %s\n", fr_strerror());
+	packets[0]->data[RADIUS_HDR_LEN + 2] ^= 0xff;
+
+	run_test_single(packets, secrets, prepared);
+	run_test_batch(packets, secrets, prepared, rcodes, FR_MD5_MB_SCALAR);
+	run_test_batch(packets, secrets, prepared, rcodes, FR_MD5_MB_VEC4);
+	run_test_batch(packets, secrets, prepared, rcodes, FR_MD5_MB_AVX2);
+
+	talloc_free(ctx);
+
+	return 0;
+}
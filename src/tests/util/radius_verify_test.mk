@@ -0,0 +1,6 @@
+TARGET := radius_verify_test
+
+SOURCES		:= radius_verify_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
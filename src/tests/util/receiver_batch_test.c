@@ -0,0 +1,360 @@
+/*
+ * receiver_batch_test.c	Benchmark for reading packets in the network thread.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/schedule.h>
+#include <freeradius-devel/inet.h>
+#include <freeradius-devel/radius.h>
+#include <freeradius-devel/udp.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define MAX_BLASTERS (64)
+
+typedef struct fr_packet_ctx_t {
+	uint8_t		id;
+
+	struct sockaddr_storage src;
+	socklen_t	salen;
+} fr_packet_ctx_t;
+
+static int		debug_lvl = 0;
+static fr_ipaddr_t	my_ipaddr;
+static int		my_port;
+
+/*
+ *	Only the network thread writes these.
+ */
+static uint64_t		num_packets_read = 0;
+static uint64_t		num_reads = 0;
+
+static bool		blasting = true;
+static uint64_t		num_sent[MAX_BLASTERS];
+
+static ssize_t test_read(int sockfd, UNUSED void *ctx, void **packet_ctx, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t data_size;
+	fr_packet_ctx_t *pc;
+
+	num_reads++;
+
+	pc = talloc_zero(NULL, fr_packet_ctx_t);
+	if (!pc) return -1;
+
+	pc->salen = sizeof(pc->src);
+
+	data_size = recvfrom(sockfd, buffer, buffer_len, 0, (struct sockaddr *) &pc->src, &pc->salen);
+	if (data_size < 20) {
+		talloc_free(pc);
+		return 0;
+	}
+
+	pc->id = buffer[1];
+	num_packets_read++;
+
+	*packet_ctx = pc;
+	return data_size;
+}
+
+static int test_read_batch(int sockfd, UNUSED void *ctx, void **packet_ctx, size_t *data_size,
+			   uint8_t *buffer, size_t slot_size, int num)
+{
+	int i, received;
+	struct sockaddr_storage src[UDP_MAX_BATCH];
+	socklen_t salen[UDP_MAX_BATCH];
+
+	num_reads++;
+
+	if (num > UDP_MAX_BATCH) num = UDP_MAX_BATCH;
+
+	received = udp_recv_batch(sockfd, buffer, slot_size, num, data_size, src, salen);
+	if (received <= 0) return received;
+
+	for (i = 0; i < received; i++) {
+		fr_packet_ctx_t *pc;
+
+		packet_ctx[i] = NULL;
+
+		if (data_size[i] < 20) {
+			data_size[i] = 0;
+			continue;
+		}
+
+		pc = talloc_zero(NULL, fr_packet_ctx_t);
+		if (!pc) {
+			data_size[i] = 0;
+			continue;
+		}
+
+		memcpy(&pc->src, &src[i], salen[i]);
+		pc->salen = salen[i];
+		pc->id = buffer[(i * slot_size) + 1];
+
+		packet_ctx[i] = pc;
+		num_packets_read++;
+	}
+
+	return received;
+}
+
+/*
+ *	We're only measuring the read side, so replies aren't sent.
+ */
+static ssize_t test_write(void *packet_ctx, UNUSED uint8_t *buffer, UNUSED size_t buffer_len)
+{
+	talloc_free(packet_ctx);
+	return 0;
+}
+
+static int test_decode(void const *packet_ctx, UNUSED uint8_t *const data, UNUSED size_t data_len, REQUEST *request)
+{
+	fr_packet_ctx_t const *pc = packet_ctx;
+
+	request->number = pc->id;
+
+	return 0;
+}
+
+static ssize_t test_encode(UNUSED void const *packet_ctx, UNUSED REQUEST *request, UNUSED uint8_t *buffer, UNUSED size_t buffer_len)
+{
+	return 0;
+}
+
+static size_t test_nak(UNUSED void const *packet_ctx, UNUSED uint8_t *const packet, UNUSED size_t packet_len,
+		       UNUSED uint8_t *reply, UNUSED size_t reply_len)
+{
+	return 0;
+}
+
+static fr_transport_final_t test_process(UNUSED REQUEST *request, UNUSED fr_transport_action_t action)
+{
+	return FR_TRANSPORT_REPLY;
+}
+
+static fr_transport_t transport = {
+	.name = "receiver-batch-test",
+	.id = 0,
+	.read = test_read,
+	.read_batch = test_read_batch,
+	.write = test_write,
+	.decode = test_decode,
+	.encode = test_encode,
+	.nak = test_nak,
+	.process = test_process,
+};
+
+static fr_transport_t *transports = &transport;
+
+/** Send packets as fast as we can
+ *
+ */
+static void *blaster(void *arg)
+{
+	int			sockfd;
+	uint8_t			id = 0;
+	uint64_t		*sent = arg;
+	uint8_t			packet[20];
+	struct sockaddr_storage	dst;
+	socklen_t		dstlen;
+
+	sockfd = socket(my_ipaddr.af, SOCK_DGRAM, 0);
+	if (sockfd < 0) {
+		fprintf(stderr, "receiver_batch_test: Failed creating client socket: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if ((fr_ipaddr_to_sockaddr(&my_ipaddr, my_port, &dst, &dstlen) < 0) ||
+	    (connect(sockfd, (struct sockaddr *) &dst, dstlen) < 0)) {
+		fprintf(stderr, "receiver_batch_test: Failed connecting client socket: %s\n", strerror(errno));
+		close(sockfd);
+		return NULL;
+	}
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = PW_CODE_ACCOUNTING_REQUEST;
+	packet[3] = sizeof(packet);
+
+	while (blasting) {
+		packet[1] = id++;
+
+		if (send(sockfd, packet, sizeof(packet), 0) < 0) {
+			if ((errno == ENOBUFS) || (errno == EAGAIN) || (errno == ECONNREFUSED)) continue;
+			break;
+		}
+
+		(*sent)++;
+	}
+
+	close(sockfd);
+	return NULL;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: receiver_batch_test [OPTS]\n");
+	fprintf(stderr, "  -b <num>               Number of blaster threads.  Default is 1.\n");
+	fprintf(stderr, "  -i <address>[:port]    Set IP address and optional port.\n");
+	fprintf(stderr, "  -r                     Read one packet at a time, instead of batching.\n");
+	fprintf(stderr, "  -t <seconds>           Run for this long.  Default is 5.\n");
+	fprintf(stderr, "  -w <num>               Start num worker threads.  Default is 2.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c, i;
+	int		num_workers = 2;
+	int		num_blasters = 1;
+	int		seconds = 5;
+	uint16_t	port16 = 0;
+	int		sockfd;
+	uint64_t	packets_start, reads_start, packets, reads, sent;
+	fr_time_t	start, end;
+	TALLOC_CTX	*autofree = talloc_init("main");
+	fr_schedule_t	*sched;
+	pthread_attr_t	attr;
+	pthread_t	blaster_id[MAX_BLASTERS];
+
+	fr_time_start();
+
+	fr_log_init(&default_log, false);
+
+	memset(&my_ipaddr, 0, sizeof(my_ipaddr));
+	my_ipaddr.af = AF_INET;
+	my_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+	my_port = 1813;
+
+	while ((c = getopt(argc, argv, "b:hi:rt:w:x")) != EOF) switch (c) {
+		case 'b':
+			num_blasters = atoi(optarg);
+			if ((num_blasters <= 0) || (num_blasters > MAX_BLASTERS)) usage();
+			break;
+
+		case 'i':
+			if (fr_inet_pton_port(&my_ipaddr, &port16, optarg, -1, AF_INET, true, false) < 0) {
+				fprintf(stderr, "Failed parsing ipaddr: %s\n", fr_strerror());
+				exit(1);
+			}
+			my_port = port16;
+			break;
+
+		case 'r':
+			transport.read_batch = NULL;
+			break;
+
+		case 't':
+			seconds = atoi(optarg);
+			if (seconds <= 0) usage();
+			break;
+
+		case 'w':
+			num_workers = atoi(optarg);
+			if ((num_workers <= 0) || (num_workers > 1024)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	sched = fr_schedule_create(autofree, &default_log, 1, num_workers, 1, &transports, NULL, NULL);
+	if (!sched) {
+		fprintf(stderr, "receiver_batch_test: Failed to create scheduler\n");
+		exit(1);
+	}
+
+	sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
+	if (sockfd < 0) {
+		fprintf(stderr, "receiver_batch_test: Failed creating socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
+		fprintf(stderr, "receiver_batch_test: Failed binding to socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	(void) fr_schedule_socket_add(sched, sockfd, &sockfd, &transport);
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	for (i = 0; i < num_blasters; i++) {
+		(void) pthread_create(&blaster_id[i], &attr, blaster, &num_sent[i]);
+	}
+
+	/*
+	 *	Let things settle down before measuring.
+	 */
+	sleep(1);
+
+	packets_start = num_packets_read;
+	reads_start = num_reads;
+	start = fr_time();
+
+	sleep(seconds);
+
+	packets = num_packets_read - packets_start;
+	reads = num_reads - reads_start;
+	end = fr_time();
+
+	blasting = false;
+	sent = 0;
+	for (i = 0; i < num_blasters; i++) {
+		(void) pthread_join(blaster_id[i], NULL);
+		sent += num_sent[i];
+	}
+
+	MPRINT1("Blasters sent %" PRIu64 " packets\n", sent);
+
+	printf("%s reads: %" PRIu64 " packets in %" PRIu64 " reads (%.2f packets/read)\n",
+	       transport.read_batch ? "batched" : "single",
+	       packets, reads, reads ? ((double) packets) / reads : 0.0);
+	printf("%.0f packets/s per network thread\n", ((double) packets * NANOSEC) / (end - start));
+
+	(void) fr_schedule_destroy(sched);
+
+	talloc_free(autofree);
+
+	return 0;
+}
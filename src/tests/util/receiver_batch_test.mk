@@ -0,0 +1,7 @@
+TARGET := receiver_batch_test
+
+SOURCES		:= receiver_batch_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
@@ -29,7 +29,6 @@ RCSID("$Id$")
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/rad_assert.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -0,0 +1,296 @@
+/*
+ * sql_stmt_sqlite_test.c	Benchmark for running rlm_sql queries as prepared statements with SQLite.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "../../modules/rlm_sql/rlm_sql.h"
+
+#include <sqlite3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_users = 10000;
+static int		num_loops = 200000;
+
+/*
+ *	authorize_check_query from mods-config/sql/main/sqlite/queries.conf
+ */
+static char const *check_query = "SELECT id, username, attribute, value, op FROM radcheck "
+				 "WHERE username = '%{SQL-User-Name}' ORDER BY id";
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: sql_stmt_sqlite_test [OPTS]\n");
+	fprintf(stderr, "  -l <num>               Number of lookups.  Default is 200000.\n");
+	fprintf(stderr, "  -n <num>               Number of users in radcheck.  Default is 10000.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Only called when a statement fails to run, which it never does
+ *	here.  The real one is in sql.c.
+ */
+void rlm_sql_print_error(UNUSED rlm_sql_t const *inst, UNUSED REQUEST *request, UNUSED rlm_sql_handle_t *handle,
+			 UNUSED bool force_debug)
+{
+}
+
+/*
+ *	sql_stmt_compile() only checks that these exist.  The
+ *	benchmark calls SQLite itself, as the driver does.
+ */
+static sql_rcode_t stmt_prepare(UNUSED void **out, UNUSED rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				UNUSED rlm_sql_stmt_t const *stmt)
+{
+	return RLM_SQL_ERROR;
+}
+
+static sql_rcode_t stmt_execute(UNUSED rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				UNUSED void *prepared, UNUSED rlm_sql_stmt_t const *stmt,
+				UNUSED char const * const *values)
+{
+	return RLM_SQL_ERROR;
+}
+
+static void NEVER_RETURNS sqlite_error(sqlite3 *db)
+{
+	fprintf(stderr, "sql_stmt_sqlite_test: %s\n", sqlite3_errmsg(db));
+	exit(1);
+}
+
+/*
+ *	Create radcheck, with one password for each user.
+ */
+static sqlite3 *db_create(void)
+{
+	sqlite3		*db;
+	sqlite3_stmt	*insert;
+	char		buffer[64];
+	int		i;
+
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK) sqlite_error(db);
+
+	if (sqlite3_exec(db, "CREATE TABLE radcheck ("
+			 "id INTEGER PRIMARY KEY, "
+			 "username varchar(64) NOT NULL default '', "
+			 "attribute varchar(64) NOT NULL default '', "
+			 "op char(2) NOT NULL DEFAULT '==', "
+			 "value varchar(253) NOT NULL default ''); "
+			 "CREATE INDEX check_username ON radcheck(username); "
+			 "BEGIN", NULL, NULL, NULL) != SQLITE_OK) sqlite_error(db);
+
+	if (sqlite3_prepare_v2(db, "INSERT INTO radcheck (username, attribute, op, value) "
+			       "VALUES (?, 'Cleartext-Password', ':=', ?)", -1, &insert, NULL) != SQLITE_OK) {
+		sqlite_error(db);
+	}
+
+	for (i = 0; i < num_users; i++) {
+		snprintf(buffer, sizeof(buffer), "user%i", i);
+		sqlite3_bind_text(insert, 1, buffer, -1, SQLITE_TRANSIENT);
+		snprintf(buffer, sizeof(buffer), "password%i", i);
+		sqlite3_bind_text(insert, 2, buffer, -1, SQLITE_TRANSIENT);
+
+		if (sqlite3_step(insert) != SQLITE_DONE) sqlite_error(db);
+		sqlite3_reset(insert);
+	}
+	sqlite3_finalize(insert);
+
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) sqlite_error(db);
+
+	return db;
+}
+
+/*
+ *	Read all the rows, as rlm_sql does.
+ */
+static int fetch_rows(sqlite3 *db, sqlite3_stmt *statement)
+{
+	int status, i, rows = 0;
+
+	while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
+		for (i = 0; i < sqlite3_column_count(statement); i++) (void) sqlite3_column_text(statement, i);
+		rows++;
+	}
+	if (status != SQLITE_DONE) sqlite_error(db);
+
+	return rows;
+}
+
+/*
+ *	Expand the query, and have SQLite parse it for every lookup.
+ *	This is what happens without prepare_statements.
+ */
+static int run_test_expanded(sqlite3 *db)
+{
+	int		i, rows = 0;
+	fr_time_t	start, end;
+	sqlite3_stmt	*statement;
+	char		query[512];
+	char const	*p;
+	size_t		len;
+
+	/*
+	 *	The user names don't need escaping.
+	 */
+	p = strstr(check_query, "%{SQL-User-Name}");
+	rad_assert(p != NULL);
+	len = p - check_query;
+
+	start = fr_time();
+
+	for (i = 0; i < num_loops; i++) {
+		snprintf(query, sizeof(query), "%.*suser%i%s", (int) len, check_query, (i * 7919) % num_users,
+			 p + strlen("%{SQL-User-Name}"));
+
+		if (sqlite3_prepare_v2(db, query, -1, &statement, NULL) != SQLITE_OK) sqlite_error(db);
+		rows += fetch_rows(db, statement);
+		sqlite3_finalize(statement);
+	}
+
+	end = fr_time();
+
+	printf("expanded: %.0f queries/s\n", ((double) num_loops * NANOSEC) / (end - start));
+
+	return rows;
+}
+
+/*
+ *	Prepare the compiled statement once, and bind the user name
+ *	for every lookup, as the driver does.
+ */
+static int run_test_prepared(sqlite3 *db, rlm_sql_stmt_t const *stmt)
+{
+	int		i, rows = 0;
+	fr_time_t	start, end;
+	sqlite3_stmt	*statement;
+	char		buffer[64];
+
+	rad_assert(stmt->num_params == 1);
+
+	start = fr_time();
+
+	if (sqlite3_prepare_v2(db, stmt->query, -1, &statement, NULL) != SQLITE_OK) sqlite_error(db);
+
+	for (i = 0; i < num_loops; i++) {
+		snprintf(buffer, sizeof(buffer), "user%i", (i * 7919) % num_users);
+
+		if (sqlite3_bind_text(statement, 1, buffer, -1, SQLITE_TRANSIENT) != SQLITE_OK) sqlite_error(db);
+		rows += fetch_rows(db, statement);
+		sqlite3_reset(statement);
+	}
+
+	sqlite3_finalize(statement);
+
+	end = fr_time();
+
+	printf("prepared: %.0f queries/s\n", ((double) num_loops * NANOSEC) / (end - start));
+
+	return rows;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, expanded, prepared;
+	rlm_sql_t		*inst;
+	rlm_sql_config_t	config;
+	rlm_sql_driver_t	driver;
+	rlm_sql_stmt_t		*stmt;
+	sqlite3			*db;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "hl:n:x")) != EOF) switch (c) {
+		case 'l':
+			num_loops = atoi(optarg);
+			if (num_loops <= 0) usage();
+			break;
+
+		case 'n':
+			num_users = atoi(optarg);
+			if (num_users <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.prepare_statements = true;
+
+	memset(&driver, 0, sizeof(driver));
+	driver.name = "sql_stmt_sqlite_test";
+	driver.sql_stmt_prepare = stmt_prepare;
+	driver.sql_stmt_execute = stmt_execute;
+
+	inst = talloc_zero(NULL, rlm_sql_t);
+	rad_assert(inst != NULL);
+	inst->config = &config;
+	inst->driver = &driver;
+	inst->name = "sql_stmt_sqlite_test";
+
+	stmt = sql_stmt_compile(inst, "authorize_check_query", check_query);
+	if (!stmt) {
+		fprintf(stderr, "sql_stmt_sqlite_test: Failed compiling authorize_check_query\n");
+		return 1;
+	}
+	MPRINT1("Compiled to: %s\n", stmt->query);
+
+	db = db_create();
+	MPRINT1("Created %i users\n", num_users);
+
+	expanded = run_test_expanded(db);
+	prepared = run_test_prepared(db, stmt);
+
+	/*
+	 *	Both should have found the same rows.
+	 */
+	if (expanded != prepared) {
+		fprintf(stderr, "sql_stmt_sqlite_test: Expanded queries found %i rows, prepared statement found %i\n",
+			expanded, prepared);
+		return 1;
+	}
+	MPRINT1("Found %i rows\n", prepared);
+
+	sqlite3_close(db);
+	talloc_free(inst);
+
+	return 0;
+}
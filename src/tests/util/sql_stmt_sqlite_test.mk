@@ -0,0 +1,6 @@
+TARGET := sql_stmt_sqlite_test
+
+SOURCES		:= sql_stmt_sqlite_test.c ../../modules/rlm_sql/stmt.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS) -lsqlite3
@@ -0,0 +1,291 @@
+/*
+ * sql_stmt_test.c	Check that rlm_sql query templates compile into the right statements.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/rad_assert.h>
+
+#include "../../modules/rlm_sql/rlm_sql.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#define MAX_PARAMS	(4)
+
+static int		debug_lvl = 0;
+
+/*
+ *	Templates, and what they should compile into.  A NULL query
+ *	means the template can't be compiled.
+ */
+static struct {
+	char const	*in;
+	char const	*query;
+	char const	*param[MAX_PARAMS];
+} templates[] = {
+	/*
+	 *	The default authorize_check_query.
+	 */
+	{ "SELECT id, username, attribute, value, op FROM radcheck WHERE username = '%{SQL-User-Name}' ORDER BY id",
+	  "SELECT id, username, attribute, value, op FROM radcheck WHERE username = $1 ORDER BY id",
+	  { "%{SQL-User-Name}" } },
+
+	/*
+	 *	Constant strings stay in the query, with doubled
+	 *	quotes left alone.
+	 */
+	{ "SELECT groupname FROM radusergroup WHERE username = '%{SQL-User-Name}' AND x = 'it''s' ORDER BY priority",
+	  "SELECT groupname FROM radusergroup WHERE username = $1 AND x = 'it''s' ORDER BY priority",
+	  { "%{SQL-User-Name}" } },
+
+	/*
+	 *	Quotes inside an expansion belong to the expansion,
+	 *	and doubled quotes in a parameter are undone.
+	 */
+	{ "SELECT a FROM t WHERE u = '%{%{Foo}:-'bar'}' AND v='%{Bar}''x'",
+	  "SELECT a FROM t WHERE u = $1 AND v=$2",
+	  { "%{%{Foo}:-'bar'}", "%{Bar}'x" } },
+
+	/*
+	 *	Identifiers and casts are fine.
+	 */
+	{ "SELECT a FROM \"t\" WHERE u = '%{Foo}'::inet",
+	  "SELECT a FROM \"t\" WHERE u = $1::inet",
+	  { "%{Foo}" } },
+
+	/*
+	 *	Nothing to bind.
+	 */
+	{ "SELECT a FROM t WHERE u = 'bar'",
+	  "SELECT a FROM t WHERE u = 'bar'",
+	  { NULL } },
+
+	{ "SELECT a FROM t WHERE u = %{Foo}", NULL, { NULL } },
+	{ "SELECT a FROM t WHERE u = E'%{Foo}'", NULL, { NULL } },
+	{ "SELECT a FROM \"t%{Foo}\"", NULL, { NULL } },
+	{ "SELECT a FROM t WHERE u = 'a\\b%{Foo}'", NULL, { NULL } },
+	{ "SELECT a FROM t WHERE u = '%{Foo'", NULL, { NULL } },
+	{ "SELECT 'unterminated", NULL, { NULL } },
+};
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: sql_stmt_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Only called when a statement fails to run, which it never does
+ *	here.  The real one is in sql.c.
+ */
+void rlm_sql_print_error(UNUSED rlm_sql_t const *inst, UNUSED REQUEST *request, UNUSED rlm_sql_handle_t *handle,
+			 UNUSED bool force_debug)
+{
+}
+
+static sql_rcode_t stmt_prepare(UNUSED void **out, UNUSED rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				UNUSED rlm_sql_stmt_t const *stmt)
+{
+	return RLM_SQL_ERROR;
+}
+
+static sql_rcode_t stmt_execute(UNUSED rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				UNUSED void *prepared, UNUSED rlm_sql_stmt_t const *stmt,
+				UNUSED char const * const *values)
+{
+	return RLM_SQL_ERROR;
+}
+
+static sql_rcode_t query_submit(UNUSED rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				UNUSED char const *query)
+{
+	return RLM_SQL_ERROR;
+}
+
+/*
+ *	Compile the templates, and compare the results.
+ */
+static int test_compile(rlm_sql_t *inst)
+{
+	size_t		i, num = sizeof(templates) / sizeof(templates[0]);
+	int		j, fails = 0, last_id = -1;
+	rlm_sql_stmt_t	*stmt;
+
+	for (i = 0; i < num; i++) {
+		stmt = sql_stmt_compile(inst, "test", templates[i].in);
+
+		if (!stmt) {
+			if (!templates[i].query) {
+				MPRINT1("%s -> not compiled\n", templates[i].in);
+				continue;
+			}
+
+			fprintf(stderr, "sql_stmt_test: Failed compiling \"%s\"\n", templates[i].in);
+			fails++;
+			continue;
+		}
+
+		MPRINT1("%s -> %s\n", templates[i].in, stmt->query);
+
+		if (!templates[i].query) {
+			fprintf(stderr, "sql_stmt_test: \"%s\" shouldn't compile, got \"%s\"\n",
+				templates[i].in, stmt->query);
+			fails++;
+			goto next;
+		}
+
+		if (strcmp(stmt->query, templates[i].query) != 0) {
+			fprintf(stderr, "sql_stmt_test: \"%s\" compiled to \"%s\", expected \"%s\"\n",
+				templates[i].in, stmt->query, templates[i].query);
+			fails++;
+		}
+
+		for (j = 0; (j < MAX_PARAMS) && templates[i].param[j]; j++);
+		if (stmt->num_params != j) {
+			fprintf(stderr, "sql_stmt_test: \"%s\" has %i parameters, expected %i\n",
+				templates[i].in, stmt->num_params, j);
+			fails++;
+			goto next;
+		}
+
+		for (j = 0; j < stmt->num_params; j++) {
+			if (strcmp(stmt->param[j], templates[i].param[j]) == 0) continue;
+
+			fprintf(stderr, "sql_stmt_test: \"%s\" has $%i = \"%s\", expected \"%s\"\n",
+				templates[i].in, j + 1, stmt->param[j], templates[i].param[j]);
+			fails++;
+		}
+
+		/*
+		 *	Ids index the statements cached by each
+		 *	connection, so they must all be different.
+		 */
+		if (stmt->id <= last_id) {
+			fprintf(stderr, "sql_stmt_test: \"%s\" has id %i, after id %i\n",
+				templates[i].in, stmt->id, last_id);
+			fails++;
+		}
+		last_id = stmt->id;
+
+	next:
+		talloc_free(stmt);
+	}
+
+	return fails;
+}
+
+/*
+ *	Nothing is compiled if it's turned off, or the driver can't run
+ *	it.
+ */
+static int test_disabled(rlm_sql_t *inst, rlm_sql_driver_t *driver)
+{
+	char const	*in = templates[0].in;
+	int		fails = 0;
+
+	inst->config->prepare_statements = false;
+	if (sql_stmt_compile(inst, "test", in) != NULL) {
+		fprintf(stderr, "sql_stmt_test: Compiled a template with prepare_statements = no\n");
+		fails++;
+	}
+	inst->config->prepare_statements = true;
+
+	if (sql_stmt_compile(inst, "test", NULL) != NULL) {
+		fprintf(stderr, "sql_stmt_test: Compiled a NULL template\n");
+		fails++;
+	}
+
+	/*
+	 *	Drivers which submit queries without blocking must
+	 *	be able to submit statements too.
+	 */
+	driver->sql_query_submit = query_submit;
+	if (sql_stmt_compile(inst, "test", in) != NULL) {
+		fprintf(stderr, "sql_stmt_test: Compiled a template for a driver without sql_stmt_submit\n");
+		fails++;
+	}
+	driver->sql_query_submit = NULL;
+
+	driver->sql_stmt_prepare = NULL;
+	if (sql_stmt_compile(inst, "test", in) != NULL) {
+		fprintf(stderr, "sql_stmt_test: Compiled a template for a driver without sql_stmt_prepare\n");
+		fails++;
+	}
+	driver->sql_stmt_prepare = stmt_prepare;
+
+	return fails;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, fails = 0;
+	rlm_sql_t		*inst;
+	rlm_sql_config_t	config;
+	rlm_sql_driver_t	driver;
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (debug_lvl > 1) rad_debug_lvl = L_DBG_LVL_2;
+
+	memset(&config, 0, sizeof(config));
+	config.prepare_statements = true;
+
+	memset(&driver, 0, sizeof(driver));
+	driver.name = "sql_stmt_test";
+	driver.sql_stmt_prepare = stmt_prepare;
+	driver.sql_stmt_execute = stmt_execute;
+
+	inst = talloc_zero(NULL, rlm_sql_t);
+	rad_assert(inst != NULL);
+	inst->config = &config;
+	inst->driver = &driver;
+	inst->name = "sql_stmt_test";
+
+	fails += test_compile(inst);
+	fails += test_disabled(inst, &driver);
+
+	talloc_free(inst);
+
+	if (fails) {
+		fprintf(stderr, "sql_stmt_test: %i checks failed\n", fails);
+		return 1;
+	}
+
+	return 0;
+}
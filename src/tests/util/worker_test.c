@@ -25,6 +25,8 @@ RCSID("$Id$")
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/worker.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/fr_log.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -33,11 +35,8 @@ RCSID("$Id$")
 #include <pthread.h>
 #include <signal.h>
 
-#include <sys/event.h>
-
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
-#define MAX_KEVENTS		(10)
 #define MAX_WORKERS		(1024)
 
 #define MPRINT1 if (debug_lvl) printf
@@ -51,7 +50,7 @@ typedef struct fr_schedule_worker_t {
 } fr_schedule_worker_t;
 
 static int		debug_lvl = 0;
-static int		kq_master;
+static fr_event_list_t	*el_master;
 static fr_atomic_queue_t *aq_master;
 static fr_control_t	*control_master;
 static int		max_messages = 10;
@@ -159,6 +158,14 @@ static void *worker_thread(void *arg)
 }
 
 
+/*
+ *	@todo this should NOT take a channel pointer
+ */
+static void master_user_event(UNUSED int kq, uintptr_t ident, UNUSED void *ctx)
+{
+	(void) fr_channel_service_user(workers[0].ch, control_master, ident);
+}
+
 static void master_process(void)
 {
 	bool running, signaled_close;
@@ -171,7 +178,6 @@ static void master_process(void)
 	fr_channel_event_t ce;
 	pthread_attr_t	attr;
 	fr_schedule_worker_t *sw;
-	struct kevent events[MAX_KEVENTS];
 
 	ctx = talloc_init("master");
 	if (!ctx) _exit(1);
@@ -321,13 +327,11 @@ check_close:
 		MPRINT1("Master waiting on events.\n");
 		rad_assert(num_messages <= max_messages);
 
-		num_events = kevent(kq_master, NULL, 0, events, MAX_KEVENTS, NULL);
-		MPRINT1("Master kevent returned %d\n", num_events);
+		num_events = fr_event_corral(el_master, true);
+		MPRINT1("Master corral returned %d\n", num_events);
 
 		if (num_events < 0) {
-			if (num_events == EINTR) continue;
-
-			fprintf(stderr, "Failed waiting for kevent: %s\n", strerror(errno));
+			fprintf(stderr, "Failed waiting for events: %s\n", fr_strerror());
 			exit(1);
 		}
 
@@ -335,12 +339,8 @@ check_close:
 
 		/*
 		 *	Service the events.
-		 *
-		 *	@todo this should NOT take a channel pointer
 		 */
-		for (i = 0; i < num_events; i++) {
-			(void) fr_channel_service_kevent(workers[0].ch, control_master, &events[i]);
-		}
+		fr_event_service(el_master);
 
 		now = fr_time();
 
@@ -514,15 +514,17 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	kq_master = kqueue();
-	rad_assert(kq_master >= 0);
+	el_master = fr_event_list_create(autofree, NULL, NULL);
+	rad_assert(el_master != NULL);
 
 	aq_master = fr_atomic_queue_create(autofree, max_control_plane);
 	rad_assert(aq_master != NULL);
 
-	control_master = fr_control_create(autofree, kq_master, aq_master);
+	control_master = fr_control_create(autofree, fr_event_list_kq(el_master), aq_master);
 	rad_assert(control_master != NULL);
 
+	(void) fr_event_user_insert(el_master, master_user_event, NULL);
+
 	signal(SIGTERM, sig_ignore);
 
 	if (debug_lvl) {
@@ -531,8 +533,6 @@ int main(int argc, char *argv[])
 
 	master_process();
 
-	close(kq_master);
-
 	talloc_free(autofree);
 
 	return 0;
@@ -0,0 +1,207 @@
+/*
+ * xlat_eval_test.c	Benchmark for runtime xlat expansions.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_loops = 100000;
+
+/*
+ *	Similar to the accounting queries in mods-config/sql/main/
+ */
+static char const *query = "INSERT INTO radacct "
+	"(acctsessionid, acctuniqueid, username, realm, nasipaddress, nasportid, "
+	"acctstarttime, callingstationid, calledstationid, framedipaddress) "
+	"VALUES ('%{Acct-Session-Id}', '%{Acct-Unique-Session-Id}', '%{User-Name}', "
+	"'%{%{Realm}:-}', '%{NAS-IP-Address}', '%{%{NAS-Port-ID}:-%{NAS-Port}}', "
+	"FROM_UNIXTIME(%{integer:Event-Timestamp}), '%{Calling-Station-Id}', "
+	"'%{Called-Station-Id}', '%{Framed-IP-Address}')";
+
+static char const *request_pairs[] = {
+	"User-Name", "bob",
+	"NAS-IP-Address", "192.0.2.1",
+	"NAS-Port", "17",
+	"Acct-Session-Id", "0123456789abcdef",
+	"Acct-Unique-Session-Id", "fedcba9876543210",
+	"Event-Timestamp", "1500000000",
+	"Calling-Station-Id", "00-11-22-33-44-55",
+	"Called-Station-Id", "66-77-88-99-aa-bb:example",
+	"Framed-IP-Address", "198.51.100.7",
+	NULL
+};
+
+/*
+ *	Like rlm_sql's escape function, without the connection handle.
+ */
+static size_t test_escape(UNUSED REQUEST *request, char *out, size_t outlen, char const *in, UNUSED void *arg)
+{
+	char *p = out, *end = out + outlen - 1;
+
+	while (*in && (p < end)) {
+		if ((*in == '\'') || (*in == '\\')) {
+			if ((end - p) < 2) break;
+			*p++ = '\\';
+		}
+		*p++ = *in++;
+	}
+	*p = '\0';
+
+	return p - out;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: xlat_eval_test [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -n <num>               Number of times to expand the query.  Default is 100000.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Expand the query num_loops times.  If "tokenize" is set, parse
+ *	the format string each time, the way xlat_aeval() used to.
+ */
+static void run_test(REQUEST *request, bool tokenize)
+{
+	int		i;
+	size_t		len = 0;
+	fr_time_t	start, end;
+
+	start = fr_time();
+
+	for (i = 0; i < num_loops; i++) {
+		char		*out = NULL;
+		ssize_t		slen;
+
+		if (tokenize) {
+			char		*fmt;
+			char const	*error = NULL;
+			xlat_exp_t	*head;
+
+			fmt = talloc_typed_strdup(NULL, query);
+			if (xlat_tokenize(fmt, fmt, &head, &error) <= 0) {
+				fprintf(stderr, "xlat_eval_test: Failed parsing query: %s\n", error);
+				exit(1);
+			}
+
+			slen = xlat_aeval_compiled(request, &out, request, head, test_escape, NULL);
+			talloc_free(fmt);
+		} else {
+			slen = xlat_aeval(request, &out, request, query, test_escape, NULL);
+		}
+		if (slen <= 0) {
+			fprintf(stderr, "xlat_eval_test: Failed expanding query\n");
+			exit(1);
+		}
+		len = slen;
+
+		if (i == 0) MPRINT1("%s\n", out);
+		talloc_free(out);
+	}
+
+	end = fr_time();
+
+	printf("%s: %zu bytes, %.0f expansions/s\n", tokenize ? "tokenize each time" : "cached",
+	       len, ((double) num_loops * NANOSEC) / (end - start));
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	char const		*dict_dir = DICTDIR;
+	fr_dict_t		*dict = NULL;
+	REQUEST			*request;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hn:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_loops = atoi(optarg);
+			if (num_loops <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("xlat_eval_test");
+		return 1;
+	}
+
+	/*
+	 *	Registering any xlat creates the built-in ones,
+	 *	such as %{integer:...}.
+	 */
+	if (xlat_register(NULL, "xlat_eval_test", NULL, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) < 0) {
+		fprintf(stderr, "xlat_eval_test: Failed registering xlat\n");
+		return 1;
+	}
+
+	request = request_alloc(NULL);
+	rad_assert(request != NULL);
+
+	request->packet = fr_radius_alloc(request, false);
+	request->reply = fr_radius_alloc(request, false);
+	rad_assert(request->packet && request->reply);
+
+	for (i = 0; request_pairs[i] != NULL; i += 2) {
+		if (!pair_make_request(request_pairs[i], request_pairs[i + 1], T_OP_EQ)) {
+			fr_perror("xlat_eval_test");
+			return 1;
+		}
+	}
+
+	run_test(request, true);
+	run_test(request, false);
+
+	talloc_free(request);
+	xlat_free();
+	talloc_free(dict);
+
+	return 0;
+}
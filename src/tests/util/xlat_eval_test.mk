@@ -0,0 +1,6 @@
+TARGET := xlat_eval_test
+
+SOURCES		:= xlat_eval_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -101,7 +101,7 @@ typedef struct fr_channel_end_t {
 
 	size_t			num_resignals;	//!< number of signals resent
 
-	size_t			num_kevents;	//!< number of times we've looked at kevents
+	size_t			num_events;	//!< number of times we've looked at user events
 
 	uint64_t		sequence;	//!< sequence number for this channel.
 	uint64_t		ack;		//!< sequence number of the other end
@@ -483,14 +483,15 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	MPRINT("\twhen - last signal = %zd - %zd = %zd\n", when, worker->last_sent_signal, when - worker->last_sent_signal);
 	MPRINT("\tsequence - ack = %zd - %zd = %zd\n", worker->sequence, worker->their_view_of_my_sequence, worker->sequence - worker->their_view_of_my_sequence);
 
-#ifdef __APPLE__
+#if defined(__APPLE__) || defined(WITH_EPOLL)
 	/*
 	 *	If we've sent them a signal since the last ACK, they
 	 *	will receive it, and process the packets.  So we don't
 	 *	need to signal them again.
 	 *
 	 *	But... this doesn't appear to work on the Linux
-	 *	libkqueue implementation.
+	 *	libkqueue implementation.  It does work with epoll,
+	 *	where every signal is a write to an eventfd.
 	 */
 	if (worker->sequence_at_last_signal > worker->their_view_of_my_sequence) return 0;
 #endif
@@ -652,34 +653,33 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 }
 
 
-/** Service an EVFILT_USER event.
+/** Service a user event.
  *
- *  The channels use EVFILT_USER events for internal signaling.  A
- *  master / worker should call this function for every EVFILT_USER
- *  event.  Note that the caller does NOT pass the channel into this
- *  function.  Instead, the channel is taken from the kevent.
+ *  The channels use user events (EVFILT_USER with kqueue, eventfd
+ *  with epoll) for internal signaling.  A master / worker should call
+ *  this function for every user event.
  *
  * @param[in] ch the channel to service
- * @param[in] c the control plane on which we received the kev
- * @param[in] kev the event of type EVFILT_USER
+ * @param[in] c the control plane on which we received the event
+ * @param[in] ident of the user event
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev)
+int fr_channel_service_user(fr_channel_t *ch, fr_control_t *c, uintptr_t ident)
 {
 #ifndef NDEBUG
 	talloc_get_type_abort(ch, fr_channel_t);
 #endif
 
-	if (fr_control_message_service_kevent(c, kev) == 0) {
+	if (fr_control_message_service_user(c, ident) == 0) {
 		return 0;
 	}
 
 	if (c == ch->end[TO_WORKER].control) {
-		ch->end[TO_WORKER].num_kevents++;
+		ch->end[TO_WORKER].num_events++;
 	} else {
-		ch->end[FROM_WORKER].num_kevents++;
+		ch->end[FROM_WORKER].num_events++;
 	}
 
 	return 0;
@@ -830,13 +830,13 @@ void fr_channel_debug(fr_channel_t *ch, FILE *fp)
 	fprintf(fp, "to worker\n");
 	fprintf(fp, "\tnum_signals sent = %zd\n", ch->end[TO_WORKER].num_signals);
 	fprintf(fp, "\tnum_signals re-sent = %zd\n", ch->end[TO_WORKER].num_resignals);
-	fprintf(fp, "\tnum_kevents checked = %zd\n", ch->end[TO_WORKER].num_kevents);
+	fprintf(fp, "\tnum_events checked = %zd\n", ch->end[TO_WORKER].num_events);
 	fprintf(fp, "\tsequence = %zd\n", ch->end[TO_WORKER].sequence);
 	fprintf(fp, "\tack = %zd\n", ch->end[TO_WORKER].ack);
 
 	fprintf(fp, "to receive\n");
 	fprintf(fp, "\tnum_signals sent = %zd\n", ch->end[FROM_WORKER].num_signals);
-	fprintf(fp, "\tnum_kevents checked = %zd\n", ch->end[FROM_WORKER].num_kevents);
+	fprintf(fp, "\tnum_events checked = %zd\n", ch->end[FROM_WORKER].num_events);
 	fprintf(fp, "\tsequence = %zd\n", ch->end[FROM_WORKER].sequence);
 	fprintf(fp, "\tack = %zd\n", ch->end[FROM_WORKER].ack);
 }
@@ -29,7 +29,7 @@ RCSIDH(channel_h, "$Id$")
 #include <freeradius-devel/util/control.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -114,7 +114,7 @@ fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch) CC_HINT(nonnull);
 
 int fr_channel_worker_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
 
-int fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
+int fr_channel_service_user(fr_channel_t *ch, fr_control_t *c, uintptr_t ident) CC_HINT(nonnull);
 fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
 
 bool fr_channel_active(fr_channel_t *ch) CC_HINT(nonnull);
@@ -27,9 +27,9 @@ RCSID("$Id$")
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/ring_buffer.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
 
 #include <string.h>
-#include <sys/event.h>
 
 #define FR_CONTROL_SIGNAL	(1024)
 #define FR_CONTROL_MAX_IDENT	(32)
@@ -75,6 +75,7 @@ typedef struct fr_control_ctx_t {
  */
 struct fr_control_t {
 	int			kq;			//!< destination KQ
+	int			fd;			//!< descriptor we signal, from fr_event_user_register()
 
 	fr_atomic_queue_t	*aq;			//!< destination AQ
 
@@ -91,10 +92,16 @@ struct fr_control_t {
  *	- NULL on error
  *	- fr_control_t on success
  */
+static int _control_free(fr_control_t *c)
+{
+	fr_event_user_deregister(c->kq, c->fd, FR_CONTROL_SIGNAL);
+
+	return 0;
+}
+
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq)
 {
 	fr_control_t *c;
-	struct kevent kev;
 
 	c = talloc_zero(ctx, fr_control_t);
 	if (!c) return NULL;
@@ -108,17 +115,18 @@ fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq)
 	 *	We COULD overload the "ident" field with our channel
 	 *	number, followed by the actual signal we're sending.
 	 *	This would work.  The downside is that it would
-	 *	require N*M EVFILT_USER kevents to be registered,
-	 *	which is bad
+	 *	require N*M user events to be registered, which is
+	 *	bad
 	 *
 	 *	The implementation here is perhaps a bit less optimal,
 	 *	but it's clean, and it works.
 	 */
-	EV_SET(&kev, FR_CONTROL_SIGNAL, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
-	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+	c->fd = fr_event_user_register(kq, FR_CONTROL_SIGNAL);
+	if (c->fd < 0) {
 		talloc_free(c);
 		return NULL;
 	}
+	talloc_set_destructor(c, _control_free);
 
 	return c;
 }
@@ -293,8 +301,6 @@ int fr_control_message_push(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
  */
 int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id, void *data, size_t data_size)
 {
-	struct kevent kev;
-
 #ifndef NDEBUG
 	(void) talloc_get_type_abort(c, fr_control_t);
 #endif
@@ -303,8 +309,7 @@ int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
 		return -1;
 	}
 
-	EV_SET(&kev, FR_CONTROL_SIGNAL, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	return kevent(c->kq, &kev, 1, NULL, 0, NULL);
+	return fr_event_user_trigger(c->fd, FR_CONTROL_SIGNAL);
 }
 
 
@@ -349,20 +354,20 @@ ssize_t fr_control_message_pop(fr_atomic_queue_t *aq, uint32_t *p_id, void *data
 }
 
 
-/** Service a control-plane kevent
+/** Service a control-plane user event
  *
  *  This function is called ONLY from the receiving thread.
  *
  * @param[in] c the control structure
- * @param[in] kev the kevent for this receiver
+ * @param[in] ident of the user event for this receiver
  * @return
  *	- <0 error
- *	- 0 this kevent is not for us.
- *	- >0 this kevent is for us
+ *	- 0 this event is not for us.
+ *	- >0 this event is for us
  */
-int fr_control_message_service_kevent(UNUSED fr_control_t *c, struct kevent const *kev)
+int fr_control_message_service_user(UNUSED fr_control_t *c, uintptr_t ident)
 {
-	if (kev->ident != FR_CONTROL_SIGNAL) return 0;
+	if (ident != FR_CONTROL_SIGNAL) return 0;
 
 	return 1;
 }
@@ -30,7 +30,7 @@ RCSIDH(control_h, "$Id$")
 #include <freeradius-devel/util/time.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,6 +55,9 @@ typedef	void (*fr_control_callback_t)(void *ctx, void const *data, size_t data_s
  */
 #define FR_CONTROL_ID_CHANNEL (1)
 #define FR_CONTROL_ID_SOCKET  (2)
+#define FR_CONTROL_ID_WORKER  (3)
+#define FR_CONTROL_ID_STEAL   (4)
+#define FR_CONTROL_ID_REPLY   (5)
 
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq);
 void fr_control_free(fr_control_t *c);
@@ -62,7 +65,7 @@ void fr_control_free(fr_control_t *c);
 int fr_control_gc(fr_control_t *c, fr_ring_buffer_t *rb) CC_HINT(nonnull);
 
 int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id, void *data, size_t data_size) CC_HINT(nonnull);
-int fr_control_message_service_kevent(fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
+int fr_control_message_service_user(fr_control_t *c, uintptr_t ident) CC_HINT(nonnull);
 
 int fr_control_message_push(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id, void *data, size_t data_size) CC_HINT(nonnull);
 ssize_t fr_control_message_pop(fr_atomic_queue_t *aq, uint32_t *p_id, void *data, size_t data_size) CC_HINT(nonnull);
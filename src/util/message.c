@@ -1031,10 +1031,12 @@ fr_message_t *fr_message_alloc_reserve(fr_message_set_t *ms, fr_message_t *m, si
 	}
 
 	/*
-	 *	Mark how much room there is in this message.
+	 *	Mark how much room there is in this message.  As with
+	 *	fr_message_reserve(), data_size is zero until the
+	 *	caller allocates the data.
 	 */
 	m2->rb = m->rb;
-	m2->data_size = room;
+	m2->data_size = 0;
 	m2->rb_size = room;
 
 	/*
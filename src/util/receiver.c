@@ -44,13 +44,46 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
+/*
+ *	The maximum size of a packet we read from the network.
+ */
+#define MAX_PACKET_SIZE (4096)
+
+/*
+ *	The maximum number of packets we read from a socket at once,
+ *	when the transport supports it.  This sizes arrays on the
+ *	stack of fr_receiver_read_batch(), so it's fixed at compile
+ *	time.  Transports can return fewer packets.
+ */
+#define MAX_READ_BATCH (32)
+
+/*
+ *	The maximum number of batches we read from an edge-triggered
+ *	socket before servicing the other sockets.  If the socket
+ *	still has packets, we come back to it on the next loop.
+ */
+#define MAX_READ_LOOPS (4)
+
+/*
+ *	The maximum number of replies we write at once, when the
+ *	transport supports it.
+ */
+#define MAX_WRITE_BATCH (32)
+
 typedef struct fr_receiver_worker_t {
+	fr_channel_t		*channel;		//!< channel to the worker
+	fr_worker_t		*worker;		//!< worker pointer
+
 	int			heap_id;		//!< workers are in a heap
-	fr_time_t		cpu_time;		//!< how much CPU time this worker has spent
+	fr_time_t		cpu_time;		//!< how much CPU time this worker has spent, including predicted work
 	fr_time_t		processing_time;	//!< predicted processing time for one packet
 
-	fr_channel_t		*channel;		//!< channel to the worker
-	fr_worker_t		*worker;		//!< worker pointer
+	fr_time_t		reported_cpu_time;	//!< CPU time as last reported by the worker
+	fr_time_t		busy_since;		//!< when the worker last started on work it hasn't reported
+	uint32_t		num_outstanding;	//!< requests sent to the worker which have no reply
+
+	uint64_t		num_requests;		//!< number of requests sent to this worker
+	uint64_t		num_replies;		//!< number of replies received from this worker
 } fr_receiver_worker_t;
 
 typedef struct fr_receiver_socket_t {
@@ -58,6 +91,10 @@ typedef struct fr_receiver_socket_t {
 	void			*ctx;			//!< transport context
 	fr_transport_t		*transport;		//!< the transport
 	int			heap_id;		//!< for the heap
+
+	bool			edge_triggered;		//!< we're only told when new packets arrive
+	bool			pending;		//!< the socket may have more packets to read
+	fr_dlist_t		entry;			//!< for the list of pending sockets
 } fr_receiver_socket_t;
 
 
@@ -72,6 +109,10 @@ struct fr_receiver_t {
 
 	fr_event_list_t		*el;			//!< our event list
 
+	fr_message_set_t	*ms;			//!< packets we read from the network are allocated from here
+	int			message_set_size;	//!< start number of messages in ms
+	size_t			ring_buffer_size;	//!< start size of the ring buffer in ms
+
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
 	fr_heap_t		*workers;		//!< workers, ordered by total CPU time spent
 	fr_heap_t		*closing;		//!< workers which are being closed
@@ -80,6 +121,7 @@ struct fr_receiver_t {
 	uint64_t		num_replies;		//!< number of replies we received
 
 	fr_heap_t		*sockets;		//!< list of sockets we're managing
+	fr_dlist_t		pending;		//!< edge-triggered sockets which still have packets
 
 	uint32_t		num_transports;		//!< how many transport layers we have
 	fr_transport_t		**transports;		//!< array of active transports.
@@ -122,6 +164,38 @@ static int reply_cmp(void const *one, void const *two)
 	return 0;
 }
 
+#define IALPHA (8)
+#define RTT(_old, _new) ((_new + ((IALPHA - 1) * _old)) / IALPHA)
+
+/** Update the predicted CPU time for a worker
+ *
+ *  The worker tells us how much CPU time it has used, as of the last
+ *  reply it sent.  Anything which is still outstanding is either
+ *  being processed now, or is queued.  So we predict that it will
+ *  take "processing_time" for each outstanding request.
+ *
+ *  However, if the worker has been busy for longer than we predicted,
+ *  it is likely blocked (e.g. waiting on a database).  In that case,
+ *  we charge it for all of the time it has been busy, so that it
+ *  doesn't get sent any more packets until it catches up.
+ *
+ * @param[in] worker the worker to update
+ * @param[in] now the current time
+ */
+static void fr_receiver_worker_predict(fr_receiver_worker_t *worker, fr_time_t now)
+{
+	fr_time_t predicted, busy;
+
+	predicted = worker->num_outstanding * worker->processing_time;
+
+	if (worker->num_outstanding && (now > worker->busy_since)) {
+		busy = now - worker->busy_since;
+		if (busy >= predicted) predicted = busy + worker->processing_time;
+	}
+
+	worker->cpu_time = worker->reported_cpu_time + predicted;
+}
+
 /** Drain the input channel
  *
  * @param[in] rc the receiver
@@ -130,6 +204,8 @@ static int reply_cmp(void const *one, void const *two)
  */
 static void fr_receiver_drain_input(fr_receiver_t *rc, fr_channel_t *ch, fr_channel_data_t *cd)
 {
+	fr_receiver_worker_t *worker;
+
 	if (!cd) {
 		cd = fr_channel_recv_reply(ch);
 		if (!cd) {
@@ -138,24 +214,90 @@ static void fr_receiver_drain_input(fr_receiver_t *rc, fr_channel_t *ch, fr_chan
 		}
 	}
 
+	worker = fr_channel_master_ctx_get(ch);
+	rad_assert(worker != NULL);
+
 	do {
 		rc->num_replies++;
 		MPRINT("MASTER received reply %zd\n", rc->num_replies);
 
+		/*
+		 *	Update the worker with the real CPU time it
+		 *	has used, and with the time it took to process
+		 *	this packet.  NAKs have zero processing time,
+		 *	so we ignore them for the purpose of
+		 *	prediction.
+		 */
+		worker->num_replies++;
+		if (worker->num_outstanding > 0) worker->num_outstanding--;
+
+		worker->reported_cpu_time = cd->reply.cpu_time;
+		worker->busy_since = cd->m.when;
+
+		if (cd->reply.processing_time) {
+			if (!worker->processing_time) {
+				worker->processing_time = cd->reply.processing_time;
+			} else {
+				worker->processing_time = RTT(worker->processing_time, cd->reply.processing_time);
+			}
+		}
+
 		cd->channel.ch = ch;
 		(void) fr_heap_insert(rc->replies, cd);
 	} while ((cd = fr_channel_recv_reply(ch)) != NULL);
 
 	/*
-	 *	@todo get CPU time and processing time from the message, and update the worker.
+	 *	Re-sort the worker, now that we know how busy it really is.
 	 */
+	if (fr_heap_extract(rc->workers, worker)) {
+		fr_receiver_worker_predict(worker, fr_time());
+		(void) fr_heap_insert(rc->workers, worker);
+	}
+}
+
+/** Find the worker which will be able to process a packet soonest
+ *
+ *  The predictions in the heap are updated only when we send or
+ *  receive packets.  A worker which is blocked will have a stale
+ *  (i.e. low) prediction.  So we re-predict the least loaded worker,
+ *  and if it is now more loaded than the next one, we put it back and
+ *  try again.  Each worker is checked at most once.
+ *
+ * @param[in] rc the receiver
+ * @param[in] now the current time
+ * @return
+ *	- NULL on no workers
+ *	- the worker, which has been removed from the heap.
+ */
+static fr_receiver_worker_t *fr_receiver_worker_select(fr_receiver_t *rc, fr_time_t now)
+{
+	size_t i, num_workers;
+	fr_receiver_worker_t *worker, *next;
+
+	num_workers = fr_heap_num_elements(rc->workers);
+
+	for (i = 0; i < num_workers; i++) {
+		worker = fr_heap_pop(rc->workers);
+		if (!worker) return NULL;
+
+		fr_receiver_worker_predict(worker, now);
+
+		next = fr_heap_peek(rc->workers);
+		if (!next || (worker->cpu_time <= next->cpu_time)) return worker;
+
+		(void) fr_heap_insert(rc->workers, worker);
+	}
+
+	return fr_heap_pop(rc->workers);
 }
 
-#if 0
 /** Send a message on the "best" channel.
  *
  * @param rc the receiver
  * @param cd the message we've received
+ * @return
+ *	- <0 on error, or no worker could take the message
+ *	- 0 on success
  */
 static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 {
@@ -169,8 +311,8 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 	/*
 	 *	Grab the worker with the least total CPU time.
 	 */
-	worker = fr_heap_pop(rc->workers);
-	if (!worker) return 0;
+	worker = fr_receiver_worker_select(rc, cd->m.when);
+	if (!worker) return -1;
 
 	/*
 	 *	Send the message to the channel.  If we fail, recurse.
@@ -191,14 +333,15 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 		rcode = fr_receiver_send_request(rc, cd);
 
 		/*
-		 *	Mark this channel as still busy, for some
-		 *	future time.  This process ensures that we
-		 *	don't immediately pop it off the heap and try
-		 *	to send it another request.
+		 *	Mark this channel as still busy.  It has a
+		 *	full queue, so its prediction is already high,
+		 *	and we don't immediately pop it off the heap
+		 *	and try to send it another request.
 		 */
-		worker->cpu_time = cd->m.when + worker->processing_time;
 		(void) fr_heap_insert(rc->workers, worker);
 
+		if (reply) fr_receiver_drain_input(rc, worker->channel, reply);
+
 		return rcode;
 	}
 
@@ -208,7 +351,12 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 	 *	updated with a more accurate number when we receive a
 	 *	reply from this channel.
 	 */
-	worker->cpu_time += worker->processing_time;
+	if (!worker->num_outstanding) worker->busy_since = cd->m.when;
+	worker->num_outstanding++;
+	worker->num_requests++;
+	rc->num_requests++;
+
+	fr_receiver_worker_predict(worker, cd->m.when);
 
 	/*
 	 *	Insert the worker back into the heap of workers.
@@ -223,7 +371,87 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 
 	return 0;
 }
-#endif
+
+/** Write all pending replies to the network.
+ *
+ *  Replies are taken off of the queue in groups.  Replies in a group
+ *  which use the same transport are passed to the transports
+ *  write_batch function all at once, so that the transport can send
+ *  them with as few system calls as possible.  Transports without
+ *  write_batch have each reply written individually.
+ *
+ * @param[in] rc the receiver
+ */
+static void fr_receiver_write_replies(fr_receiver_t *rc)
+{
+	int i, j, num, count;
+	fr_channel_data_t *cd;
+	fr_channel_data_t *replies[MAX_WRITE_BATCH];
+	bool written[MAX_WRITE_BATCH];
+	void *packet_ctx[MAX_WRITE_BATCH];
+	uint8_t *buffer[MAX_WRITE_BATCH];
+	size_t buffer_len[MAX_WRITE_BATCH];
+
+	do {
+		for (num = 0; num < MAX_WRITE_BATCH; num++) {
+			cd = fr_heap_pop(rc->replies);
+			if (!cd) break;
+
+			rad_assert(cd->transport < rc->num_transports);
+			replies[num] = cd;
+			written[num] = false;
+		}
+
+		for (i = 0; i < num; i++) {
+			fr_transport_t *transport;
+
+			if (written[i]) continue;
+
+			cd = replies[i];
+			transport = rc->transports[cd->transport];
+			written[i] = true;
+
+			if (!transport->write_batch) {
+				if (transport->write &&
+				    (transport->write(cd->ctx, cd->m.data, cd->m.data_size) < 0)) {
+					MPRINT("MASTER failed writing reply\n");
+				}
+				continue;
+			}
+
+			/*
+			 *	Coalesce this reply with all of the
+			 *	later ones for the same transport.
+			 */
+			packet_ctx[0] = cd->ctx;
+			buffer[0] = cd->m.data;
+			buffer_len[0] = cd->m.data_size;
+			count = 1;
+
+			for (j = i + 1; j < num; j++) {
+				if (written[j] || (replies[j]->transport != cd->transport)) continue;
+
+				packet_ctx[count] = replies[j]->ctx;
+				buffer[count] = replies[j]->m.data;
+				buffer_len[count] = replies[j]->m.data_size;
+				count++;
+				written[j] = true;
+			}
+
+			if (transport->write_batch(packet_ctx, buffer, buffer_len, count) < 0) {
+				MPRINT("MASTER failed writing %d replies\n", count);
+			}
+		}
+
+		/*
+		 *	The messages can only be freed after they've
+		 *	all been written.
+		 */
+		for (i = 0; i < num; i++) {
+			fr_message_done(&replies[i]->m);
+		}
+	} while (num == MAX_WRITE_BATCH);
+}
 
 /** Run the event loop 'idle' callback
  *
@@ -273,6 +501,8 @@ static void fr_receiver_channel_callback(void *ctx, void const *data, size_t dat
 {
 	fr_channel_event_t ce;
 	fr_channel_t *ch;
+	fr_channel_data_t *cd;
+	fr_receiver_worker_t *worker;
 	fr_receiver_t *rc = ctx;
 
 	ce = fr_channel_service_message(now, &ch, data, data_size);
@@ -307,25 +537,245 @@ static void fr_receiver_channel_callback(void *ctx, void const *data, size_t dat
 
 	case FR_CHANNEL_CLOSE:
 		MPRINT("MASTER aq channel close\n");
-		///
+
+		/*
+		 *	The worker has acknowledged the close (or is
+		 *	exiting).  Stop sending it packets, and clean
+		 *	up the channel.
+		 */
+		rad_assert(ch != NULL);
+		worker = fr_channel_master_ctx_get(ch);
+		rad_assert(worker != NULL);
+
+		if (!fr_heap_extract(rc->workers, worker)) (void) fr_heap_extract(rc->closing, worker);
+
+		/*
+		 *	The worker won't read any more requests.
+		 *	They're in our message set, so free them
+		 *	here.  Any replies left in the channel are in
+		 *	the worker's message set, which it frees.
+		 */
+		while ((cd = fr_channel_recv_request(ch)) != NULL) {
+			fr_message_done(&cd->m);
+		}
+
+		rad_assert(worker->channel == ch);
+		talloc_free(worker->channel);
+		worker->channel = NULL;
+		talloc_free(worker);
 		break;
 	}
 }
 
-static void fr_receiver_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED void *ctx)
+/** Read multiple packets from a socket, and send them to workers
+ *
+ * @param[in] rc the receiver
+ * @param[in] s the socket
+ * @param[in] sockfd the socket which is ready to read
+ * @return the number of packets read by the transport
+ */
+static int fr_receiver_read_batch(fr_receiver_t *rc, fr_receiver_socket_t *s, int sockfd)
+{
+	int i, num;
+	size_t reserve;
+	fr_time_t now;
+	void *packet_ctx[MAX_READ_BATCH];
+	size_t data_size[MAX_READ_BATCH];
+	fr_channel_data_t *cd, *next;
+	fr_channel_data_t *batch[MAX_READ_BATCH];
+
+	/*
+	 *	Reserve room for all of the packets, and let the
+	 *	transport read them directly into the message set.
+	 */
+	cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, MAX_READ_BATCH * MAX_PACKET_SIZE);
+	if (!cd) {
+		MPRINT("MASTER failed reserving message\n");
+		return 0;
+	}
+
+	num = s->transport->read_batch(sockfd, s->ctx, packet_ctx, data_size,
+				       cd->m.data, MAX_PACKET_SIZE, MAX_READ_BATCH);
+	if (num <= 0) {
+		MPRINT("MASTER ignoring batch (%d packets)\n", num);
+		fr_message_done(&cd->m);
+		return 0;
+	}
+
+	rad_assert(num <= MAX_READ_BATCH);
+
+	now = fr_time();
+
+	/*
+	 *	Split the reservation into one message per packet.
+	 *	Each message keeps its whole slot, so that the
+	 *	packets don't have to be copied.
+	 */
+	reserve = num * MAX_PACKET_SIZE;
+	for (i = 0; i < num; i++) {
+		reserve -= MAX_PACKET_SIZE;
+
+		if (reserve) {
+			next = (fr_channel_data_t *) fr_message_alloc_reserve(rc->ms, &cd->m, MAX_PACKET_SIZE, reserve);
+		} else {
+			(void) fr_message_alloc(rc->ms, &cd->m, MAX_PACKET_SIZE);
+			next = NULL;
+		}
+
+		cd->m.data_size = data_size[i];
+
+		if (!data_size[i]) {
+			fr_message_done(&cd->m);
+			batch[i] = NULL;
+
+		} else {
+			cd->m.when = now;
+			cd->ctx = packet_ctx[i];
+			cd->transport = s->transport->id;
+			cd->priority = 0;
+			cd->request.start_time = NULL;
+			batch[i] = cd;
+		}
+
+		/*
+		 *	We couldn't allocate a message for the rest
+		 *	of the packets.  Drop them.
+		 */
+		if (reserve && !next) {
+			MPRINT("MASTER failed splitting batch\n");
+			while (++i < num) {
+				batch[i] = NULL;
+				if (data_size[i] && s->transport->write) (void) s->transport->write(packet_ctx[i], NULL, 0);
+			}
+			num = i;
+			break;
+		}
+
+		cd = next;
+	}
+
+	/*
+	 *	Hand all of the packets to the workers.
+	 */
+	for (i = 0; i < num; i++) {
+		if (!batch[i]) continue;
+
+		if (fr_receiver_send_request(rc, batch[i]) < 0) {
+			MPRINT("MASTER failed sending packet to a worker\n");
+			if (s->transport->write) (void) s->transport->write(batch[i]->ctx, NULL, 0);
+			fr_message_done(&batch[i]->m);
+		}
+	}
+
+	return num;
+}
+
+
+/** Read a packet from a socket, and send it to a worker
+ *
+ * @param[in] el the event list
+ * @param[in] sockfd the socket which is ready to read
+ * @param[in] ctx the fr_receiver_socket_t
+ */
+static void fr_receiver_read(UNUSED fr_event_list_t *el, int sockfd, void *ctx)
 {
-//	fr_receiver_socket_t *m = ctx;
-//	fr_receiver_t *rc = talloc_parent(m);
+	fr_receiver_socket_t *s = ctx;
+	fr_receiver_t *rc = talloc_parent(s);
 	ssize_t data_size;
-	struct sockaddr_storage ss;
-	socklen_t salen = sizeof(ss);
-	uint8_t buffer[256];
+	void *packet_ctx = NULL;
+	fr_channel_data_t *cd;
+
+	if (s->transport->read_batch) {
+		int i;
+
+		/*
+		 *	A short batch means that the socket is empty.
+		 *	Level-triggered sockets will tell us again if
+		 *	there is more data, so we read only one batch.
+		 */
+		for (i = 0; i < MAX_READ_LOOPS; i++) {
+			if (fr_receiver_read_batch(rc, s, sockfd) < MAX_READ_BATCH) return;
 
-	data_size = recvfrom(sockfd, buffer, sizeof(buffer), 0,
-			     (struct sockaddr *) &ss, &salen);
-	fprintf(stderr, "Got packet size %zd\n", data_size);
+			if (!s->edge_triggered) return;
+		}
 
-	fprintf(stderr, "READ FROM SOCKET %d - %zd bytes\n", sockfd, data_size);
+		/*
+		 *	The socket still has packets, but we won't be
+		 *	told about them again.  Remember to come back
+		 *	to it after servicing the other sockets.
+		 */
+		if (!s->pending) {
+			s->pending = true;
+			FR_DLIST_INSERT_TAIL(rc->pending, s->entry);
+		}
+		return;
+	}
+
+	cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, MAX_PACKET_SIZE);
+	if (!cd) {
+		MPRINT("MASTER failed reserving message\n");
+		return;
+	}
+
+	data_size = s->transport->read(sockfd, s->ctx, &packet_ctx, cd->m.data, cd->m.rb_size);
+	if (data_size <= 0) {
+		MPRINT("MASTER ignoring packet (data length %zd)\n", data_size);
+		fr_message_done(&cd->m); /* re-use it for the next packet */
+		return;
+	}
+
+	(void) fr_message_alloc(rc->ms, &cd->m, data_size);
+
+	cd->m.when = fr_time();
+	cd->ctx = packet_ctx;
+	cd->transport = s->transport->id;
+	cd->priority = 0;
+	cd->request.start_time = NULL;
+
+	/*
+	 *	No worker could take the packet.  Drop it, and tell
+	 *	the transport to clean up.
+	 */
+	if (fr_receiver_send_request(rc, cd) < 0) {
+		MPRINT("MASTER failed sending packet to a worker\n");
+		if (s->transport->write) (void) s->transport->write(packet_ctx, NULL, 0);
+		fr_message_done(&cd->m);
+	}
+}
+
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
+
+/** Read more packets from edge-triggered sockets which weren't drained
+ *
+ * @param[in] rc the receiver
+ */
+static void fr_receiver_read_pending(fr_receiver_t *rc)
+{
+	fr_dlist_t *entry;
+	fr_dlist_t pending;
+
+	if (rc->pending.next == &rc->pending) return;
+
+	/*
+	 *	Move the sockets to a local list, so that sockets
+	 *	which still aren't drained go back on rc->pending,
+	 *	and are read on the next loop.
+	 */
+	pending.next = rc->pending.next;
+	pending.prev = rc->pending.prev;
+	pending.next->prev = &pending;
+	pending.prev->next = &pending;
+	FR_DLIST_INIT(rc->pending);
+
+	while ((entry = FR_DLIST_FIRST(pending)) != NULL) {
+		fr_receiver_socket_t *s;
+
+		s = fr_ptr_to_type(fr_receiver_socket_t, entry, entry);
+		FR_DLIST_REMOVE(s->entry);
+		s->pending = false;
+
+		fr_receiver_read(rc->el, s->fd, s);
+	}
 }
 
 /** Handle a receiver control message callback for a new socket
@@ -347,6 +797,13 @@ static void fr_receiver_socket_callback(void *ctx, void const *data, size_t data
 	m = talloc(rc, fr_receiver_socket_t);
 	rad_assert(m != NULL);
 	memcpy(m, data, sizeof(*m));
+	FR_DLIST_INIT(m->entry);
+
+	if (!m->transport->read && !m->transport->read_batch) {
+		fprintf(stderr, "TRANSPORT %s CANNOT READ PACKETS\n", m->transport->name);
+		talloc_free(m);
+		return;
+	}
 
 	if (fr_event_fd_insert(rc->el, m->fd, fr_receiver_read, NULL, NULL, m) < 0) {
 		fprintf(stderr, "FAILED ADDING NEW SOCKET\n");
@@ -354,18 +811,73 @@ static void fr_receiver_socket_callback(void *ctx, void const *data, size_t data
 		return;
 	}
 
+	/*
+	 *	Batch reads tell us when the socket has been drained,
+	 *	so we only need to be woken up when new packets
+	 *	arrive.
+	 */
+	if (m->transport->read_batch &&
+	    (fr_event_fd_edge_triggered(rc->el, m->fd, true) == 0)) {
+		m->edge_triggered = true;
+	}
+
 	(void) fr_heap_insert(rc->sockets, m);
 
 	fprintf(stderr, "GOT NEW SOCKET\n");
 }
 
-/** Service an EVFILT_USER event
+/** Handle a receiver control message callback for a new worker
+ *
+ *  Create a channel to the worker, and tell the worker that the
+ *  channel is open.
+ *
+ * @param[in] ctx the receiver
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_receiver_worker_callback(void *ctx, void const *data, size_t data_size, fr_time_t now)
+{
+	fr_receiver_t *rc = ctx;
+	fr_worker_t *worker;
+	fr_receiver_worker_t *w;
+
+	rad_assert(data_size == sizeof(worker));
+
+	if (data_size != sizeof(worker)) return;
+
+	memcpy(&worker, data, sizeof(worker));
+
+	w = talloc_zero(rc, fr_receiver_worker_t);
+	rad_assert(w != NULL);
+
+	w->worker = worker;
+	w->busy_since = now;
+	w->channel = fr_worker_channel_create(worker, w, rc->control);
+	if (!w->channel) {
+		fprintf(stderr, "FAILED CREATING CHANNEL TO WORKER\n");
+		talloc_free(w);
+		return;
+	}
+
+	fr_channel_master_ctx_add(w->channel, w);
+
+	if (fr_channel_signal_open(w->channel) < 0) {
+		fprintf(stderr, "FAILED SIGNALING OPEN TO WORKER\n");
+		talloc_free(w);
+		return;
+	}
+
+	(void) fr_heap_insert(rc->workers, w);
+}
+
+/** Service a user event
  *
  * @param[in] kq the kq to service
- * @param[in] kev the kevent to service
+ * @param[in] ident of the user event to service
  * @param[in] ctx the fr_worker_t
  */
-static void fr_receiver_evfilt_user(UNUSED int kq, struct kevent const *kev, void *ctx)
+static void fr_receiver_user_event(UNUSED int kq, uintptr_t ident, void *ctx)
 {
 	fr_time_t now;
 	fr_receiver_t *rc = ctx;
@@ -375,8 +887,8 @@ static void fr_receiver_evfilt_user(UNUSED int kq, struct kevent const *kev, voi
 	talloc_get_type_abort(rc, fr_receiver_t);
 #endif
 
-	if (!fr_control_message_service_kevent(rc->control, kev)) {
-		MPRINT("MASTER kevent not for us!\n");
+	if (!fr_control_message_service_user(rc->control, ident)) {
+		MPRINT("MASTER user event not for us!\n");
 		return;
 	}
 
@@ -444,7 +956,12 @@ fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_t
 		return NULL;
 	}
 
-	if (fr_event_user_insert(rc->el, fr_receiver_evfilt_user, rc) < 0) {
+	if (fr_control_callback_add(rc->control, FR_CONTROL_ID_WORKER, rc, fr_receiver_worker_callback) < 0) {
+		talloc_free(rc);
+		return NULL;
+	}
+
+	if (fr_event_user_insert(rc->el, fr_receiver_user_event, rc) < 0) {
 		talloc_free(rc);
 		return NULL;
 	}
@@ -464,18 +981,33 @@ fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_t
 		return NULL;
 	}
 
-	rc->workers = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	rc->workers = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
 	if (!rc->workers) {
 		talloc_free(rc);
 		return NULL;
 	}
 
-	rc->closing = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	rc->closing = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
 	if (!rc->closing) {
 		talloc_free(rc);
 		return NULL;
 	}
 
+	/*
+	 *	The message set grows as needed.  The ring buffer
+	 *	starts with room for many full batches, as each read
+	 *	reserves MAX_READ_BATCH * MAX_PACKET_SIZE bytes.
+	 */
+	rc->message_set_size = 1024;
+	rc->ring_buffer_size = 1024 * MAX_PACKET_SIZE;
+
+	rc->ms = fr_message_set_create(rc, rc->message_set_size, sizeof(fr_channel_data_t), rc->ring_buffer_size);
+	if (!rc->ms) {
+		talloc_free(rc);
+		return NULL;
+	}
+
+	FR_DLIST_INIT(rc->pending);
 
 	rc->num_transports = num_transports;
 	rc->transports = transports;
@@ -495,11 +1027,19 @@ int fr_receiver_destroy(fr_receiver_t *rc)
 {
 	fr_receiver_worker_t *worker;
 	fr_channel_data_t *cd;
+	uint8_t data[256];
 
 #ifndef NDEBUG
 	(void) talloc_get_type_abort(rc, fr_receiver_t);
 #endif
 
+	/*
+	 *	Workers which have already exited will have sent us a
+	 *	close message.  Service those before signaling the
+	 *	remaining workers.
+	 */
+	fr_control_service(rc->control, data, sizeof(data), fr_time());
+
 	/*
 	 *	Pop all of the workers, and signal them that we're
 	 *	closing/
@@ -534,11 +1074,35 @@ int fr_receiver_destroy(fr_receiver_t *rc)
  */
 void fr_receiver(fr_receiver_t *rc)
 {
-	/*
-	 *	The receiver is entirely event driven.
-	 */
-	while (fr_event_loop(rc->el) == 0) {
-		/* nothing */
+	while (true) {
+		bool wait_for_event;
+		int num_events;
+
+		/*
+		 *	There are replies to write, or packets left on
+		 *	an edge-triggered socket.  We still service the
+		 *	event loop, but we don't wait for events.
+		 */
+		wait_for_event = (fr_heap_num_elements(rc->replies) == 0) &&
+				 (rc->pending.next == &rc->pending);
+
+		/*
+		 *	Check the event list.  If there's an error
+		 *	(e.g. exit), we stop looping and clean up.
+		 */
+		num_events = fr_event_corral(rc->el, wait_for_event);
+		if (num_events < 0) break;
+
+		/*
+		 *	Service outstanding events.  This reads
+		 *	packets and sends them to the workers, and
+		 *	receives replies from the workers.
+		 */
+		if (num_events > 0) fr_event_service(rc->el);
+
+		fr_receiver_read_pending(rc);
+
+		fr_receiver_write_replies(rc);
 	}
 }
 
@@ -564,9 +1128,23 @@ int fr_receiver_socket_add(fr_receiver_t *rc, int fd, void *ctx, fr_transport_t
 {
 	fr_receiver_socket_t m;
 
+	memset(&m, 0, sizeof(m));
 	m.fd = fd;
 	m.ctx = ctx;
 	m.transport = transport;
 
 	return fr_control_message_send(rc->control, rc->rb, FR_CONTROL_ID_SOCKET, &m, sizeof(m));
 }
+
+/** Add a worker to a receiver
+ *
+ *  The receiver creates a channel to the worker, and then sends it
+ *  packets based on how busy it is.
+ *
+ * @param rc the receiver
+ * @param worker the worker
+ */
+int fr_receiver_worker_add(fr_receiver_t *rc, fr_worker_t *worker)
+{
+	return fr_control_message_send(rc->control, rc->rb, FR_CONTROL_ID_WORKER, &worker, sizeof(worker));
+}
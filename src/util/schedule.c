@@ -31,9 +31,13 @@ RCSID("$Id$")
 #include <freeradius-devel/rbtree.h>
 
 #include <freeradius-devel/util/receiver.h>
+#include <freeradius-devel/util/control.h>
 
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
 #define PTHREAD_MUTEX_LOCK   pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
 
@@ -104,6 +108,9 @@ typedef struct fr_schedule_worker_t {
 typedef struct fr_schedule_receiver_t {
 	pthread_t	pthread_id;		//!< the thread of this receiver
 
+	int		id;			//!< a unique ID
+	int		num_sockets;		//!< how many sockets this receiver is reading from
+
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
 
 	fr_schedule_child_status_t status;	//!< status of the worker
@@ -125,19 +132,26 @@ struct fr_schedule_t {
 	int		num_workers;		//!< number of worker threads
 	int		num_workers_exited;	//!< number of exited workers
 
+	int		num_siblings;		//!< number of workers which know about each other
+	int		num_workers_destroyed;	//!< number of those workers which have been destroyed
+
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t	mutex;			//!< for thread safey
+	pthread_cond_t	destroyed;		//!< signalled when a worker has been destroyed
 
 	sem_t		semaphore;		//!< for inter-thread signaling
 #endif
 
+	fr_ring_buffer_t *rb;			//!< for control-plane messages we send to workers
+
 	fr_schedule_thread_instantiate_t	worker_thread_instantiate;	//!< thread instantiation callback
 	void					*worker_instantiate_ctx;	//!< thread instantiation context
 
 	fr_heap_t	*workers;		//!< heap of workers
 	fr_heap_t	*done_workers;		//!< heap of done workers
 
-	fr_schedule_receiver_t *sr;		//!< pointer to the (one) network thread
+	int		num_inputs;		//!< number of running network threads
+	fr_schedule_receiver_t **sr;		//!< array of network threads
 
 	uint32_t	num_transports;		//!< how many transport layers we have
 	fr_transport_t	**transports;		//!< array of active transports.
@@ -249,6 +263,18 @@ static void *fr_schedule_worker_thread(void *arg)
 	 *	things are freed in a specific order.
 	 */
 	fr_worker_destroy(sw->worker);
+
+	/*
+	 *	The other workers may still look at the messages we
+	 *	offered them, so the worker can't be freed until they
+	 *	have all been destroyed, too.
+	 */
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	sc->num_workers_destroyed++;
+	pthread_cond_broadcast(&sc->destroyed);
+	while (sc->num_workers_destroyed < sc->num_siblings) pthread_cond_wait(&sc->destroyed, &sc->mutex);
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
 	sw->worker = NULL;
 
 	/*
@@ -296,6 +322,8 @@ static void *fr_schedule_receiver_thread(void *arg)
 	fr_schedule_t *sc = sr->sc;
 	fr_schedule_child_status_t status = FR_CHILD_FAIL;
 
+	fr_log(sc->log, L_DBG, "Network %d starting\n", sr->id);
+
 	ctx = talloc_init("receiver");
 	if (!ctx) goto fail;
 
@@ -401,6 +429,12 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 		return NULL;
 	}
 
+	rcode = pthread_cond_init(&sc->destroyed, NULL);
+	if (rcode != 0) {
+		talloc_free(sc);
+		return NULL;
+	}
+
 	/*
 	 *	Create the heap which holds the workers.
 	 */
@@ -514,21 +548,107 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
 	/*
-	 *	Create the network thread
+	 *	Create the network threads.  Each one reads from its
+	 *	own set of sockets.
 	 */
-	sc->sr = talloc_zero(sc, fr_schedule_receiver_t);
-	sc->sr->sc = sc;
-	
-	rcode = pthread_create(&sc->sr->pthread_id, &attr, fr_schedule_receiver_thread, sc->sr);
-	if (rcode != 0) goto fail;
-
-	SEM_WAIT_INTR(&sc->semaphore);
-	if (sc->sr->status != FR_CHILD_RUNNING) {
-	fail:
-		TALLOC_FREE(sc->sr);
+	sc->sr = talloc_zero_array(sc, fr_schedule_receiver_t *, sc->max_inputs);
+	if (!sc->sr) {
+		fr_schedule_destroy(sc);
+		return NULL;
+	}
+
+	for (i = 0; i < sc->max_inputs; i++) {
+		fr_schedule_receiver_t *sr;
+
+		fr_log(sc->log, L_DBG, "Creating %d/%d networks\n", i, sc->max_inputs);
+
+		sr = talloc_zero(sc, fr_schedule_receiver_t);
+		if (!sr) break;
+
+		sr->id = i;
+		sr->sc = sc;
+		sr->status = FR_CHILD_INITIALIZING;
+
+		rcode = pthread_create(&sr->pthread_id, &attr, fr_schedule_receiver_thread, sr);
+		if (rcode != 0) {
+			fr_log(sc->log, L_DBG, "Failed to create network %d: %s\n", i, strerror(errno));
+			talloc_free(sr);
+			break;
+		}
+
+		SEM_WAIT_INTR(&sc->semaphore);
+
+		/*
+		 *	The thread has signalled us, and exited.
+		 */
+		if (sr->status != FR_CHILD_RUNNING) {
+			talloc_free(sr);
+			break;
+		}
+
+		sc->sr[sc->num_inputs++] = sr;
+	}
+
+	if (sc->num_inputs != sc->max_inputs) {
+		fr_log(sc->log, L_DBG, "ERROR: Failed to create some networks\n");
 		fr_schedule_destroy(sc);
 		return NULL;
 	}
+
+	/*
+	 *	Tell each network thread about all of the workers.  It
+	 *	will open a channel to each one, and then send packets
+	 *	to the least loaded worker.
+	 */
+	{
+		int j;
+		fr_schedule_worker_t **sw_array;
+
+		sw_array = talloc_array(sc, fr_schedule_worker_t *, num_workers);
+		sc->rb = fr_ring_buffer_create(sc, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+		if (!sw_array || !sc->rb) {
+			fr_schedule_destroy(sc);
+			return NULL;
+		}
+
+		PTHREAD_MUTEX_LOCK(&sc->mutex);
+		for (i = 0; i < num_workers; i++) {
+			sw_array[i] = fr_heap_pop(sc->workers);
+			rad_assert(sw_array[i] != NULL);
+
+			for (j = 0; j < sc->num_inputs; j++) {
+				if (fr_receiver_worker_add(sc->sr[j]->rc, sw_array[i]->worker) < 0) {
+					fr_log(sc->log, L_DBG, "Failed adding worker %d to network %d\n",
+					       sw_array[i]->id, j);
+				} else {
+					sw_array[i]->uses++;
+				}
+			}
+		}
+
+		/*
+		 *	Tell each worker about the other ones, so
+		 *	that idle workers can steal from busy ones.
+		 */
+		sc->num_siblings = num_workers;
+		for (i = 0; i < num_workers; i++) {
+			for (j = 0; j < num_workers; j++) {
+				if (i == j) continue;
+
+				if (fr_worker_sibling_add(sw_array[i]->worker, sc->rb, sw_array[j]->worker) < 0) {
+					fr_log(sc->log, L_DBG, "Failed adding worker %d to worker %d\n",
+					       sw_array[j]->id, sw_array[i]->id);
+				}
+			}
+		}
+
+		for (i = 0; i < num_workers; i++) {
+			(void) fr_heap_insert(sc->workers, sw_array[i]);
+		}
+		PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+		talloc_free(sw_array);
+	}
 #endif
 
 	fr_log(sc->log, L_DBG, "Scheduler created successfully\n");
@@ -578,14 +698,17 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	}
 
 	/*
-	 *	If the network thread is running, tell it to exit.
+	 *	Tell the running network threads to exit.
 	 */
-	if (sc->sr->status == FR_CHILD_RUNNING) {
-		fr_receiver_exit(sc->sr->rc);
+	for (i = 0; i < sc->num_inputs; i++) {
+		if (sc->sr[i]->status != FR_CHILD_RUNNING) continue;
+
+		fr_receiver_exit(sc->sr[i]->rc);
 		SEM_WAIT_INTR(&sc->semaphore);
 	}
 
 	sem_destroy(&sc->semaphore);
+	pthread_cond_destroy(&sc->destroyed);
 #endif	/* HAVE_PTHREAD_H */
 
 	/*
@@ -598,15 +721,88 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 }
 
 /** Add a socket to a scheduler.
+ *
+ *  The socket is given to the network thread which has the fewest
+ *  sockets.  Adding one SO_REUSEPORT socket per network thread
+ *  therefore gives each network thread its own shard of the
+ *  clients.  All packets from a client go to the same socket, so
+ *  each network thread sees all of the retransmissions from the
+ *  clients it is responsible for.
  *
  * @param sc the scheduler
  * @param fd the file descriptor for the socket
  * @param ctx the context for the transport
  * @param transport the transport
+ * @return
+ *	- <0 on error
+ *	- the ID of the network thread which is reading the socket.
  */
 int fr_schedule_socket_add(fr_schedule_t *sc, int fd, void *ctx, fr_transport_t *transport)
 {
-	return fr_receiver_socket_add(sc->sr->rc, fd, ctx, transport);
+	int i;
+	fr_schedule_receiver_t *sr;
+
+	if (!sc->num_inputs) return -1;
+
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	sr = sc->sr[0];
+	for (i = 1; i < sc->num_inputs; i++) {
+		if (sc->sr[i]->num_sockets < sr->num_sockets) sr = sc->sr[i];
+	}
+	sr->num_sockets++;
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+	if (fr_receiver_socket_add(sr->rc, fd, ctx, transport) < 0) {
+		PTHREAD_MUTEX_LOCK(&sc->mutex);
+		sr->num_sockets--;
+		PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+		return -1;
+	}
+
+	return sr->id;
+}
+
+/** Pin the network threads to CPUs
+ *
+ *  Network thread "i" is pinned to cpus[i % num_cpus].  Pinning each
+ *  network thread to the CPU which services the NIC queue for its
+ *  shard keeps the packets in that CPUs cache.
+ *
+ * @param sc the scheduler
+ * @param cpus the array of CPU numbers
+ * @param num_cpus the number of entries in the array
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_schedule_network_affinity(fr_schedule_t *sc, int const *cpus, int num_cpus)
+{
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_SET)
+	int i, rcode;
+
+	if (num_cpus <= 0) return -1;
+
+	for (i = 0; i < sc->num_inputs; i++) {
+		cpu_set_t cpuset;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpus[i % num_cpus], &cpuset);
+
+		rcode = pthread_setaffinity_np(sc->sr[i]->pthread_id, sizeof(cpuset), &cpuset);
+		if (rcode != 0) {
+			fr_log(sc->log, L_DBG, "Failed pinning network %d to CPU %d: %s\n",
+			       i, cpus[i % num_cpus], strerror(rcode));
+			return -1;
+		}
+
+		fr_log(sc->log, L_DBG, "Network %d pinned to CPU %d\n", i, cpus[i % num_cpus]);
+	}
+
+	return 0;
+#else
+	fr_log(sc->log, L_DBG, "Pinning threads to CPUs is not supported on this system\n");
+	return -1;
+#endif
 }
 
 
@@ -44,6 +44,7 @@ int fr_schedule_destroy(fr_schedule_t *sc);
 int fr_schedule_get_worker_kq(fr_schedule_t *sc);
 
 int fr_schedule_socket_add(fr_schedule_t *sc, int fd, void *ctx, fr_transport_t *transport) CC_HINT(nonnull);
+int fr_schedule_network_affinity(fr_schedule_t *sc, int const *cpus, int num_cpus) CC_HINT(nonnull);
 
 #ifdef __cplusplus
 }
@@ -26,38 +26,160 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/track.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/hash.h>
+
+#if !defined(NDEBUG) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+/*
+ *	The number of slots in the expiry wheel.  Must be a power of 2.
+ */
+#define FR_TRACKING_WHEEL_SLOTS (64)
+
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
 
 /**
  *  RADIUS-specific tracking table.
  *
- *  It's a fixed-size array of 256 entries, indexed by ID.  Which
- *  means we don't need to store ID in the table.  We also don't
- *  need to store the packet type, as we assume that we have a
- *  unique tracking table per packet type.
+ *  Packets are tracked by (client IP, client port, code, ID).  The
+ *  authentication vector and length are used to tell if a packet is
+ *  a retransmission of an existing one, or a new packet re-using the
+ *  same ID.
+ *
+ *  When a reply is sent, a copy of it is cached in the entry.
+ *  Retransmissions of the request can then be answered directly from
+ *  the cache, without the request going to a worker.
  *
- *  @todo add a "reply" heap / list, ordered by when we need to
- *  clean up the replies.  The heap should contain nothing more than
- *  the time and the ID of the packet which needs cleaning up.
+ *  Every entry is put into an expiry wheel when it is inserted, in
+ *  the slot for when it should be cleaned up.  Entries for requests
+ *  which are never answered are therefore cleaned up, too.  When a
+ *  reply is cached, the entry is moved to a later slot, so that the
+ *  reply is kept for cleanup_delay.  The width of a slot is chosen
+ *  so that cleanup_delay spans half of the wheel.  Insertion
+ *  and removal are therefore O(1), and expiry only looks at the slots
+ *  which have passed, and the current one.  Deleted entries go onto a free list, and are
+ *  re-used for new packets.
  *
- *  @todo add an "allocation" heap, ordered by when the entry was
- *  freed.  This is so that new allocations are O(1), and use the
- *  oldest unused ID.
+ *  If max_entries is set, packets which would need a new entry are
+ *  refused once the table holds that many.  Retransmissions and
+ *  packets re-using an existing entry are still tracked.
+ *
+ *  The table has no locking.  When the packets for one port are
+ *  spread across multiple SO_REUSEPORT sockets, each network thread
+ *  has its own tracking table.  The kernel sends all packets from a
+ *  client to the same socket, so retransmissions are always seen by
+ *  the table which saw the original packet.
  */
 struct fr_tracking_t {
 	int		num_entries;	//!< number of used entries.
+	uint32_t	max_entries;	//!< maximum number of used entries, or 0 for no limit
+
+	fr_hash_table_t	*table;		//!< entries, indexed by client / code / ID
+
+	fr_time_t	cleanup_delay;	//!< how long replies are cached for
+	fr_time_t	tick;		//!< width of one slot in the wheel
+	uint64_t	wheel_now;	//!< the last tick which was expired
+
+	fr_dlist_t	wheel[FR_TRACKING_WHEEL_SLOTS];	//!< entries, by when they expire
+	fr_dlist_t	free;		//!< unused entries
 
-	fr_tracking_entry_t packet[256];
+#if !defined(NDEBUG) && defined(HAVE_PTHREAD_H)
+	bool		owned;		//!< whether the table has been used yet
+	pthread_t	owner;		//!< the only thread which may use the table
+#endif
 };
 
-/** Create a tracking table for one type of RADIUS packets.
+#if !defined(NDEBUG) && defined(HAVE_PTHREAD_H)
+/** Check that the tracking table isn't being shared across threads
+ *
+ *  The first thread to use the table becomes its owner.
+ *
+ * @param[in] ft the tracking table
+ */
+static void fr_radius_tracking_owner_check(fr_tracking_t *ft)
+{
+	if (!ft->owned) {
+		ft->owner = pthread_self();
+		ft->owned = true;
+		return;
+	}
+
+	rad_assert(pthread_equal(ft->owner, pthread_self()));
+}
+#define OWNER_CHECK(_ft) fr_radius_tracking_owner_check(_ft)
+#else
+#define OWNER_CHECK(_ft)
+#endif
+
+static uint32_t entry_hash(void const *data)
+{
+	uint32_t hash;
+	fr_tracking_entry_t const *entry = data;
+
+	hash = fr_hash(&entry->src_port, sizeof(entry->src_port));
+	hash = fr_hash_update(&entry->code, sizeof(entry->code), hash);
+	hash = fr_hash_update(&entry->id, sizeof(entry->id), hash);
+
+	if (entry->src_ipaddr.af == AF_INET) {
+		return fr_hash_update(&entry->src_ipaddr.ipaddr.ip4addr, sizeof(entry->src_ipaddr.ipaddr.ip4addr), hash);
+	}
+
+	return fr_hash_update(&entry->src_ipaddr.ipaddr.ip6addr, sizeof(entry->src_ipaddr.ipaddr.ip6addr), hash);
+}
+
+static int entry_cmp(void const *one, void const *two)
+{
+	fr_tracking_entry_t const *a = one;
+	fr_tracking_entry_t const *b = two;
+
+	if (a->id < b->id) return -1;
+	if (a->id > b->id) return +1;
+
+	if (a->code < b->code) return -1;
+	if (a->code > b->code) return +1;
+
+	if (a->src_port < b->src_port) return -1;
+	if (a->src_port > b->src_port) return +1;
+
+	return fr_ipaddr_cmp(&a->src_ipaddr, &b->src_ipaddr);
+}
+
+/** Put an entry into the expiry wheel
+ *
+ *  An entry which is already in the wheel is moved.  An entry which
+ *  expires in a tick which has already been expired is cleaned up on
+ *  the next one.
+ *
+ * @param[in] ft the tracking table
+ * @param[in] entry to schedule
+ * @param[in] expires when the entry should be deleted
+ */
+static void fr_radius_tracking_wheel_insert(fr_tracking_t *ft, fr_tracking_entry_t *entry, fr_time_t expires)
+{
+	uint64_t slot;
+
+	entry->expires = expires;
+
+	slot = expires / ft->tick;
+	if (slot <= ft->wheel_now) slot = ft->wheel_now + 1;
+
+	FR_DLIST_REMOVE(entry->list);
+	FR_DLIST_INSERT_TAIL(ft->wheel[slot & (FR_TRACKING_WHEEL_SLOTS - 1)], entry->list);
+}
+
+/** Create a tracking table for RADIUS packets.
  *
  * @param[in] ctx the talloc ctx
+ * @param[in] cleanup_delay how long replies are cached for
+ * @param[in] max_entries the maximum number of packets to track, or 0 for no limit
  * @return
  *	- NULL on error
  *	- fr_tracking_t * on success
  */
-fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx)
+fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, fr_time_t cleanup_delay, uint32_t max_entries)
 {
+	int i;
 	fr_tracking_t *ft;
 
 	if (!ctx) return NULL;
@@ -65,74 +187,135 @@ fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx)
 	ft = talloc_zero(ctx, fr_tracking_t);
 	if (!ft) return NULL;
 
+	ft->table = fr_hash_table_create(ft, entry_hash, entry_cmp, NULL);
+	if (!ft->table) {
+		talloc_free(ft);
+		return NULL;
+	}
+
+	ft->cleanup_delay = cleanup_delay;
+	ft->max_entries = max_entries;
+
+	ft->tick = cleanup_delay / (FR_TRACKING_WHEEL_SLOTS / 2);
+	if (!ft->tick) ft->tick = 1;
+
+	for (i = 0; i < FR_TRACKING_WHEEL_SLOTS; i++) {
+		FR_DLIST_INIT(ft->wheel[i]);
+	}
+	FR_DLIST_INIT(ft->free);
+
 	ft->num_entries = 0;
 	return ft;
 }
 
 /** Delete an entry from the tracking table.
+ *
+ *  The entry is put onto the free list, so pointers to it remain
+ *  valid.  Its timestamp is set to zero.
  *
  * @param[in] ft the tracking table
- * @param[in] id the ID of the entry to delete
+ * @param[in] entry the entry to delete
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_tracking_entry_delete(fr_tracking_t *ft, uint8_t id)
+int fr_radius_tracking_entry_delete(fr_tracking_t *ft, fr_tracking_entry_t *entry)
 {
-	fr_tracking_entry_t *entry;
-
 #ifndef NDEBUG
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
 #endif
+	OWNER_CHECK(ft);
 
-	entry = &ft->packet[id];
 	if (entry->timestamp == 0) return -1;
 
+	(void) fr_hash_table_delete(ft->table, entry);
+
 	entry->timestamp = 0;
+	entry->replied = false;
+	entry->reply_len = 0;
 	ft->num_entries--;
 
 	/*
-	 *	Mark the reply (if any) as done.
+	 *	Remove it from the wheel, and add it to the free list.
 	 */
-	if (entry->reply) {
-		fr_message_done(&entry->reply->m);
-		entry->reply = NULL;
-	}
+	FR_DLIST_REMOVE(entry->list);
+	FR_DLIST_INSERT_HEAD(ft->free, entry->list);
 
 	return 0;
 }
 
 /** Insert a (possibly new) packet and a timestamp
+ *
+ *  New entries, and entries re-used for a different packet, are
+ *  scheduled to expire cleanup_delay after the timestamp.  If the
+ *  request is answered, fr_radius_tracking_entry_reply() moves the
+ *  expiry to cleanup_delay after the reply.
  *
  * @param[in] ft the tracking table
  * @param[in] packet the packet to insert
  * @param[in] timestamp when this packet was received
+ * @param[in] src_ipaddr the client IP address
+ * @param[in] src_port the client port
  * @param[out] p_entry pointer to newly inserted entry.
  * @return
- *	- FR_TRACKING_UNUSED, there was an error inserting the element
+ *	- FR_TRACKING_UNUSED, there was an error inserting the element, or the table is full
  *	- FR_TRACKING_NEW, a new entry was created
  *	- FR_TRACKING_SAME, the packet is the same as one already in the tracking table
  *	- FR_TRACKING_DIFFERENT, the old packet was deleted, and the newer packet inserted
  */
-fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t *packet, fr_time_t timestamp,
+fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t const *packet, fr_time_t timestamp,
+						     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
 						     fr_tracking_entry_t **p_entry)
 {
-	fr_tracking_entry_t *entry;
+	fr_tracking_entry_t *entry, my_entry;
+	fr_dlist_t *head;
 
 #ifndef NDEBUG
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
 #endif
+	OWNER_CHECK(ft);
 
-	entry = &ft->packet[packet[1]];
+	my_entry.src_ipaddr = *src_ipaddr;
+	my_entry.src_port = src_port;
+	my_entry.code = packet[0];
+	my_entry.id = packet[1];
+
+	entry = fr_hash_table_finddata(ft->table, &my_entry);
+	if (!entry) {
+		if (ft->max_entries && ((uint32_t) ft->num_entries >= ft->max_entries)) return FR_TRACKING_UNUSED;
+
+		/*
+		 *	Re-use a free entry if we can.
+		 */
+		head = FR_DLIST_FIRST(ft->free);
+		if (head) {
+			entry = fr_ptr_to_type(fr_tracking_entry_t, list, head);
+			FR_DLIST_REMOVE(entry->list);
+		} else {
+			entry = talloc_zero(ft, fr_tracking_entry_t);
+			if (!entry) return FR_TRACKING_UNUSED;
+
+			FR_DLIST_INIT(entry->list);
+		}
+
+		entry->src_ipaddr = *src_ipaddr;
+		entry->src_port = src_port;
+		entry->code = packet[0];
+		entry->id = packet[1];
+
+		if (!fr_hash_table_insert(ft->table, entry)) {
+			FR_DLIST_INSERT_HEAD(ft->free, entry->list);
+			return FR_TRACKING_UNUSED;
+		}
 
-	/*
-	 *	The entry is unused, insert it.
-	 */
-	if (entry->timestamp == 0) {
 		entry->timestamp = timestamp;
-		memcpy(&entry->data[0], packet + 2, 18);
+		entry->replied = false;
+		entry->reply_len = 0;
+		memcpy(&entry->data[0], packet + 2, sizeof(entry->data));
 		*p_entry = entry;
 
+		fr_radius_tracking_wheel_insert(ft, entry, timestamp + ft->cleanup_delay);
+
 		ft->num_entries++;
 		return FR_TRACKING_NEW;
 	}
@@ -140,7 +323,7 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t
 	/*
 	 *	Is it the same packet?  If so, return that.
 	 */
-	if (memcmp(packet + 2, &entry->data[0], 18) == 0) {
+	if (memcmp(packet + 2, &entry->data[0], sizeof(entry->data)) == 0) {
 		*p_entry = entry;
 		return FR_TRACKING_SAME;
 	}
@@ -152,43 +335,145 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t
 	 */
 	entry->timestamp = timestamp;
 
+	/*
+	 *	The old reply is no longer relevant, either.
+	 */
+	entry->replied = false;
+	entry->reply_len = 0;
+	fr_radius_tracking_wheel_insert(ft, entry, timestamp + ft->cleanup_delay);
+
 	/*
 	 *	Copy the new packet over top of the old one.
 	 */
-	memcpy(&entry->data[0], packet + 2, 18);
+	memcpy(&entry->data[0], packet + 2, sizeof(entry->data));
 	*p_entry = entry;
 
 	return FR_TRACKING_DIFFERENT;
 }
 
-/** Insert a (possibly new) packet and a timestamp
+/** Cache a reply for an entry, and reschedule it for cleanup.
+ *
+ *  If the entry has since been used for a different packet, or has
+ *  expired, the reply is ignored.
  *
  * @param[in] ft the tracking table
- * @param[in] id the ID of the entry which this reply is for
- * @param[in] cd the reply message
+ * @param[in] entry the entry which this reply is for
+ * @param[in] timestamp the timestamp of the request which this reply is for
+ * @param[in] reply the reply packet.  May be NULL if no reply was sent.
+ * @param[in] reply_len the length of the reply packet.
+ * @param[in] now the current time
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_tracking_entry_reply(fr_tracking_t *ft, uint8_t id,
-				   fr_channel_data_t *cd)
+int fr_radius_tracking_entry_reply(fr_tracking_t *ft, fr_tracking_entry_t *entry, fr_time_t timestamp,
+				   uint8_t const *reply, size_t reply_len, fr_time_t now)
 {
-	fr_tracking_entry_t *entry;
-
 #ifndef NDEBUG
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
 #endif
+	OWNER_CHECK(ft);
+
+	if (entry->timestamp != timestamp) return 0;
 
-	entry = &ft->packet[id];
+	rad_assert(!entry->replied);
 
-	if (entry->timestamp != cd->reply.request_time) {
-		fr_message_done(&cd->m);
-		return 0;
+	if (!reply) reply_len = 0;
+
+	if (reply_len > entry->reply_size) {
+		talloc_free(entry->reply);
+
+		entry->reply = talloc_array(entry, uint8_t, reply_len);
+		if (!entry->reply) {
+			entry->reply_size = 0;
+			return -1;
+		}
+		entry->reply_size = reply_len;
 	}
 
-	rad_assert(entry->reply == NULL);
+	if (reply_len) memcpy(entry->reply, reply, reply_len);
+	entry->reply_len = reply_len;
+	entry->replied = true;
 
-	entry->reply = cd;
+	/*
+	 *	Keep the reply for cleanup_delay from now.
+	 */
+	fr_radius_tracking_wheel_insert(ft, entry, now + ft->cleanup_delay);
 
 	return 0;
 }
+
+/** Delete all of the entries which have expired.
+ *
+ * @param[in] ft the tracking table
+ * @param[in] now the current time
+ * @return
+ *	- the number of entries which were deleted.
+ */
+int fr_radius_tracking_expire(fr_tracking_t *ft, fr_time_t now)
+{
+	int expired = 0;
+	bool pending = false;
+	uint64_t tick, last;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(ft, fr_tracking_t);
+#endif
+	OWNER_CHECK(ft);
+
+	last = now / ft->tick;
+	if (last <= ft->wheel_now) return 0;
+
+	/*
+	 *	We don't need to go around the wheel more than once.
+	 */
+	tick = ft->wheel_now + 1;
+	if ((last - tick) >= FR_TRACKING_WHEEL_SLOTS) tick = last - FR_TRACKING_WHEEL_SLOTS + 1;
+
+	for (/* nothing */; tick <= last; tick++) {
+		fr_dlist_t *head, *next;
+		int slot = tick & (FR_TRACKING_WHEEL_SLOTS - 1);
+
+		/*
+		 *	The slot may also contain entries for a later
+		 *	trip around the wheel.  Leave those alone.
+		 *
+		 *	The current tick hasn't finished, so its slot
+		 *	may have entries which aren't due yet.
+		 */
+		for (head = FR_DLIST_FIRST(ft->wheel[slot]); head != NULL; head = next) {
+			fr_tracking_entry_t *entry;
+
+			next = FR_DLIST_NEXT(ft->wheel[slot], head);
+
+			entry = fr_ptr_to_type(fr_tracking_entry_t, list, head);
+			if (entry->expires > now) {
+				if ((entry->expires / ft->tick) <= last) pending = true;
+				continue;
+			}
+
+			(void) fr_radius_tracking_entry_delete(ft, entry);
+			expired++;
+		}
+	}
+
+	/*
+	 *	Look at the current slot again on the next call, so
+	 *	that its remaining entries are deleted on time, and
+	 *	not on the next trip around the wheel.
+	 */
+	ft->wheel_now = pending ? last - 1 : last;
+
+	return expired;
+}
+
+/** Return the number of entries in the tracking table.
+ *
+ * @param[in] ft the tracking table
+ * @return
+ *	- the number of used entries.
+ */
+int fr_radius_tracking_num_entries(fr_tracking_t *ft)
+{
+	return ft->num_entries;
+}
@@ -25,7 +25,10 @@
  */
 RCSIDH(track_h, "$Id$")
 
-#include <freeradius-devel/util/channel.h>
+#include <talloc.h>
+
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/inet.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,13 +40,27 @@ typedef struct fr_tracking_t fr_tracking_t;
  *  An entry for the tracking table.  It contains the minimum
  *  information required to track RADIUS packets.
  *
- *  @todo include event information, so that this tracking entry can
- *  be cleaned up at an appropriate time.
+ *  Entries are never freed while the table exists, so a packet
+ *  context can hold a pointer to one.  The caller should also
+ *  remember the timestamp, so that it can tell if the entry has
+ *  since been re-used for a different packet.
  */
 typedef struct fr_tracking_entry_t {
 	fr_time_t		timestamp;	//!< when the request was received
-	fr_channel_data_t	*reply;		//!< the reply (if any)
+	fr_time_t		expires;	//!< when the entry will be deleted
+
+	fr_dlist_t		list;		//!< for the expiry wheel, or the free list
+
+	fr_ipaddr_t		src_ipaddr;	//!< client IP address
+	uint16_t		src_port;	//!< client port
+	uint8_t			code;		//!< packet code
+	uint8_t			id;		//!< packet ID
 	uint8_t			data[18];	//!< 2 byte length + authentication vector
+
+	bool			replied;	//!< whether there's a reply
+	uint8_t			*reply;		//!< the cached reply (if any)
+	size_t			reply_len;	//!< length of the cached reply
+	size_t			reply_size;	//!< size of the reply buffer
 } fr_tracking_entry_t;
 
 /**
@@ -56,12 +73,15 @@ typedef enum fr_tracking_status_t {
 	FR_TRACKING_DIFFERENT,
 } fr_tracking_status_t;
 
-fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx);
-int fr_radius_tracking_entry_delete(fr_tracking_t *ft, uint8_t id) CC_HINT(nonnull);
-fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t *packet, fr_time_t timestamp,
+fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, fr_time_t cleanup_delay, uint32_t max_entries);
+int fr_radius_tracking_entry_delete(fr_tracking_t *ft, fr_tracking_entry_t *entry) CC_HINT(nonnull);
+fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t const *packet, fr_time_t timestamp,
+						     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
 						     fr_tracking_entry_t **p_entry) CC_HINT(nonnull);
-int fr_radius_tracking_entry_reply(fr_tracking_t *ft, uint8_t id,
-				   fr_channel_data_t *cd) CC_HINT(nonnull);
+int fr_radius_tracking_entry_reply(fr_tracking_t *ft, fr_tracking_entry_t *entry, fr_time_t timestamp,
+				   uint8_t const *reply, size_t reply_len, fr_time_t now) CC_HINT(nonnull(1,2));
+int fr_radius_tracking_expire(fr_tracking_t *ft, fr_time_t now) CC_HINT(nonnull);
+int fr_radius_tracking_num_entries(fr_tracking_t *ft) CC_HINT(nonnull);
 
 #ifdef __cplusplus
 }
@@ -66,8 +66,41 @@ typedef struct fr_transport_t fr_transport_t;
 
 /**
  *  Read a packet from the network into a buffer.
+ *
+ *  The transport allocates (and owns) the packet context, which is
+ *  passed to the decode / encode / nak functions, and to the write
+ *  function when the reply comes back.
+ */
+typedef ssize_t (*fr_transport_read_t)(int sockfd, void *ctx, void **packet_ctx, uint8_t *buffer, size_t buffer_len);
+
+/**
+ *  Read multiple packets from the network into a buffer.
+ *
+ *  The buffer is split into "num" slots of "slot_size" bytes.  Packet
+ *  "i" is read into slot "i", and its packet context and length are
+ *  written to packet_ctx[i] and data_size[i].  A packet which should
+ *  be ignored has data_size[i] of zero, and no packet context.
+ *
+ *  Returns the number of slots used, 0 for no packets, or <0 on error.
+ */
+typedef int (*fr_transport_read_batch_t)(int sockfd, void *ctx, void **packet_ctx, size_t *data_size,
+					 uint8_t *buffer, size_t slot_size, int num);
+
+/**
+ *  Write a reply to the network.  If buffer_len is zero, no reply is
+ *  sent, but the packet context is still cleaned up.
+ */
+typedef ssize_t (*fr_transport_write_t)(void *packet_ctx, uint8_t *buffer, size_t buffer_len);
+
+/**
+ *  Write multiple replies to the network.  Reply "i" is in buffer[i],
+ *  with length buffer_len[i].  As with the write function, a
+ *  buffer_len of zero means that no reply is sent, but the packet
+ *  context is still cleaned up.
+ *
+ *  Returns the number of replies sent, or <0 on error.
  */
-//typedef int (*fr_transport_read_t)(int fd, fr_io_buffer_t *io);
+typedef int (*fr_transport_write_batch_t)(void **packet_ctx, uint8_t **buffer, size_t *buffer_len, int num);
 
 /**
  *  Process raw packets into a form suitable
@@ -119,6 +152,10 @@ typedef	fr_transport_final_t (*fr_transport_process_t)(REQUEST *, fr_transport_a
 typedef struct fr_transport_t {
 	char const			*name;		//!< name of this transport
 	uint32_t			id;		//!< ID of this transport
+	fr_transport_read_t		read;		//!< function to read a packet from the network (master)
+	fr_transport_read_batch_t	read_batch;	//!< function to read multiple packets from the network (master)
+	fr_transport_write_t		write;		//!< function to write a reply to the network (master)
+	fr_transport_write_batch_t	write_batch;	//!< function to write multiple replies to the network (master)
 	fr_transport_recv_request_t	recv_request;	//!< function to receive a request (worker -> master)
 	fr_transport_decode_t		decode;		//!< function to decode packet to request (worker)
 	fr_transport_encode_t		encode;		//!< function to encode request to packet (worker)
@@ -163,6 +200,7 @@ struct rad_request {
 	fr_channel_t		*channel;
 	void			*packet_ctx;
 	fr_transport_t		*transport;
+	void			*owner;			//!< worker which owns the channel, if the request was stolen
 };
 #endif
 
@@ -57,10 +57,28 @@
  *  yeilded, it is placed onto the yielded list in the worker
  *  "tracking" data structure.
  *
+ *  When a worker has a backlog of messages to decode, it offers the
+ *  newest ones to the other workers, via a lock-free queue.  Workers
+ *  which would otherwise go to sleep steal messages from that queue.
+ *  Only the owner of a channel may write to it, so the thief sends
+ *  its reply back to the owner via the control plane, and the owner
+ *  sends the reply to the network thread.  Messages which nobody
+ *  steals are taken back when the owner checks its timeouts.
+ *
+ *  Workers look at each other's queues, so the scheduler doesn't free
+ *  any worker until all of them have been destroyed.  A worker being
+ *  destroyed waits for the messages other workers stole from it.
+ *
  * @copyright 2016 Alan DeKok <aland@freeradius.org>
  */
 RCSID("$Id$")
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #include <freeradius-devel/util/worker.h>
 #include <freeradius-devel/util/channel.h>
 #include <freeradius-devel/util/control.h>
@@ -76,6 +94,12 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
+/*
+ *	Offer messages to other workers when we have this many
+ *	waiting to be decoded.
+ */
+#define WORKER_STEAL_THRESHOLD	(8)
+
 /**
  *  Track things by priority and time.
  */
@@ -95,7 +119,20 @@ struct fr_worker_t {
 
 	fr_control_t		*control;	//!< the control plane
 
-	fr_message_set_t	*ms;		//!< replies are allocated from here.
+	fr_ring_buffer_t	*rb_peer;	//!< ring buffer for control-plane messages I send to other workers
+
+	fr_message_set_t	*ms;		//!< replies to stolen requests are allocated from here.
+
+	fr_atomic_queue_t	*aq_steal;	//!< messages which other workers may steal from us
+	atomic_int		num_offered;	//!< number of messages in aq_steal
+	atomic_int		num_lent;	//!< number of our messages which other workers stole, and
+						//!< haven't yet replied to.
+	atomic_bool		sleeping;	//!< we're waiting for events, and have nothing to do
+	bool			exiting;	//!< we're being destroyed, so don't offer any more messages.
+
+	fr_worker_t		**siblings;	//!< other workers we can steal from
+	int			num_siblings;	//!< number of other workers
+	int			next_sibling;	//!< where we start looking for work to steal
 
 	fr_event_list_t		*el;		//!< our event list
 
@@ -121,6 +158,10 @@ struct fr_worker_t {
 	int			num_decoded;	//!< number of messages which have been decoded
 	int			num_replies;	//!< number of messages which were replied to
 	int			num_timeouts;	//!< number of messages which timed out
+	int			num_stolen;	//!< number of messages we stole from other workers
+	int			num_given;	//!< number of our messages which other workers processed
+
+	fr_time_t		created;	//!< when the worker was created
 
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
@@ -158,6 +199,154 @@ struct fr_worker_t {
                FR_DLIST_REMOVE(_var->_member); \
        } while (0)
 
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
+
+
+/** Offer a message to the other workers
+ *
+ *  If nobody was looking at our queue, wake up a sleeping worker so
+ *  that it can steal the message.  If nobody steals it, we take it
+ *  back when we run out of other work.
+ *
+ * @param[in] worker the worker
+ * @param[in] cd the message to offer
+ * @return
+ *	- true if the message was offered
+ *	- false if the queue is full
+ */
+static bool fr_worker_offer(fr_worker_t *worker, fr_channel_data_t *cd)
+{
+	int i;
+
+	if (!fr_atomic_queue_push(worker->aq_steal, cd)) return false;
+
+	if (atomic_fetch_add_explicit(&worker->num_offered, 1, memory_order_seq_cst) > 0) return true;
+
+	for (i = 0; i < worker->num_siblings; i++) {
+		fr_worker_t *sibling;
+
+		sibling = worker->siblings[(worker->next_sibling + i) % worker->num_siblings];
+		if (!atomic_load_explicit(&sibling->sleeping, memory_order_seq_cst)) continue;
+
+		MPRINT("\tWORKER waking up sibling %p\n", sibling);
+		(void) fr_control_message_send(sibling->control, worker->rb_peer, FR_CONTROL_ID_STEAL,
+					       &worker, sizeof(worker));
+		break;
+	}
+
+	return true;
+}
+
+
+/** Steal a message from another worker
+ *
+ *  We first take back any messages which we offered, but which no
+ *  other worker has taken.  Then we look at the other workers.
+ *
+ * @param[in] worker the worker
+ * @param[out] p_owner the worker which owns the message, or NULL if the message is ours.
+ * @return
+ *	- NULL on nothing to steal
+ *	- fr_channel_data_t the stolen message
+ */
+static fr_channel_data_t *fr_worker_steal(fr_worker_t *worker, fr_worker_t **p_owner)
+{
+	int i;
+	fr_channel_data_t *cd;
+
+	*p_owner = NULL;
+
+	if (fr_atomic_queue_pop(worker->aq_steal, (void **) &cd)) {
+		atomic_fetch_sub_explicit(&worker->num_offered, 1, memory_order_seq_cst);
+		return cd;
+	}
+
+	for (i = 0; i < worker->num_siblings; i++) {
+		fr_worker_t *sibling;
+
+		sibling = worker->siblings[worker->next_sibling];
+		worker->next_sibling = (worker->next_sibling + 1) % worker->num_siblings;
+
+		if (atomic_load_explicit(&sibling->num_offered, memory_order_seq_cst) <= 0) continue;
+
+		/*
+		 *	Count the message as lent before taking it, so
+		 *	that a sibling which is being destroyed can't
+		 *	miss it.
+		 */
+		atomic_fetch_add_explicit(&sibling->num_lent, 1, memory_order_seq_cst);
+
+		if (!fr_atomic_queue_pop(sibling->aq_steal, (void **) &cd)) {
+			atomic_fetch_sub_explicit(&sibling->num_lent, 1, memory_order_seq_cst);
+			continue;
+		}
+
+		atomic_fetch_sub_explicit(&sibling->num_offered, 1, memory_order_seq_cst);
+
+		MPRINT("\tWORKER stole message from %p\n", sibling);
+		worker->num_stolen++;
+		*p_owner = sibling;
+		return cd;
+	}
+
+	return NULL;
+}
+
+
+/** Check if there are messages we can steal
+ *
+ * @param[in] worker the worker
+ * @return
+ *	- true if another worker (or we) have offered messages
+ *	- false if there is nothing to steal
+ */
+static bool fr_worker_steal_pending(fr_worker_t *worker)
+{
+	int i;
+
+	if (atomic_load_explicit(&worker->num_offered, memory_order_seq_cst) > 0) return true;
+
+	for (i = 0; i < worker->num_siblings; i++) {
+		if (atomic_load_explicit(&worker->siblings[i]->num_offered, memory_order_seq_cst) > 0) return true;
+	}
+
+	return false;
+}
+
+
+/** Take back the messages which no other worker has stolen
+ *
+ *  They're put into the "to_decode" queue in time order, so that
+ *  fr_worker_check_timeouts() ages them out like any other message.
+ *  Offered messages are usually the newest ones we have, so the walk
+ *  is short.
+ *
+ * @param[in] worker the worker
+ */
+static void fr_worker_take_back(fr_worker_t *worker)
+{
+	fr_channel_data_t *cd, *older;
+	fr_dlist_t *entry;
+
+	while (fr_atomic_queue_pop(worker->aq_steal, (void **) &cd)) {
+		atomic_fetch_sub_explicit(&worker->num_offered, 1, memory_order_seq_cst);
+
+		for (entry = FR_DLIST_FIRST(worker->to_decode.list);
+		     entry != NULL;
+		     entry = FR_DLIST_NEXT(worker->to_decode.list, entry)) {
+			older = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
+			if (older->m.when <= cd->m.when) break;
+		}
+
+		if (entry) {
+			FR_DLIST_INSERT_TAIL_PTR(entry, cd->request.list);
+		} else {
+			FR_DLIST_INSERT_TAIL(worker->to_decode.list, cd->request.list);
+		}
+		(void) fr_heap_insert(worker->to_decode.heap, cd);
+	}
+}
+
 
 /** Drain the input channel
  *
@@ -179,6 +368,15 @@ static void fr_worker_drain_input(fr_worker_t *worker, fr_channel_t *ch, fr_chan
 		worker->num_requests++;
 		MPRINT("\tWORKER received request %zd\n", worker->num_requests);
 		cd->channel.ch = ch;
+
+		/*
+		 *	We have a backlog, so let the other workers
+		 *	take some of it.
+		 */
+		if (worker->num_siblings && !worker->exiting &&
+		    (fr_heap_num_elements(worker->to_decode.heap) >= WORKER_STEAL_THRESHOLD) &&
+		    fr_worker_offer(worker, cd)) continue;
+
 		WORKER_HEAP_INSERT(to_decode, cd, request.list);
 	} while ((cd = fr_channel_recv_request(ch)) != NULL);
 }
@@ -292,13 +490,147 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 }
 
 
-/** Service an EVFILT_USER event
+/** Handle a control message telling us about another worker
+ *
+ * @param[in] ctx the worker
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_worker_sibling_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	fr_worker_t *sibling, **siblings;
+	fr_worker_t *worker = ctx;
+
+	rad_assert(data_size == sizeof(sibling));
+
+	memcpy(&sibling, data, sizeof(sibling));
+	if (sibling == worker) return;
+
+	siblings = talloc_realloc(worker, worker->siblings, fr_worker_t *, worker->num_siblings + 1);
+	if (!siblings) return;
+
+	siblings[worker->num_siblings++] = sibling;
+	worker->siblings = siblings;
+
+	MPRINT("\tWORKER added sibling %p\n", sibling);
+}
+
+
+/** Handle a control message telling us that there is work to steal
+ *
+ *  There's nothing to do here.  The message woke us up, and
+ *  fr_worker_idle() will see that there is work to steal.
+ *
+ * @param[in] ctx the worker
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_worker_steal_callback(UNUSED void *ctx, UNUSED void const *data, UNUSED size_t data_size,
+				     UNUSED fr_time_t now)
+{
+	MPRINT("\tWORKER woken up to steal work\n");
+}
+
+
+/** Handle a control message containing a reply to a stolen request
+ *
+ *  The thief can't write to our channel, so we send the reply for it.
+ *
+ * @param[in] ctx the worker
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_worker_reply_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	int i;
+	fr_channel_t *ch;
+	fr_channel_data_t *reply, *cd;
+	fr_worker_t *worker = ctx;
+
+	rad_assert(data_size == sizeof(reply));
+
+	memcpy(&reply, data, sizeof(reply));
+	ch = reply->channel.ch;
+
+	rad_assert(atomic_load_explicit(&worker->num_lent, memory_order_seq_cst) > 0);
+	atomic_fetch_sub_explicit(&worker->num_lent, 1, memory_order_seq_cst);
+
+	/*
+	 *	We're being destroyed, and are only waiting for
+	 *	the other workers to finish with our messages.
+	 */
+	if (worker->exiting) {
+		MPRINT("\tWORKER discarding reply while exiting\n");
+		fr_message_done(&reply->m);
+		return;
+	}
+
+	/*
+	 *	The channel may have been closed while the other
+	 *	worker was processing the request.
+	 */
+	for (i = 0; i < worker->max_channels; i++) {
+		if (worker->channel[i] == ch) break;
+	}
+
+	if (i == worker->max_channels) {
+		MPRINT("\tWORKER discarding reply for closed channel\n");
+		fr_message_done(&reply->m);
+		return;
+	}
+
+	worker->num_given++;
+
+	/*
+	 *	The network thread tracks CPU time per channel, so
+	 *	it gets our CPU time, not the thiefs.
+	 */
+	reply->reply.cpu_time = worker->tracking.running;
+
+	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
+		MPRINT("\tWORKER fails sending reply\n");
+		cd = NULL;
+	}
+
+	worker->num_replies++;
+
+	if (cd) fr_worker_drain_input(worker, ch, cd);
+}
+
+
+/** Send a reply to a stolen request back to the worker which owns the channel
+ *
+ * @param[in] worker the worker
+ * @param[in] owner the worker which owns the channel
+ * @param[in] ch the channel for the reply
+ * @param[in] reply the reply to send
+ */
+static void fr_worker_return_reply(fr_worker_t *worker, fr_worker_t *owner, fr_channel_t *ch, fr_channel_data_t *reply)
+{
+	/*
+	 *	The sequence numbers are filled in by the owner, so
+	 *	we can cache the channel here.
+	 */
+	reply->channel.ch = ch;
+
+	if (fr_control_message_send(owner->control, worker->rb_peer, FR_CONTROL_ID_REPLY, &reply, sizeof(reply)) < 0) {
+		MPRINT("\tWORKER fails returning reply\n");
+		fr_message_done(&reply->m);
+		atomic_fetch_sub_explicit(&owner->num_lent, 1, memory_order_seq_cst);
+	}
+}
+
+
+/** Service a user event
  *
  * @param[in] kq the kq to service
- * @param[in] kev the kevent to service
+ * @param[in] ident of the user event to service
  * @param[in] ctx the fr_worker_t
  */
-static void fr_worker_evfilt_user(UNUSED int kq, struct kevent const *kev, void *ctx)
+static void fr_worker_user_event(UNUSED int kq, uintptr_t ident, void *ctx)
 {
 	fr_time_t now;
 	fr_worker_t *worker = ctx;
@@ -308,8 +640,8 @@ static void fr_worker_evfilt_user(UNUSED int kq, struct kevent const *kev, void
 	talloc_get_type_abort(worker, fr_worker_t);
 #endif
 
-	if (!fr_control_message_service_kevent(worker->control, kev)) {
-		MPRINT("\tWORKER kevent not for us!\n");
+	if (!fr_control_message_service_user(worker->control, ident)) {
+		MPRINT("\tWORKER user event not for us!\n");
 		return;
 	}
 
@@ -328,9 +660,10 @@ static void fr_worker_evfilt_user(UNUSED int kq, struct kevent const *kev, void
  *
  * @param[in] worker the worker
  * @param[in] cd the message to NAK
+ * @param[in] owner the worker which owns the channel, or NULL if it's ours
  * @param[in] now when the message is NAKd
  */
-static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_worker_t *owner, fr_time_t now)
 {
 	size_t size;
 	fr_channel_data_t *reply;
@@ -344,7 +677,11 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	 */
 	ch = cd->channel.ch;
 
-	ms = fr_channel_worker_ctx_get(ch);
+	if (!owner) {
+		ms = fr_channel_worker_ctx_get(ch);
+	} else {
+		ms = worker->ms;
+	}
 	rad_assert(ms != NULL);
 
 	/*
@@ -377,6 +714,11 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	 */
 	fr_message_done(&cd->m);
 
+	if (owner) {
+		fr_worker_return_reply(worker, owner, ch, reply);
+		return;
+	}
+
 	/*
 	 *	Send the reply, which also polls the request queue.
 	 */
@@ -411,7 +753,11 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	ch = request->channel;
 	rad_assert(ch != NULL);
 
-	ms = fr_channel_worker_ctx_get(ch);
+	if (!request->owner) {
+		ms = fr_channel_worker_ctx_get(ch);
+	} else {
+		ms = worker->ms;
+	}
 	rad_assert(ms != NULL);
 
 	reply = (fr_channel_data_t *) fr_message_reserve(ms, size);
@@ -455,21 +801,26 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	reply->priority = request->priority;
 	reply->transport = request->transport->id;
 
-	/*
-	 *	Send the reply, which also polls the request queue.
-	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
-		MPRINT("\tWORKER fails sending reply\n");
-		cd = NULL;
-	}
+	if (request->owner) {
+		fr_worker_return_reply(worker, request->owner, ch, reply);
 
-	worker->num_replies++;
+	} else {
+		/*
+		 *	Send the reply, which also polls the request queue.
+		 */
+		if (fr_channel_send_reply(ch, reply, &cd) < 0) {
+			MPRINT("\tWORKER fails sending reply\n");
+			cd = NULL;
+		}
 
-	/*
-	 *	Drain the incoming TO_WORKER queue.  We do this every
-	 *	time we're done processing a request.
-	 */
-	if (cd) fr_worker_drain_input(worker, ch, cd);
+		worker->num_replies++;
+
+		/*
+		 *	Drain the incoming TO_WORKER queue.  We do this every
+		 *	time we're done processing a request.
+		 */
+		if (cd) fr_worker_drain_input(worker, ch, cd);
+	}
 
 	/*
 	 *	@todo Use a talloc pool for the request.  Clean it up,
@@ -480,8 +831,6 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 }
 
 
-#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
-
 /** Check timeouts on the various queues
  *
  *  This function checks and enforces timeouts on the multiple worker
@@ -497,6 +846,12 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 	fr_time_t waiting;
 	fr_dlist_t *entry;
 
+	/*
+	 *	Messages which nobody stole are ours again, and
+	 *	are checked below with the rest.
+	 */
+	if (atomic_load_explicit(&worker->num_offered, memory_order_seq_cst) > 0) fr_worker_take_back(worker);
+
 	/*
 	 *	Check the "localized" queue for old packets.
 	 *
@@ -515,7 +870,7 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 		 *	Waiting too long, delete it.
 		 */
 		WORKER_HEAP_EXTRACT(localized, cd, request.list);
-		fr_worker_nak(worker, cd, now);
+		fr_worker_nak(worker, cd, NULL, now);
 	}
 
 	/*
@@ -536,7 +891,7 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 		if (waiting > NANOSEC) {
 			WORKER_HEAP_EXTRACT(to_decode, cd, request.list);
 		nak:
-			fr_worker_nak(worker, cd, now);
+			fr_worker_nak(worker, cd, NULL, now);
 			continue;
 		}
 
@@ -617,6 +972,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 {
 	int rcode;
 	fr_channel_data_t *cd;
+	fr_worker_t *owner;
 	REQUEST *request;
 #ifndef HAVE_TALLOC_POOLED_OBJECT
 	TALLOC_CTX *ctx;
@@ -633,13 +989,18 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 
 	/*
 	 *	Find either a localized message, or one which is in
-	 *	the "to_decode" queue.
+	 *	the "to_decode" queue.  If we have neither, steal one.
 	 */
 	do {
+		owner = NULL;
+
 		WORKER_HEAP_POP(localized, cd, request.list);
 		if (!cd) {
 			WORKER_HEAP_POP(to_decode, cd, request.list);
 		}
+		if (!cd) {
+			cd = fr_worker_steal(worker, &owner);
+		}
 		if (!cd) return NULL;
 
 		worker->num_decoded++;
@@ -650,7 +1011,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		 */
 		if (cd->request.start_time && (cd->m.when != *cd->request.start_time)) {
 			MPRINT("\tIGNORING old message\n");
-			fr_worker_nak(worker, cd, fr_time());
+			fr_worker_nak(worker, cd, owner, fr_time());
 			cd = NULL;
 		}
 	} while (!cd);
@@ -675,7 +1036,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	 *	Receive a message to the worker queue, and decode it
 	 *	to a request.
 	 */
-	rad_assert(cd->transport <= worker->num_transports);
+	rad_assert(cd->transport < worker->num_transports);
 	rad_assert(worker->transports[cd->transport] != NULL);
 
 	/*
@@ -695,6 +1056,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	request->runnable = worker->runnable;
 	request->el = worker->el;
 	request->packet_ctx = cd->ctx;
+	request->owner = owner;
 
 	/*
 	 *	Now that the "request" structure has been initialized, go decode the packet.
@@ -704,7 +1066,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		MPRINT("\tFAILED decode of request %zd\n", request->number);
 		talloc_free(ctx);
 nak:
-		fr_worker_nak(worker, cd, fr_time());
+		fr_worker_nak(worker, cd, owner, fr_time());
 		return NULL;
 	}
 
@@ -844,6 +1206,18 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 	 */
 	if (!sleeping) return 1;
 
+	/*
+	 *	Mark ourselves as sleeping BEFORE checking the other
+	 *	workers.  Otherwise a worker could offer a message
+	 *	after we check, and not wake us up.
+	 */
+	atomic_store_explicit(&worker->sleeping, true, memory_order_seq_cst);
+
+	if (fr_worker_steal_pending(worker)) {
+		atomic_store_explicit(&worker->sleeping, false, memory_order_seq_cst);
+		return 1;
+	}
+
 	MPRINT("\tWORKER sleeping running %zd, localized %zd, to_decode %zd\n",
 	       fr_heap_num_elements(worker->runnable),
 	       fr_heap_num_elements(worker->localized.heap),
@@ -909,6 +1283,16 @@ void fr_worker_destroy(fr_worker_t *worker)
 {
 	int i;
 	fr_channel_data_t *cd;
+	fr_dlist_t *entry;
+	char data[256];
+
+	worker->exiting = true;
+
+	/*
+	 *	Take back the messages which nobody stole, so that
+	 *	they're cleaned up with the others.
+	 */
+	fr_worker_take_back(worker);
 
 	/*
 	 *	These messages aren't in the channel, so we have to
@@ -926,6 +1310,49 @@ void fr_worker_destroy(fr_worker_t *worker)
 		fr_message_done(&cd->m);
 	}
 
+	/*
+	 *	We won't reply to the requests we stole, so their
+	 *	owners shouldn't wait for us.  The owners are still
+	 *	waiting for our replies, so they haven't been freed.
+	 */
+	for (entry = FR_DLIST_FIRST(worker->time_order);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(worker->time_order, entry)) {
+		REQUEST *request;
+		fr_worker_t *owner;
+
+		request = fr_ptr_to_type(REQUEST, time_order, entry);
+		owner = request->owner;
+		if (!owner) continue;
+
+		atomic_fetch_sub_explicit(&owner->num_lent, 1, memory_order_seq_cst);
+		request->owner = NULL;
+	}
+
+	for (entry = FR_DLIST_FIRST(worker->waiting_to_die);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(worker->waiting_to_die, entry)) {
+		REQUEST *request;
+		fr_worker_t *owner;
+
+		request = fr_ptr_to_type(REQUEST, time_order, entry);
+		owner = request->owner;
+		if (!owner) continue;
+
+		atomic_fetch_sub_explicit(&owner->num_lent, 1, memory_order_seq_cst);
+		request->owner = NULL;
+	}
+
+	/*
+	 *	Wait for the other workers to finish with the
+	 *	messages they stole from us.  Their replies arrive on
+	 *	our control plane, and are discarded.
+	 */
+	while (atomic_load_explicit(&worker->num_lent, memory_order_seq_cst) > 0) {
+		fr_control_service(worker->control, data, sizeof(data), fr_time());
+		if (atomic_load_explicit(&worker->num_lent, memory_order_seq_cst) > 0) usleep(1000);
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -980,7 +1407,7 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 		return NULL;
 	}
 
-	if (fr_event_user_insert(worker->el, fr_worker_evfilt_user, worker) < 0) {
+	if (fr_event_user_insert(worker->el, fr_worker_user_event, worker) < 0) {
 		talloc_free(worker);
 		return NULL;
 	}
@@ -1013,7 +1440,49 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 		return NULL;
 	}
 
-	if (fr_event_user_insert(worker->el, fr_worker_evfilt_user, worker) < 0) {
+	if (fr_control_callback_add(worker->control, FR_CONTROL_ID_WORKER, worker, fr_worker_sibling_callback) < 0) {
+		talloc_free(worker);
+		return NULL;
+	}
+
+	if (fr_control_callback_add(worker->control, FR_CONTROL_ID_STEAL, worker, fr_worker_steal_callback) < 0) {
+		talloc_free(worker);
+		return NULL;
+	}
+
+	if (fr_control_callback_add(worker->control, FR_CONTROL_ID_REPLY, worker, fr_worker_reply_callback) < 0) {
+		talloc_free(worker);
+		return NULL;
+	}
+
+	worker->rb_peer = fr_ring_buffer_create(worker, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+	if (!worker->rb_peer) {
+		talloc_free(worker);
+		return NULL;
+	}
+
+	/*
+	 *	Messages we offer to other workers, and the replies
+	 *	to messages we steal from them.
+	 */
+	worker->aq_steal = fr_atomic_queue_create(worker, 1024);
+	if (!worker->aq_steal) {
+		talloc_free(worker);
+		return NULL;
+	}
+	atomic_init(&worker->num_offered, 0);
+	atomic_init(&worker->num_lent, 0);
+	atomic_init(&worker->sleeping, false);
+
+	worker->ms = fr_message_set_create(worker, worker->message_set_size,
+					   sizeof(fr_channel_data_t),
+					   worker->ring_buffer_size);
+	if (!worker->ms) {
+		talloc_free(worker);
+		return NULL;
+	}
+
+	if (fr_event_user_insert(worker->el, fr_worker_user_event, worker) < 0) {
 		talloc_free(worker);
 		return NULL;
 	}
@@ -1031,6 +1500,7 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 
 	worker->num_transports = num_transports;
 	worker->transports = transports;
+	worker->created = fr_time();
 
 	return worker;
 }
@@ -1085,6 +1555,8 @@ void fr_worker(fr_worker_t *worker)
 		MPRINT("\tGot num_events %d\n", num_events);
 		if (num_events < 0) break;
 
+		atomic_store_explicit(&worker->sleeping, false, memory_order_seq_cst);
+
 		/*
 		 *	Service outstanding events.
 		 */
@@ -1152,10 +1624,41 @@ void fr_worker_debug(fr_worker_t *worker, FILE *fp)
 	fprintf(fp, "\tcalculated (predicted) total CPU time = %zd\n", worker->tracking.predicted * worker->num_requests);
 	fprintf(fp, "\tcalculated (counted) per request time = %zd\n", worker->tracking.running / worker->num_requests);
 
+	fprintf(fp, "\tnum_siblings = %d\n", worker->num_siblings);
+	fprintf(fp, "\tnum_stolen = %d\n", worker->num_stolen);
+	fprintf(fp, "\tnum_given = %d\n", worker->num_given);
+	fprintf(fp, "\tsteal rate = %.3f/s (%.2f%% of decoded messages)\n",
+		((double) worker->num_stolen * NANOSEC) / (fr_time() - worker->created),
+		worker->num_decoded ? (100.0 * worker->num_stolen) / worker->num_decoded : 0.0);
+
 	fr_time_tracking_debug(&worker->tracking, fp);
 
 }
 
+/** Tell a worker about another worker
+ *
+ *  When the worker is idle, it will steal messages which the other
+ *  worker has offered.
+ *
+ *  Called by the scheduler.  The scheduler must not free either
+ *  worker until all of the workers have been destroyed.
+ *
+ * @param[in] worker the worker
+ * @param[in] rb the callers ring buffer for message allocation.
+ * @param[in] sibling the other worker
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_sibling_add(fr_worker_t *worker, fr_ring_buffer_t *rb, fr_worker_t *sibling)
+{
+#ifndef NDEBUG
+	talloc_get_type_abort(worker, fr_worker_t);
+#endif
+
+	return fr_control_message_send(worker->control, rb, FR_CONTROL_ID_WORKER, &sibling, sizeof(sibling));
+}
+
 /** Create a channel to the worker
  *
  *  Called by the master (i.e. network) thread when it needs to create
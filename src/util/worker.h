@@ -31,6 +31,7 @@ RCSIDH(worker_h, "$Id$")
 #include <freeradius-devel/event.h>
 
 #include <freeradius-devel/util/transport.h>
+#include <freeradius-devel/util/ring_buffer.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,7 @@ int fr_worker_kq(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_exit(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_debug(fr_worker_t *worker, FILE *fp) CC_HINT(nonnull);
+int fr_worker_sibling_add(fr_worker_t *worker, fr_ring_buffer_t *rb, fr_worker_t *sibling) CC_HINT(nonnull);
 fr_channel_t *fr_worker_channel_create(fr_worker_t const *worker, TALLOC_CTX *ctx, fr_control_t *master) CC_HINT(nonnull);
 
 #ifdef __cplusplus